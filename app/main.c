@@ -9,29 +9,19 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <time.h>
 #include "../src/lab.h"
 
-static void explain_waitpid(int status)
-{
-    if (!WIFEXITED(status))
-    {
-        fprintf(stderr, "Child exited with status %d\n", WEXITSTATUS(status));
-    }
-
-    if (WIFSIGNALED(status))
-    {
-        fprintf(stderr, "Child exited via signal %d\n", WTERMSIG(status));
-    }
-
-    if (WIFSTOPPED(status))
-    {
-        fprintf(stderr, "Child stopped by %d\n", WSTOPSIG(status));
-    }
+// the line handed over by readline's callback interface
+static char *input_line = (char *)NULL;
+static bool input_ready = false;
 
-    if (WIFCONTINUED(status))
-    {
-        fprintf(stderr, "Child was resumed by delivery of SIGCONT\n");
-    }
+static void on_line(char *line)
+{
+    input_line = line;
+    input_ready = true;
+    // readline redraws nothing until the next prompt is installed
+    rl_callback_handler_remove();
 }
 
 int main(int argc, char *argv[])
@@ -39,62 +29,81 @@ int main(int argc, char *argv[])
     parse_args(argc, argv);
     struct shell sh;
     sh_init(&sh);
-    char *line = (char *)NULL;
-    while ((line = readline(sh.prompt)))
+    // scripts, -c strings and piped input skip readline and history
+    if (!sh.shell_is_interactive)
     {
-        // do nothing on blank lines don't save history or attempt to exec
-        line = trim_white(line);
-        if (!*line)
-        {
-            free(line);
-            continue;
-        }
-        add_history(line);
-        // check to see if we are launching a built in command
-        char **cmd = cmd_parse(line);
-        if (!do_builtin(&sh, cmd))
+        int status = sh_run_batch(&sh);
+        sh_destroy(&sh);
+        return status;
+    }
+    sh.loop.on_input = rl_callback_read_char;
+    for (;;)
+    {
+        // report background jobs that finished since the last prompt
+        jobs_notify(&sh);
+        input_ready = false;
+        // MY_PROMPT escapes are expanded afresh for every prompt
+        rl_callback_handler_install(prompt_render(&sh), on_line);
+        // input, child exits and signals are all dispatched from the loop;
+        // while nothing is pending the search index catches up a slice at
+        // a time, so Ctrl-R never has to index a large history at once
+        bool indexed = !sh.hist.ready;
+        while (!input_ready)
         {
-            pid_t pid = fork();
-            if (pid == 0)
+            int events = sh_loop_once(&sh, true, indexed ? -1 : 0);
+            if (events < 0)
             {
-                /*This is the child process*/
-                pid_t child = getpid();
-                setpgid(child, child);
-                tcsetpgrp(sh.shell_terminal, child);
-                signal(SIGINT, SIG_DFL);
-                signal(SIGQUIT, SIG_DFL);
-                signal(SIGTSTP, SIG_DFL);
-                signal(SIGTTIN, SIG_DFL);
-                signal(SIGTTOU, SIG_DFL);
-                execvp(cmd[0], cmd);
-                exit(EXIT_FAILURE);
+                // no event loop, fall back to plain blocking reads
+                rl_callback_read_char();
             }
-            else if (pid < 0)
+            else if (events == 0 && !indexed)
             {
-                // If fork failed we are in trouble!
-                perror("fork return < 0 Process creation failed!");
-                abort();
+                indexed = hist_search_sync_some(&sh.search, &sh.hist, HIST_SEARCH_SLICE);
             }
+        }
+        char *line = input_line;
+        if (!line)
+            break;
 
-            /*
-            This is in the parent put the child process into its own
-            process group and give it control of the terminal
-            to avoid a race condition
-            */
-            // printf("shell:%d , child%d\n",sh.shell_pgid, pid);
-            setpgid(pid, pid);
-            tcsetpgrp(sh.shell_terminal, pid);
-            int status;
-            int rval = waitpid(pid, &status, 0);
-            if (rval == -1)
+        // do nothing on blank lines don't save history or attempt to exec
+        char *cmdline = trim_white(line);
+        if (!*cmdline)
+        {
+            free(line);
+            continue;
+        }
+        // !! and !n are replaced before the line is remembered or run
+        if (strchr(cmdline, '!'))
+        {
+            char *expanded = hist_expand(&sh.hist, cmdline);
+            if (!expanded)
             {
-                fprintf(stderr, "Wait pid failed with -1\n");
-		        explain_waitpid(status);
+                sh.last_status = 1;
+                free(line);
+                continue;
             }
-            cmd_free(cmd);
-            // get control of the shell
-            tcsetpgrp(sh.shell_terminal, sh.shell_pgid);
+            if (strcmp(expanded, cmdline) != 0)
+                printf("%s\n", expanded);
+            free(line);
+            line = cmdline = expanded;
         }
+        add_history(cmdline);
+        hist_add(&sh.hist, cmdline);
+        // an index that is caught up follows the addition right away; one
+        // still behind, or behind other shells, catches up while idle
+        size_t count = hist_count(&sh.hist);
+        if (count == sh.search.nentries + 1 && sh.search.generation == sh.hist.generation)
+            hist_search_add(&sh.search, count, cmdline, strlen(cmdline));
+        // the whole line, with its ; && || lists, runs in one pass
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        sh_run_line(&sh, cmdline, strlen(cmdline));
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        // \D in the prompt shows how long that took
+        sh.prompt_info.duration_ms = (end.tv_sec - start.tv_sec) * 1000 +
+                                     (end.tv_nsec - start.tv_nsec) / 1000000;
+        free(line);
     }
     sh_destroy(&sh);
+    return sh.last_status;
 }
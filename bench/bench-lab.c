@@ -0,0 +1,260 @@
+/**
+ * bench-lab.c
+ * Timings of the shell's hot paths, kept out of the unit tests so that
+ * those never depend on how loaded the machine is. Each benchmark prints
+ * one line; run them all with make bench.
+ *
+ * @author Vladyslav (Vlad) Maliutin
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../src/lab.h"
+
+static double elapsed_ns(const struct timespec *a, const struct timespec *b)
+{
+     return (b->tv_sec - a->tv_sec) * 1e9 + (b->tv_nsec - a->tv_nsec);
+}
+
+/* The parser cmd_parse replaced: strtok over a copy, then strdup per token */
+static char **legacy_cmd_parse(const char *line, size_t max)
+{
+     char **cmd = malloc(max * sizeof(char *));
+     char *token, *line_copy = strdup(line);
+     size_t i = 0;
+     token = strtok(line_copy, " ");
+     while (token && i < max - 1) {
+          cmd[i++] = strdup(token);
+          token = strtok(NULL, " ");
+     }
+     cmd[i] = NULL;
+     free(line_copy);
+     return cmd;
+}
+
+static void legacy_cmd_free(char **cmd)
+{
+     for (int i = 0; cmd[i]; i++) free(cmd[i]);
+     free(cmd);
+}
+
+static void bench_cmd_parse(void)
+{
+     enum { WORDS = 4000, ROUNDS = 200 };
+     char *line = malloc(WORDS * 8 + 1);
+     char *p = line;
+     for (int i = 0; i < WORDS; i++) p += sprintf(p, "arg%04d ", i);
+
+     /* Best of a few runs keeps scheduler noise out of the comparison */
+     double best_new = 1e18, best_old = 1e18;
+     for (int run = 0; run < 5; run++) {
+          struct timespec t0, t1, t2;
+          clock_gettime(CLOCK_MONOTONIC, &t0);
+          for (int r = 0; r < ROUNDS; r++) cmd_free(cmd_parse(line));
+          clock_gettime(CLOCK_MONOTONIC, &t1);
+          for (int r = 0; r < ROUNDS; r++) legacy_cmd_free(legacy_cmd_parse(line, WORDS + 1));
+          clock_gettime(CLOCK_MONOTONIC, &t2);
+          if (elapsed_ns(&t0, &t1) < best_new) best_new = elapsed_ns(&t0, &t1);
+          if (elapsed_ns(&t1, &t2) < best_old) best_old = elapsed_ns(&t1, &t2);
+     }
+     printf("cmd_parse: %.0f ns/line, strtok+strdup: %.0f ns/line (%d words)\n",
+            best_new / ROUNDS, best_old / ROUNDS, WORDS);
+     free(line);
+}
+
+static void bench_scan(void)
+{
+     /* Long generated argument lists: few separators, long words */
+     enum { WORDS = 1000, ROUNDS = 100 };
+     char *line = malloc(WORDS * 64 + 1);
+     char *p = line;
+     for (int i = 0; i < WORDS; i++)
+          p += sprintf(p, "/usr/share/generated/build/output/objects/file-%06d.o ", i);
+
+     double best[2] = { 1e18, 1e18 };
+     enum scan_backend backends[2] = { SCAN_SCALAR, SCAN_AUTO };
+     for (int run = 0; run < 5; run++) {
+          for (int b = 0; b < 2; b++) {
+               struct timespec t0, t1;
+               sh_scan_use(backends[b]);
+               clock_gettime(CLOCK_MONOTONIC, &t0);
+               for (int r = 0; r < ROUNDS; r++) cmd_free(cmd_parse(line));
+               clock_gettime(CLOCK_MONOTONIC, &t1);
+               if (elapsed_ns(&t0, &t1) < best[b]) best[b] = elapsed_ns(&t0, &t1);
+          }
+     }
+     sh_scan_use(SCAN_AUTO);
+     printf("cmd_parse on %zu bytes: scalar scan %.0f ns, vector scan %.0f ns\n",
+            strlen(line), best[0] / ROUNDS, best[1] / ROUNDS);
+     free(line);
+}
+
+static void bench_history_search(void)
+{
+     enum { ENTRIES = 1000000, QUERIES = 200 };
+     char dir[] = "/tmp/lab-bench-XXXXXX";
+     if (!mkdtemp(dir)) return;
+     char path[64], idx[64], line[96];
+     snprintf(path, sizeof(path), "%s/log", dir);
+     snprintf(idx, sizeof(idx), "%s/log.idx", dir);
+     struct history h;
+     if (hist_open(&h, path) != 0) return;
+     for (int i = 0; i < ENTRIES; i++) {
+          snprintf(line, sizeof(line), "cc -O%d -c src/module_%d.c -o build/obj_%d.o", i % 4, i, i * 7);
+          hist_add(&h, line);
+     }
+
+     /* Built the way the idle shell does it, one slice at a time */
+     struct hist_search s = { 0 };
+     struct timespec t0, t1;
+     double build = 0, slice = 0;
+     bool done = false;
+     while (!done) {
+          clock_gettime(CLOCK_MONOTONIC, &t0);
+          done = hist_search_sync_some(&s, &h, HIST_SEARCH_SLICE);
+          clock_gettime(CLOCK_MONOTONIC, &t1);
+          double ns = elapsed_ns(&t0, &t1);
+          build += ns;
+          if (ns > slice) slice = ns;
+     }
+     size_t bytes = s.capacity * sizeof(*s.slots) + s.pool_cap;
+     printf("history search: %d entries indexed in %.1f ms (longest slice %.2f ms), "
+            "index %.1f MB\n",
+            ENTRIES, build / 1e6, slice / 1e6, bytes / 1e6);
+
+     size_t ids[8], found = 0;
+     clock_gettime(CLOCK_MONOTONIC, &t0);
+     for (int q = 0; q < QUERIES; q++) {
+          snprintf(line, sizeof(line), "module_%d.c", q * 997);
+          found += hist_search_find(&s, &h, line, SIZE_MAX, ids, 8);
+     }
+     clock_gettime(CLOCK_MONOTONIC, &t1);
+     double query = elapsed_ns(&t0, &t1) / QUERIES;
+
+     /* What the first keystrokes of a search ask for */
+     const char *shorts[] = { "c", "cc", "_9", "-O" };
+     clock_gettime(CLOCK_MONOTONIC, &t0);
+     for (int q = 0; q < QUERIES; q++)
+          found += hist_search_find(&s, &h, shorts[q & 3], SIZE_MAX, ids, 8);
+     clock_gettime(CLOCK_MONOTONIC, &t1);
+     double short_query = elapsed_ns(&t0, &t1) / QUERIES;
+     printf("history search: %.1f us per query, %.1f us per short query (%zu found)\n",
+            query / 1e3, short_query / 1e3, found);
+
+     /* A query that matches nothing has to read every entry */
+     clock_gettime(CLOCK_MONOTONIC, &t0);
+     found = hist_search_find(&s, &h, "x", SIZE_MAX, ids, 8);
+     clock_gettime(CLOCK_MONOTONIC, &t1);
+     printf("history search: %.1f ms for a short query with %zu matches\n",
+            elapsed_ns(&t0, &t1) / 1e6, found);
+
+     hist_search_destroy(&s);
+     hist_close(&h);
+     unlink(idx);
+     unlink(path);
+     rmdir(dir);
+}
+
+static void bench_completion(void)
+{
+     enum { COMMANDS = 5000, LOOKUPS = 100000 };
+     char dir[] = "/tmp/lab-bench-XXXXXX";
+     if (!mkdtemp(dir)) return;
+     char name[96];
+     for (int i = 0; i < COMMANDS; i++) {
+          snprintf(name, sizeof(name), "%s/tool-%04d", dir, i);
+          int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+          if (fd >= 0) close(fd);
+     }
+     char *saved = getenv("PATH") ? strdup(getenv("PATH")) : NULL;
+     setenv("PATH", dir, 1);
+
+     struct command_index ci;
+     cmd_index_init(&ci);
+     struct timespec t0, t1;
+     clock_gettime(CLOCK_MONOTONIC, &t0);
+     cmd_index_refresh(&ci);
+     clock_gettime(CLOCK_MONOTONIC, &t1);
+     double build = elapsed_ns(&t0, &t1);
+
+     size_t first, found = 0;
+     clock_gettime(CLOCK_MONOTONIC, &t0);
+     for (int i = 0; i < LOOKUPS; i++) {
+          snprintf(name, sizeof(name), "tool-%03d", i % 500);
+          found += cmd_index_prefix(&ci, name, &first);
+     }
+     clock_gettime(CLOCK_MONOTONIC, &t1);
+     printf("completion: %d commands indexed in %.2f ms, %.3f us per prefix lookup (%zu found)\n",
+            COMMANDS, build / 1e6, elapsed_ns(&t0, &t1) / LOOKUPS / 1e3, found);
+     cmd_index_destroy(&ci);
+
+     if (saved) setenv("PATH", saved, 1);
+     free(saved);
+     snprintf(name, sizeof(name), "rm -rf %s", dir);
+     if (system(name) != 0) fprintf(stderr, "could not remove %s\n", dir);
+}
+
+static void bench_builtin_lookup(void)
+{
+     /* External commands pay one hash, not a walk over every name */
+     const char *names[] = { "grep", "ls", "make", "git", "sed", "awk", "python3", "cc" };
+     enum { LOOKUPS = 1000000 };
+     struct timespec t0, t1;
+     clock_gettime(CLOCK_MONOTONIC, &t0);
+     size_t found = 0;
+     for (int i = 0; i < LOOKUPS; i++) found += builtin_find(names[i & 7]) != NULL;
+     clock_gettime(CLOCK_MONOTONIC, &t1);
+     printf("builtin lookup: %.1f ns per external name (%zu found)\n",
+            elapsed_ns(&t0, &t1) / LOOKUPS, found);
+}
+
+/* Runs a script in a fresh shell and returns the commands run per second */
+static double script_rate(const char *line, int runs)
+{
+     FILE *in = tmpfile();
+     if (!in) return 0;
+     for (int i = 0; i < runs; i++) fputs(line, in);
+     rewind(in);
+
+     struct shell sh;
+     memset(&sh, 0, sizeof(sh));
+     sh_limits_init(&sh.limits);
+     path_cache_init(&sh.paths);
+     sh.launch = LAUNCH_SPAWN;
+     struct line_reader r;
+     reader_init_fd(&r, fileno(in), true);
+     struct timespec t0, t1;
+     clock_gettime(CLOCK_MONOTONIC, &t0);
+     sh_run_script(&sh, &r, NULL);
+     clock_gettime(CLOCK_MONOTONIC, &t1);
+     reader_destroy(&r);
+     path_cache_destroy(&sh.paths);
+     jobs_destroy(&sh);
+     sh_capture_close(&sh);
+     vars_destroy(&sh.vars);
+     fclose(in);
+     return runs / (elapsed_ns(&t0, &t1) / 1e9);
+}
+
+static void bench_test_builtin(void)
+{
+     /* A script testing files: builtin test against the external one */
+     double builtin = script_rate("test -f /etc/passwd\n", 20000);
+     double external = script_rate("/usr/bin/test -f /etc/passwd\n", 500);
+     printf("test -f: %.0f commands/s builtin, %.0f commands/s external\n", builtin, external);
+}
+
+int main(void)
+{
+     bench_cmd_parse();
+     bench_scan();
+     bench_history_search();
+     bench_completion();
+     bench_builtin_lookup();
+     bench_test_builtin();
+     return 0;
+}
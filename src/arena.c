@@ -0,0 +1,80 @@
+/**
+ * arena.c
+ * Chunked bump allocator for per command line allocations.
+ *
+ * @author Vladyslav (Vlad) Maliutin
+ */
+
+#include "lab.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#define ARENA_MIN_CHUNK 1024
+
+struct arena_chunk
+{
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+};
+
+/**
+ * @brief Allocates zeroed memory from the arena, adding a chunk if needed.
+ *
+ * @param a Arena instance.
+ * @param size Number of bytes.
+ * @return Pointer to the memory or NULL.
+ */
+void *arena_alloc(struct arena *a, size_t size) {
+    size_t align = sizeof(max_align_t);
+    size = (size + align - 1) & ~(align - 1);
+
+    struct arena_chunk *c = a->head;
+    if (!c || c->size - c->used < size) {
+        size_t cap = size > ARENA_MIN_CHUNK ? size : ARENA_MIN_CHUNK;
+        c = malloc(sizeof(*c) + cap);
+        if (!c) return NULL;
+        c->next = a->head;
+        c->size = cap;
+        c->used = 0;
+        a->head = c;
+    }
+
+    void *p = (char *)c->data + c->used;
+    c->used += size;
+    memset(p, 0, size);
+    return p;
+}
+
+/**
+ * @brief Copies a byte range into the arena as a C string.
+ *
+ * @param a Arena instance.
+ * @param s Source bytes.
+ * @param len Number of bytes.
+ * @return The copy or NULL.
+ */
+char *arena_strndup(struct arena *a, const char *s, size_t len) {
+    char *p = arena_alloc(a, len + 1);
+    if (!p) return NULL;
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+/**
+ * @brief Frees every chunk of the arena.
+ *
+ * @param a Arena instance.
+ */
+void arena_free(struct arena *a) {
+    struct arena_chunk *c = a->head;
+    while (c) {
+        struct arena_chunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    a->head = NULL;
+}
@@ -0,0 +1,357 @@
+/**
+ * complete.c
+ * Tab completion. Command names come from an index of every executable in
+ * the PATH directories, built once and kept sorted so a prefix is found
+ * with two binary searches. inotify watches on the directories mark the
+ * index stale when something is installed or removed, so it never has to
+ * be rescanned just in case.
+ *
+ * @author Vladyslav (Vlad) Maliutin
+ */
+
+#define _GNU_SOURCE
+#include "lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <readline/readline.h>
+
+/* Anything that can add, remove or change the mode of a command */
+#define INDEX_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+                          IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+#define INDEX_POOL_INITIAL 16384
+
+/* Shell whose commands and jobs are completed */
+static struct shell *complete_shell;
+
+/* Where the generators are within the current list of matches */
+static size_t next_builtin, next_command, end_command, next_job;
+
+/**
+ * @brief Initializes an empty index that has not been built yet.
+ *
+ * @param ci Index.
+ */
+void cmd_index_init(struct command_index *ci) {
+    memset(ci, 0, sizeof(*ci));
+    ci->inotify_fd = -1;
+}
+
+/**
+ * @brief Stops watching the PATH directories.
+ *
+ * @param ci Index.
+ */
+static void unwatch(struct command_index *ci) {
+    if (ci->watching) sh_loop_unwatch_fd(ci->inotify_fd);
+    ci->inotify_fd = -1;
+    ci->watching = false;
+}
+
+/**
+ * @brief Frees the index and closes its watches.
+ *
+ * @param ci Index.
+ */
+void cmd_index_destroy(struct command_index *ci) {
+    unwatch(ci);
+    free(ci->pool);
+    free(ci->names);
+    free(ci->path_env);
+    cmd_index_init(ci);
+}
+
+/**
+ * @brief Appends a name to the pool.
+ *
+ * @param ci Index.
+ * @param name Command name.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+static int add_name(struct command_index *ci, const char *name) {
+    size_t n = strlen(name) + 1;
+    if (ci->pool_len + n > ci->pool_cap) {
+        size_t cap = ci->pool_cap ? ci->pool_cap * 2 : INDEX_POOL_INITIAL;
+        while (cap < ci->pool_len + n) cap *= 2;
+        char *pool = realloc(ci->pool, cap);
+        if (!pool) return -1;
+        ci->pool = pool;
+        ci->pool_cap = cap;
+    }
+    if (ci->count == ci->cap) {
+        size_t cap = ci->cap ? ci->cap * 2 : 1024;
+        uint32_t *names = realloc(ci->names, cap * sizeof(*names));
+        if (!names) return -1;
+        ci->names = names;
+        ci->cap = cap;
+    }
+    memcpy(ci->pool + ci->pool_len, name, n);
+    ci->names[ci->count++] = ci->pool_len;
+    ci->pool_len += n;
+    return 0;
+}
+
+/**
+ * @brief Whether a directory entry is something execve would run. The
+ * type readdir reports saves a stat for plain files.
+ *
+ * @param dfd Descriptor of the directory.
+ * @param d The entry.
+ * @return True for an executable regular file or a link to one.
+ */
+static bool is_command(int dfd, const struct dirent *d) {
+    if (d->d_type != DT_REG && d->d_type != DT_LNK && d->d_type != DT_UNKNOWN) return false;
+    if (d->d_type != DT_REG) {
+        struct stat st;
+        if (fstatat(dfd, d->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) return false;
+    }
+    return faccessat(dfd, d->d_name, X_OK, 0) == 0;
+}
+
+/**
+ * @brief qsort_r comparison of two pool offsets by name.
+ */
+static int compare_names(const void *a, const void *b, void *pool) {
+    return strcmp((const char *)pool + *(const uint32_t *)a, (const char *)pool + *(const uint32_t *)b);
+}
+
+/**
+ * @brief Rebuilds the index from the directories of path, watching each
+ * one before it is read so that nothing changing meanwhile goes unseen.
+ *
+ * @param ci Index.
+ * @param path Value of PATH.
+ */
+static void build(struct command_index *ci, const char *path) {
+    unwatch(ci);
+    ci->count = ci->pool_len = 0;
+    ci->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    ci->watching = ci->inotify_fd >= 0;
+    bool relative = false;
+
+    char *dir = malloc(sh_limits()->path_max + 1);
+    for (const char *p = path; dir;) {
+        const char *end = strchr(p, ':');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        /* An empty PATH element means the current directory */
+        if (len == 0) {
+            memcpy(dir, ".", 2);
+        } else if (len <= (size_t)sh_limits()->path_max) {
+            memcpy(dir, p, len);
+            dir[len] = '\0';
+        } else {
+            dir[0] = '\0';
+        }
+        if (dir[0] && dir[0] != '/') relative = true;
+
+        DIR *d = dir[0] ? opendir(dir) : NULL;
+        if (d && ci->watching) inotify_add_watch(ci->inotify_fd, dir, INDEX_WATCH_MASK);
+        struct dirent *e;
+        while (d && (e = readdir(d))) {
+            if (is_command(dirfd(d), e) && add_name(ci, e->d_name) != 0) break;
+        }
+        if (d) closedir(d);
+        if (!end) break;
+        p = end + 1;
+    }
+    free(dir);
+
+    /* Sort, then keep the first of every run of equal names */
+    qsort_r(ci->names, ci->count, sizeof(*ci->names), compare_names, ci->pool);
+    size_t kept = 0;
+    for (size_t i = 0; i < ci->count; i++) {
+        if (kept && strcmp(ci->pool + ci->names[kept - 1], ci->pool + ci->names[i]) == 0) continue;
+        ci->names[kept++] = ci->names[i];
+    }
+    ci->count = kept;
+
+    free(ci->path_env);
+    ci->path_env = strdup(path);
+    ci->built = true;
+    /* Relative directories depend on the working directory, never trust them */
+    ci->stale = relative;
+}
+
+/**
+ * @brief Reads every queued notification. Which file changed does not
+ * matter, the whole index is rebuilt when it is next used, so a package
+ * install touching hundreds of files costs one rebuild.
+ *
+ * @param ci Index.
+ * @return True if anything changed.
+ */
+bool cmd_index_drain(struct command_index *ci) {
+    if (!ci->watching) return false;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    while (read(ci->inotify_fd, buf, sizeof(buf)) > 0) changed = true;
+    if (changed) ci->stale = true;
+    return changed;
+}
+
+/**
+ * @brief Rebuilds the index if it is missing, stale or built for another
+ * PATH.
+ *
+ * @param ci Index.
+ * @return True if it was rebuilt.
+ */
+bool cmd_index_refresh(struct command_index *ci) {
+    const char *path = getenv("PATH");
+    if (!path) path = "/usr/bin:/bin";
+    cmd_index_drain(ci);
+    if (ci->built && !ci->stale && ci->path_env && strcmp(ci->path_env, path) == 0) return false;
+    build(ci, path);
+    return true;
+}
+
+/**
+ * @brief Finds the range of names starting with prefix.
+ *
+ * @param ci Index.
+ * @param prefix Start of the name.
+ * @param first Receives the position of the first match.
+ * @return Number of matches.
+ */
+size_t cmd_index_prefix(const struct command_index *ci, const char *prefix, size_t *first) {
+    size_t len = strlen(prefix);
+    size_t lo = 0, hi = ci->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strncmp(ci->pool + ci->names[mid], prefix, len) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    *first = lo;
+    hi = ci->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strncmp(ci->pool + ci->names[mid], prefix, len) <= 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo - *first;
+}
+
+/**
+ * @brief Name at a position of the index.
+ *
+ * @param ci Index.
+ * @param i Position.
+ * @return The name.
+ */
+const char *cmd_index_name(const struct command_index *ci, size_t i) {
+    return ci->pool + ci->names[i];
+}
+
+/**
+ * @brief readline generator of builtins, then commands, starting with text.
+ *
+ * @param text Word being completed.
+ * @param state 0 for the first call of a completion.
+ * @return Next match, allocated, or NULL when there are no more.
+ */
+static char *command_generator(const char *text, int state) {
+    struct command_index *ci = &complete_shell->commands;
+    const struct builtin *builtins = builtin_list();
+    size_t len = strlen(text);
+    if (state == 0) {
+        next_builtin = 0;
+        end_command = cmd_index_prefix(ci, text, &next_command);
+        end_command += next_command;
+    }
+    while (builtins[next_builtin].name) {
+        const char *name = builtins[next_builtin++].name;
+        if (strncmp(name, text, len) == 0) return strdup(name);
+    }
+    while (next_command < end_command) {
+        const char *name = cmd_index_name(ci, next_command++);
+        /* cat, kill and friends are also in PATH; list them once */
+        if (!is_builtin(name)) return strdup(name);
+    }
+    return NULL;
+}
+
+/**
+ * @brief readline generator of %n job specs starting with text.
+ *
+ * @param text Word being completed.
+ * @param state 0 for the first call of a completion.
+ * @return Next match, allocated, or NULL when there are no more.
+ */
+static char *job_generator(const char *text, int state) {
+    struct job_table *jt = &complete_shell->jobs;
+    if (state == 0) next_job = 0;
+    while (next_job < jt->count) {
+        char spec[16];
+        snprintf(spec, sizeof(spec), "%%%d", jt->jobs[next_job++]->id);
+        if (strncmp(spec, text, strlen(text)) == 0) return strdup(spec);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Whether the word at start is a command name: the first word of
+ * the line or the first after a pipe, list operator or parenthesis.
+ *
+ * @param line Input line.
+ * @param start Offset of the word.
+ * @return True in command position.
+ */
+static bool command_position(const char *line, int start) {
+    while (start > 0 && (line[start - 1] == ' ' || line[start - 1] == '\t')) start--;
+    return start == 0 || strchr("|;&(", line[start - 1]);
+}
+
+/**
+ * @brief Completes the word between start and end, see lab.h.
+ *
+ * @param sh Shell instance.
+ * @param line Input line.
+ * @param start Offset of the word.
+ * @param end Offset of the cursor.
+ * @return Matches, or NULL for none or for filename completion.
+ */
+char **sh_complete(struct shell *sh, const char *line, int start, int end) {
+    char *text = strndup(line + start, end - start);
+    if (!text) return NULL;
+    complete_shell = sh;
+    char **matches = NULL;
+    if (text[0] == '%') {
+        rl_attempted_completion_over = 1;
+        matches = rl_completion_matches(text, job_generator);
+    } else if (command_position(line, start) && !strchr(text, '/')) {
+        rl_attempted_completion_over = 1;
+        if (cmd_index_refresh(&sh->commands)) sh_loop_watch_commands(sh);
+        matches = rl_completion_matches(text, command_generator);
+    }
+    free(text);
+    return matches;
+}
+
+/**
+ * @brief readline's attempted completion hook.
+ *
+ * @param text Word being completed.
+ * @param start Offset of the word in rl_line_buffer.
+ * @param end Offset of the cursor.
+ * @return Matches, or NULL to fall back to filenames.
+ */
+static char **complete_line(const char *text, int start, int end) {
+    UNUSED(text);
+    return sh_complete(complete_shell, rl_line_buffer, start, end);
+}
+
+/**
+ * @brief Makes Tab complete through sh_complete.
+ *
+ * @param sh Shell instance.
+ */
+void sh_complete_bind(struct shell *sh) {
+    complete_shell = sh;
+    rl_attempted_completion_function = complete_line;
+}
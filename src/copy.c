@@ -0,0 +1,214 @@
+/**
+ * copy.c
+ * Moves bytes between descriptors for builtins without bouncing them
+ * through a userspace buffer whenever the kernel can do it directly.
+ *
+ * @author Vladyslav (Vlad) Maliutin
+ */
+
+#define _GNU_SOURCE
+#include "lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+/* Upper bound for a single kernel copy request */
+#define COPY_CHUNK (1 << 30)
+/* Buffer used when nothing better is available */
+#define COPY_BUF (64 * 1024)
+
+/**
+ * @brief Plain read/write loop used when no zero-copy path applies.
+ *
+ * @param in_fd Source descriptor.
+ * @param out_fd Destination descriptor.
+ * @param copied Bytes moved so far, updated in place.
+ * @return 0 on success, -1 on error.
+ */
+static int copy_rw(int in_fd, int out_fd, ssize_t *copied) {
+    char *buf = malloc(COPY_BUF);
+    if (!buf) return -1;
+    for (;;) {
+        ssize_t n = read(in_fd, buf, COPY_BUF);
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            free(buf);
+            return -1;
+        }
+        for (ssize_t off = 0; off < n;) {
+            ssize_t w = write(out_fd, buf + off, n - off);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                free(buf);
+                return -1;
+            }
+            off += w;
+        }
+        *copied += n;
+    }
+    free(buf);
+    return 0;
+}
+
+/**
+ * @brief Moves exactly len bytes from in_fd to out_fd with read/write.
+ *
+ * @param in_fd Source descriptor.
+ * @param out_fd Destination descriptor.
+ * @param len Number of bytes; in_fd must hold at least that many.
+ * @return 0 on success, -1 on error.
+ */
+static int copy_exact(int in_fd, int out_fd, size_t len) {
+    char buf[4096];
+    while (len > 0) {
+        ssize_t n = read(in_fd, buf, len < sizeof(buf) ? len : sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        for (ssize_t off = 0; off < n;) {
+            ssize_t w = write(out_fd, buf + off, n - off);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) return -1;
+            off += w;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Tells whether errno means the kernel cannot do this kind of copy,
+ * as opposed to a real I/O error.
+ *
+ * @return True if a slower method should be tried.
+ */
+static bool unsupported(void) {
+    return errno == EINVAL || errno == ENOSYS || errno == EXDEV ||
+           errno == EOPNOTSUPP || errno == EBADF;
+}
+
+/**
+ * @brief Copies everything from in_fd to out_fd. File to file copies use
+ * copy_file_range, anything involving a pipe uses splice, a regular file
+ * into anything else uses sendfile, and only what is left falls back to
+ * read/write.
+ *
+ * @param in_fd Source descriptor.
+ * @param out_fd Destination descriptor.
+ * @return Number of bytes copied or -1 on error.
+ */
+ssize_t sh_copy_fd(int in_fd, int out_fd) {
+    struct stat in_st, out_st;
+    if (fstat(in_fd, &in_st) != 0 || fstat(out_fd, &out_st) != 0) return -1;
+
+    ssize_t copied = 0, n;
+    bool in_reg = S_ISREG(in_st.st_mode), out_reg = S_ISREG(out_st.st_mode);
+    bool in_pipe = S_ISFIFO(in_st.st_mode), out_pipe = S_ISFIFO(out_st.st_mode);
+
+    /* copy_file_range refuses O_APPEND destinations */
+    if (in_reg && out_reg && !(fcntl(out_fd, F_GETFL) & O_APPEND)) {
+        while ((n = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK, 0)) > 0 ||
+               (n < 0 && errno == EINTR)) {
+            if (n > 0) copied += n;
+        }
+        if (n == 0) return copied;
+        if (!unsupported() || copied) return -1;
+    }
+
+    if (in_pipe || out_pipe) {
+        unsigned int flags = SPLICE_F_MOVE | SPLICE_F_MORE;
+        while ((n = splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK, flags)) > 0 ||
+               (n < 0 && errno == EINTR)) {
+            if (n > 0) copied += n;
+        }
+        if (n == 0) return copied;
+        if (!unsupported() || copied) return -1;
+    }
+
+    if (in_reg) {
+        while ((n = sendfile(out_fd, in_fd, NULL, COPY_CHUNK)) > 0 ||
+               (n < 0 && errno == EINTR)) {
+            if (n > 0) copied += n;
+        }
+        if (n == 0) return copied;
+        if (!unsupported() || copied) return -1;
+    }
+
+    return copy_rw(in_fd, out_fd, &copied) == 0 ? copied : -1;
+}
+
+/**
+ * @brief Copies in_fd to both out_fd and file_fd. When both in_fd and
+ * out_fd are pipes and the file is not opened for appending, the data is
+ * duplicated in the kernel with tee(2) and then spliced into the file,
+ * otherwise a shared buffer is written twice.
+ *
+ * @param in_fd Source descriptor.
+ * @param out_fd First destination, usually stdout.
+ * @param file_fd Second destination.
+ * @return Number of bytes copied or -1 on error.
+ */
+ssize_t sh_tee_fd(int in_fd, int out_fd, int file_fd) {
+    struct stat in_st, out_st;
+    if (fstat(in_fd, &in_st) != 0 || fstat(out_fd, &out_st) != 0) return -1;
+
+    ssize_t copied = 0;
+    /* splice refuses O_APPEND files, and by then tee has already copied */
+    bool kernel = S_ISFIFO(in_st.st_mode) && S_ISFIFO(out_st.st_mode) &&
+                  !(fcntl(file_fd, F_GETFL) & O_APPEND);
+    while (kernel) {
+        ssize_t n = tee(in_fd, out_fd, COPY_CHUNK, 0);
+        if (n == 0) return copied;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (!unsupported() || copied) return -1;
+            break;
+        }
+        /* tee left the bytes in in_fd, consume exactly that many */
+        for (ssize_t left = n; left > 0;) {
+            ssize_t m = splice(in_fd, NULL, file_fd, NULL, left, SPLICE_F_MOVE);
+            if (m < 0 && errno == EINTR) continue;
+            if (m < 0 && unsupported()) {
+                /* out_fd has them already, so they go to the file alone */
+                if (copy_exact(in_fd, file_fd, left) != 0) return -1;
+                kernel = false;
+                break;
+            }
+            if (m <= 0) return -1;
+            left -= m;
+        }
+        copied += n;
+    }
+
+    char *buf = malloc(COPY_BUF);
+    if (!buf) return -1;
+    for (;;) {
+        ssize_t n = read(in_fd, buf, COPY_BUF);
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            free(buf);
+            return -1;
+        }
+        int fds[2] = { out_fd, file_fd };
+        for (int i = 0; i < 2; i++) {
+            for (ssize_t off = 0; off < n;) {
+                ssize_t w = write(fds[i], buf + off, n - off);
+                if (w < 0 && errno == EINTR) continue;
+                if (w < 0) {
+                    free(buf);
+                    return -1;
+                }
+                off += w;
+            }
+        }
+        copied += n;
+    }
+    free(buf);
+    return copied;
+}
@@ -0,0 +1,388 @@
+/**
+ * exec.c
+ * Runs parsed pipelines: wires the stages together with pipes, launches
+ * them into a single process group and reaps them.
+ *
+ * @author Vladyslav (Vlad) Maliutin
+ */
+
+#define _GNU_SOURCE
+#include "lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+/**
+ * @brief Runs a builtin as one stage of a pipeline in a forked child.
+ *
+ * @param sh Shell instance.
+ * @param argv Builtin command.
+ * @param io Descriptors for the stage.
+ * @param pgid Process group to join, 0 for a new group.
+ * @param foreground Whether the stage gets the terminal.
+ * @param pipes Every pipe of the pipeline, closed in the child.
+ * @param npipes Number of pipes.
+ * @return Child pid or -1 on failure.
+ */
+pid_t sh_fork_builtin(struct shell *sh, char **argv, const struct launch_io *io,
+                      pid_t pgid, bool foreground, int (*pipes)[2], size_t npipes) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        sh->subshell = 1;
+        sh_loop_detach(sh);
+        if (sh_child_setup(sh, io, pgid, foreground) != 0)
+            _exit(1);
+        /* No exec follows, so close-on-exec will not drop the other ends */
+        for (size_t i = 0; i < npipes; i++) {
+            close(pipes[i][0]);
+            close(pipes[i][1]);
+        }
+        /* The assignments in front only have this copy of the shell to affect */
+        for (size_t i = 0; io && i < io->nassigns; i++) {
+            if (sh_assign(sh, io->assigns[i], argv[0] ? VAR_EXPORT : 0) != 0)
+                _exit(1);
+        }
+        const struct builtin *b = argv[0] ? builtin_find(argv[0]) : NULL;
+        if (b && !(b->flags & BUILTIN_FORKABLE)) {
+            fprintf(stderr, "%s: not available in a pipeline or background job\n", b->name);
+            _exit(1);
+        }
+        bool ok = b ? b->run(sh, argv) : true;
+        fflush(stdout);
+        _exit(sh_builtin_status(sh, ok));
+    }
+    setpgid(pid, pgid ? pgid : pid);
+    if (foreground && sh->shell_is_interactive)
+        tcsetpgrp(sh->shell_terminal, pgid ? pgid : pid);
+    return pid;
+}
+
+/**
+ * @brief Runs a builtin inside the shell with the assignments in front of
+ * it in effect, then gives the variables their old values back. Without a
+ * builtin the assignments are simply made.
+ *
+ * @param sh Shell instance.
+ * @param cmd Command to run.
+ * @return True on success.
+ */
+static bool run_assigned(struct shell *sh, struct command *cmd) {
+    bool ok = true;
+    if (!cmd->argv[0]) {
+        for (size_t i = 0; i < cmd->nassigns; i++) ok &= sh_assign(sh, cmd->assigns[i], 0) == 0;
+        return ok;
+    }
+    if (cmd->nassigns == 0) return do_builtin(sh, cmd->argv);
+
+    /* Remember each variable as NAME=value, or NULL if it was not set */
+    char **old = calloc(cmd->nassigns, sizeof(*old));
+    if (!old) return false;
+    size_t set = 0;
+    for (; set < cmd->nassigns && ok; set++) {
+        const char *w = cmd->assigns[set];
+        size_t len = var_name_len(w);
+        const char *value = var_get(&sh->vars, w, len);
+        if (value && asprintf(&old[set], "%.*s=%s", (int)len, w, value) < 0) old[set] = NULL;
+        ok = sh_assign(sh, w, 0) == 0;
+    }
+    if (ok) ok = do_builtin(sh, cmd->argv);
+    while (set-- > 0) {
+        if (old[set]) {
+            sh_assign(sh, old[set], 0);
+            free(old[set]);
+        } else {
+            char *name = strndup(cmd->assigns[set], var_name_len(cmd->assigns[set]));
+            if (name) sh_unset(sh, name);
+            free(name);
+        }
+    }
+    free(old);
+    return ok;
+}
+
+/**
+ * @brief Wait status of a command run inside the shell. A command with no
+ * name reports the status of the last command substitution made for it.
+ *
+ * @param sh Shell instance.
+ * @param cmd Command that ran.
+ * @param ok Whether it succeeded.
+ * @return Wait status style result.
+ */
+static int here_status(struct shell *sh, const struct command *cmd, bool ok) {
+    int status = sh_builtin_status(sh, ok);
+    if (ok && !cmd->argv[0] && cmd->substituted) status = sh->last_status;
+    return W_EXITCODE(status, 0);
+}
+
+/**
+ * @brief Runs a builtin (or a bare list of assignments and redirections)
+ * inside the shell with its redirections applied, then puts the shell's
+ * own descriptors back.
+ *
+ * @param sh Shell instance.
+ * @param cmd Command to run.
+ * @return Wait status style result.
+ */
+static int run_builtin_here(struct shell *sh, struct command *cmd) {
+    /* Flushed at once so output keeps its place among external commands' */
+    if (cmd->nredirs == 0) {
+        bool ok = run_assigned(sh, cmd);
+        fflush(stdout);
+        return here_status(sh, cmd, ok);
+    }
+
+    /* Keep a close-on-exec copy of every descriptor that gets replaced */
+    int *saved = malloc(cmd->nredirs * sizeof(*saved));
+    if (!saved) return W_EXITCODE(1, 0);
+    fflush(stdout);
+    fflush(stderr);
+    for (size_t i = 0; i < cmd->nredirs; i++)
+        saved[i] = fcntl(cmd->redirs[i].fd, F_DUPFD_CLOEXEC, 10);
+
+    int status = W_EXITCODE(1, 0);
+    if (sh_apply_redirects(cmd->redirs, cmd->nredirs, false) == 0) {
+        status = here_status(sh, cmd, run_assigned(sh, cmd));
+    }
+    fflush(stdout);
+    fflush(stderr);
+
+    /* Restore in reverse so a descriptor redirected twice ends up original */
+    for (size_t i = cmd->nredirs; i-- > 0;) {
+        int fd = cmd->redirs[i].fd;
+        if (saved[i] >= 0) {
+            dup2(saved[i], fd);
+            close(saved[i]);
+        } else {
+            close(fd);
+        }
+    }
+    free(saved);
+    return status;
+}
+
+/**
+ * @brief Starts the stages of a pipeline and, unless it is in the
+ * background, waits for every one.
+ *
+ * @param sh Shell instance.
+ * @param pl Parsed pipeline.
+ * @param cmds Its stages, expanded.
+ * @return Wait status of the last stage, -1 if nothing ran.
+ */
+static int run_stages(struct shell *sh, struct pipeline *pl, struct command *cmds) {
+    size_t n = pl->ncmds;
+    char *first = cmds[0].argv[0];
+    const struct builtin *b = first ? builtin_find(first) : NULL;
+    if (n == 1 && !pl->background && (!first || (b && (b->flags & BUILTIN_PARENT))))
+        return run_builtin_here(sh, &cmds[0]);
+    bool foreground = !pl->background;
+
+    int (*pipes)[2] = malloc((n - 1) * sizeof(*pipes));
+    pid_t *pids = malloc(n * sizeof(*pids));
+    if (!pids || (n > 1 && !pipes)) {
+        free(pipes);
+        free(pids);
+        return -1;
+    }
+
+    for (size_t i = 0; i < n - 1; i++) {
+        if (pipe2(pipes[i], O_CLOEXEC) != 0) {
+            perror("pipe");
+            while (i-- > 0) {
+                close(pipes[i][0]);
+                close(pipes[i][1]);
+            }
+            free(pipes);
+            free(pids);
+            return -1;
+        }
+    }
+
+    /* Without job control a background job must not compete for our input */
+    int null_fd = -1;
+    if (!foreground && !sh->shell_is_interactive)
+        null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    /* A subshell has no job control, its pipelines stay in its own group */
+    pid_t pgid = sh->subshell ? getpgrp() : 0;
+    for (size_t i = 0; i < n; i++) {
+        struct launch_io io = {
+            .in_fd = i > 0 ? pipes[i - 1][0] : null_fd,
+            .out_fd = i < n - 1 ? pipes[i][1] : -1,
+            .nredirs = cmds[i].nredirs,
+            .redirs = cmds[i].redirs,
+            .nassigns = cmds[i].nassigns,
+            .assigns = cmds[i].assigns,
+        };
+        char **argv = cmds[i].argv;
+        if (!argv[0] || is_builtin(argv[0]))
+            pids[i] = sh_fork_builtin(sh, argv, &io, pgid, foreground, pipes, n - 1);
+        else
+            pids[i] = sh_launch(sh, argv, &io, pgid, foreground);
+        if (pids[i] > 0 && pgid == 0) pgid = pids[i];
+
+        /* The child has its own copies now, keep only what later stages need */
+        if (i > 0) close(pipes[i - 1][0]);
+        if (i < n - 1) close(pipes[i][1]);
+    }
+
+    if (null_fd >= 0) close(null_fd);
+
+    struct job *j = job_add(&sh->jobs, pgid, pids, n, pl->text);
+    free(pipes);
+    free(pids);
+    if (!j) return -1;
+    sh_loop_watch_job(sh, j);
+
+    if (!foreground) {
+        if (sh->shell_is_interactive) fprintf(stderr, "[%d] %d\n", j->id, (int)j->pgid);
+        return 0;
+    }
+
+    int status = job_wait(sh, j, true);
+    if (j->state == JOB_DONE) job_remove(&sh->jobs, j);
+    return status;
+}
+
+/**
+ * @brief Runs a pipeline in the foreground and waits for every stage.
+ * Stages with marked words are expanded first, into an arena that is
+ * dropped once they have run.
+ *
+ * @param sh Shell instance.
+ * @param pl Parsed pipeline.
+ * @return Wait status of the last stage, -1 if nothing ran.
+ */
+int sh_run_pipeline(struct shell *sh, struct pipeline *pl) {
+    size_t n = pl->ncmds;
+    if (n == 0) return -1;
+    bool expand = false;
+    for (size_t i = 0; i < n; i++) expand |= pl->cmds[i].expand;
+    if (!expand) return run_stages(sh, pl, pl->cmds);
+
+    struct arena scratch = { 0 };
+    struct command *cmds = arena_alloc(&scratch, n * sizeof(*cmds));
+    int status = cmds ? 0 : -1;
+    for (size_t i = 0; i < n && status == 0; i++)
+        status = sh_expand_command(sh, &pl->cmds[i], &cmds[i], &scratch);
+    status = status == 0 ? run_stages(sh, pl, cmds) : W_EXITCODE(1, 0);
+    arena_free(&scratch);
+    return status;
+}
+/**
+ * @brief Converts a wait status into the exit status $? reports.
+ *
+ * @param status Wait status, -1 if nothing ran.
+ * @return Exit status.
+ */
+int sh_exit_code(int status) {
+    if (status < 0) return 1;
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    if (WIFSTOPPED(status)) return 128 + WSTOPSIG(status);
+    return 1;
+}
+
+/**
+ * @brief Runs the pipelines of an and-or list with short-circuiting.
+ *
+ * @param sh Shell instance.
+ * @param item The and-or list.
+ * @return True if a foreground pipeline was interrupted with ^C.
+ */
+static bool run_and_or(struct shell *sh, struct and_or *item) {
+    for (size_t i = 0; i < item->npipelines; i++) {
+        if (i > 0 && (item->ops[i - 1] == ANDOR_AND) != (sh->last_status == 0))
+            continue;
+        int status = sh_run_pipeline(sh, &item->pipelines[i]);
+        sh->last_status = sh_exit_code(status);
+        if (status > 0 && WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Runs a background and-or list of several pipelines in a forked
+ * subshell that becomes one job.
+ *
+ * @param sh Shell instance.
+ * @param item The and-or list.
+ */
+static void run_and_or_background(struct shell *sh, struct and_or *item) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        sh->last_status = 1;
+        return;
+    }
+    if (pid == 0) {
+        /* Without job control a background job must not compete for our input */
+        int null_fd = sh->shell_is_interactive ? -1 : open("/dev/null", O_RDONLY | O_CLOEXEC);
+        struct launch_io io = { .in_fd = null_fd, .out_fd = -1 };
+        sh->subshell = 1;
+        sh_loop_detach(sh);
+        if (sh_child_setup(sh, &io, 0, false) != 0)
+            _exit(1);
+        sh->shell_is_interactive = 0;
+        run_and_or(sh, item);
+        fflush(stdout);
+        _exit(sh->last_status);
+    }
+    setpgid(pid, pid);
+
+    sh->last_status = 0;
+    struct job *j = job_add(&sh->jobs, pid, &pid, 1, item->text);
+    if (!j) return;
+    sh_loop_watch_job(sh, j);
+    if (sh->shell_is_interactive) fprintf(stderr, "[%d] %d\n", j->id, (int)j->pgid);
+}
+
+/**
+ * @brief Runs every and-or list of a command list in order.
+ *
+ * @param sh Shell instance.
+ * @param list Parsed list.
+ * @return Exit status of the last pipeline that ran.
+ */
+int sh_run_list(struct shell *sh, struct cmd_list *list) {
+    for (size_t i = 0; i < list->nitems; i++) {
+        struct and_or *item = &list->items[i];
+        if (item->background && item->npipelines > 1)
+            run_and_or_background(sh, item);
+        else if (run_and_or(sh, item))
+            break;
+    }
+    return sh->last_status;
+}
+
+/**
+ * @brief Parses one input line, through the parse cache, and runs it.
+ *
+ * @param sh Shell instance.
+ * @param line Line without surrounding blanks.
+ * @param len Length of the line.
+ * @return False if the line had a syntax error.
+ */
+bool sh_run_line(struct shell *sh, const char *line, size_t len) {
+    struct cmd_list *list = parse_cache_get(&sh->parses, line, len);
+    if (!list) {
+        sh->last_status = 2;
+        return false;
+    }
+    sh_run_list(sh, list);
+    list_free(list);
+    return true;
+}
@@ -0,0 +1,976 @@
+/**
+ * expand.c
+ * Expansion of the words the lexer marked with EXP_* bytes. Parsed lines
+ * are cached and shared, so expansion never touches them: it runs just
+ * before a command starts and writes an expanded copy of the command into
+ * a scratch arena. Commands without marks are run as parsed.
+ *
+ * Every word of a command is expanded into one growable buffer, starting
+ * on the stack, as a run of NUL terminated fields; the buffer is copied
+ * into the arena once at the end and the fields become the argv.
+ *
+ * @author Vladyslav (Vlad) Maliutin
+ */
+
+#define _GNU_SOURCE
+#include "lab.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/* Bytes and fields an expansion holds before moving to the heap */
+#define EXPAND_INLINE_BYTES 256
+#define EXPAND_INLINE_FIELDS 32
+/* How deep variables holding expressions are followed in $((...)) */
+#define ARITH_MAX_DEPTH 32
+
+/* How a byte of IFS delimits fields */
+enum ifs_class
+{
+    IFS_NONE,
+    IFS_WHITE,
+    IFS_OTHER
+};
+
+/* State of the expansion of one command */
+struct expander
+{
+    struct shell *sh;
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t *fields;
+    size_t nfields;
+    size_t fields_cap;
+    bool open;      /* a field is being written */
+    bool ws_closed; /* the last field was ended by IFS white space */
+    bool split;     /* unquoted values are split into fields */
+    bool ran;       /* a command substitution ran */
+    unsigned char ifs[256];
+    char inline_buf[EXPAND_INLINE_BYTES];
+    size_t inline_fields[EXPAND_INLINE_FIELDS];
+};
+
+/* State of the evaluation of one arithmetic expression */
+struct arith
+{
+    struct shell *sh;
+    const char *p;
+    int depth;
+    int skip; /* inside a branch that is not taken, so errors are ignored */
+    const char *error;
+};
+
+static bool expand_ref(struct expander *ex, const char *ref, size_t n, bool quoted);
+static long long arith_cond(struct arith *a);
+
+/**
+ * @brief Sets up an expander, reading IFS once for the whole command.
+ *
+ * @param ex Expander.
+ * @param sh Shell instance.
+ */
+static void expander_init(struct expander *ex, struct shell *sh) {
+    memset(ex, 0, offsetof(struct expander, ifs));
+    ex->sh = sh;
+    ex->buf = ex->inline_buf;
+    ex->cap = sizeof(ex->inline_buf);
+    ex->fields = ex->inline_fields;
+    ex->fields_cap = EXPAND_INLINE_FIELDS;
+    memset(ex->ifs, IFS_NONE, sizeof(ex->ifs));
+    const char *ifs = var_get(&sh->vars, "IFS", 3);
+    if (!ifs) ifs = " \t\n";
+    for (; *ifs; ifs++) {
+        unsigned char c = *ifs;
+        ex->ifs[c] = c == ' ' || c == '\t' || c == '\n' ? IFS_WHITE : IFS_OTHER;
+    }
+}
+
+/**
+ * @brief Releases the heap parts of an expander.
+ *
+ * @param ex Expander.
+ */
+static void expander_free(struct expander *ex) {
+    if (ex->buf != ex->inline_buf) free(ex->buf);
+    if (ex->fields != ex->inline_fields) free(ex->fields);
+}
+
+/**
+ * @brief Makes room for n more bytes in the buffer, moving it to the heap
+ * once the inline part is full.
+ *
+ * @param ex Expander.
+ * @param n Bytes needed.
+ * @return False if out of memory (reported).
+ */
+static bool reserve(struct expander *ex, size_t n) {
+    if (ex->cap - ex->len >= n) return true;
+    size_t cap = ex->cap * 2;
+    while (cap - ex->len < n) cap *= 2;
+    char *buf = ex->buf == ex->inline_buf ? malloc(cap) : realloc(ex->buf, cap);
+    if (!buf) {
+        perror("expand");
+        return false;
+    }
+    if (ex->buf == ex->inline_buf) memcpy(buf, ex->buf, ex->len);
+    ex->buf = buf;
+    ex->cap = cap;
+    return true;
+}
+
+/**
+ * @brief Appends bytes to the buffer. They may come from further along in
+ * the buffer itself.
+ *
+ * @param ex Expander.
+ * @param s Bytes.
+ * @param n Count.
+ * @return False if out of memory.
+ */
+static bool put(struct expander *ex, const char *s, size_t n) {
+    if (!reserve(ex, n)) return false;
+    memmove(ex->buf + ex->len, s, n);
+    ex->len += n;
+    return true;
+}
+
+/**
+ * @brief Starts a field at the end of the buffer unless one is open.
+ *
+ * @param ex Expander.
+ * @return False if out of memory.
+ */
+static bool open_field(struct expander *ex) {
+    ex->ws_closed = false;
+    if (ex->open) return true;
+    if (ex->nfields == ex->fields_cap) {
+        size_t cap = ex->fields_cap * 2;
+        size_t *fields = ex->fields == ex->inline_fields
+                             ? malloc(cap * sizeof(*fields))
+                             : realloc(ex->fields, cap * sizeof(*fields));
+        if (!fields) {
+            perror("expand");
+            return false;
+        }
+        if (ex->fields == ex->inline_fields)
+            memcpy(fields, ex->fields, ex->nfields * sizeof(*fields));
+        ex->fields = fields;
+        ex->fields_cap = cap;
+    }
+    ex->fields[ex->nfields++] = ex->len;
+    ex->open = true;
+    return true;
+}
+
+/**
+ * @brief Ends the open field, if any.
+ *
+ * @param ex Expander.
+ * @return False if out of memory.
+ */
+static bool close_field(struct expander *ex) {
+    if (!ex->open) return true;
+    ex->open = false;
+    return put(ex, "", 1);
+}
+
+/**
+ * @brief Appends text that is never split, opening a field even for none.
+ *
+ * @param ex Expander.
+ * @param s Text.
+ * @param n Length.
+ * @return False if out of memory.
+ */
+static bool append_literal(struct expander *ex, const char *s, size_t n) {
+    return open_field(ex) && put(ex, s, n);
+}
+
+/**
+ * @brief Appends the result of an expansion. Unquoted, it is split into
+ * fields on IFS: runs of IFS white space separate fields, and each other
+ * IFS character, with the white space around it, ends one even if that
+ * leaves it empty.
+ *
+ * @param ex Expander.
+ * @param s Value.
+ * @param n Length.
+ * @param quoted True inside double quotes.
+ * @return False if out of memory.
+ */
+static bool append_value(struct expander *ex, const char *s, size_t n, bool quoted) {
+    if (quoted || !ex->split) return append_literal(ex, s, n);
+    for (size_t i = 0; i < n;) {
+        enum ifs_class cls = ex->ifs[(unsigned char)s[i]];
+        if (cls == IFS_NONE) {
+            size_t run = i + 1;
+            while (run < n && ex->ifs[(unsigned char)s[run]] == IFS_NONE) run++;
+            if (!append_literal(ex, s + i, run - i)) return false;
+            i = run;
+            continue;
+        }
+        if (cls == IFS_WHITE) {
+            bool closing = ex->open;
+            if (!close_field(ex)) return false;
+            ex->ws_closed |= closing;
+        } else if (ex->open) {
+            if (!close_field(ex)) return false;
+        } else if (ex->ws_closed) {
+            ex->ws_closed = false;
+        } else if (!open_field(ex) || !close_field(ex)) {
+            return false;
+        }
+        i++;
+    }
+    return true;
+}
+
+/**
+ * @brief Finds the value of $NAME or $?.
+ *
+ * @param sh Shell instance.
+ * @param name The name.
+ * @param len Its length.
+ * @param buf Room for a number.
+ * @return The value, NULL if the variable is unset.
+ */
+static const char *lookup(struct shell *sh, const char *name, size_t len, char buf[24]) {
+    if (*name == '?') {
+        snprintf(buf, 24, "%d", sh->last_status);
+        return buf;
+    }
+    return var_get(&sh->vars, name, len);
+}
+
+/**
+ * @brief Position of the " that closes a double quoted string.
+ *
+ * @param p First character inside the quotes.
+ * @param end End of the text.
+ * @return The closing quote, or end if there is none.
+ */
+static const char *quote_end(const char *p, const char *end) {
+    while (p < end && *p != '"') {
+        size_t ref = *p == '$' ? lex_reference_len(p, end) : 0;
+        if (ref == SIZE_MAX) return end;
+        if (ref) p += ref;
+        else p += *p == '\\' && p + 1 < end ? 2 : 1;
+    }
+    return p;
+}
+
+/**
+ * @brief Expands text as written in the line, such as the word of a
+ * ${NAME:-word} or an arithmetic expression: quotes, backslashes and
+ * references are handled here, since the lexer left them as they were.
+ *
+ * @param ex Expander.
+ * @param s Text.
+ * @param n Length.
+ * @param quoted True inside double quotes.
+ * @return False on failure (reported).
+ */
+static bool expand_text(struct expander *ex, const char *s, size_t n, bool quoted) {
+    const char *end = s + n;
+    for (const char *p = s; p < end;) {
+        char c = *p;
+        size_t ref = c == '$' ? lex_reference_len(p, end) : 0;
+        if (ref && ref != SIZE_MAX) {
+            if (!expand_ref(ex, p, ref, quoted)) return false;
+            p += ref;
+        } else if (c == '\\' && p + 1 < end) {
+            bool escape = !quoted || strchr("$`\"\\", p[1]);
+            if (!append_literal(ex, escape ? p + 1 : p, escape ? 1 : 2)) return false;
+            p += 2;
+        } else if (c == '\'' && !quoted) {
+            const char *close = memchr(p + 1, '\'', end - (p + 1));
+            if (!close) close = end;
+            if (!append_literal(ex, p + 1, close - (p + 1))) return false;
+            p = close < end ? close + 1 : end;
+        } else if (c == '"') {
+            const char *close = quote_end(p + 1, end);
+            if (!open_field(ex) || !expand_text(ex, p + 1, close - (p + 1), true)) return false;
+            p = close < end ? close + 1 : end;
+        } else {
+            const char *q = p + 1;
+            while (q < end && !strchr("$\\'\"", *q)) q++;
+            if (!append_value(ex, p, q - p, quoted)) return false;
+            p = q;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Expands text into a NUL terminated string at the end of the
+ * buffer, outside of any field. The caller takes the string at the
+ * returned offset and gives the space back by resetting ex->len to it.
+ *
+ * @param ex Expander.
+ * @param prefix Bytes to put in front of the expansion.
+ * @param plen Their length.
+ * @param s Text as written in the line.
+ * @param n Its length.
+ * @param mark Receives the offset of the string.
+ * @return False on failure (reported).
+ */
+static bool expand_string(struct expander *ex, const char *prefix, size_t plen,
+                          const char *s, size_t n, size_t *mark) {
+    size_t nfields = ex->nfields;
+    bool open = ex->open, ws_closed = ex->ws_closed, split = ex->split;
+    *mark = ex->len;
+    /* An open field keeps open_field from recording one */
+    ex->open = true;
+    ex->split = false;
+    bool ok = put(ex, prefix, plen) && expand_text(ex, s, n, true) && put(ex, "", 1);
+    ex->nfields = nfields;
+    ex->open = open;
+    ex->ws_closed = ws_closed;
+    ex->split = split;
+    return ok;
+}
+
+/**
+ * @brief Finds the operator of ${NAME op word}.
+ *
+ * @param s Text between the braces.
+ * @param n Its length.
+ * @param len Receives the length of NAME.
+ * @return The op past any colon, s + n for a bare ${NAME}, NULL if the
+ * text is neither.
+ */
+static const char *braced_op(const char *s, size_t n, size_t *len) {
+    *len = n > 0 && s[0] == '?' ? 1 : var_name_len(s);
+    if (*len == 0) return NULL;
+    const char *op = s + *len;
+    if (op == s + n) return op;
+    op += *op == ':';
+    return op < s + n && strchr("-=+?", *op) ? op : NULL;
+}
+
+/**
+ * @brief Whether expanding text could assign a variable through a
+ * ${NAME=word} or ${NAME:=word}, nested ones included.
+ *
+ * @param s Text, lexer marked or as written.
+ * @param n Its length.
+ * @return True if it could.
+ */
+static bool text_assigns(const char *s, size_t n) {
+    const char *end = s + n;
+    for (const char *p = s; p < end; p++) {
+        size_t ref = *p == '$' ? lex_reference_len(p, end) : 0;
+        if (ref == 0 || ref == SIZE_MAX) continue;
+        if (p[1] == '{' && ref > 3 && p[2] != '#') {
+            const char *body = p + 2, *body_end = p + ref - 1, *op;
+            size_t len;
+            if ((op = braced_op(body, body_end - body, &len)) && op < body_end &&
+                (*op == '=' || text_assigns(op + 1, body_end - (op + 1))))
+                return true;
+        }
+        p += ref - 1;
+    }
+    return false;
+}
+
+/**
+ * @brief Expands ${...}: ${NAME}, ${#NAME} and ${NAME op word} with op one
+ * of - = + ? (unset) or :- := :+ :? (unset or empty).
+ *
+ * @param ex Expander.
+ * @param s Text between the braces.
+ * @param n Its length.
+ * @param quoted True inside double quotes.
+ * @return False on failure (reported).
+ */
+static bool expand_braced(struct expander *ex, const char *s, size_t n, bool quoted) {
+    struct shell *sh = ex->sh;
+    char num[24];
+    if (n > 1 && s[0] == '#') {
+        size_t len = s[1] == '?' ? 1 : var_name_len(s + 1);
+        if (len == 0 || len != n - 1) goto bad;
+        const char *value = lookup(sh, s + 1, len, num);
+        snprintf(num, sizeof(num), "%zu", value ? strlen(value) : 0);
+        return append_value(ex, num, strlen(num), quoted);
+    }
+
+    size_t len;
+    const char *op = braced_op(s, n, &len);
+    if (!op) goto bad;
+    const char *value = lookup(sh, s, len, num);
+    if (op < s + n) {
+        bool colon = op > s + len;
+        const char *word = op + 1;
+        size_t wlen = s + n - word;
+        bool unset = !value || (colon && !*value);
+        if (*op == '-' && unset) return expand_text(ex, word, wlen, quoted);
+        if (*op == '+') return unset || expand_text(ex, word, wlen, quoted);
+        if (*op == '=' && unset) {
+            size_t mark;
+            if (!expand_string(ex, s, len + 1, word, wlen, &mark)) return false;
+            ex->buf[mark + len] = '=';
+            bool ok = sh_assign(sh, ex->buf + mark, 0) == 0;
+            ex->len = mark;
+            if (!ok) return false;
+            value = var_get(&sh->vars, s, len);
+        } else if (*op == '?' && unset) {
+            size_t mark;
+            if (!expand_string(ex, "", 0, word, wlen, &mark)) return false;
+            const char *msg = ex->buf[mark] ? ex->buf + mark : "parameter null or not set";
+            fprintf(stderr, "%.*s: %s\n", (int)len, s, msg);
+            ex->len = mark;
+            return false;
+        }
+    }
+    if (!value) value = "";
+    return append_value(ex, value, strlen(value), quoted);
+
+bad:
+    fprintf(stderr, "${%.*s}: bad substitution\n", (int)n, s);
+    return false;
+}
+
+/**
+ * @brief Skips blanks in an arithmetic expression.
+ *
+ * @param a Evaluation state.
+ */
+static void arith_blank(struct arith *a) {
+    while (*a->p == ' ' || *a->p == '\t' || *a->p == '\n') a->p++;
+}
+
+/**
+ * @brief Records the first error of an evaluation outside skipped branches.
+ *
+ * @param a Evaluation state.
+ * @param error Message.
+ * @return 0, the value of a failed operand.
+ */
+static long long arith_fail(struct arith *a, const char *error) {
+    if (!a->skip && !a->error) a->error = error;
+    return 0;
+}
+
+/**
+ * @brief Evaluates the value of a variable used in an expression, which
+ * may itself be an expression.
+ *
+ * @param a Evaluation state.
+ * @param value The variable's value, NULL if unset.
+ * @return The number.
+ */
+static long long arith_variable(struct arith *a, const char *value) {
+    if (!value || !*value) return 0;
+    if (a->depth >= ARITH_MAX_DEPTH) return arith_fail(a, "expression recursion level exceeded");
+    struct arith sub = { .sh = a->sh, .p = value, .depth = a->depth + 1, .skip = a->skip };
+    long long v = arith_cond(&sub);
+    arith_blank(&sub);
+    if (!sub.error && *sub.p) arith_fail(&sub, "syntax error in expression");
+    if (sub.error) arith_fail(a, sub.error);
+    return v;
+}
+
+/**
+ * @brief Evaluates a unary expression: a number, a variable, a
+ * parenthesized expression or + - ! ~ applied to a unary expression.
+ *
+ * @param a Evaluation state.
+ * @return The value.
+ */
+static long long arith_unary(struct arith *a) {
+    arith_blank(a);
+    char c = *a->p;
+    if (c == '+' || c == '-' || c == '!' || c == '~') {
+        a->p++;
+        long long v = arith_unary(a);
+        if (c == '-') return (long long)(0ULL - (unsigned long long)v);
+        if (c == '!') return !v;
+        if (c == '~') return ~v;
+        return v;
+    }
+    if (c == '(') {
+        a->p++;
+        long long v = arith_cond(a);
+        arith_blank(a);
+        if (*a->p != ')') return arith_fail(a, "missing `)'");
+        a->p++;
+        return v;
+    }
+    if (isdigit((unsigned char)c)) {
+        char *end;
+        long long v = strtoll(a->p, &end, 0);
+        if (isalnum((unsigned char)*end) || *end == '_') return arith_fail(a, "value too great for base");
+        a->p = end;
+        return v;
+    }
+    size_t len = var_name_len(a->p);
+    if (len == 0) return arith_fail(a, "syntax error: operand expected");
+    const char *name = a->p;
+    a->p += len;
+    return arith_variable(a, var_get(&a->sh->vars, name, len));
+}
+
+/**
+ * @brief Binding strength of the binary operator at p.
+ *
+ * @param p Position in the expression.
+ * @param len Receives the operator's length.
+ * @return Precedence, higher binds tighter, 0 if no operator is there.
+ */
+static int arith_binary_op(const char *p, size_t *len) {
+    static const struct
+    {
+        const char *op;
+        int prec;
+    } ops[] = {
+        { "||", 1 }, { "&&", 2 }, { "==", 6 }, { "!=", 6 }, { "<=", 7 }, { ">=", 7 },
+        { "<<", 8 }, { ">>", 8 }, { "|", 3 }, { "^", 4 }, { "&", 5 }, { "<", 7 },
+        { ">", 7 }, { "+", 9 }, { "-", 9 }, { "*", 10 }, { "/", 10 }, { "%", 10 },
+    };
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        *len = strlen(ops[i].op);
+        if (strncmp(p, ops[i].op, *len) == 0) return ops[i].prec;
+    }
+    return 0;
+}
+
+/**
+ * @brief Evaluates binary operators of at least the given precedence by
+ * precedence climbing. The right side of && and || is parsed but its
+ * errors are ignored when it does not count.
+ *
+ * @param a Evaluation state.
+ * @param min Lowest precedence to take.
+ * @return The value.
+ */
+static long long arith_binary(struct arith *a, int min) {
+    long long lhs = arith_unary(a);
+    for (;;) {
+        arith_blank(a);
+        size_t len;
+        int prec = arith_binary_op(a->p, &len);
+        if (prec == 0 || prec < min) return lhs;
+        char op = a->p[0];
+        a->p += len;
+        bool skip = (prec == 1 && lhs) || (prec == 2 && !lhs);
+        a->skip += skip;
+        long long rhs = arith_binary(a, prec + 1);
+        a->skip -= skip;
+        unsigned long long l = lhs, r = rhs;
+        switch (prec) {
+        case 1: lhs = lhs || rhs; break;
+        case 2: lhs = lhs && rhs; break;
+        case 3: lhs = lhs | rhs; break;
+        case 4: lhs = lhs ^ rhs; break;
+        case 5: lhs = lhs & rhs; break;
+        case 6: lhs = op == '=' ? lhs == rhs : lhs != rhs; break;
+        case 7:
+            if (op == '<') lhs = len == 2 ? lhs <= rhs : lhs < rhs;
+            else lhs = len == 2 ? lhs >= rhs : lhs > rhs;
+            break;
+        case 8: lhs = op == '<' ? (long long)(l << (r & 63)) : lhs >> (r & 63); break;
+        case 9: lhs = (long long)(op == '+' ? l + r : l - r); break;
+        default:
+            if (op == '*') {
+                lhs = (long long)(l * r);
+            } else if (rhs == 0) {
+                lhs = arith_fail(a, "division by 0");
+            } else if (rhs == -1) {
+                lhs = op == '/' ? (long long)(0ULL - l) : 0;
+            } else {
+                lhs = op == '/' ? lhs / rhs : lhs % rhs;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Evaluates a conditional expression, cond ? a : b, the loosest
+ * binding form.
+ *
+ * @param a Evaluation state.
+ * @return The value.
+ */
+static long long arith_cond(struct arith *a) {
+    long long cond = arith_binary(a, 1);
+    arith_blank(a);
+    if (*a->p != '?') return cond;
+    a->p++;
+    a->skip += !cond;
+    long long then = arith_cond(a);
+    a->skip -= !cond;
+    arith_blank(a);
+    if (*a->p != ':') return arith_fail(a, "`:' expected for conditional expression");
+    a->p++;
+    a->skip += !!cond;
+    long long other = arith_cond(a);
+    a->skip -= !!cond;
+    return cond ? then : other;
+}
+
+/**
+ * @brief Expands $((...)): the expression is expanded as if in double
+ * quotes, then evaluated in long long arithmetic.
+ *
+ * @param ex Expander.
+ * @param s Expression as written.
+ * @param n Its length.
+ * @param quoted True inside double quotes.
+ * @return False on failure (reported).
+ */
+static bool expand_arith(struct expander *ex, const char *s, size_t n, bool quoted) {
+    size_t mark;
+    if (!expand_string(ex, "", 0, s, n, &mark)) return false;
+    const char *expr = ex->buf + mark;
+    struct arith a = { .sh = ex->sh, .p = expr };
+    arith_blank(&a);
+    long long v = *a.p ? arith_cond(&a) : 0;
+    arith_blank(&a);
+    if (!a.error && *a.p) arith_fail(&a, "syntax error in expression");
+    if (a.error) {
+        fprintf(stderr, "%s: %s\n", expr, a.error);
+        ex->len = mark;
+        return false;
+    }
+    ex->len = mark;
+    char num[24];
+    snprintf(num, sizeof(num), "%lld", v);
+    return append_value(ex, num, strlen(num), quoted);
+}
+
+/**
+ * @brief The memory file $(...) of a builtin writes into, created on first
+ * use. A forked copy of the shell makes its own, as sharing the parent's
+ * would share its file offset too.
+ *
+ * @param sh Shell instance.
+ * @return The descriptor, -1 if none could be made.
+ */
+static int capture_file(struct shell *sh) {
+    pid_t self = getpid();
+    if (sh->capture_pid == self) return sh->capture_fd;
+    if (sh->capture_pid) close(sh->capture_fd);
+    sh->capture_fd = memfd_create("subst", MFD_CLOEXEC);
+    sh->capture_pid = sh->capture_fd >= 0 ? self : 0;
+    return sh->capture_fd;
+}
+
+/**
+ * @brief Closes the capture file, see lab.h.
+ *
+ * @param sh Shell instance.
+ */
+void sh_capture_close(struct shell *sh) {
+    if (sh->capture_pid) close(sh->capture_fd);
+    sh->capture_pid = 0;
+}
+
+/**
+ * @brief Runs the body of a $(...) inside the shell if it is a lone
+ * builtin that only writes output (BUILTIN_CAPTURE), with stdout on the
+ * capture file, and reads what it wrote into the free end of the buffer.
+ * A body that could change the shell, such as one expanding ${NAME:=word},
+ * is left to a child.
+ *
+ * @param ex Expander.
+ * @param list The parsed body.
+ * @return 1 if it ran, 0 if it needs a child, -1 on failure (reported).
+ */
+static int capture_builtin(struct expander *ex, const struct cmd_list *list) {
+    struct shell *sh = ex->sh;
+    if (list->nitems != 1 || list->items[0].npipelines != 1 || list->items[0].background)
+        return 0;
+    const struct pipeline *pl = &list->items[0].pipelines[0];
+    if (pl->ncmds != 1 || pl->background) return 0;
+    const struct command *cmd = &pl->cmds[0];
+    const struct builtin *b = cmd->argv[0] ? builtin_find(cmd->argv[0]) : NULL;
+    if (!b || !(b->flags & BUILTIN_CAPTURE) || cmd->nredirs || cmd->nassigns) return 0;
+    for (char **w = cmd->argv; *w; w++) {
+        if (text_assigns(*w, strlen(*w))) return 0;
+    }
+    int fd = capture_file(sh);
+    if (fd < 0) return 0;
+
+    struct arena scratch = { 0 };
+    struct command run;
+    if (sh_expand_command(sh, cmd, &run, &scratch) != 0) {
+        arena_free(&scratch);
+        return -1;
+    }
+    fflush(stdout);
+    int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    if (saved < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+        if (saved >= 0) close(saved);
+        arena_free(&scratch);
+        return 0;
+    }
+    bool ok = b->run(sh, run.argv);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    arena_free(&scratch);
+    sh->last_status = sh_builtin_status(sh, ok);
+
+    /* Take the output and empty the file for the next one */
+    off_t size = lseek(fd, 0, SEEK_CUR);
+    bool read_ok = size >= 0 && reserve(ex, size);
+    for (off_t done = 0; read_ok && done < size;) {
+        ssize_t got = pread(fd, ex->buf + ex->len, size - done, done);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        ex->len += got;
+        done += got;
+    }
+    if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0) sh_capture_close(sh);
+    return read_ok ? 1 : -1;
+}
+
+/**
+ * @brief Runs the body of a $(...) in a forked copy of the shell with
+ * stdout on a pipe, and reads what it prints into the free end of the
+ * buffer. The copy stays in the shell's process group, so it gets ^C
+ * from the terminal like the shell's foreground jobs do.
+ *
+ * @param ex Expander.
+ * @param list The parsed body.
+ * @return False on failure (reported).
+ */
+static bool fork_command(struct expander *ex, struct cmd_list *list) {
+    struct shell *sh = ex->sh;
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        perror("pipe");
+        return false;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        struct launch_io io = { .in_fd = -1, .out_fd = fds[1] };
+        sh->subshell = 1;
+        sh_loop_detach(sh);
+        if (sh_child_setup(sh, &io, getpgrp(), false) != 0)
+            _exit(1);
+        sh->shell_is_interactive = 0;
+        close(fds[0]);
+        close(fds[1]);
+        sh_run_list(sh, list);
+        fflush(stdout);
+        _exit(sh->last_status);
+    }
+    close(fds[1]);
+
+    bool ok = true;
+    for (;;) {
+        if (!reserve(ex, 4096)) {
+            ok = false;
+            break;
+        }
+        ssize_t got = read(fds[0], ex->buf + ex->len, ex->cap - ex->len);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        ex->len += got;
+    }
+    close(fds[0]);
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            status = W_EXITCODE(1, 0);
+            break;
+        }
+    }
+    sh->last_status = sh_exit_code(status);
+    return ok;
+}
+
+/**
+ * @brief Expands $(...): what the commands print, less trailing newlines,
+ * becomes the value. A lone output-only builtin runs inside the shell;
+ * anything else runs in a child.
+ *
+ * @param ex Expander.
+ * @param s Commands as written.
+ * @param n Their length.
+ * @param quoted True inside double quotes.
+ * @return False on failure (reported).
+ */
+static bool expand_command(struct expander *ex, const char *s, size_t n, bool quoted) {
+    struct cmd_list *list = parse_cache_get(&ex->sh->parses, s, n);
+    if (!list) return false;
+    size_t start = ex->len;
+    int ran = capture_builtin(ex, list);
+    bool ok = ran == 0 ? fork_command(ex, list) : ran > 0;
+    list_free(list);
+    ex->ran = true;
+
+    size_t len = ex->len - start;
+    ex->len = start;
+    if (!ok) return false;
+    while (len > 0 && ex->buf[start + len - 1] == '\n') len--;
+    /* Splitting never writes more than it has read, so it can work in place */
+    return append_value(ex, ex->buf + start, len, quoted);
+}
+
+/**
+ * @brief Expands a tilde prefix to the home directory of the user named
+ * after it, or the shell user's for a bare ~. An unknown user leaves it
+ * as written.
+ *
+ * @param ex Expander.
+ * @param s The prefix, starting at the ~.
+ * @param n Its length.
+ * @return False if out of memory.
+ */
+static bool expand_tilde(struct expander *ex, const char *s, size_t n) {
+    const char *home = NULL;
+    if (n == 1) {
+        home = sh_home_dir();
+    } else {
+        char *name = strndup(s + 1, n - 1);
+        struct passwd *pw = name ? getpwnam(name) : NULL;
+        free(name);
+        if (pw) home = pw->pw_dir;
+    }
+    return home ? append_literal(ex, home, strlen(home)) : append_literal(ex, s, n);
+}
+
+/**
+ * @brief Expands one marked reference.
+ *
+ * @param ex Expander.
+ * @param ref The reference, starting at its $ or ~.
+ * @param n Its length.
+ * @param quoted True inside double quotes.
+ * @return False on failure (reported).
+ */
+static bool expand_ref(struct expander *ex, const char *ref, size_t n, bool quoted) {
+    if (*ref == '~') return expand_tilde(ex, ref, n);
+    if (ref[1] == '(') {
+        if (n >= 5 && ref[2] == '(' && ref[n - 2] == ')')
+            return expand_arith(ex, ref + 3, n - 5, quoted);
+        return expand_command(ex, ref + 2, n - 3, quoted);
+    }
+    if (ref[1] == '{') return expand_braced(ex, ref + 2, n - 3, quoted);
+    char num[24];
+    const char *value = lookup(ex->sh, ref + 1, n - 1, num);
+    if (!value) value = "";
+    return append_value(ex, value, strlen(value), quoted);
+}
+
+/**
+ * @brief Length of the tilde prefix at the start of s, as the lexer
+ * marked it: the ~ and a login name.
+ *
+ * @param s The ~.
+ * @return Length including the ~.
+ */
+static size_t tilde_prefix_len(const char *s) {
+    size_t n = 1;
+    while (isalnum((unsigned char)s[n]) || (s[n] && strchr("._-", s[n]))) n++;
+    return n;
+}
+
+/**
+ * @brief Expands one word marked by the lexer into fields of the buffer.
+ *
+ * @param ex Expander.
+ * @param word Word with EXP_* bytes.
+ * @param whole True to always make exactly one field, as for assignments
+ * and redirection targets.
+ * @return False on failure (reported).
+ */
+static bool expand_word(struct expander *ex, const char *word, bool whole) {
+    const char *end = word + strlen(word);
+    size_t first = ex->nfields;
+    bool quotes = whole;
+    ex->ws_closed = false;
+    for (const char *p = word; p < end;) {
+        char c = *p;
+        if (c == EXP_LITERAL && p + 1 < end) {
+            if (!append_literal(ex, p + 1, 1)) return false;
+            p += 2;
+        } else if ((c == EXP_PLAIN || c == EXP_QUOTED) && p + 1 < end &&
+                   (p[1] == '$' || p[1] == '~')) {
+            const char *ref = p + 1;
+            size_t n = *ref == '~' ? tilde_prefix_len(ref) : lex_reference_len(ref, end);
+            if (n == 0 || n == SIZE_MAX) n = 1;
+            if (!expand_ref(ex, ref, n, c == EXP_QUOTED)) return false;
+            p = ref + n;
+        } else if (c == EXP_QUOTED) {
+            quotes = true; /* the word had quotes */
+            p++;
+        } else {
+            size_t n = strcspn(p, "\001\002\003");
+            if (n == 0) n = 1;
+            if (!append_literal(ex, p, n)) return false;
+            p += n;
+        }
+    }
+    if (ex->nfields == first && quotes && !open_field(ex)) return false;
+    return close_field(ex);
+}
+
+/**
+ * @brief Expands a command into a copy, see lab.h.
+ *
+ * @param sh Shell instance.
+ * @param cmd Command as parsed.
+ * @param out Receives the copy.
+ * @param a Arena for the copy.
+ * @return 0 on success, -1 on failure.
+ */
+int sh_expand_command(struct shell *sh, const struct command *cmd, struct command *out,
+                      struct arena *a) {
+    *out = *cmd;
+    if (!cmd->expand) return 0;
+
+    struct expander ex;
+    expander_init(&ex, sh);
+    bool ok = true;
+    for (size_t i = 0; ok && i < cmd->nassigns; i++) ok = expand_word(&ex, cmd->assigns[i], true);
+    ex.split = true;
+    for (size_t i = 0; ok && cmd->argv[i]; i++) ok = expand_word(&ex, cmd->argv[i], false);
+    size_t nwords = ex.nfields;
+    ex.split = false;
+    for (size_t i = 0; ok && i < cmd->nredirs; i++) {
+        if (cmd->redirs[i].kind == REDIR_OPEN) ok = expand_word(&ex, cmd->redirs[i].path, true);
+    }
+
+    /* The fields move into the arena in one piece */
+    char *text = ok ? arena_alloc(a, ex.len + 1) : NULL;
+    char **words = text ? arena_alloc(a, (nwords + 1) * sizeof(*words)) : NULL;
+    struct redirect *redirs = words ? arena_alloc(a, cmd->nredirs * sizeof(*redirs) + 1) : NULL;
+    if (redirs) {
+        memcpy(text, ex.buf, ex.len);
+        for (size_t i = 0; i < nwords; i++) words[i] = text + ex.fields[i];
+        words[nwords] = NULL;
+        out->assigns = words;
+        out->argv = words + cmd->nassigns;
+
+        memcpy(redirs, cmd->redirs, cmd->nredirs * sizeof(*redirs));
+        size_t f = nwords;
+        for (size_t i = 0; i < cmd->nredirs; i++) {
+            if (redirs[i].kind == REDIR_OPEN) redirs[i].path = text + ex.fields[f++];
+        }
+        out->redirs = redirs;
+        out->expand = false;
+        out->substituted = ex.ran;
+    }
+    expander_free(&ex);
+    return redirs ? 0 : -1;
+}
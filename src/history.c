@@ -0,0 +1,526 @@
+/**
+ * history.c
+ * Persistent command history shared by every shell of a user. Commands are
+ * appended as length prefixed records to a log, and the offset of each
+ * record to an index that is mapped, so entry n is found without reading
+ * the log. Both files are only ever appended to with O_APPEND, which keeps
+ * concurrent shells from overwriting each other's entries. Clearing swaps
+ * in new empty files instead of truncating ones that others have mapped.
+ *
+ * @author Vladyslav (Vlad) Maliutin
+ */
+
+#include "lab.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* The index is mapped in steps of this many bytes so appends rarely remap */
+#define HISTORY_MAP_STEP (1 << 20)
+/* Reading newest first, a block ends this far past the record wanted */
+#define HISTORY_BACK_SLACK 4096
+
+/* Every log record starts with the length of the command that follows */
+typedef uint32_t record_len;
+
+/**
+ * @brief Writes a whole buffer, retrying short writes.
+ *
+ * @param fd Descriptor.
+ * @param buf Data.
+ * @param n Number of bytes.
+ * @return 0 on success, -1 on error.
+ */
+static int write_all(int fd, const void *buf, size_t n) {
+    const char *p = buf;
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+/**
+ * @brief Builds the name of a file next to the log.
+ *
+ * @param h History store.
+ * @param suffix Appended to the log's path.
+ * @return Newly allocated path or NULL.
+ */
+static char *sibling_path(const struct history *h, const char *suffix) {
+    size_t n = strlen(h->path), m = strlen(suffix);
+    char *path = malloc(n + m + 1);
+    if (!path) return NULL;
+    memcpy(path, h->path, n);
+    memcpy(path + n, suffix, m + 1);
+    return path;
+}
+
+/**
+ * @brief Opens (creating if needed) the log and its index by name, in
+ * place of the files held so far. Used on open and once another shell
+ * has cleared the history by replacing both files.
+ *
+ * @param h History store.
+ * @return 0 on success, -1 if either file could not be opened.
+ */
+static int open_files(struct history *h) {
+    char *idx_path = sibling_path(h, ".idx");
+    if (!idx_path) return -1;
+    int flags = O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC;
+    int log_fd = open(h->path, flags, 0600);
+    int idx_fd = log_fd >= 0 ? open(idx_path, flags, 0600) : -1;
+    free(idx_path);
+    if (idx_fd < 0) {
+        if (log_fd >= 0) close(log_fd);
+        return -1;
+    }
+    if (h->ready) {
+        if (h->map_len) munmap((void *)h->index, h->map_len);
+        close(h->log_fd);
+        close(h->idx_fd);
+        h->generation++;
+    }
+    h->index = NULL;
+    h->map_len = 0;
+    h->count = 0;
+    h->log_fd = log_fd;
+    h->idx_fd = idx_fd;
+    return 0;
+}
+
+/**
+ * @brief Takes the exclusive lock that orders appends and clears. A lock
+ * won on files that were replaced in the meantime is dropped and taken
+ * again on the new ones.
+ *
+ * @param h History store.
+ * @return 0 on success, -1 if the new files could not be opened.
+ */
+static int lock_files(struct history *h) {
+    for (;;) {
+        struct stat st;
+        flock(h->idx_fd, LOCK_EX);
+        if (fstat(h->idx_fd, &st) != 0 || st.st_nlink > 0) return 0;
+        flock(h->idx_fd, LOCK_UN);
+        if (open_files(h) != 0) return -1;
+    }
+}
+
+/**
+ * @brief Maps the current index, reusing the mapping while the file still
+ * fits in it. Other shells append to the index at any time, so this is
+ * checked before every lookup.
+ *
+ * @param h History store.
+ * @return Number of entries.
+ */
+static size_t refresh(struct history *h) {
+    struct stat st;
+    if (fstat(h->idx_fd, &st) != 0) return 0;
+    /* The index was renamed over by hist_clear in some shell: follow it */
+    if (st.st_nlink == 0 && open_files(h) == 0 && fstat(h->idx_fd, &st) != 0) return 0;
+    size_t size = st.st_size - st.st_size % sizeof(uint64_t);
+    if (size > h->map_len || (h->map_len && size == 0)) {
+        if (h->map_len) munmap((void *)h->index, h->map_len);
+        h->index = NULL;
+        h->map_len = 0;
+        if (size) {
+            size_t len = (size + HISTORY_MAP_STEP - 1) / HISTORY_MAP_STEP * HISTORY_MAP_STEP;
+            void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, h->idx_fd, 0);
+            if (map == MAP_FAILED) return 0;
+            h->index = map;
+            h->map_len = len;
+        }
+    }
+    h->count = size / sizeof(uint64_t);
+    return h->count;
+}
+
+/**
+ * @brief Repairs the index: drops a torn last entry, and indexes the
+ * complete records of the log behind the last indexed one. That rebuilds
+ * an index that is empty, for a log written before the index existed or
+ * an index that was lost, and catches up with a shell killed between its
+ * two writes. Runs under an exclusive lock so that shells starting
+ * together do not index the same records twice.
+ *
+ * @param h History store.
+ */
+static void rebuild_index(struct history *h) {
+    if (lock_files(h) != 0) return;
+    struct stat log_st, idx_st;
+    if (fstat(h->log_fd, &log_st) != 0 || fstat(h->idx_fd, &idx_st) != 0) {
+        flock(h->idx_fd, LOCK_UN);
+        return;
+    }
+    /* A shell killed halfway through an index write leaves a partial entry */
+    off_t idx_size = idx_st.st_size - idx_st.st_size % sizeof(uint64_t);
+    if (idx_size != idx_st.st_size && ftruncate(h->idx_fd, idx_size) != 0)
+        perror("history");
+
+    /* Start right behind the record the last index entry points at */
+    uint64_t off = 0, batch[512];
+    size_t n = 0;
+    record_len len;
+    if (idx_size > 0) {
+        if (pread(h->idx_fd, &off, sizeof(off), idx_size - sizeof(off)) != sizeof(off) ||
+            pread(h->log_fd, &len, sizeof(len), off) != sizeof(len)) {
+            flock(h->idx_fd, LOCK_UN);
+            return;
+        }
+        off += sizeof(len) + len;
+    }
+    while (pread(h->log_fd, &len, sizeof(len), off) == sizeof(len) &&
+           off + sizeof(len) + len <= (uint64_t)log_st.st_size) {
+        batch[n++] = off;
+        if (n == sizeof(batch) / sizeof(batch[0])) {
+            write_all(h->idx_fd, batch, sizeof(batch));
+            n = 0;
+        }
+        off += sizeof(len) + len;
+    }
+    write_all(h->idx_fd, batch, n * sizeof(batch[0]));
+    flock(h->idx_fd, LOCK_UN);
+}
+
+/**
+ * @brief Opens (creating if needed) the log at path and its index at
+ * path.idx.
+ *
+ * @param h History store to set up.
+ * @param path Path of the log.
+ * @return 0 on success, -1 if either file could not be opened.
+ */
+int hist_open(struct history *h, const char *path) {
+    memset(h, 0, sizeof(*h));
+    h->path = strdup(path);
+    if (!h->path || open_files(h) != 0) {
+        free(h->path);
+        h->path = NULL;
+        return -1;
+    }
+    h->ready = true;
+    rebuild_index(h);
+    refresh(h);
+    return 0;
+}
+
+/**
+ * @brief Opens the history file named by HISTFILE, or ~/.lab_history.
+ *
+ * @param h History store to set up.
+ * @return 0 on success, -1 otherwise.
+ */
+int hist_open_default(struct history *h) {
+    const char *file = getenv("HISTFILE");
+    if (file && *file) return hist_open(h, file);
+
+    const char *home = sh_home_dir();
+    if (!home) return -1;
+    size_t n = strlen(home);
+    char *path = malloc(n + sizeof("/.lab_history"));
+    if (!path) return -1;
+    memcpy(path, home, n);
+    memcpy(path + n, "/.lab_history", sizeof("/.lab_history"));
+    int rc = hist_open(h, path);
+    free(path);
+    return rc;
+}
+
+/**
+ * @brief Closes the store.
+ *
+ * @param h History store.
+ */
+void hist_close(struct history *h) {
+    if (!h->ready) return;
+    if (h->map_len) munmap((void *)h->index, h->map_len);
+    close(h->log_fd);
+    close(h->idx_fd);
+    free(h->path);
+    memset(h, 0, sizeof(*h));
+}
+
+/**
+ * @brief Appends a command to the log and its offset to the index.
+ *
+ * @param h History store.
+ * @param line Command to remember.
+ * @return 0 on success, -1 on error.
+ */
+int hist_add(struct history *h, const char *line) {
+    if (!h->ready) return -1;
+    size_t n = strlen(line);
+    if (n > UINT32_MAX - sizeof(record_len)) return -1;
+
+    /* One write per record, so appends from other shells cannot split it */
+    char stack[512];
+    char *rec = sizeof(record_len) + n <= sizeof(stack) ? stack : malloc(sizeof(record_len) + n);
+    if (!rec) return -1;
+    record_len len = n;
+    memcpy(rec, &len, sizeof(len));
+    memcpy(rec + sizeof(len), line, n);
+
+    /* Under the lock, index entries follow log order and no clear intervenes */
+    if (lock_files(h) != 0) {
+        if (rec != stack) free(rec);
+        return -1;
+    }
+    int rc = write_all(h->log_fd, rec, sizeof(len) + n);
+    if (rec != stack) free(rec);
+
+    /* This descriptor's offset now sits right behind the record just written */
+    off_t end = rc == 0 ? lseek(h->log_fd, 0, SEEK_CUR) : -1;
+    if (end >= 0) {
+        uint64_t off = end - sizeof(len) - n;
+        rc = write_all(h->idx_fd, &off, sizeof(off));
+    } else {
+        rc = -1;
+    }
+    flock(h->idx_fd, LOCK_UN);
+    return rc;
+}
+
+/**
+ * @brief Number of stored entries, including other shells' appends.
+ *
+ * @param h History store.
+ * @return Entry count.
+ */
+size_t hist_count(struct history *h) {
+    return h->ready ? refresh(h) : 0;
+}
+
+/**
+ * @brief Reads one entry with two preads.
+ *
+ * @param h History store.
+ * @param n Entry number, counting from 1.
+ * @return Newly allocated command, NULL if there is no such entry.
+ */
+char *hist_get(struct history *h, size_t n) {
+    if (!h->ready || n == 0 || n > refresh(h)) return NULL;
+    uint64_t off = h->index[n - 1];
+    record_len len;
+    if (pread(h->log_fd, &len, sizeof(len), off) != sizeof(len)) return NULL;
+    char *line = malloc((size_t)len + 1);
+    if (!line) return NULL;
+    if (pread(h->log_fd, line, len, off + sizeof(len)) != (ssize_t)len) {
+        free(line);
+        return NULL;
+    }
+    line[len] = '\0';
+    return line;
+}
+
+/* A stretch of the log read into memory, shared by many entries */
+struct log_block
+{
+    char *buf;
+    size_t cap;
+    uint64_t off;
+    size_t len;
+};
+
+/**
+ * @brief Finds the record at off in the block, reading the log again when
+ * it is not there. Entries are nearly always in log order, so one read
+ * serves many: going forward the block starts at the record, going back
+ * it ends a little past it.
+ *
+ * @param h History store.
+ * @param b Block, with buf allocated.
+ * @param off Offset of the record.
+ * @param back True when entries are visited newest first.
+ * @param len Receives the length of the text.
+ * @return The text, not NUL terminated, or NULL on error.
+ */
+static const char *block_record(struct history *h, struct log_block *b, uint64_t off,
+                                bool back, record_len *len) {
+    for (int tries = 0;; tries++) {
+        bool have_len = off >= b->off && off + sizeof(*len) <= b->off + b->len;
+        if (have_len) memcpy(len, b->buf + (off - b->off), sizeof(*len));
+        if (have_len && off + sizeof(*len) + *len <= b->off + b->len)
+            return b->buf + (off - b->off) + sizeof(*len);
+        if (tries == 2) return NULL;
+        if (have_len && sizeof(*len) + *len > b->cap) {
+            char *grown = realloc(b->buf, sizeof(*len) + *len);
+            if (!grown) return NULL;
+            b->buf = grown;
+            b->cap = sizeof(*len) + *len;
+        }
+        uint64_t start = off;
+        if (back && tries == 0)
+            start = off + HISTORY_BACK_SLACK > b->cap ? off + HISTORY_BACK_SLACK - b->cap : 0;
+        ssize_t got = pread(h->log_fd, b->buf, b->cap, start);
+        b->off = start;
+        b->len = got > 0 ? got : 0;
+    }
+}
+
+/**
+ * @brief Calls fn for the entries first to last in order, reading the log
+ * in large blocks instead of two preads per entry.
+ *
+ * @param h History store.
+ * @param first First entry number, counting from 1.
+ * @param last Last entry number; larger than the count means all.
+ * @param fn Receives the entry number and its text (not NUL terminated),
+ * and returns false to stop.
+ * @param ctx Passed to fn.
+ * @return Number of the last entry fn took, first - 1 if none.
+ */
+size_t hist_scan(struct history *h, size_t first, size_t last, hist_scan_fn fn, void *ctx) {
+    size_t count = hist_count(h);
+    if (last > count) last = count;
+    struct log_block b = { .cap = HISTORY_MAP_STEP };
+    b.buf = first <= last ? malloc(b.cap) : NULL;
+    if (!b.buf) return first - 1;
+
+    size_t n = first;
+    for (; n <= last; n++) {
+        record_len len;
+        const char *text = block_record(h, &b, h->index[n - 1], false, &len);
+        if (!text || !fn(ctx, n, text, len)) break;
+    }
+    free(b.buf);
+    return n - 1;
+}
+
+/**
+ * @brief Like hist_scan, newest first: calls fn for the entries last down
+ * to first.
+ *
+ * @param h History store.
+ * @param first Lowest entry number visited, counting from 1.
+ * @param last Highest entry number; larger than the count means all.
+ * @param fn Receives the entry number and its text (not NUL terminated),
+ * and returns false to stop.
+ * @param ctx Passed to fn.
+ * @return Number of the last entry fn took, last + 1 if none.
+ */
+size_t hist_scan_back(struct history *h, size_t first, size_t last, hist_scan_fn fn, void *ctx) {
+    size_t count = hist_count(h);
+    if (last > count) last = count;
+    if (first == 0) first = 1;
+    struct log_block b = { .cap = HISTORY_MAP_STEP };
+    b.buf = first <= last ? malloc(b.cap) : NULL;
+    if (!b.buf) return last + 1;
+
+    size_t n = last;
+    for (; n >= first; n--) {
+        record_len len;
+        const char *text = block_record(h, &b, h->index[n - 1], true, &len);
+        if (!text || !fn(ctx, n, text, len)) break;
+    }
+    free(b.buf);
+    return n + 1;
+}
+
+/**
+ * @brief Empties the log and the index, for every shell sharing them.
+ * Other shells may have the index mapped, so rather than being truncated
+ * both files are replaced by empty ones, the index last; the old index
+ * losing its name is what tells those shells to reopen.
+ *
+ * @param h History store.
+ */
+void hist_clear(struct history *h) {
+    if (!h->ready || lock_files(h) != 0) return;
+    char *log_new = sibling_path(h, ".new");
+    char *idx_path = sibling_path(h, ".idx");
+    char *idx_new = sibling_path(h, ".idx.new");
+    bool ok = log_new && idx_path && idx_new;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    for (int i = 0; ok && i < 2; i++) {
+        int fd = open(i ? idx_new : log_new, flags, 0600);
+        ok = fd >= 0 && close(fd) == 0;
+    }
+    ok = ok && rename(log_new, h->path) == 0 && rename(idx_new, idx_path) == 0;
+    if (!ok) perror("history");
+    flock(h->idx_fd, LOCK_UN);
+    free(log_new);
+    free(idx_path);
+    free(idx_new);
+    refresh(h);
+}
+
+/**
+ * @brief Replaces the events !!, !n and !-n outside single quotes with the
+ * commands they refer to.
+ *
+ * @param h History store.
+ * @param line Line as typed.
+ * @return Newly allocated expanded line, or NULL after reporting an event
+ * that does not exist.
+ */
+char *hist_expand(struct history *h, const char *line) {
+    size_t cap = strlen(line) + 1, len = 0;
+    char *out = malloc(cap);
+    if (!out) return NULL;
+
+    bool quoted = false;
+    for (const char *p = line; *p;) {
+        size_t event = 0;
+        const char *next = p + 1;
+        if (*p == '\'') {
+            quoted = !quoted;
+        } else if (*p == '\\' && !quoted && p[1]) {
+            next = p + 2;
+        } else if (*p == '!' && !quoted) {
+            size_t count = hist_count(h);
+            if (p[1] == '!') {
+                event = count;
+                next = p + 2;
+            } else if (isdigit((unsigned char)p[1])) {
+                event = strtoul(p + 1, (char **)&next, 10);
+            } else if (p[1] == '-' && isdigit((unsigned char)p[2])) {
+                size_t back = strtoul(p + 2, (char **)&next, 10);
+                event = back <= count ? count - back + 1 : 0;
+            }
+            if (next > p + 1 && event == 0) event = (size_t)-1;
+        }
+
+        const char *text = p;
+        size_t n = next - p;
+        char *found = NULL;
+        if (event) {
+            found = event == (size_t)-1 ? NULL : hist_get(h, event);
+            if (!found) {
+                fprintf(stderr, "%.*s: event not found\n", (int)(next - p), p);
+                free(out);
+                return NULL;
+            }
+            text = found;
+            n = strlen(found);
+        }
+        if (len + n + 1 > cap) {
+            cap = (len + n + 1) * 2;
+            char *grown = realloc(out, cap);
+            if (!grown) {
+                free(found);
+                free(out);
+                return NULL;
+            }
+            out = grown;
+        }
+        memcpy(out + len, text, n);
+        len += n;
+        free(found);
+        p = next;
+    }
+    out[len] = '\0';
+    return out;
+}
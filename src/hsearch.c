@@ -0,0 +1,518 @@
+/**
+ * hsearch.c
+ * Trigram index over the history store and the Ctrl-R search that uses
+ * it. Every entry is filed under each three byte sequence it contains, so
+ * a query only has to look at entries holding all of its trigrams instead
+ * of scanning the whole history on every keystroke. The posting lists are
+ * varint encoded deltas in chunks of one shared pool, a few bytes per
+ * entry and trigram. Queries too short to have a trigram read the newest
+ * entries straight from the log until they have enough matches.
+ *
+ * @author Vladyslav (Vlad) Maliutin
+ */
+
+#define _GNU_SOURCE
+#include "lab.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <readline/readline.h>
+
+#define TRIGRAM_INITIAL 4096
+/* Most distinct trigrams looked at per query; longer queries are verified */
+#define QUERY_TRIGRAMS 16
+/* A longer list is not merged in; reading the candidates left costs less */
+#define INTERSECT_RATIO 128
+#define POOL_INITIAL (64 * 1024)
+/* Data bytes of a list's first chunk; each next one doubles up to the max */
+#define CHUNK_FIRST 8
+#define CHUNK_MAX 1024
+
+/* Shell whose history the readline binding searches */
+static struct shell *search_shell;
+
+/* Start of every chunk in the pool, followed by size bytes of varints */
+struct chunk
+{
+    uint32_t next;
+    uint16_t used;
+    uint16_t size;
+};
+
+/* Position while decoding a posting list */
+struct list_reader
+{
+    const struct hist_search *s;
+    uint32_t chunk;
+    uint16_t pos;
+    uint32_t id;
+};
+
+/**
+ * @brief Packs three bytes into a key, never 0, which marks an empty slot.
+ *
+ * @param p At least three bytes.
+ * @return The key.
+ */
+static inline uint32_t gram_key(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+    return ((uint32_t)u[0] << 16 | (uint32_t)u[1] << 8 | u[2]) + 1;
+}
+
+/**
+ * @brief The chunk at an offset of the pool. Chunks are sized in multiples
+ * of eight bytes, so the header is always aligned.
+ *
+ * @param s Index.
+ * @param off Offset, not 0.
+ * @return The chunk.
+ */
+static inline struct chunk *chunk_at(const struct hist_search *s, uint32_t off) {
+    return (struct chunk *)(s->pool + off);
+}
+
+/**
+ * @brief Carves a chunk out of the end of the pool, growing it if needed.
+ * Offset 0 is never handed out so that it can end a chain.
+ *
+ * @param s Index.
+ * @param size Data bytes.
+ * @return Offset of the chunk, 0 if memory could not be allocated.
+ */
+static uint32_t new_chunk(struct hist_search *s, uint16_t size) {
+    if (s->pool_len == 0) s->pool_len = sizeof(struct chunk);
+    size_t need = s->pool_len + sizeof(struct chunk) + size;
+    if (need > UINT32_MAX) return 0;
+    if (need > s->pool_cap) {
+        size_t cap = s->pool_cap ? s->pool_cap : POOL_INITIAL;
+        while (cap < need) cap *= 2;
+        unsigned char *pool = realloc(s->pool, cap);
+        if (!pool) return 0;
+        s->pool = pool;
+        s->pool_cap = cap;
+    }
+    uint32_t off = s->pool_len;
+    struct chunk *c = chunk_at(s, off);
+    c->next = 0;
+    c->used = 0;
+    c->size = size;
+    s->pool_len = need;
+    return off;
+}
+
+/**
+ * @brief Appends an entry to a posting list as its distance from the last
+ * one. A varint never straddles two chunks.
+ *
+ * @param s Index.
+ * @param l List; id must be larger than l->last.
+ * @param id Entry number.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+static int list_append(struct hist_search *s, struct trigram_list *l, uint32_t id) {
+    unsigned char bytes[5];
+    size_t nb = 0;
+    for (uint32_t d = id - l->last;; d >>= 7) {
+        bytes[nb++] = (d & 0x7f) | (d > 0x7f ? 0x80 : 0);
+        if (d <= 0x7f) break;
+    }
+    struct chunk *c = l->tail ? chunk_at(s, l->tail) : NULL;
+    if (!c || (size_t)(c->size - c->used) < nb) {
+        uint16_t size = !c ? CHUNK_FIRST : c->size < CHUNK_MAX ? c->size * 2 : CHUNK_MAX;
+        uint32_t off = new_chunk(s, size);
+        if (!off) return -1;
+        if (l->tail) chunk_at(s, l->tail)->next = off;
+        else l->head = off;
+        l->tail = off;
+        c = chunk_at(s, off);
+    }
+    memcpy((unsigned char *)(c + 1) + c->used, bytes, nb);
+    c->used += nb;
+    l->last = id;
+    l->n++;
+    return 0;
+}
+
+/**
+ * @brief Decodes the next entry of a posting list.
+ *
+ * @param r Reader, started at the list's head with id 0.
+ * @param id Receives the entry number.
+ * @return False at the end of the list.
+ */
+static bool list_next(struct list_reader *r, uint32_t *id) {
+    const struct chunk *c = r->chunk ? chunk_at(r->s, r->chunk) : NULL;
+    while (c && r->pos == c->used) {
+        r->chunk = c->next;
+        r->pos = 0;
+        c = r->chunk ? chunk_at(r->s, r->chunk) : NULL;
+    }
+    if (!c) return false;
+    const unsigned char *p = (const unsigned char *)(c + 1);
+    uint32_t d = 0;
+    for (int shift = 0;; shift += 7) {
+        unsigned char b = p[r->pos++];
+        d |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) break;
+    }
+    r->id += d;
+    *id = r->id;
+    return true;
+}
+
+/**
+ * @brief Finds the slot for a key, either the one holding it or the empty
+ * slot where it would go.
+ *
+ * @param s Index.
+ * @param key Trigram key.
+ * @return The slot.
+ */
+static struct trigram_list *find_slot(const struct hist_search *s, uint32_t key) {
+    size_t mask = s->capacity - 1;
+    size_t i = (key * 2654435761u) & mask;
+    while (s->slots[i].key && s->slots[i].key != key) i = (i + 1) & mask;
+    return &s->slots[i];
+}
+
+/**
+ * @brief Doubles the table and reinserts every list.
+ *
+ * @param s Index.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+static int grow(struct hist_search *s) {
+    struct trigram_list *old = s->slots;
+    size_t old_cap = s->capacity;
+    size_t cap = old_cap ? old_cap * 2 : TRIGRAM_INITIAL;
+
+    struct trigram_list *slots = calloc(cap, sizeof(*slots));
+    if (!slots) return -1;
+    s->slots = slots;
+    s->capacity = cap;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].key) *find_slot(s, old[i].key) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/**
+ * @brief Frees the index and leaves it empty.
+ *
+ * @param s Index.
+ */
+void hist_search_destroy(struct hist_search *s) {
+    free(s->slots);
+    free(s->pool);
+    memset(s, 0, sizeof(*s));
+}
+
+/**
+ * @brief Files one entry under one trigram.
+ *
+ * @param s Index.
+ * @param key Trigram key.
+ * @param id Entry number.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+static int file_gram(struct hist_search *s, uint32_t key, uint32_t id) {
+    if ((s->used + 1) * 2 > s->capacity && grow(s) != 0) return -1;
+    struct trigram_list *l = find_slot(s, key);
+    if (!l->key) {
+        l->key = key;
+        s->used++;
+    }
+    /* A trigram seen twice in one entry is filed once */
+    if (l->n && l->last == id) return 0;
+    return list_append(s, l, id);
+}
+
+/**
+ * @brief Files one entry under each of its trigrams. Short of memory, the
+ * entry still counts as indexed so that syncing moves on; a search may
+ * then miss it.
+ *
+ * @param s Index.
+ * @param id Entry number; entries must be added in increasing order.
+ * @param line Text of the entry.
+ * @param len Length of the text.
+ */
+void hist_search_add(struct hist_search *s, size_t id, const char *line, size_t len) {
+    if (id > UINT32_MAX) return;
+    s->nentries = id;
+    for (size_t i = 0; i + 3 <= len; i++) {
+        if (file_gram(s, gram_key(line + i), id) != 0) return;
+    }
+}
+
+/**
+ * @brief hist_scan callback filing each entry.
+ */
+static bool add_scanned(void *ctx, size_t n, const char *line, size_t len) {
+    hist_search_add(ctx, n, line, len);
+    return true;
+}
+
+/**
+ * @brief Indexes up to max of the entries this or any other shell
+ * appended since the last call. A store that was cleared empties the
+ * index first.
+ *
+ * @param s Index.
+ * @param h History store.
+ * @param max Most entries to add.
+ * @return True if every entry of the store is indexed.
+ */
+bool hist_search_sync_some(struct hist_search *s, struct history *h, size_t max) {
+    size_t count = hist_count(h);
+    if (count < s->nentries || s->generation != h->generation) {
+        hist_search_destroy(s);
+        s->generation = h->generation;
+    }
+    if (count > s->nentries && max > 0) {
+        size_t last = count - s->nentries > max ? s->nentries + max : count;
+        hist_scan(h, s->nentries + 1, last, add_scanned, s);
+    }
+    return s->nentries >= count;
+}
+
+/**
+ * @brief Brings the index up to date with the store.
+ *
+ * @param s Index.
+ * @param h History store.
+ */
+void hist_search_sync(struct hist_search *s, struct history *h) {
+    hist_search_sync_some(s, h, SIZE_MAX);
+}
+
+/**
+ * @brief Whether entry id really contains the query; the trigrams only
+ * say that it might.
+ *
+ * @param h History store.
+ * @param id Entry number.
+ * @param query Search text.
+ * @return True on a match.
+ */
+static bool entry_matches(struct history *h, size_t id, const char *query) {
+    char *line = hist_get(h, id);
+    bool found = line && strstr(line, query);
+    free(line);
+    return found;
+}
+
+/* State of a search reading the log directly */
+struct scan_match
+{
+    const char *query;
+    size_t qlen;
+    size_t *out;
+    size_t max;
+    size_t found;
+};
+
+/**
+ * @brief hist_scan_back callback keeping the entries that contain the
+ * query, until there is no more room.
+ */
+static bool match_scanned(void *ctx, size_t n, const char *line, size_t len) {
+    struct scan_match *m = ctx;
+    if (memmem(line, len, m->query, m->qlen)) m->out[m->found++] = n;
+    return m->found < m->max;
+}
+
+/**
+ * @brief Intersects the candidates with a posting list, both in
+ * increasing order.
+ *
+ * @param s Index.
+ * @param l Posting list.
+ * @param ids Candidates, filtered in place.
+ * @param n Number of candidates.
+ * @return Number of candidates left.
+ */
+static size_t list_intersect(const struct hist_search *s, const struct trigram_list *l,
+                             uint32_t *ids, size_t n) {
+    struct list_reader r = { s, l->head, 0, 0 };
+    size_t kept = 0, i = 0;
+    uint32_t id;
+    bool more = list_next(&r, &id);
+    while (more && i < n) {
+        if (id < ids[i]) more = list_next(&r, &id);
+        else if (id > ids[i]) i++;
+        else ids[kept++] = ids[i++];
+    }
+    return kept;
+}
+
+/**
+ * @brief Finds entries containing query, newest first. Entries the index
+ * has not reached yet are read from the log first, then the candidates
+ * holding the query's trigrams are confirmed newest first.
+ *
+ * @param s Index.
+ * @param h History store.
+ * @param query Search text.
+ * @param before Only entries with a smaller number are returned.
+ * @param out Receives the entry numbers.
+ * @param max Room in out.
+ * @return Number of matches stored.
+ */
+size_t hist_search_find(struct hist_search *s, struct history *h, const char *query,
+                        size_t before, size_t *out, size_t max) {
+    size_t qlen = strlen(query), count = hist_count(h);
+    if (before > count + 1) before = count + 1;
+    if (max == 0 || before <= 1) return 0;
+
+    /* Short queries have no trigram and are answered from the log alone */
+    size_t indexed = s->generation == h->generation ? s->nentries : 0;
+    if (qlen < 3) indexed = 0;
+    struct scan_match m = { query, qlen, out, max, 0 };
+    if (indexed + 1 < before) hist_scan_back(h, indexed + 1, before - 1, match_scanned, &m);
+    if (qlen < 3 || m.found == max) return m.found;
+    if (before > indexed + 1) before = indexed + 1;
+
+    /* Gather the lists of the query's trigrams, shortest first */
+    const struct trigram_list *lists[QUERY_TRIGRAMS];
+    size_t nlists = 0;
+    for (size_t i = 0; i + 3 <= qlen && nlists < QUERY_TRIGRAMS; i++) {
+        const struct trigram_list *l = s->capacity ? find_slot(s, gram_key(query + i)) : NULL;
+        if (!l || !l->key) return m.found;
+        size_t k = nlists++;
+        while (k > 0 && lists[k - 1]->n > l->n) {
+            lists[k] = lists[k - 1];
+            k--;
+        }
+        lists[k] = l;
+    }
+
+    /* Decode the shortest list and narrow it down by the others */
+    uint32_t *ids = malloc(lists[0]->n * sizeof(*ids));
+    if (!ids) return m.found;
+    struct list_reader r = { s, lists[0]->head, 0, 0 };
+    size_t n = 0;
+    while (n < lists[0]->n && list_next(&r, &ids[n])) n++;
+    for (size_t k = 1; k < nlists && n > 0 && lists[k]->n / INTERSECT_RATIO <= n; k++)
+        n = list_intersect(s, lists[k], ids, n);
+
+    while (n > 0 && ids[n - 1] >= before) n--;
+    while (n > 0 && m.found < max) {
+        uint32_t id = ids[--n];
+        if (entry_matches(h, id, query)) out[m.found++] = id;
+    }
+    free(ids);
+    return m.found;
+}
+
+/**
+ * @brief Shows the search prompt and the current match.
+ *
+ * @param query Text typed so far.
+ * @param failed True if nothing matches it.
+ * @param line Line to show.
+ */
+static void search_show(const char *query, bool failed, const char *line) {
+    rl_message("(%si-search)`%s': ", failed ? "failed " : "", query);
+    rl_replace_line(line, 0);
+    const char *at = *query ? strstr(line, query) : NULL;
+    rl_point = at ? (int)(at - line) : (int)strlen(line);
+    rl_redisplay();
+}
+
+/**
+ * @brief Readline command bound to Ctrl-R: incremental reverse search
+ * through the shared history using the trigram index. Typing narrows the
+ * search, Ctrl-R moves to the next older match, Enter runs the match,
+ * Ctrl-G restores the original line and any other key accepts the match
+ * and is then handled as usual.
+ *
+ * @param count Unused.
+ * @param key Unused.
+ * @return 0.
+ */
+static int search_history(int count, int key) {
+    UNUSED(count);
+    UNUSED(key);
+    struct shell *sh = search_shell;
+    if (!sh || !sh->hist.ready) return 0;
+    /* Whatever the idle loop has not indexed yet is read from the log */
+    hist_search_sync_some(&sh->search, &sh->hist, HIST_SEARCH_SLICE);
+
+    char *saved = strdup(rl_line_buffer);
+    int saved_point = rl_point;
+    if (!saved) return 0;
+    char query[256] = "";
+    size_t qlen = 0, match = 0;
+    char *shown = strdup(saved);
+    bool failed = false;
+
+    rl_save_prompt();
+    search_show(query, failed, shown ? shown : "");
+    for (;;) {
+        int c = rl_read_key();
+        size_t before = SIZE_MAX;
+        if (c == 18) {
+            before = match ? match : SIZE_MAX; /* Ctrl-R: older */
+        } else if ((c == 127 || c == 8) && qlen > 0) {
+            query[--qlen] = '\0';
+        } else if (c >= 32 && c != 127 && qlen + 1 < sizeof(query)) {
+            query[qlen++] = c;
+            query[qlen] = '\0';
+        } else if (c == 127 || c == 8) {
+            continue;
+        } else {
+            rl_restore_prompt();
+            rl_clear_message();
+            if (c == 7) { /* Ctrl-G: give up */
+                rl_replace_line(saved, 0);
+                rl_point = saved_point;
+            } else if (c == '\r' || c == '\n') {
+                rl_done = 1;
+            } else {
+                /* ESC too, so that arrow keys arrive whole */
+                rl_execute_next(c);
+            }
+            break;
+        }
+
+        /* Skip older entries identical to the one shown */
+        size_t ids[16], n;
+        failed = true;
+        while (qlen && (n = hist_search_find(&sh->search, &sh->hist, query, before, ids, 16)) > 0) {
+            size_t k = 0;
+            char *line = NULL;
+            for (; k < n; k++) {
+                free(line);
+                line = hist_get(&sh->hist, ids[k]);
+                if (line && (c != 18 || !shown || strcmp(line, shown) != 0)) break;
+            }
+            before = ids[n - 1];
+            if (k == n) {
+                free(line);
+                continue;
+            }
+            free(shown);
+            shown = line;
+            match = ids[k];
+            failed = false;
+            break;
+        }
+        if (!qlen) failed = false;
+        search_show(query, failed, shown ? shown : "");
+    }
+    free(shown);
+    free(saved);
+    return 0;
+}
+
+/**
+ * @brief Binds Ctrl-R to the indexed search over sh's history.
+ *
+ * @param sh Shell instance.
+ */
+void hist_search_bind(struct shell *sh) {
+    search_shell = sh;
+    rl_bind_keyseq("\\C-r", search_history);
+}
@@ -0,0 +1,353 @@
+/**
+ * jobs.c
+ * Job table and job control: tracks every pipeline the shell started,
+ * records what the event loop learns about its children, and moves jobs
+ * between the foreground and the background.
+ *
+ * @author Vladyslav (Vlad) Maliutin
+ */
+
+#define _GNU_SOURCE
+#include "lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+/**
+ * @brief Frees every job in the table.
+ *
+ * @param sh Shell instance.
+ */
+void jobs_destroy(struct shell *sh) {
+    while (sh->jobs.count) job_remove(&sh->jobs, sh->jobs.jobs[0]);
+    free(sh->jobs.jobs);
+    sh->jobs.jobs = NULL;
+    sh->jobs.capacity = 0;
+}
+
+/**
+ * @brief Adds a job for a freshly launched pipeline. The id is one more
+ * than the highest id in use, so ids start over once the table empties.
+ *
+ * @param jt Job table.
+ * @param pgid Process group of the job.
+ * @param pids Pid of each stage, -1 for stages that failed to start.
+ * @param n Number of stages.
+ * @param text Command text shown by jobs.
+ * @return The new job or NULL if memory ran out.
+ */
+struct job *job_add(struct job_table *jt, pid_t pgid, const pid_t *pids, size_t n,
+                    const char *text) {
+    if (jt->count == jt->capacity) {
+        size_t cap = jt->capacity ? jt->capacity * 2 : 8;
+        struct job **jobs = realloc(jt->jobs, cap * sizeof(*jobs));
+        if (!jobs) return NULL;
+        jt->jobs = jobs;
+        jt->capacity = cap;
+    }
+
+    struct job *j = calloc(1, sizeof(*j));
+    if (!j) return NULL;
+    j->procs = calloc(n, sizeof(*j->procs));
+    j->text = strdup(text ? text : "");
+    if (!j->procs || !j->text) {
+        free(j->procs);
+        free(j->text);
+        free(j);
+        return NULL;
+    }
+
+    j->id = jt->count ? jt->jobs[jt->count - 1]->id + 1 : 1;
+    j->pgid = pgid;
+    j->nprocs = n;
+    j->state = JOB_DONE;
+    for (size_t i = 0; i < n; i++) {
+        j->procs[i].pid = pids[i];
+        j->procs[i].pidfd = -1;
+        if (pids[i] > 0) {
+            j->state = JOB_RUNNING;
+        } else {
+            j->procs[i].done = true;
+            j->procs[i].status = W_EXITCODE(127, 0);
+        }
+    }
+    jt->jobs[jt->count++] = j;
+    return j;
+}
+
+/**
+ * @brief Removes a job from the table and frees it.
+ *
+ * @param jt Job table.
+ * @param j Job to remove.
+ */
+void job_remove(struct job_table *jt, struct job *j) {
+    for (size_t i = 0; i < jt->count; i++) {
+        if (jt->jobs[i] == j) {
+            memmove(&jt->jobs[i], &jt->jobs[i + 1], (jt->count - i - 1) * sizeof(*jt->jobs));
+            jt->count--;
+            break;
+        }
+    }
+    for (size_t i = 0; i < j->nprocs; i++) sh_loop_unwatch_fd(j->procs[i].pidfd);
+    free(j->procs);
+    free(j->text);
+    free(j);
+}
+
+/**
+ * @brief Looks up a job from a job spec: %n, n, %% or %+ (the current
+ * job, i.e. the most recent one), or NULL/empty for the current job.
+ *
+ * @param jt Job table.
+ * @param spec Job spec.
+ * @return Matching job or NULL.
+ */
+struct job *job_find(struct job_table *jt, const char *spec) {
+    if (jt->count == 0) return NULL;
+    if (!spec || !*spec || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0 ||
+        strcmp(spec, "%") == 0)
+        return jt->jobs[jt->count - 1];
+    if (*spec == '%') spec++;
+
+    char *end;
+    long id = strtol(spec, &end, 10);
+    if (*end) return NULL;
+    for (size_t i = 0; i < jt->count; i++) {
+        if (jt->jobs[i]->id == id) return jt->jobs[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Recomputes a job's state from its members.
+ *
+ * @param j Job to update.
+ */
+static void job_update_state(struct job *j) {
+    bool running = false, stopped = false;
+    for (size_t i = 0; i < j->nprocs; i++) {
+        if (j->procs[i].done) continue;
+        if (j->procs[i].stopped)
+            stopped = true;
+        else
+            running = true;
+    }
+    j->state = running ? JOB_RUNNING : stopped ? JOB_STOPPED : JOB_DONE;
+}
+
+/**
+ * @brief Finds the job member with the given pid.
+ *
+ * @param jt Job table.
+ * @param pid Process id.
+ * @param owner Receives the owning job, may be NULL.
+ * @return The member or NULL.
+ */
+static struct job_proc *find_proc(struct job_table *jt, pid_t pid, struct job **owner) {
+    for (size_t i = 0; i < jt->count; i++) {
+        struct job *j = jt->jobs[i];
+        for (size_t k = 0; k < j->nprocs; k++) {
+            if (j->procs[k].pid != pid) continue;
+            if (owner) *owner = j;
+            return &j->procs[k];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Finds the job member with the given pid.
+ *
+ * @param jt Job table.
+ * @param pid Process id.
+ * @return The member or NULL.
+ */
+struct job_proc *job_find_proc(struct job_table *jt, pid_t pid) {
+    return find_proc(jt, pid, NULL);
+}
+
+/**
+ * @brief Records a status reported by waitpid or waitid against the owning job.
+ *
+ * @param sh Shell instance.
+ * @param pid Child that changed state.
+ * @param status Wait status.
+ */
+void job_record(struct shell *sh, pid_t pid, int status) {
+    struct job *j;
+    struct job_proc *p = find_proc(&sh->jobs, pid, &j);
+    if (!p) return;
+    if (WIFSTOPPED(status)) {
+        p->stopped = true;
+    } else if (WIFCONTINUED(status)) {
+        p->stopped = false;
+    } else {
+        p->done = true;
+        p->status = status;
+    }
+    job_update_state(j);
+}
+
+/**
+ * @brief Collects every child that changed state without blocking. With the
+ * event loop running this just dispatches whatever events are pending.
+ *
+ * @param sh Shell instance.
+ */
+void jobs_reap(struct shell *sh) {
+    if (sh->loop.active) {
+        while (sh_loop_once(sh, false, 0) > 0)
+            ;
+        return;
+    }
+
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0)
+        job_record(sh, pid, status);
+}
+
+/**
+ * @brief Status of the last stage of a finished job.
+ *
+ * @param j Job.
+ * @return Wait status.
+ */
+static int job_status(const struct job *j) {
+    return j->nprocs ? j->procs[j->nprocs - 1].status : 0;
+}
+
+/**
+ * @brief Waits until a job finishes or stops. For a foreground job the
+ * terminal is handed back to the shell afterwards.
+ *
+ * @param sh Shell instance.
+ * @param j Job to wait for.
+ * @param foreground Whether the job owns the terminal.
+ * @return Wait status of the last stage (a stopped status if it stopped).
+ */
+int job_wait(struct shell *sh, struct job *j, bool foreground) {
+    int status;
+    while (j->state == JOB_RUNNING) {
+        if (sh->loop.active) {
+            if (sh_loop_once(sh, false, -1) >= 0) continue;
+            perror("epoll_wait");
+            break;
+        }
+        pid_t pid = waitpid(-1, &status, WUNTRACED);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            /* Nothing left to wait for, the members were reaped elsewhere */
+            for (size_t i = 0; i < j->nprocs; i++) j->procs[i].done = true;
+            job_update_state(j);
+            break;
+        }
+        job_record(sh, pid, status);
+    }
+
+    if (foreground && sh->shell_is_interactive) {
+        tcsetpgrp(sh->shell_terminal, sh->shell_pgid);
+        if (j->state == JOB_STOPPED) tcgetattr(sh->shell_terminal, &j->tmodes);
+        tcsetattr(sh->shell_terminal, TCSADRAIN, &sh->shell_tmodes);
+    }
+
+    if (j->state == JOB_STOPPED) {
+        fprintf(stderr, "\n[%d]+  Stopped                 %s\n", j->id, j->text);
+        return W_STOPCODE(SIGTSTP);
+    }
+    status = job_status(j);
+    /* Keep the next prompt off the line the ^C was echoed on */
+    if (foreground && sh->shell_is_interactive && WIFSIGNALED(status) &&
+        WTERMSIG(status) == SIGINT)
+        fputc('\n', stderr);
+    return status;
+}
+
+/**
+ * @brief Resumes a stopped job, in the foreground or the background.
+ *
+ * @param sh Shell instance.
+ * @param j Job to continue.
+ * @param foreground True to give it the terminal and wait for it.
+ * @return Wait status when run in the foreground, 0 otherwise.
+ */
+int job_continue(struct shell *sh, struct job *j, bool foreground) {
+    bool was_stopped = j->state == JOB_STOPPED;
+    for (size_t i = 0; i < j->nprocs; i++) j->procs[i].stopped = false;
+    job_update_state(j);
+
+    if (foreground && sh->shell_is_interactive) {
+        tcsetpgrp(sh->shell_terminal, j->pgid);
+        if (was_stopped) tcsetattr(sh->shell_terminal, TCSADRAIN, &j->tmodes);
+    }
+    if (was_stopped && kill(-j->pgid, SIGCONT) < 0) perror("kill (SIGCONT)");
+
+    if (!foreground) return 0;
+    int status = job_wait(sh, j, true);
+    if (j->state == JOB_DONE) job_remove(&sh->jobs, j);
+    return status;
+}
+
+/**
+ * @brief Human readable state of a job for jobs and notifications.
+ *
+ * @param j Job.
+ * @param buf Scratch buffer.
+ * @param len Size of buf.
+ * @return State text.
+ */
+static const char *job_state_text(const struct job *j, char *buf, size_t len) {
+    if (j->state == JOB_RUNNING) return "Running";
+    if (j->state == JOB_STOPPED) return "Stopped";
+    int status = job_status(j);
+    if (WIFSIGNALED(status)) {
+        snprintf(buf, len, "%s", strsignal(WTERMSIG(status)));
+    } else if (WEXITSTATUS(status)) {
+        snprintf(buf, len, "Exit %d", WEXITSTATUS(status));
+    } else {
+        return "Done";
+    }
+    return buf;
+}
+
+/**
+ * @brief Prints one line per job like the jobs builtin.
+ *
+ * @param sh Shell instance.
+ * @param j Job to print.
+ * @param with_pids Also print the pid of every member.
+ */
+void job_print(struct shell *sh, const struct job *j, bool with_pids) {
+    char buf[64];
+    struct job_table *jt = &sh->jobs;
+    char mark = jt->count && jt->jobs[jt->count - 1] == j ? '+'
+              : jt->count > 1 && jt->jobs[jt->count - 2] == j ? '-' : ' ';
+    printf("[%d]%c  ", j->id, mark);
+    if (with_pids) printf("%d ", (int)j->pgid);
+    printf("%-22s  %s%s\n", job_state_text(j, buf, sizeof(buf)), j->text,
+           j->state == JOB_RUNNING ? " &" : "");
+}
+
+/**
+ * @brief Reports finished background jobs and drops them from the table.
+ *
+ * @param sh Shell instance.
+ */
+void jobs_notify(struct shell *sh) {
+    jobs_reap(sh);
+    for (size_t i = 0; i < sh->jobs.count;) {
+        struct job *j = sh->jobs.jobs[i];
+        if (j->state != JOB_DONE) {
+            i++;
+            continue;
+        }
+        if (sh->shell_is_interactive) job_print(sh, j, false);
+        job_remove(&sh->jobs, j);
+    }
+}
@@ -5,6 +5,7 @@
  * @author Vladyslav (Vlad) Maliutin
  */
 
+#define _GNU_SOURCE
 #include "lab.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,24 +18,58 @@
 #include <pwd.h>
 #include <errno.h>
 #include <signal.h>
+#include <strings.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <ctype.h>
 
-#define ARG_MAX sysconf(_SC_ARG_MAX)
+/* Process wide copy of the limits, see sh_limits() */
+static struct shell_limits cached_limits;
+
+/* Launch backend chosen on the command line, applied by sh_init */
+static enum launch_backend launch_backend = LAUNCH_SPAWN;
+
+/* Number of distinct lines the parse cache remembers */
+#define PARSE_CACHE_SIZE 256
+
+/* Number of recent history entries handed to readline for recall */
+#define HISTORY_RECALL 1000
+
+/* Non-interactive input named on the command line, applied by sh_init */
+static const char *command_string;
+static const char *script_path;
 
 /**
  * @brief Parses command-line arguments passed when launching the shell.
  * If the '-v' flag is detected, it prints the shell version and exits.
+ * '-l spawn' or '-l fork' selects how external commands are launched,
+ * '-c string' runs string, and the first operand names a script file.
  *
  * @param argc Number of arguments.
  * @param argv Argument array.
  */
 void parse_args(int argc, char **argv) {
     int opt;
-    while ((opt = getopt(argc, argv, "v")) != -1) {
+    while ((opt = getopt(argc, argv, "+vl:c:")) != -1) {
         if (opt == 'v') {
             printf("Shell Version: %d.%d\n", lab_VERSION_MAJOR, lab_VERSION_MINOR);
             exit(0);
+        } else if (opt == 'l') {
+            if (strcmp(optarg, "spawn") == 0) {
+                launch_backend = LAUNCH_SPAWN;
+            } else if (strcmp(optarg, "fork") == 0) {
+                launch_backend = LAUNCH_FORK;
+            } else {
+                fprintf(stderr, "%s: unknown launch backend '%s'\n", argv[0], optarg);
+                exit(1);
+            }
+        } else if (opt == 'c') {
+            command_string = optarg;
+        } else {
+            exit(1);
         }
     }
+    if (!command_string && optind < argc) script_path = argv[optind];
 }
 
 /**
@@ -53,39 +88,59 @@ char *get_prompt(const char *env) {
 }
 
 /**
- * @brief Parses a command line into an array of arguments.
+ * @brief Parses a command line into an array of arguments, honouring
+ * quotes and backslash escapes.
+ * The argv pointer array and the token bytes share one allocation: the
+ * pointer slots come first, sized for the most words the line can hold,
+ * and the lexer writes each word behind them in a single pass. Nothing is
+ * allocated per token.
  *
  * @param line Input command string.
- * @return Dynamically allocated argument array (must be freed using cmd_free).
+ * @return Dynamically allocated argument array (must be freed using
+ * cmd_free), NULL if a quote is left open.
  */
 char **cmd_parse(const char *line) {
-    char **cmd = malloc(ARG_MAX * sizeof(char *));
-    if (!cmd) return NULL;
+    return cmd_parse_n(line, strlen(line));
+}
+
+/**
+ * @brief cmd_parse for a line that is not NUL terminated.
+ *
+ * @param line Start of the line.
+ * @param len Length of the line.
+ * @return Same as cmd_parse.
+ */
+char **cmd_parse_n(const char *line, size_t len) {
+    size_t max_args = sh_limits()->arg_max - 1;
 
-    char *token, *line_copy = strdup(line);
-    int i = 0;
+    /* Every word but the last is followed by a separator */
+    size_t argc = len / 2 + 1;
+    if (argc > max_args) argc = max_args;
+    size_t slots = (argc + 1) * sizeof(char *);
+    char **cmd = malloc(slots + len + 1);
+    if (!cmd) return NULL;
 
-    token = strtok(line_copy, " ");
-    while (token && i < ARG_MAX - 1) {
-        cmd[i++] = strdup(token);
-        token = strtok(NULL, " ");
+    struct lexer lx;
+    struct lex_token t;
+    lexer_init(&lx, line, len, (char *)cmd + slots, true);
+    size_t i = 0;
+    enum lex_kind kind = LEX_END;
+    while (i < argc && (kind = lexer_next(&lx, &t)) == LEX_WORD) cmd[i++] = t.word;
+    if (i < argc && kind == LEX_ERROR) {
+        free(cmd);
+        return NULL;
     }
     cmd[i] = NULL;
-
-    free(line_copy);
     return cmd;
 }
 
 /**
- * @brief Frees the memory allocated for a parsed command.
+ * @brief Frees the memory allocated for a parsed command. The array and
+ * its tokens live in a single block so one free releases everything.
  *
  * @param cmd Command argument array.
  */
 void cmd_free(char **cmd) {
-    if (!cmd) return;
-    for (int i = 0; cmd[i] != NULL; i++) {
-        free(cmd[i]);
-    }
     free(cmd);
 }
 
@@ -96,14 +151,46 @@ void cmd_free(char **cmd) {
  * @return Pointer to the trimmed string.
  */
 char *trim_white(char *line) {
-    while (isspace((unsigned char)*line)) line++;
-    if (*line == 0) return line;
-    char *end = line + strlen(line) - 1;
-    while (end > line && isspace((unsigned char)*end)) end--;
-    end[1] = '\0';
+    size_t len = strlen(line);
+    line = (char *)trim_white_n(line, &len);
+    line[len] = '\0';
     return line;
 }
 
+/**
+ * @brief Finds a line's text without surrounding whitespace, without
+ * writing to it.
+ *
+ * @param line Start of the line.
+ * @param len In: length of the line, out: length of the trimmed text.
+ * @return Start of the trimmed text.
+ */
+const char *trim_white_n(const char *line, size_t *len) {
+    static struct scan_set space;
+    if (!space.n) sh_scan_set_init(&space, SCAN_SPACE);
+
+    size_t lead = sh_strnspn(line, *len, &space);
+    line += lead;
+    *len -= lead;
+    *len -= sh_strrspn(line, *len, &space);
+    return line;
+}
+
+/**
+ * @brief Finds the user's home directory: $HOME, or the password database
+ * entry when it is not set.
+ *
+ * @return The directory (not to be freed) or NULL.
+ */
+const char *sh_home_dir(void) {
+    const char *home = getenv("HOME");
+    if (!home) {
+        struct passwd *pw = getpwuid(getuid());
+        home = pw ? pw->pw_dir : NULL;
+    }
+    return home;
+}
+
 /**
  * @brief Changes the current working directory.
  * Defaults to the home directory if no argument is given.
@@ -113,11 +200,7 @@ char *trim_white(char *line) {
  */
 int change_dir(char **args) {
     if (args[1] == NULL) {
-        const char *home = getenv("HOME");
-        if (!home) {
-            struct passwd *pw = getpwuid(getuid());
-            home = pw ? pw->pw_dir : NULL;
-        }
+        const char *home = sh_home_dir();
         if (home && chdir(home) != 0) {
             perror("cd");
             return -1;
@@ -130,30 +213,612 @@ int change_dir(char **args) {
 }
 
 /**
- * @brief Checks and executes built-in shell commands.
+ * @brief Hands a command the builtin version does not support to the
+ * external utility of the same name. Inside a forked pipeline stage the
+ * stage itself is replaced, otherwise the utility runs in the foreground.
  *
  * @param sh Shell instance.
- * @param argv Parsed command arguments.
- * @return True if the command was executed, false otherwise.
+ * @param argv Command arguments.
+ * @return True if the utility succeeded.
  */
-bool do_builtin(struct shell *sh, char **argv) {
-    if (!argv[0]) return false;
-
-    if (strcmp(argv[0], "exit") == 0) {
-        sh_destroy(sh);
-        exit(0);
-    } else if (strcmp(argv[0], "cd") == 0) {
-        return change_dir(argv) == 0;
-    } else if (strcmp(argv[0], "history") == 0) {
-        HIST_ENTRY **hist = history_list();
-        if (hist) {
-            for (int i = 0; hist[i]; i++) {
-                printf("%d  %s\n", i + history_base, hist[i]->line);
+static bool run_external(struct shell *sh, char **argv) {
+    if (sh->subshell) {
+        const char *exe = path_cache_lookup(&sh->paths, argv[0]);
+        if (exe) execv(exe, argv);
+        fprintf(stderr, "%s: command not found\n", argv[0]);
+        _exit(127);
+    }
+    return execute_command(sh, argv) == 0;
+}
+
+/**
+ * @brief Tells whether a builtin would read interactively from the terminal,
+ * in which case a real process with job control is the better choice.
+ *
+ * @param sh Shell instance.
+ * @return True if stdin is the shell's terminal.
+ */
+static bool stdin_is_terminal(struct shell *sh) {
+    return sh->shell_is_interactive && isatty(STDIN_FILENO);
+}
+
+/**
+ * @brief Builtin cat: concatenates files (or stdin, or '-') to stdout using
+ * the zero-copy engine. Options are left to the external cat.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @return True on success.
+ */
+static bool builtin_cat(struct shell *sh, char **argv) {
+    for (int i = 1; argv[i]; i++) {
+        if (argv[i][0] == '-' && argv[i][1]) return run_external(sh, argv);
+    }
+    if ((!argv[1] || strcmp(argv[1], "-") == 0) && stdin_is_terminal(sh))
+        return run_external(sh, argv);
+
+    fflush(stdout);
+    if (!argv[1]) return sh_copy_fd(STDIN_FILENO, STDOUT_FILENO) >= 0;
+
+    bool ok = true;
+    for (int i = 1; argv[i]; i++) {
+        int fd = strcmp(argv[i], "-") == 0 ? STDIN_FILENO
+                                            : open(argv[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || sh_copy_fd(fd, STDOUT_FILENO) < 0) {
+            fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(errno));
+            ok = false;
+        }
+        if (fd > STDIN_FILENO) close(fd);
+    }
+    return ok;
+}
+
+/**
+ * @brief Builtin tee: copies stdin to stdout and at most one file, using
+ * tee(2) and splice(2) when both ends are pipes. Anything fancier is left
+ * to the external tee.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @return True on success.
+ */
+static bool builtin_tee(struct shell *sh, char **argv) {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    int i = 1;
+    if (argv[i] && strcmp(argv[i], "-a") == 0) {
+        flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+        i++;
+    }
+    if ((argv[i] && (argv[i][0] == '-' || argv[i + 1])) || stdin_is_terminal(sh))
+        return run_external(sh, argv);
+
+    fflush(stdout);
+    if (!argv[i]) return sh_copy_fd(STDIN_FILENO, STDOUT_FILENO) >= 0;
+
+    int fd = open(argv[i], flags, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "tee: %s: %s\n", argv[i], strerror(errno));
+        return false;
+    }
+    bool ok = sh_tee_fd(STDIN_FILENO, STDOUT_FILENO, fd) >= 0;
+    if (!ok) perror("tee");
+    close(fd);
+    return ok;
+}
+
+/**
+ * @brief Looks up the job named by a job spec and complains if it is gone.
+ *
+ * @param sh Shell instance.
+ * @param name Builtin name for the error message.
+ * @param spec Job spec, NULL for the current job.
+ * @return The job or NULL.
+ */
+static struct job *find_job_or_warn(struct shell *sh, const char *name, const char *spec) {
+    struct job *j = job_find(&sh->jobs, spec);
+    if (!j) fprintf(stderr, "%s: %s: no such job\n", name, spec ? spec : "current");
+    return j;
+}
+
+/**
+ * @brief The history builtin: lists the whole history, or the last N
+ * entries with "history N", from the persistent store. "history -c"
+ * empties the store and readline's list.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @return True on success.
+ */
+static bool builtin_history(struct shell *sh, char **argv) {
+    struct history *h = &sh->hist;
+    if (argv[1] && strcmp(argv[1], "-c") == 0) {
+        hist_clear(h);
+        clear_history();
+        return true;
+    }
+    size_t count = hist_count(h);
+    size_t first = 1;
+    if (argv[1]) {
+        char *end;
+        unsigned long n = strtoul(argv[1], &end, 10);
+        if (*end || argv[1][0] == '-') {
+            fprintf(stderr, "history: %s: numeric argument required\n", argv[1]);
+            return false;
+        }
+        if (n < count) first = count - n + 1;
+    }
+    /* Only the entries shown are read from the log */
+    for (size_t i = first; i <= count; i++) {
+        char *line = hist_get(h, i);
+        if (line) printf("%5zu  %s\n", i, line);
+        free(line);
+    }
+    return true;
+}
+
+/**
+ * @brief Builtin fg and bg: continue a job in the foreground or background.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @param foreground True for fg.
+ * @return True on success.
+ */
+static bool builtin_fg_bg(struct shell *sh, char **argv, bool foreground) {
+    jobs_reap(sh);
+    struct job *j = find_job_or_warn(sh, argv[0], argv[1]);
+    if (!j) return false;
+    if (j->state == JOB_DONE) {
+        fprintf(stderr, "%s: job has terminated\n", argv[0]);
+        job_remove(&sh->jobs, j);
+        return false;
+    }
+    if (foreground) {
+        printf("%s\n", j->text);
+        fflush(stdout);
+        int status = job_continue(sh, j, true);
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    printf("[%d]+ %s &\n", j->id, j->text);
+    job_continue(sh, j, false);
+    return true;
+}
+
+/**
+ * @brief Builtin wait: waits for the given jobs (%n) or pids, or for every
+ * job when no argument is given.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @return True if the last job waited for succeeded.
+ */
+static bool builtin_wait(struct shell *sh, char **argv) {
+    int status = 0;
+    if (!argv[1]) {
+        while (sh->jobs.count) {
+            struct job *j = sh->jobs.jobs[0];
+            status = job_wait(sh, j, false);
+            if (j->state == JOB_STOPPED) break;
+            job_remove(&sh->jobs, j);
+        }
+        return true;
+    }
+
+    for (int i = 1; argv[i]; i++) {
+        struct job *j = NULL;
+        if (argv[i][0] == '%') {
+            j = find_job_or_warn(sh, "wait", argv[i]);
+        } else {
+            pid_t pid = atoi(argv[i]);
+            for (size_t k = 0; !j && k < sh->jobs.count; k++) {
+                for (size_t p = 0; p < sh->jobs.jobs[k]->nprocs; p++) {
+                    if (sh->jobs.jobs[k]->procs[p].pid == pid) j = sh->jobs.jobs[k];
+                }
             }
+            if (!j) fprintf(stderr, "wait: pid %s is not a child of this shell\n", argv[i]);
+        }
+        if (!j) {
+            status = W_EXITCODE(127, 0);
+            continue;
+        }
+        status = job_wait(sh, j, false);
+        if (j->state == JOB_DONE) job_remove(&sh->jobs, j);
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * @brief Converts a signal name (TERM, SIGTERM, term) or number to a signal.
+ *
+ * @param name Signal name or number.
+ * @return Signal number or -1 if unknown.
+ */
+static int parse_signal(const char *name) {
+    if (isdigit((unsigned char)*name)) return atoi(name);
+    if (strncasecmp(name, "SIG", 3) == 0) name += 3;
+    for (int sig = 1; sig < NSIG; sig++) {
+        const char *abbrev = sigabbrev_np(sig);
+        if (abbrev && strcasecmp(abbrev, name) == 0) return sig;
+    }
+    return -1;
+}
+
+/**
+ * @brief Builtin kill: sends a signal (default SIGTERM) to pids or to every
+ * process of a job (%n). 'kill -l' lists the signal names.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @return True if every signal was delivered.
+ */
+static bool builtin_kill(struct shell *sh, char **argv) {
+    int sig = SIGTERM;
+    int i = 1;
+    if (argv[i] && strcmp(argv[i], "-l") == 0) {
+        for (int s = 1; s < NSIG; s++) {
+            const char *abbrev = sigabbrev_np(s);
+            if (abbrev) printf("%2d) SIG%s\n", s, abbrev);
         }
         return true;
     }
-    return false;
+    if (argv[i] && strcmp(argv[i], "-s") == 0 && argv[i + 1]) {
+        sig = parse_signal(argv[i + 1]);
+        i += 2;
+    } else if (argv[i] && argv[i][0] == '-' && argv[i][1]) {
+        sig = parse_signal(argv[i] + 1);
+        i++;
+    }
+    if (sig < 0) {
+        fprintf(stderr, "kill: %s: invalid signal specification\n", argv[i - 1]);
+        return false;
+    }
+    if (!argv[i]) {
+        fprintf(stderr, "kill: usage: kill [-s sigspec | -signum] pid | %%job ...\n");
+        return false;
+    }
+
+    bool ok = true;
+    for (; argv[i]; i++) {
+        pid_t target;
+        if (argv[i][0] == '%') {
+            struct job *j = find_job_or_warn(sh, "kill", argv[i]);
+            if (!j) {
+                ok = false;
+                continue;
+            }
+            target = -j->pgid;
+        } else {
+            target = atoi(argv[i]);
+        }
+        if (kill(target, sig) < 0) {
+            fprintf(stderr, "kill: (%s) - %s\n", argv[i], strerror(errno));
+            ok = false;
+        } else if (target < 0 && (sig == SIGCONT)) {
+            jobs_reap(sh);
+        }
+    }
+    return ok;
+}
+
+/**
+ * @brief Builtin exit: leaves the shell with the given status, or with the
+ * status of the last command.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @return Does not return.
+ */
+static bool builtin_exit(struct shell *sh, char **argv) {
+    int code = argv[1] ? atoi(argv[1]) : sh->last_status;
+    if (sh->subshell) {
+        /* A forked builtin must not run the shell's exit handlers */
+        fflush(stdout);
+        _exit(code);
+    }
+    sh_destroy(sh);
+    exit(code);
+}
+
+/**
+ * @brief Builtin cd, see change_dir.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @return True on success.
+ */
+static bool builtin_cd(struct shell *sh, char **argv) {
+    UNUSED(sh);
+    return change_dir(argv) == 0;
+}
+
+/**
+ * @brief Builtin ulimit: prints the limits the shell cached at startup.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @return False for an unknown option.
+ */
+static bool builtin_ulimit(struct shell *sh, char **argv) {
+    const struct shell_limits *lim = &sh->limits;
+    if (argv[1] && strcmp(argv[1], "-n") == 0) {
+        printf("%ld\n", lim->open_max);
+    } else if (!argv[1] || strcmp(argv[1], "-a") == 0) {
+        printf("arg_max    %ld\n", lim->arg_max);
+        printf("open_max   %ld\n", lim->open_max);
+        printf("path_max   %ld\n", lim->path_max);
+        printf("page_size  %ld\n", lim->page_size);
+        printf("cpus       %ld\n", lim->ncpu);
+    } else {
+        fprintf(stderr, "ulimit: %s: invalid option\n", argv[1]);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Builtin hash: lists the command location cache, looks names up
+ * or empties it with -r.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @return True.
+ */
+static bool builtin_hash(struct shell *sh, char **argv) {
+    struct path_cache *pc = &sh->paths;
+    if (argv[1] && strcmp(argv[1], "-r") == 0) {
+        path_cache_clear(pc);
+    } else if (argv[1]) {
+        for (int i = 1; argv[i]; i++) {
+            if (!path_cache_lookup(pc, argv[i]))
+                fprintf(stderr, "hash: %s: not found\n", argv[i]);
+        }
+    } else if (pc->count == 0) {
+        printf("hash: hash table empty\n");
+    } else {
+        printf("hits\tcommand\n");
+        for (size_t i = 0; i < pc->capacity; i++) {
+            if (pc->slots[i].name)
+                printf("%4lu\t%s\n", pc->slots[i].hits, pc->slots[i].path);
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Builtin parsecache: prints the parse cache statistics, or empties
+ * it and resets them with -r.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @return True on success.
+ */
+static bool builtin_parsecache(struct shell *sh, char **argv) {
+    struct parse_cache *pc = &sh->parses;
+    if (argv[1] && strcmp(argv[1], "-r") == 0) {
+        parse_cache_clear(pc);
+        pc->hits = pc->misses = 0;
+    } else if (argv[1]) {
+        fprintf(stderr, "parsecache: usage: parsecache [-r]\n");
+        return false;
+    } else {
+        printf("hits\tmisses\tlines\n%lu\t%lu\t%zu/%zu\n", pc->hits, pc->misses,
+               pc->count, pc->max);
+    }
+    return true;
+}
+
+/**
+ * @brief Builtin jobs: lists the jobs, with -l including their process
+ * groups, with -p only the process groups.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @return True.
+ */
+static bool builtin_jobs(struct shell *sh, char **argv) {
+    jobs_reap(sh);
+    bool with_pids = argv[1] && strcmp(argv[1], "-l") == 0;
+    for (size_t i = 0; i < sh->jobs.count; i++) {
+        struct job *j = sh->jobs.jobs[i];
+        if (argv[1] && strcmp(argv[1], "-p") == 0)
+            printf("%d\n", (int)j->pgid);
+        else
+            job_print(sh, j, with_pids);
+    }
+    return true;
+}
+
+/**
+ * @brief Builtin fg, see builtin_fg_bg.
+ */
+static bool builtin_fg(struct shell *sh, char **argv) {
+    return builtin_fg_bg(sh, argv, true);
+}
+
+/**
+ * @brief Builtin bg, see builtin_fg_bg.
+ */
+static bool builtin_bg(struct shell *sh, char **argv) {
+    return builtin_fg_bg(sh, argv, false);
+}
+
+/* Every builtin. fg and bg act on the shell's own children, which a forked
+ * copy of the shell cannot wait for or hand the terminal to. */
+static const struct builtin builtins[] = {
+    { "exit", builtin_exit, BUILTIN_PARENT | BUILTIN_FORKABLE },
+    { "cd", builtin_cd, BUILTIN_PARENT | BUILTIN_FORKABLE },
+    { "ulimit", builtin_ulimit, BUILTIN_PARENT | BUILTIN_FORKABLE },
+    { "hash", builtin_hash, BUILTIN_PARENT | BUILTIN_FORKABLE },
+    { "history", builtin_history, BUILTIN_PARENT | BUILTIN_FORKABLE },
+    { "cat", builtin_cat, BUILTIN_PARENT | BUILTIN_FORKABLE },
+    { "tee", builtin_tee, BUILTIN_PARENT | BUILTIN_FORKABLE },
+    { "jobs", builtin_jobs, BUILTIN_PARENT | BUILTIN_FORKABLE },
+    { "fg", builtin_fg, BUILTIN_PARENT },
+    { "bg", builtin_bg, BUILTIN_PARENT },
+    { "wait", builtin_wait, BUILTIN_PARENT | BUILTIN_FORKABLE },
+    { "kill", builtin_kill, BUILTIN_PARENT | BUILTIN_FORKABLE },
+    { "parallel", sh_parallel, BUILTIN_PARENT | BUILTIN_FORKABLE },
+    { "parsecache", builtin_parsecache, BUILTIN_PARENT | BUILTIN_FORKABLE },
+    { "echo", builtin_echo, BUILTIN_PARENT | BUILTIN_FORKABLE | BUILTIN_CAPTURE },
+    { "printf", builtin_printf, BUILTIN_PARENT | BUILTIN_FORKABLE | BUILTIN_CAPTURE },
+    { "test", builtin_test, BUILTIN_PARENT | BUILTIN_FORKABLE | BUILTIN_CAPTURE },
+    { "[", builtin_test, BUILTIN_PARENT | BUILTIN_FORKABLE | BUILTIN_CAPTURE },
+    { "true", builtin_true, BUILTIN_PARENT | BUILTIN_FORKABLE | BUILTIN_CAPTURE },
+    { "false", builtin_false, BUILTIN_PARENT | BUILTIN_FORKABLE | BUILTIN_CAPTURE },
+    { "pwd", builtin_pwd, BUILTIN_PARENT | BUILTIN_FORKABLE | BUILTIN_CAPTURE },
+    { "export", builtin_export, BUILTIN_PARENT | BUILTIN_FORKABLE },
+    { "readonly", builtin_readonly, BUILTIN_PARENT | BUILTIN_FORKABLE },
+    { "unset", builtin_unset, BUILTIN_PARENT | BUILTIN_FORKABLE },
+    { "set", builtin_set, BUILTIN_PARENT | BUILTIN_FORKABLE },
+    { NULL, NULL, 0 },
+};
+
+#define NBUILTINS (sizeof(builtins) / sizeof(builtins[0]) - 1)
+
+/* Slot of each builtin, plus one; 0 marks an empty slot. BUILTIN_SEED is
+ * picked so that every name above lands in a slot of its own, which makes
+ * a lookup one hash and at most one strcmp. A name added later that
+ * collides still works through linear probing, but test_builtin_registry
+ * fails until the seed is updated. */
+static unsigned char builtin_slots[BUILTIN_SLOTS];
+static bool builtin_slots_ready;
+
+/**
+ * @brief Home slot of a builtin name: the top bits of its seeded 32 bit
+ * FNV-1a hash. The low bits of FNV-1a only depend on the low bits of the
+ * seed, so they leave too few seeds to choose from.
+ *
+ * @param name Name to hash.
+ * @return Slot number below BUILTIN_SLOTS.
+ */
+static uint32_t builtin_hash_name(const char *name) {
+    uint32_t h = BUILTIN_SEED;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h >> (32 - __builtin_ctz(BUILTIN_SLOTS));
+}
+
+/**
+ * @brief Places every builtin in the slot table, once.
+ */
+static void builtin_slots_init(void) {
+    for (size_t i = 0; i < NBUILTINS; i++) {
+        uint32_t slot = builtin_hash_name(builtins[i].name);
+        while (builtin_slots[slot]) slot = (slot + 1) & (BUILTIN_SLOTS - 1);
+        builtin_slots[slot] = i + 1;
+    }
+    builtin_slots_ready = true;
+}
+
+/**
+ * @brief Looks a builtin up by name.
+ *
+ * @param name Command name.
+ * @return The builtin, NULL if name is not one.
+ */
+const struct builtin *builtin_find(const char *name) {
+    if (!name) return NULL;
+    if (!builtin_slots_ready) builtin_slots_init();
+    uint32_t slot = builtin_hash_name(name);
+    while (builtin_slots[slot]) {
+        const struct builtin *b = &builtins[builtin_slots[slot] - 1];
+        if (strcmp(b->name, name) == 0) return b;
+        slot = (slot + 1) & (BUILTIN_SLOTS - 1);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Number of builtins that do not sit in the slot their hash picks.
+ *
+ * @return 0 while BUILTIN_SEED fits the registry.
+ */
+size_t builtin_collisions(void) {
+    if (!builtin_slots_ready) builtin_slots_init();
+    size_t displaced = 0;
+    for (size_t i = 0; i < NBUILTINS; i++) {
+        uint32_t slot = builtin_hash_name(builtins[i].name);
+        if (builtin_slots[slot] != i + 1) displaced++;
+    }
+    return displaced;
+}
+
+/**
+ * @brief Checks whether a command name is a builtin without running it.
+ *
+ * @param name Command name.
+ * @return True if do_builtin handles the name.
+ */
+bool is_builtin(const char *name) {
+    return builtin_find(name) != NULL;
+}
+
+/**
+ * @brief Every builtin.
+ *
+ * @return Array ending with an entry whose name is NULL.
+ */
+const struct builtin *builtin_list(void) {
+    return builtins;
+}
+
+/**
+ * @brief Executes a built-in shell command, see lab.h.
+ *
+ * @param sh Shell instance.
+ * @param argv Parsed command arguments.
+ * @return True if argv named a builtin and it succeeded.
+ */
+bool do_builtin(struct shell *sh, char **argv) {
+    const struct builtin *b = argv[0] ? builtin_find(argv[0]) : NULL;
+    return b && b->run(sh, argv);
+}
+
+/**
+ * @brief Exit status of a builtin that just ran, see lab.h.
+ *
+ * @param sh Shell instance.
+ * @param ok What the builtin returned.
+ * @return Exit status.
+ */
+int sh_builtin_status(struct shell *sh, bool ok) {
+    int status = ok ? 0 : sh->builtin_status ? sh->builtin_status : 1;
+    sh->builtin_status = 0;
+    return status;
+}
+
+/**
+ * @brief Reads the system limits used by the shell.
+ *
+ * @param lim Limits block to populate.
+ */
+void sh_limits_init(struct shell_limits *lim) {
+    lim->arg_max = sysconf(_SC_ARG_MAX);
+    if (lim->arg_max <= 0) lim->arg_max = _POSIX_ARG_MAX;
+
+    lim->open_max = sysconf(_SC_OPEN_MAX);
+    if (lim->open_max <= 0) lim->open_max = _POSIX_OPEN_MAX;
+
+    lim->path_max = pathconf("/", _PC_PATH_MAX);
+    if (lim->path_max <= 0) lim->path_max = PATH_MAX;
+
+    lim->page_size = sysconf(_SC_PAGESIZE);
+    if (lim->page_size <= 0) lim->page_size = 4096;
+
+    lim->ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (lim->ncpu <= 0) lim->ncpu = 1;
+}
+
+/**
+ * @brief Returns the cached limits, loading them on first use.
+ *
+ * @return Process wide limits.
+ */
+const struct shell_limits *sh_limits(void) {
+    if (cached_limits.arg_max == 0) sh_limits_init(&cached_limits);
+    return &cached_limits;
 }
 
 /**
@@ -162,8 +827,24 @@ bool do_builtin(struct shell *sh, char **argv) {
  * @param sh Shell instance.
  */
 void sh_init(struct shell *sh) {
+    sh_limits_init(&sh->limits);
+    cached_limits = sh->limits;
+    path_cache_init(&sh->paths);
+    parse_cache_init(&sh->parses, PARSE_CACHE_SIZE);
+    sh->launch = launch_backend;
+    sh->subshell = 0;
+    sh->last_status = 0;
+    sh->command_string = command_string;
+    sh->script_path = script_path;
+    memset(&sh->jobs, 0, sizeof(sh->jobs));
+    /* The shell's variables start as a copy of the environment and own it */
+    vars_init(&sh->vars);
+    vars_environ(&sh->vars);
+    /* The loop polls the terminal, so it has to be known first */
     sh->shell_terminal = STDIN_FILENO;
-    sh->shell_is_interactive = isatty(sh->shell_terminal);
+    sh_loop_init(sh);
+
+    sh->shell_is_interactive = !command_string && !script_path && isatty(sh->shell_terminal);
 
     if (sh->shell_is_interactive) {
         while (tcgetpgrp(sh->shell_terminal) != (sh->shell_pgid = getpgrp()))
@@ -183,6 +864,23 @@ void sh_init(struct shell *sh) {
     }
 
     sh->prompt = get_prompt("MY_PROMPT");
+    prompt_init(sh);
+
+    /* Arrow keys recall the most recent entries of the shared history */
+    memset(&sh->hist, 0, sizeof(sh->hist));
+    memset(&sh->search, 0, sizeof(sh->search));
+    cmd_index_init(&sh->commands);
+    if (sh->shell_is_interactive) sh_complete_bind(sh);
+    if (sh->shell_is_interactive && hist_open_default(&sh->hist) == 0) {
+        hist_search_bind(sh);
+        size_t count = hist_count(&sh->hist);
+        size_t first = count > HISTORY_RECALL ? count - HISTORY_RECALL + 1 : 1;
+        for (size_t i = first; i <= count; i++) {
+            char *line = hist_get(&sh->hist, i);
+            if (line) add_history(line);
+            free(line);
+        }
+    }
 }
 
 /**
@@ -191,32 +889,54 @@ void sh_init(struct shell *sh) {
  * @param sh Shell instance.
  */
 void sh_destroy(struct shell *sh) {
+    prompt_destroy(sh);
     free(sh->prompt);
+    path_cache_destroy(&sh->paths);
+    parse_cache_destroy(&sh->parses);
+    hist_search_destroy(&sh->search);
+    hist_close(&sh->hist);
+    cmd_index_destroy(&sh->commands);
+    jobs_destroy(sh);
+    sh_loop_destroy(sh);
+    sh_capture_close(sh);
+    vars_destroy(&sh->vars);
 }
 
 /**
- * @brief Executes a given command using fork and execvp.
+ * @brief Executes a given command in the foreground and waits for it.
  *
+ * @param sh Shell instance.
  * @param cmd Parsed command arguments.
+ * @return Wait status of the child, -1 if it could not be started.
  */
-void execute_command(char **cmd) {
-    if (!cmd || !cmd[0]) return;
-
-    pid_t pid = fork();
-    if (pid == 0) {
-        signal(SIGINT, SIG_DFL);
-        signal(SIGQUIT, SIG_DFL);
-        signal(SIGTSTP, SIG_DFL);
-        signal(SIGTTIN, SIG_DFL);
-        signal(SIGTTOU, SIG_DFL);
-
-        execvp(cmd[0], cmd);
-        perror("execvp");
-        exit(EXIT_FAILURE);
-    } else if (pid > 0) {
-        int status;
-        waitpid(pid, &status, 0);
-    } else {
-        perror("fork");
+int execute_command(struct shell *sh, char **cmd) {
+    if (!cmd || !cmd[0]) return -1;
+
+    pid_t pid = sh_launch(sh, cmd, NULL, 0, true);
+    if (pid < 0) return -1;
+
+    /* Track it as a job so that stopping it with ^Z leaves it resumable */
+    size_t len = 0;
+    for (int i = 0; cmd[i]; i++) len += strlen(cmd[i]) + 1;
+    char *text = malloc(len);
+    if (text) {
+        char *p = text;
+        for (int i = 0; cmd[i]; i++) p = stpcpy(p, cmd[i]), *p++ = ' ';
+        p[-1] = '\0';
+    }
+    struct job *j = job_add(&sh->jobs, pid, &pid, 1, text);
+    free(text);
+    if (!j) {
+        int status = -1;
+        while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+            ;
+        if (sh->shell_is_interactive)
+            tcsetpgrp(sh->shell_terminal, sh->shell_pgid);
+        return status;
     }
+    sh_loop_watch_job(sh, j);
+
+    int status = job_wait(sh, j, true);
+    if (j->state == JOB_DONE) job_remove(&sh->jobs, j);
+    return status;
 }
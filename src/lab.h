@@ -2,19 +2,591 @@
 #define LAB_H
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <signal.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #define lab_VERSION_MAJOR 1
 #define lab_VERSION_MINOR 0
 #define UNUSED(x) (void)x;
 
+/* Directories whose version control state the prompt remembers */
+#define PROMPT_VCS_CACHE 32
+
+/* Size of the builtin lookup table, a power of two */
+#define BUILTIN_SLOTS 64
+/* Hash seed under which no two builtin names share a slot */
+#define BUILTIN_SEED 2166136361u
+
+/* Builtin may run inside the shell process when it is the whole command */
+#define BUILTIN_PARENT 0x1
+/* Builtin may run in a forked copy of the shell (pipelines, & and parallel) */
+#define BUILTIN_FORKABLE 0x2
+/* Builtin only writes output, so $(...) of it may run inside the shell */
+#define BUILTIN_CAPTURE 0x4
+
+/* History entries the search index takes in at once while the shell idles */
+#define HIST_SEARCH_SLICE 4096
+
+/* Variable is passed to the environment of commands */
+#define VAR_EXPORT 0x1
+/* Variable can be neither assigned nor unset */
+#define VAR_READONLY 0x2
+
+/*
+Bytes the lexer leaves in words that need expanding: EXP_PLAIN or
+EXP_QUOTED (inside double quotes) comes before the $ or ~ of each expansion,
+EXP_LITERAL before an input byte that happens to be one of these three,
+and a word that had quotes ends with an EXP_QUOTED of its own
+*/
+#define EXP_PLAIN '\001'
+#define EXP_QUOTED '\002'
+#define EXP_LITERAL '\003'
+
+/* Largest character set the vectorized scanners take */
+#define SCAN_MAX_SET 16
+/* The characters isspace accepts in the C locale */
+#define SCAN_SPACE " \t\n\v\f\r"
+
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
+  /**
+   * System limits queried once at startup so hot paths never go back to
+   * the kernel (or libc) for them.
+   */
+  struct shell_limits
+  {
+    long arg_max;
+    long open_max;
+    long path_max;
+    long page_size;
+    long ncpu;
+  };
+
+  /**
+   * One slot of the command location cache. A NULL name marks an empty slot.
+   */
+  struct path_entry
+  {
+    char *name;
+    char *path;
+    unsigned long hits;
+  };
+
+  /**
+   * Open addressing hash table mapping command names to the absolute path
+   * found by searching PATH. The table remembers the PATH value it was built
+   * from and empties itself when PATH changes.
+   */
+  struct path_cache
+  {
+    struct path_entry *slots;
+    size_t capacity;
+    size_t count;
+    char *path_env;
+  };
+
+  /**
+   * Bump allocator used for everything that belongs to one parsed command
+   * line. Memory comes from a short chain of chunks and is only released
+   * all at once with arena_free.
+   */
+  struct arena_chunk;
+  struct arena
+  {
+    struct arena_chunk *head;
+  };
+
+  /**
+   * What a redirection does to its target descriptor.
+   */
+  enum redirect_kind
+  {
+    REDIR_OPEN,
+    REDIR_DUP,
+    REDIR_CLOSE
+  };
+
+  /**
+   * One file descriptor action, applied in order after the pipe ends are in
+   * place: open path onto fd, duplicate src_fd onto fd, or close fd.
+   */
+  struct redirect
+  {
+    enum redirect_kind kind;
+    int fd;
+    int src_fd;
+    int flags;
+    const char *path;
+  };
+
+  /**
+   * Kinds of token produced by the lexer.
+   */
+  enum lex_kind
+  {
+    LEX_END,
+    LEX_WORD,
+    LEX_PIPE,   /* |  */
+    LEX_OR_IF,  /* || */
+    LEX_AMP,    /* &  */
+    LEX_AND_IF, /* && */
+    LEX_SEMI,   /* ;  */
+    LEX_REDIR,
+    LEX_ERROR
+  };
+
+  /**
+   * Redirection operators as written, before their target word is known.
+   */
+  enum redir_op
+  {
+    OP_IN,         /* <   */
+    OP_INOUT,      /* <>  */
+    OP_OUT,        /* >   */
+    OP_APPEND,     /* >>  */
+    OP_DUP_IN,     /* <&  */
+    OP_DUP_OUT,    /* >&  */
+    OP_BOTH,       /* &>  */
+    OP_BOTH_APPEND /* &>> */
+  };
+
+  /**
+   * One token. start and srclen locate it in the line for error messages; a
+   * word's text, with quotes and escapes removed, is NUL terminated in the
+   * lexer's output buffer. expand is set if the word holds EXP_* bytes.
+   */
+  struct lex_token
+  {
+    enum lex_kind kind;
+    const char *start;
+    size_t srclen;
+    char *word;
+    size_t len;
+    enum redir_op op;
+    int fd;
+    bool expand;
+  };
+
+  /**
+   * Lexer state: the read position and end of the line and the write
+   * position in the output buffer. With words_only set the buffer never
+   * needs more than the line's length + 1 bytes, since every word but the
+   * last is followed by at least one byte that is not copied; otherwise
+   * the EXP_* bytes can take up to twice the length + 1.
+   */
+  struct lexer
+  {
+    const char *pos;
+    const char *end;
+    char *out;
+    bool words_only;
+  };
+
+  /**
+   * Implementations of the byte class scanners. SCAN_AUTO picks the widest
+   * one the CPU supports.
+   */
+  enum scan_backend
+  {
+    SCAN_AUTO,
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2
+  };
+
+  /**
+   * A character set prepared for the scanners: the characters themselves,
+   * a byte lookup table and the nibble tables for the AVX2 code.
+   */
+  struct scan_set
+  {
+    unsigned char chars[SCAN_MAX_SET];
+    size_t n;
+    bool table[256];
+    bool nibble;
+    unsigned char lo[16];
+    unsigned char hi[16];
+  };
+
+  /**
+   * One stage of a pipeline. The NAME=value words in front of the command
+   * name are kept apart in assigns, directly before argv in the same
+   * array. expand is set if any word still holds EXP_* bytes; substituted
+   * is set on an expanded copy if a command substitution ran for it.
+   */
+  struct command
+  {
+    char **argv;
+    size_t nredirs;
+    struct redirect *redirs;
+    char **assigns;
+    size_t nassigns;
+    bool expand;
+    bool substituted;
+  };
+
+  /**
+   * A pipeline of one or more commands joined by '|', optionally followed by
+   * '&'. All of it, including the strings argv points at and the command
+   * text shown by jobs, lives in the pipeline's arena.
+   */
+  struct pipeline
+  {
+    struct arena arena;
+    size_t ncmds;
+    struct command *cmds;
+    bool background;
+    char *text;
+  };
+
+  /**
+   * How a pipeline of an and-or list is joined to the one before it.
+   */
+  enum andor_op
+  {
+    ANDOR_AND, /* && */
+    ANDOR_OR   /* || */
+  };
+
+  /**
+   * Pipelines joined by && and ||, evaluated left to right with
+   * short-circuiting. ops[i] joins pipelines[i] and pipelines[i + 1]. A
+   * background list is run as a whole by a forked subshell, unless it is a
+   * single pipeline, which is then simply marked as background.
+   */
+  struct and_or
+  {
+    size_t npipelines;
+    struct pipeline *pipelines;
+    enum andor_op *ops;
+    bool background;
+    char *text;
+  };
+
+  /**
+   * The syntax tree of a line: and-or lists separated by ';' or '&', made
+   * of pipelines of simple commands. Every node and string lives in the
+   * list's arena. A list may be shared through the parse cache, so it is
+   * never modified once parsed and is freed when the last reference goes.
+   */
+  struct cmd_list
+  {
+    struct arena arena;
+    unsigned refs;
+    size_t nitems;
+    struct and_or *items;
+  };
+
+  /**
+   * A remembered line and a reference to its parsed list. Entries hang off
+   * a hash bucket chain and a recency list running from newest to oldest.
+   */
+  struct parse_entry
+  {
+    struct parse_entry *chain;
+    struct parse_entry *newer;
+    struct parse_entry *older;
+    struct cmd_list *list;
+    unsigned long long hash;
+    size_t len;
+    char line[];
+  };
+
+  /**
+   * LRU cache of parsed lines keyed by the trimmed line text. At most max
+   * entries are kept; the least recently used one makes room for a new one.
+   */
+  struct parse_cache
+  {
+    struct parse_entry **buckets;
+    size_t nbuckets;
+    size_t count;
+    size_t max;
+    struct parse_entry *newest;
+    struct parse_entry *oldest;
+    unsigned long hits;
+    unsigned long misses;
+  };
+
+  /**
+   * Extra file descriptors to install in a child before it runs. A value of
+   * -1 leaves the shell's descriptor in place. The redirections are applied
+   * after the pipe ends. The NAME=value assignments go into the child's
+   * environment only.
+   */
+  struct launch_io
+  {
+    int in_fd;
+    int out_fd;
+    size_t nredirs;
+    const struct redirect *redirs;
+    size_t nassigns;
+    char *const *assigns;
+  };
+
+  /**
+   * How external commands are started. posix_spawn lets libc use vfork/clone
+   * semantics and avoids copying the shell's page tables; fork is kept as a
+   * fallback and for comparison.
+   */
+  enum launch_backend
+  {
+    LAUNCH_SPAWN,
+    LAUNCH_FORK
+  };
+
+  enum job_state
+  {
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE
+  };
+
+  /**
+   * One process of a job and what waitpid last said about it. pidfd is
+   * the descriptor the event loop watches for its exit, or -1.
+   */
+  struct job_proc
+  {
+    pid_t pid;
+    int pidfd;
+    int status;
+    bool done;
+    bool stopped;
+  };
+
+  /**
+   * A pipeline the shell launched, identified by its job id and process
+   * group. tmodes holds the terminal modes the job had when it stopped.
+   */
+  struct job
+  {
+    int id;
+    pid_t pgid;
+    size_t nprocs;
+    struct job_proc *procs;
+    enum job_state state;
+    char *text;
+    struct termios tmodes;
+  };
+
+  /**
+   * Jobs ordered by id, the last one is the current job.
+   */
+  struct job_table
+  {
+    struct job **jobs;
+    size_t count;
+    size_t capacity;
+  };
+
+  /**
+   * State of the event loop: one epoll instance watching the input
+   * descriptor (only while input is wanted), a signalfd for SIGCHLD and
+   * SIGWINCH, and a pidfd per running child. on_input is called when input
+   * is readable, normally rl_callback_read_char.
+   */
+  struct event_loop
+  {
+    bool active;
+    int epfd;
+    int sigfd;
+    int input_fd;
+    bool input_pollable;
+    bool input_armed;
+    bool pidfds;
+    void (*on_input)(void);
+  };
+
+  /**
+   * Line reader for non-interactive input. Either map holds a whole script
+   * file, or lines are split in place in buf; in both bytes [start, end)
+   * are not yet handed out. Line numbers of a mapped script come from a
+   * line start index that is only built when one is asked for.
+   */
+  struct line_reader
+  {
+    int fd;
+    const char *map;
+    char *buf;
+    size_t cap;
+    size_t start;
+    size_t end;
+    size_t checked;
+    bool eof;
+    bool shared;
+    off_t synced;
+    unsigned long lineno;
+    size_t line_off;
+    size_t *lines;
+    size_t nlines;
+    size_t lines_cap;
+    size_t indexed;
+  };
+
+  /**
+   * Persistent history: a log of length prefixed commands and an index of
+   * their offsets, both shared by all of a user's shells and only ever
+   * appended to. The index is mapped (map_len bytes) for O(1) lookups.
+   * generation counts the times the files were replaced by a clear.
+   */
+  struct history
+  {
+    bool ready;
+    char *path;
+    int log_fd;
+    int idx_fd;
+    unsigned long generation;
+    const unsigned long long *index;
+    size_t map_len;
+    size_t count;
+  };
+
+  /**
+   * Callback of hist_scan and hist_scan_back: entry number n and its text,
+   * which is not NUL terminated. Returning false ends the scan.
+   */
+  typedef bool (*hist_scan_fn)(void *ctx, size_t n, const char *line, size_t len);
+
+  /**
+   * The n entries (in increasing order) containing one trigram, kept as a
+   * chain of chunks in the index's pool from head to tail, each entry as
+   * the varint encoded difference from the one before; last is the newest.
+   * key is the three bytes plus one, so that 0 marks an empty slot.
+   */
+  struct trigram_list
+  {
+    uint32_t key;
+    uint32_t n;
+    uint32_t last;
+    uint32_t head;
+    uint32_t tail;
+  };
+
+  /**
+   * Trigram index over the history store: an open addressing table of
+   * posting lists whose chunks all live in pool. Entries 1..nentries are
+   * indexed.
+   */
+  struct hist_search
+  {
+    struct trigram_list *slots;
+    size_t capacity;
+    size_t used;
+    unsigned char *pool;
+    size_t pool_len;
+    size_t pool_cap;
+    size_t nentries;
+    unsigned long generation;
+  };
+
+  /**
+   * Every executable name found in the PATH directories, sorted and without
+   * duplicates, for completion. The names live in pool and names holds
+   * their offsets. inotify_fd watches the directories; any change marks
+   * the index stale and it is rebuilt the next time it is needed, as is an
+   * index built for a different PATH.
+   */
+  struct command_index
+  {
+    char *pool;
+    size_t pool_len;
+    size_t pool_cap;
+    uint32_t *names;
+    size_t count;
+    size_t cap;
+    char *path_env;
+    int inotify_fd;
+    bool watching;
+    bool built;
+    bool stale;
+  };
+
+  /**
+   * Version control segment of the prompt for one directory; segment is
+   * empty outside a repository. used orders entries for eviction.
+   */
+  struct vcs_entry
+  {
+    char *dir;
+    char *segment;
+    unsigned long used;
+  };
+
+  /**
+   * Prompt state. Expensive segments are looked up by a helper thread:
+   * pending holds the directory it should look at next, results go to
+   * cache (all under lock) and a write to eventfd wakes the event loop so
+   * the prompt can be redrawn. shown is the prompt last displayed and
+   * duration_ms how long the last command line took.
+   */
+  struct prompt_state
+  {
+    bool running;
+    bool quit;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int eventfd;
+    char *pending;
+    struct vcs_entry cache[PROMPT_VCS_CACHE];
+    unsigned long tick;
+    char *shown;
+    long duration_ms;
+  };
+
+  struct shell;
+
+  /**
+   * A builtin command: its name, the function running it (which returns
+   * false on failure) and BUILTIN_* flags.
+   */
+  struct builtin
+  {
+    const char *name;
+    bool (*run)(struct shell *sh, char **argv);
+    unsigned flags;
+  };
+
+  /**
+   * One shell variable. entry is a single "NAME=value" allocation, or just
+   * "NAME" for a variable that was exported before it got a value, so an
+   * exported entry can go into the environment as it is. env_index is the
+   * position of the entry in the environment array.
+   */
+  struct shell_var
+  {
+    char *entry;
+    size_t name_len;
+    unsigned flags;
+    size_t env_index;
+  };
+
+  /**
+   * Open addressing hash table of the shell's variables, filled from
+   * environ the first time it is used. envp lists the exported entries and
+   * is kept up to date as they change, so starting a command never has to
+   * build an environment; environ points at it while the table exists.
+   */
+  struct var_table
+  {
+    struct shell_var *slots;
+    size_t capacity;
+    size_t count;
+    char **envp;
+    size_t nenv;
+    size_t env_cap;
+    char **saved_environ;
+    bool imported;
+  };
+
   struct shell
   {
     int shell_is_interactive;
@@ -22,6 +594,24 @@ extern "C"
     struct termios shell_tmodes;
     int shell_terminal;
     char *prompt;
+    struct shell_limits limits;
+    struct path_cache paths;
+    struct parse_cache parses;
+    struct history hist;
+    struct hist_search search;
+    struct command_index commands;
+    struct prompt_state prompt_info;
+    enum launch_backend launch;
+    int subshell;
+    struct job_table jobs;
+    struct event_loop loop;
+    struct var_table vars;
+    int capture_fd;
+    pid_t capture_pid;
+    int last_status;
+    int builtin_status;
+    const char *command_string;
+    const char *script_path;
   };
 
 
@@ -48,49 +638,1355 @@ extern "C"
    */
   int change_dir(char **dir);
 
+  /**
+   * @brief The user's home directory, from HOME or the password database.
+   *
+   * @return const char* The directory, not to be freed, or NULL
+   */
+  const char *sh_home_dir(void);
+
   /**
    * @brief Convert line read from the user into to format that will work with
    * execvp. We limit the number of arguments to ARG_MAX loaded from sysconf.
-   * This function allocates memory that must be reclaimed with the cmd_free
-   * function.
+   * Words are separated by blanks; quotes and backslashes are handled as by
+   * lexer_next. The argument array and the argument strings are stored in a
+   * single allocation that must be reclaimed with the cmd_free function.
    *
    * @param line The line to process
    *
-   * @return The line read in a format suitable for exec
+   * @return The line read in a format suitable for exec, NULL if a quote is
+   * not closed
    */
   char **cmd_parse(char const *line);
 
   /**
-   * @brief Free the line that was constructed with parse_cmd
+   * @brief cmd_parse for a (pointer, length) view of a line, such as a
+   * slice of a mapped script.
+   *
+   * @param line Start of the line
+   * @param len Length of the line
+   * @return Same as cmd_parse
+   */
+  char **cmd_parse_n(char const *line, size_t len);
+
+  /**
+   * @brief Free the line that was constructed with parse_cmd. Individual
+   * arguments must not be freed on their own.
    *
    * @param line the line to free
    */
   void cmd_free(char ** line);
 
   /**
-   * @brief Trim the whitespace from the start and end of a string.
-   * For example "   ls -a   " becomes "ls -a". This function modifies
-   * the argument line so that all printable chars are moved to the
-   * front of the string
+   * @brief Prepare a character set for sh_strcspn and friends.
    *
-   * @param line The line to trim
-   * @return The new line with no whitespace
+   * @param set The set to fill in
+   * @param chars The characters, at most SCAN_MAX_SET are vectorized
    */
-  char *trim_white(char *line);
+  void sh_scan_set_init(struct scan_set *set, const char *chars);
 
+  /**
+   * @brief Length of the initial part of s that contains no byte from the
+   * set, like strcspn, classifying 16 or 32 bytes per step.
+   *
+   * @param s The string
+   * @param set Characters to stop at
+   * @return size_t Length of the prefix
+   */
+  size_t sh_strcspn(const char *s, const struct scan_set *set);
 
   /**
-   * @brief Takes an argument list and checks if the first argument is a
-   * built in command such as exit, cd, jobs, etc. If the command is a
-   * built in command this function will handle the command and then return
-   * true. If the first argument is NOT a built in command this function will
-   * return false.
+   * @brief Length of the initial part of s made only of bytes from the
+   * set, like strspn, classifying 16 or 32 bytes per step.
    *
-   * @param sh The shell
-   * @param argv The command to check
-   * @return True if the command was a built in command
+   * @param s The string
+   * @param set Characters to skip
+   * @return size_t Length of the prefix
    */
-  bool do_builtin(struct shell *sh, char **argv);
+  size_t sh_strspn(const char *s, const struct scan_set *set);
+
+  /**
+   * @brief Number of bytes at the end of s[0..len) that are in the set.
+   *
+   * @param s The string, it does not have to be NUL terminated
+   * @param len Length of s
+   * @param set Characters to skip
+   * @return size_t Length of the suffix
+   */
+  size_t sh_strrspn(const char *s, size_t len, const struct scan_set *set);
+
+  /**
+   * @brief sh_strcspn over at most len bytes. Safe on a view into a larger
+   * buffer or mapping: nothing is read from pages past s + len.
+   *
+   * @param s The string, it does not have to be NUL terminated
+   * @param len Length of s
+   * @param set Characters to stop at
+   * @return size_t Length of the prefix, at most len
+   */
+  size_t sh_strncspn(const char *s, size_t len, const struct scan_set *set);
+
+  /**
+   * @brief sh_strspn over at most len bytes, see sh_strncspn.
+   *
+   * @param s The string, it does not have to be NUL terminated
+   * @param len Length of s
+   * @param set Characters to skip
+   * @return size_t Length of the prefix, at most len
+   */
+  size_t sh_strnspn(const char *s, size_t len, const struct scan_set *set);
+
+  /**
+   * @brief Choose the scanner implementation; without a call SCAN_AUTO is
+   * used. Meant for tests and benchmarks.
+   *
+   * @param backend The implementation
+   * @return bool False if this CPU cannot run it (the choice is unchanged)
+   */
+  bool sh_scan_use(enum scan_backend backend);
+
+  /**
+   * @brief Start lexing a line. Words are written to buf, which must hold
+   * len + 1 bytes with words_only set and 2 * len + 1 otherwise. The line
+   * need not be NUL terminated; a NUL inside it ends it early. With
+   * words_only set, operator characters are ordinary word characters, only
+   * blanks separate words and $ is not special.
+   *
+   * @param lx The lexer
+   * @param line The line to split
+   * @param len Length of the line
+   * @param buf Output buffer for the words
+   * @param words_only True to split on blanks alone
+   */
+  void lexer_init(struct lexer *lx, const char *line, size_t len, char *buf, bool words_only);
+
+  /**
+   * @brief Read the next token in a single pass over the line: blanks
+   * separate words, single quotes keep everything literally, double quotes
+   * keep everything but \$ \` \" \\ and line continuations, and a backslash
+   * outside quotes escapes the next character. $NAME, ${...}, $?, $(...)
+   * and $((...)) outside single quotes are marked for expansion, as is a ~
+   * prefix at the start of a word or of an assignment's value. An
+   * unterminated quote or substitution is reported on stderr and yields
+   * LEX_ERROR.
+   *
+   * @param lx The lexer
+   * @param t Receives the token
+   * @return enum lex_kind The kind of the token
+   */
+  enum lex_kind lexer_next(struct lexer *lx, struct lex_token *t);
+
+  /**
+   * @brief Length of the reference starting at the $ at p: $NAME, $?, or a
+   * ${...}, $(...) or $((...)) up to its matching bracket, with quotes and
+   * nested references inside it stepped over.
+   *
+   * @param p The $
+   * @param end End of the text
+   * @return size_t Length including the $, 0 if no reference starts there,
+   * SIZE_MAX if the closing bracket is missing
+   */
+  size_t lex_reference_len(const char *p, const char *end);
+
+  /**
+   * @brief Split a line into pipeline stages on '|' and each stage into
+   * arguments and redirections (<, >, >>, <>, <&, >&, &>, &>> with an
+   * optional leading fd number). Everything is allocated from one arena and
+   * must be released with pipeline_free. An empty stage is a syntax error,
+   * and so are ';', '&&' and '||', which only list_parse accepts.
+   *
+   * @param line The line to process
+   * @return struct pipeline* The parsed pipeline or NULL on error
+   */
+  struct pipeline *pipeline_parse(char const *line);
+
+  /**
+   * @brief Parse a whole line into a command list: and-or lists separated
+   * by ';' or '&', each made of pipelines joined by '&&' or '||'. A line
+   * may end in ';' or '&'. The line is lexed once and the tree is carved
+   * out of one arena; it must be released with list_free.
+   *
+   * @param line The line to process
+   * @return struct cmd_list* The tree, with no items for a blank line, or
+   * NULL on a syntax error
+   */
+  struct cmd_list *list_parse(char const *line);
+
+  /**
+   * @brief list_parse for a (pointer, length) view of a line. Nothing is
+   * read past line + len.
+   *
+   * @param line Start of the line
+   * @param len Length of the line
+   * @return struct cmd_list* Same as list_parse
+   */
+  struct cmd_list *list_parse_n(char const *line, size_t len);
+
+  /**
+   * @brief Release a reference to a command list constructed with
+   * list_parse. The list is freed with its last reference.
+   *
+   * @param list The list to free
+   */
+  void list_free(struct cmd_list *list);
+
+  /**
+   * @brief Take another reference to a command list.
+   *
+   * @param list The list
+   * @return struct cmd_list* The same list
+   */
+  struct cmd_list *list_ref(struct cmd_list *list);
+
+  /**
+   * @brief Free a pipeline constructed with pipeline_parse
+   *
+   * @param pl The pipeline to free
+   */
+  void pipeline_free(struct pipeline *pl);
+
+  /**
+   * @brief Allocate zeroed, suitably aligned memory from an arena.
+   *
+   * @param a The arena
+   * @param size Number of bytes
+   * @return void* The memory or NULL if it could not be allocated
+   */
+  void *arena_alloc(struct arena *a, size_t size);
+
+  /**
+   * @brief Copy len bytes of s into the arena and NUL terminate them.
+   *
+   * @param a The arena
+   * @param s The bytes to copy
+   * @param len Number of bytes
+   * @return char* The copy or NULL if it could not be allocated
+   */
+  char *arena_strndup(struct arena *a, const char *s, size_t len);
+
+  /**
+   * @brief Release every chunk of an arena.
+   *
+   * @param a The arena
+   */
+  void arena_free(struct arena *a);
+
+  /**
+   * @brief Report whether name is handled by do_builtin without running it.
+   *
+   * @param name The command name
+   * @return True if name is a builtin command
+   */
+  bool is_builtin(const char *name);
+
+  /**
+   * @brief Every builtin do_builtin handles, for completion.
+   *
+   * @return const struct builtin* Array ending with a NULL name
+   */
+  const struct builtin *builtin_list(void);
+
+  /**
+   * @brief Find a builtin by name through the perfect hash table.
+   *
+   * @param name The command name
+   * @return const struct builtin* The builtin or NULL
+   */
+  const struct builtin *builtin_find(const char *name);
+
+  /**
+   * @brief Count the builtins that missed the slot their hash picks, so a
+   * test notices when BUILTIN_SEED no longer fits the registry.
+   *
+   * @return size_t 0 if the table is a perfect hash
+   */
+  size_t builtin_collisions(void);
+
+  /**
+   * @brief Trim the whitespace from the start and end of a string.
+   * For example "   ls -a   " becomes "ls -a". This function modifies
+   * the argument line so that all printable chars are moved to the
+   * front of the string
+   *
+   * @param line The line to trim
+   * @return The new line with no whitespace
+   */
+  char *trim_white(char *line);
+
+  /**
+   * @brief Locate the text of a line without its surrounding whitespace.
+   * Unlike trim_white the line is only read, so it may be a view into
+   * read-only memory.
+   *
+   * @param line Start of the line
+   * @param len In: length of the line. Out: length of the trimmed text
+   * @return const char* Start of the trimmed text
+   */
+  const char *trim_white_n(const char *line, size_t *len);
+
+
+  /**
+   * @brief Runs argv as a built in command such as exit, cd, jobs, etc.
+   * The return value is the builtin's success, so it cannot tell a failed
+   * builtin from a name that is not one; check is_builtin first. A failed
+   * builtin's exit status comes from sh_builtin_status.
+   *
+   * @param sh The shell
+   * @param argv The command to run
+   * @return True if argv named a builtin and it succeeded
+   */
+  bool do_builtin(struct shell *sh, char **argv);
+
+  /**
+   * @brief Exit status of a builtin that just ran. A builtin that fails
+   * with a status other than 1, such as test's 2 for a syntax error, stores
+   * it in sh->builtin_status before returning false; it is cleared here.
+   *
+   * @param sh The shell
+   * @param ok What the builtin returned
+   * @return int 0 on success, otherwise the requested status or 1
+   */
+  int sh_builtin_status(struct shell *sh, bool ok);
+
+  /**
+   * @brief Query sysconf and pathconf for the limits the shell cares about.
+   * Values that the system reports as indeterminate are replaced with the
+   * POSIX minimums.
+   *
+   * @param lim The limits block to fill in
+   */
+  void sh_limits_init(struct shell_limits *lim);
+
+  /**
+   * @brief Return the process wide copy of the limits. This is populated by
+   * sh_init, or on first use if sh_init has not been called yet, and is what
+   * code without access to a shell (such as cmd_parse) consults.
+   *
+   * @return const struct shell_limits* The cached limits
+   */
+  const struct shell_limits *sh_limits(void);
+
+  /**
+   * @brief Initialize an empty command location cache.
+   *
+   * @param pc The cache
+   */
+  void path_cache_init(struct path_cache *pc);
+
+  /**
+   * @brief Release every entry and the table itself.
+   *
+   * @param pc The cache
+   */
+  void path_cache_destroy(struct path_cache *pc);
+
+  /**
+   * @brief Forget every remembered location (hash -r).
+   *
+   * @param pc The cache
+   */
+  void path_cache_clear(struct path_cache *pc);
+
+  /**
+   * @brief Forget the remembered location of one command, such as one
+   * that turned out to be stale.
+   *
+   * @param pc The cache
+   * @param name The command name
+   */
+  void path_cache_forget(struct path_cache *pc, const char *name);
+
+  /**
+   * @brief Find the executable that would be run for name. Names containing
+   * a slash are returned unchanged. Otherwise the cache is consulted and on
+   * a miss each PATH directory is searched once and the result remembered.
+   * The returned string is owned by the cache and stays valid until the
+   * cache is cleared.
+   *
+   * @param pc The cache
+   * @param name The command name
+   * @return const char* The path to execute or NULL if it was not found
+   */
+  const char *path_cache_lookup(struct path_cache *pc, const char *name);
+
+  /**
+   * @brief Open the history log at path, and its index at path.idx,
+   * creating them if needed. A log without an index gets one built.
+   *
+   * @param h The store
+   * @param path Path of the log
+   * @return int 0 on success, -1 if the files could not be opened
+   */
+  int hist_open(struct history *h, const char *path);
+
+  /**
+   * @brief Open the history named by HISTFILE, by default ~/.lab_history.
+   *
+   * @param h The store
+   * @return int 0 on success, -1 otherwise
+   */
+  int hist_open_default(struct history *h);
+
+  /**
+   * @brief Close the store. Does nothing for a store that is not open.
+   *
+   * @param h The store
+   */
+  void hist_close(struct history *h);
+
+  /**
+   * @brief Append a command. The record and its index entry are each
+   * written with a single O_APPEND write, so shells sharing the files never
+   * overwrite one another.
+   *
+   * @param h The store
+   * @param line The command
+   * @return int 0 on success, -1 on error
+   */
+  int hist_add(struct history *h, const char *line);
+
+  /**
+   * @brief Number of entries, including those other shells appended.
+   *
+   * @param h The store
+   * @return size_t The count
+   */
+  size_t hist_count(struct history *h);
+
+  /**
+   * @brief Read entry n (counting from 1) without reading anything else.
+   *
+   * @param h The store
+   * @param n The entry number
+   * @return char* Newly allocated command, NULL if there is no such entry
+   */
+  char *hist_get(struct history *h, size_t n);
+
+  /**
+   * @brief Visit the entries first to last in order, reading the log in
+   * large blocks. Much faster than hist_get for long runs of entries.
+   *
+   * @param h The store
+   * @param first The first entry number
+   * @param last The last entry number, SIZE_MAX for all
+   * @param fn Called for each entry until it returns false
+   * @param ctx Passed to fn
+   * @return size_t The last entry number fn took, first - 1 if none
+   */
+  size_t hist_scan(struct history *h, size_t first, size_t last, hist_scan_fn fn, void *ctx);
+
+  /**
+   * @brief Visit the entries last down to first, newest first, reading the
+   * log in large blocks.
+   *
+   * @param h The store
+   * @param first The lowest entry number
+   * @param last The highest entry number, SIZE_MAX for the newest
+   * @param fn Called for each entry until it returns false
+   * @param ctx Passed to fn
+   * @return size_t The last entry number fn took, last + 1 if none
+   */
+  size_t hist_scan_back(struct history *h, size_t first, size_t last, hist_scan_fn fn,
+                        void *ctx);
+
+  /**
+   * @brief Empty the store for every shell using it.
+   *
+   * @param h The store
+   */
+  void hist_clear(struct history *h);
+
+  /**
+   * @brief Expand the history events !! (the last command), !n (entry n)
+   * and !-n (the nth last) that are not inside single quotes.
+   *
+   * @param h The store
+   * @param line The line as typed
+   * @return char* Newly allocated expanded line, NULL if an event does not
+   * exist (which is reported on stderr)
+   */
+  char *hist_expand(struct history *h, const char *line);
+
+  /**
+   * @brief Index one history entry under each of its trigrams. Entries
+   * must be added in increasing order.
+   *
+   * @param s The index
+   * @param id The entry number
+   * @param line The entry's text
+   * @param len Length of the text
+   */
+  void hist_search_add(struct hist_search *s, size_t id, const char *line, size_t len);
+
+  /**
+   * @brief Index whatever entries this or another shell added to the store
+   * since the last call, and start over if the store was cleared.
+   *
+   * @param s The index
+   * @param h The store
+   */
+  void hist_search_sync(struct hist_search *s, struct history *h);
+
+  /**
+   * @brief Like hist_search_sync, but index at most max entries, so that a
+   * large history can be indexed a slice at a time while the shell idles.
+   *
+   * @param s The index
+   * @param h The store
+   * @param max Most entries to index
+   * @return bool True if the index has caught up with the store
+   */
+  bool hist_search_sync_some(struct hist_search *s, struct history *h, size_t max);
+
+  /**
+   * @brief Find entries containing query, newest first. Only entries
+   * holding the query's trigrams are read to confirm the match. Queries
+   * shorter than three bytes, and entries the index has not reached yet,
+   * are checked newest first straight from the log.
+   *
+   * @param s The index
+   * @param h The store
+   * @param query The text to look for
+   * @param before Only entries numbered below this are returned
+   * @param out Receives the entry numbers
+   * @param max Room in out
+   * @return size_t The number of matches
+   */
+  size_t hist_search_find(struct hist_search *s, struct history *h, const char *query,
+                          size_t before, size_t *out, size_t max);
+
+  /**
+   * @brief Free the index.
+   *
+   * @param s The index
+   */
+  void hist_search_destroy(struct hist_search *s);
+
+  /**
+   * @brief Bind Ctrl-R to an incremental search over the shell's history
+   * store that uses the trigram index. The shell indexes the store a slice
+   * at a time while it waits for input; a search only adds one more slice.
+   *
+   * @param sh The shell
+   */
+  void hist_search_bind(struct shell *sh);
+
+  /**
+   * @brief Initialize the prompt state. No thread is started until a
+   * prompt asks for a version control segment.
+   *
+   * @param sh The shell
+   */
+  void prompt_init(struct shell *sh);
+
+  /**
+   * @brief Stop the helper thread and free the prompt state.
+   *
+   * @param sh The shell
+   */
+  void prompt_destroy(struct shell *sh);
+
+  /**
+   * @brief Expand the escapes of a prompt template: \\u user, \\h host up
+   * to the first dot, \\H full host, \\w working directory with ~ for
+   * home, \\W its last component, \\j number of live jobs, \\D duration of
+   * the last command, $? its exit status, \\$ # for root and $ otherwise,
+   * \\g the git branch (or short commit) of the working directory, \\n,
+   * \\e, \\\\ and \\[ \\] around invisible text. \\g never waits: it shows
+   * what was last found for the directory and has the helper thread look
+   * again.
+   *
+   * @param sh The shell
+   * @param fmt The template
+   * @return char* The prompt, to be freed by the caller
+   */
+  char *prompt_expand(struct shell *sh, const char *fmt);
+
+  /**
+   * @brief Render the prompt to show now, from MY_PROMPT or the default
+   * prompt.
+   *
+   * @param sh The shell
+   * @return const char* The prompt, owned by the shell
+   */
+  const char *prompt_render(struct shell *sh);
+
+  /**
+   * @brief Called when the helper thread has news: re-renders the prompt
+   * and, if it changed while readline is showing it, redraws the line.
+   *
+   * @param sh The shell
+   * @param showing True if readline is currently waiting for input
+   */
+  void prompt_update(struct shell *sh, bool showing);
+
+  /**
+   * @brief Initialize an empty, unbuilt command index.
+   *
+   * @param ci The index
+   */
+  void cmd_index_init(struct command_index *ci);
+
+  /**
+   * @brief Free the index and stop watching the PATH directories.
+   *
+   * @param ci The index
+   */
+  void cmd_index_destroy(struct command_index *ci);
+
+  /**
+   * @brief Read pending change notifications for the PATH directories.
+   * Never blocks.
+   *
+   * @param ci The index
+   * @return bool True if a directory changed, making the index stale
+   */
+  bool cmd_index_drain(struct command_index *ci);
+
+  /**
+   * @brief Make the index current: it is (re)built when it was never
+   * built, when a PATH directory changed or when PATH itself changed.
+   *
+   * @param ci The index
+   * @return bool True if the index was rebuilt
+   */
+  bool cmd_index_refresh(struct command_index *ci);
+
+  /**
+   * @brief Find the names starting with prefix. They are consecutive in
+   * the sorted index.
+   *
+   * @param ci A current index
+   * @param prefix The start of the name
+   * @param first Receives the position of the first match
+   * @return size_t Number of matches
+   */
+  size_t cmd_index_prefix(const struct command_index *ci, const char *prefix, size_t *first);
+
+  /**
+   * @brief The name at a position of the index.
+   *
+   * @param ci The index
+   * @param i Position, below ci->count
+   * @return const char* The name, owned by the index
+   */
+  const char *cmd_index_name(const struct command_index *ci, size_t i);
+
+  /**
+   * @brief Complete the word between start and end of line: a word
+   * starting with % completes job ids, a word in command position
+   * completes builtins and commands from PATH, anything else is left to
+   * filename completion.
+   *
+   * @param sh The shell
+   * @param line The whole input line
+   * @param start Offset of the word
+   * @param end Offset of the cursor
+   * @return char** Matches in readline's format (the first entry is their
+   * common prefix), or NULL for filename completion
+   */
+  char **sh_complete(struct shell *sh, const char *line, int start, int end);
+
+  /**
+   * @brief Install sh_complete as readline's completion function.
+   *
+   * @param sh The shell
+   */
+  void sh_complete_bind(struct shell *sh);
+
+  /**
+   * @brief Initialize an empty parse cache.
+   *
+   * @param pc The cache
+   * @param max Most lines to keep, 0 to parse every line afresh
+   */
+  void parse_cache_init(struct parse_cache *pc, size_t max);
+
+  /**
+   * @brief Release every entry and the table itself.
+   *
+   * @param pc The cache
+   */
+  void parse_cache_destroy(struct parse_cache *pc);
+
+  /**
+   * @brief Forget every remembered line. Lists handed out earlier stay
+   * valid until their references are released.
+   *
+   * @param pc The cache
+   */
+  void parse_cache_clear(struct parse_cache *pc);
+
+  /**
+   * @brief Parse a line through the cache. A hit returns the list built
+   * the first time without lexing or allocating; a miss parses the line
+   * and remembers it. Lines with syntax errors are never remembered.
+   *
+   * @param pc The cache
+   * @param line The trimmed line, not necessarily NUL terminated
+   * @param len Length of the line
+   * @return struct cmd_list* A read-only reference to release with
+   * list_free, or NULL on a syntax error
+   */
+  struct cmd_list *parse_cache_get(struct parse_cache *pc, const char *line, size_t len);
+
+  /**
+   * @brief Start an external command in its own process group with the
+   * job control signals restored to their defaults. The executable is
+   * resolved through the shell's path cache. The caller is responsible for
+   * waiting on the returned pid.
+   *
+   * @param sh The shell
+   * @param argv The command to run, argv[0] is the command name
+   * @param io Descriptors for stdin/stdout, NULL to inherit the shell's
+   * @param pgid Process group to join, 0 to start a new group led by the child
+   * @param foreground True to hand the terminal to the child's process group
+   * @return pid_t The child pid or -1 if it could not be started
+   */
+  pid_t sh_launch(struct shell *sh, char **argv, const struct launch_io *io,
+                  pid_t pgid, bool foreground);
+
+  /**
+   * @brief Run every stage of a pipeline concurrently in one process group.
+   * All pipes are created before the first child starts and data flows
+   * directly between the children. A single stage that is a builtin runs in
+   * the shell itself; builtins inside longer pipelines run in a forked child.
+   * The pipeline becomes a job; unless it is a background pipeline the shell
+   * waits until it finishes or stops.
+   *
+   * @param sh The shell
+   * @param pl The pipeline to run
+   * @return int The wait status of the last stage, 0 for a background job,
+   * -1 if it never ran
+   */
+  int sh_run_pipeline(struct shell *sh, struct pipeline *pl);
+
+  /**
+   * @brief Run a command list in one pass. Each and-or list runs its
+   * pipelines left to right, skipping a pipeline after && when the
+   * previous status was not 0 and after || when it was. The exit status
+   * ($?) of every pipeline that runs is stored in sh->last_status. A
+   * foreground pipeline killed by SIGINT abandons the rest of the list.
+   *
+   * @param sh The shell
+   * @param list The parsed list
+   * @return int The exit status of the last pipeline that ran
+   */
+  int sh_run_list(struct shell *sh, struct cmd_list *list);
+
+  /**
+   * @brief Convert a wait status into an exit status as $? shows it:
+   * the exit code, or 128 plus the signal that killed or stopped the
+   * process. -1 (nothing ran) becomes 1.
+   *
+   * @param status The wait status
+   * @return int The exit status
+   */
+  int sh_exit_code(int status);
+
+  /**
+   * @brief Parse a line into a command list and run it. A syntax error
+   * sets $? to 2.
+   *
+   * @param sh The shell
+   * @param line The line, already trimmed and not necessarily NUL terminated
+   * @param len Length of the line
+   * @return bool False if the line could not be parsed
+   */
+  bool sh_run_line(struct shell *sh, const char *line, size_t len);
+
+  /**
+   * @brief Start reading lines from a descriptor in large blocks.
+   *
+   * @param r The reader
+   * @param fd The descriptor, which stays owned by the caller
+   * @param shared True if the commands being run inherit fd (stdin). For
+   * seekable input the unread bytes are then handed back before every
+   * command, see reader_sync
+   */
+  void reader_init_fd(struct line_reader *r, int fd, bool shared);
+
+  /**
+   * @brief Start reading lines from a copy of a string.
+   *
+   * @param r The reader
+   * @param s The text
+   */
+  void reader_init_string(struct line_reader *r, const char *s);
+
+  /**
+   * @brief Start reading lines straight out of a read-only mapping of a
+   * regular file. The script must not be truncated while it runs.
+   *
+   * @param r The reader
+   * @param fd The open file, which can be closed afterwards
+   * @return bool False if fd is not a non-empty regular file or could not
+   * be mapped
+   */
+  bool reader_init_map(struct line_reader *r, int fd);
+
+  /**
+   * @brief Return the next line without its newline. The line is a view
+   * into the mapping, valid until reader_destroy, or into the buffer,
+   * valid until the next call and NUL terminated.
+   *
+   * @param r The reader
+   * @param len Receives the length of the line
+   * @return const char* The line, NULL at the end of the input
+   */
+  const char *reader_next_line(struct line_reader *r, size_t *len);
+
+  /**
+   * @brief Line number of the line reader_next_line returned last.
+   *
+   * @param r The reader
+   * @return unsigned long The line number, counting from 1
+   */
+  unsigned long reader_line(struct line_reader *r);
+
+  /**
+   * @brief Report an error found while parsing on stderr. While a script
+   * runs the message starts with its name and the current line number.
+   *
+   * @param fmt printf style format, without the newline
+   */
+  void sh_parse_error(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+  /**
+   * @brief Rewind a shared seekable descriptor to the end of the last line
+   * returned, so a command reading it sees the rest of the input. The next
+   * reader_next_line picks up after whatever the command consumed.
+   *
+   * @param r The reader
+   */
+  void reader_sync(struct line_reader *r);
+
+  /**
+   * @brief Free the reader's buffer.
+   *
+   * @param r The reader
+   */
+  void reader_destroy(struct line_reader *r);
+
+  /**
+   * @brief Run every line a reader returns, stopping at the first syntax
+   * error.
+   *
+   * @param sh The shell
+   * @param r The reader
+   * @param name Script name for error messages, or NULL
+   * @return int The last exit status
+   */
+  int sh_run_script(struct shell *sh, struct line_reader *r, const char *name);
+
+  /**
+   * @brief Run the -c string, the script file or stdin, whichever the
+   * command line asked for, without readline or history.
+   *
+   * @param sh The shell
+   * @return int The exit status for the shell, 127 if the script could
+   * not be opened
+   */
+  int sh_run_batch(struct shell *sh);
+
+  /**
+   * @brief Prepare a forked child the same way sh_launch prepares an
+   * external command: join the process group, take the terminal if in the
+   * foreground, restore default job control signals and install io.
+   * Returns -1 if a redirection could not be applied.
+   *
+   * @param sh The shell
+   * @param io Descriptors for stdin/stdout, NULL to inherit the shell's
+   * @param pgid Process group to join, 0 to start a new group
+   * @param foreground True to hand the terminal to the child's process group
+   */
+  int sh_child_setup(struct shell *sh, const struct launch_io *io, pid_t pgid,
+                     bool foreground);
+
+  /**
+   * @brief Run a builtin in a forked child prepared like an external
+   * command, so it can be one stage of a pipeline or a parallel job.
+   *
+   * @param sh The shell
+   * @param argv The builtin and its arguments
+   * @param io Descriptors for stdin/stdout, NULL to inherit the shell's
+   * @param pgid Process group to join, 0 to start a new group
+   * @param foreground True to hand the terminal to the child's process group
+   * @param pipes Pipes the child must close before running the builtin
+   * @param npipes Number of pipes
+   * @return pid_t The child pid or -1 if fork failed
+   */
+  pid_t sh_fork_builtin(struct shell *sh, char **argv, const struct launch_io *io,
+                        pid_t pgid, bool foreground, int (*pipes)[2], size_t npipes);
+
+  /**
+   * @brief Apply redirections to the calling process. Files are opened
+   * close-on-exec and moved into place with dup3, so the temporary
+   * descriptor disappears on exec without an extra close. Errors are
+   * reported on stderr.
+   *
+   * @param redirs The redirections in order
+   * @param n Number of redirections
+   * @param will_exec True if an exec follows, false to close temporaries now
+   * @return int 0 on success, -1 if a redirection failed
+   */
+  int sh_apply_redirects(const struct redirect *redirs, size_t n, bool will_exec);
+
+  /**
+   * @brief The parallel builtin: 'parallel [-j N] [-k] [-s] cmd ... ::: arg ...'
+   * runs cmd once per arg (substituted for every {} or appended) with at
+   * most N jobs in flight, N defaulting to the number of CPUs. Every job's
+   * stdout is buffered in memory and written out whole when it finishes, in
+   * completion order or with -k in argument order. Failed jobs are counted
+   * on stderr; -s prints the exit status of every job.
+   *
+   * @param sh The shell
+   * @param argv The builtin's arguments
+   * @return bool True if every job exited with 0
+   */
+  bool sh_parallel(struct shell *sh, char **argv);
+
+  /**
+   * @brief The echo builtin: prints its arguments separated by spaces and
+   * ended by a newline. -n leaves out the newline, -e expands backslash
+   * escapes (\n, \t, \0nnn, \xHH, \c to stop output, ...) and -E turns
+   * them back off.
+   *
+   * @param sh The shell
+   * @param argv The builtin's arguments
+   * @return bool Always true
+   */
+  bool builtin_echo(struct shell *sh, char **argv);
+
+  /**
+   * @brief The printf builtin: 'printf format [arg ...]' formats like
+   * printf(3) with %s %b %c %d %i %u %o %x %X %f %e %g %a and %%, flags,
+   * width and precision (* takes them from an argument). The format is
+   * reused while arguments remain.
+   *
+   * @param sh The shell
+   * @param argv The builtin's arguments
+   * @return bool False on a usage error, invalid number or bad directive
+   */
+  bool builtin_printf(struct shell *sh, char **argv);
+
+  /**
+   * @brief The test and [ builtins: evaluate a conditional expression of
+   * file tests (-e -f -d -r -w -x -s -L ...), string tests (-n -z = !=),
+   * integer comparisons (-eq -lt ...), -nt/-ot/-ef, !, -a, -o and
+   * parentheses. [ requires ] as its last argument.
+   *
+   * @param sh The shell
+   * @param argv The builtin's arguments
+   * @return bool The value of the expression, false with sh->builtin_status
+   * set to 2 on a syntax error
+   */
+  bool builtin_test(struct shell *sh, char **argv);
+
+  /**
+   * @brief The true builtin.
+   *
+   * @param sh The shell
+   * @param argv The builtin's arguments
+   * @return bool Always true
+   */
+  bool builtin_true(struct shell *sh, char **argv);
+
+  /**
+   * @brief The false builtin.
+   *
+   * @param sh The shell
+   * @param argv The builtin's arguments
+   * @return bool Always false
+   */
+  bool builtin_false(struct shell *sh, char **argv);
+
+  /**
+   * @brief The pwd builtin: prints the working directory.
+   *
+   * @param sh The shell
+   * @param argv The builtin's arguments
+   * @return bool False if the directory cannot be found
+   */
+  bool builtin_pwd(struct shell *sh, char **argv);
+
+  /**
+   * @brief Initialize an empty variable table. It is filled from environ
+   * the first time it is used.
+   *
+   * @param vt The table
+   */
+  void vars_init(struct var_table *vt);
+
+  /**
+   * @brief Free every variable and point environ back where it was before
+   * the table took it over.
+   *
+   * @param vt The table
+   */
+  void vars_destroy(struct var_table *vt);
+
+  /**
+   * @brief Length of the variable name at the start of s: a letter or _
+   * followed by letters, digits and _.
+   *
+   * @param s The text
+   * @return size_t Length of the name, 0 if s does not start with one
+   */
+  size_t var_name_len(const char *s);
+
+  /**
+   * @brief Look a variable up.
+   *
+   * @param vt The table
+   * @param name Name of the variable
+   * @param len Length of the name
+   * @return const char* Its value, NULL if it is not set
+   */
+  const char *var_get(struct var_table *vt, const char *name, size_t len);
+
+  /**
+   * @brief Set a variable and add flags to it. An exported variable's
+   * environment entry is replaced in place.
+   *
+   * @param vt The table
+   * @param name Name of the variable, need not be NUL terminated
+   * @param len Length of the name
+   * @param value New value, NULL to keep the current one
+   * @param flags VAR_* flags to add
+   * @return int 0 on success, -1 if the variable is readonly or memory ran out
+   */
+  int var_set(struct var_table *vt, const char *name, size_t len, const char *value, unsigned flags);
+
+  /**
+   * @brief Remove a variable.
+   *
+   * @param vt The table
+   * @param name Name of the variable
+   * @return int 0 on success or if it was not set, -1 if it is readonly
+   */
+  int var_unset(struct var_table *vt, const char *name);
+
+  /**
+   * @brief The environment for commands: every exported variable as
+   * "NAME=value", NULL terminated. The array belongs to the table and stays
+   * valid until an exported variable changes.
+   *
+   * @param vt The table
+   * @return char** The environment
+   */
+  char **vars_environ(struct var_table *vt);
+
+  /**
+   * @brief An environment for one command: the exported variables with
+   * the NAME=value words of assigns added or replacing them.
+   *
+   * @param vt The table
+   * @param assigns NAME=value words
+   * @param n Number of words
+   * @return char** Array to free (but not its strings), NULL if out of memory
+   */
+  char **vars_env_with(struct var_table *vt, char *const *assigns, size_t n);
+
+  /**
+   * @brief Carry out an assignment word NAME=value in the shell, reporting
+   * a readonly variable on stderr. Setting PATH empties the command location
+   * cache and marks the completion index stale.
+   *
+   * @param sh The shell
+   * @param word The assignment word
+   * @param flags VAR_* flags to add
+   * @return int 0 on success, -1 on failure
+   */
+  int sh_assign(struct shell *sh, const char *word, unsigned flags);
+
+  /**
+   * @brief Remove a variable from the shell, reporting a readonly one on
+   * stderr. Unsetting PATH empties the command location cache.
+   *
+   * @param sh The shell
+   * @param name Name of the variable
+   * @return int 0 on success, -1 if it is readonly
+   */
+  int sh_unset(struct shell *sh, const char *name);
+
+  /**
+   * @brief The export builtin: 'export [-p] [NAME[=value] ...]' marks
+   * variables for the environment of commands; without names it lists the
+   * exported variables.
+   *
+   * @param sh The shell
+   * @param argv The builtin's arguments
+   * @return bool False if a name was invalid or readonly
+   */
+  bool builtin_export(struct shell *sh, char **argv);
+
+  /**
+   * @brief The readonly builtin: 'readonly [-p] [NAME[=value] ...]' makes
+   * variables readonly; without names it lists them.
+   *
+   * @param sh The shell
+   * @param argv The builtin's arguments
+   * @return bool False if a name was invalid or already readonly
+   */
+  bool builtin_readonly(struct shell *sh, char **argv);
+
+  /**
+   * @brief The unset builtin: 'unset [-v] NAME ...' removes variables.
+   *
+   * @param sh The shell
+   * @param argv The builtin's arguments
+   * @return bool False if a variable was readonly
+   */
+  bool builtin_unset(struct shell *sh, char **argv);
+
+  /**
+   * @brief The set builtin. Without arguments it lists every variable; the
+   * shell has no options to set.
+   *
+   * @param sh The shell
+   * @param argv The builtin's arguments
+   * @return bool False if given an argument
+   */
+  bool builtin_set(struct shell *sh, char **argv);
+
+  /**
+   * @brief Expand the words of a command that still hold EXP_* bytes into
+   * a copy of it allocated from a: tilde prefixes, parameters (with the
+   * ${NAME:-word} family and ${#NAME}), $(...) and $((...)) are
+   * substituted, unquoted results of arguments are split into fields on
+   * IFS, and argument words left empty by unquoted expansions are dropped.
+   * All the words are built in one buffer that is copied into a at the end.
+   *
+   * @param sh The shell
+   * @param cmd The command as parsed
+   * @param out Receives the expanded command
+   * @param a Arena for the copy
+   * @return int 0 on success, -1 if an expansion failed (reported) or
+   * memory ran out
+   */
+  int sh_expand_command(struct shell *sh, const struct command *cmd, struct command *out,
+                        struct arena *a);
+
+  /**
+   * @brief Close the memory file that $(...) of a builtin such as echo or
+   * printf writes into when it runs inside the shell. capture_pid is the
+   * process that opened capture_fd, 0 if there is none.
+   *
+   * @param sh The shell
+   */
+  void sh_capture_close(struct shell *sh);
+
+  /**
+   * @brief Run an external command in the foreground and wait for it to
+   * finish, then take the terminal back.
+   *
+   * @param sh The shell
+   * @param cmd The command to run
+   * @return int The wait status of the child or -1 if it was not started
+   */
+  int execute_command(struct shell *sh, char **cmd);
+
+  /**
+   * @brief Copy everything from in_fd to out_fd until end of file, letting
+   * the kernel move the data (copy_file_range, splice or sendfile) whenever
+   * the descriptor types allow it and falling back to read/write otherwise.
+   *
+   * @param in_fd The descriptor to read from
+   * @param out_fd The descriptor to write to
+   * @return ssize_t The number of bytes copied or -1 on error
+   */
+  ssize_t sh_copy_fd(int in_fd, int out_fd);
+
+  /**
+   * @brief Copy everything from in_fd to both out_fd and file_fd. When both
+   * in_fd and out_fd are pipes the data is duplicated with tee(2) and
+   * spliced to file_fd without passing through the shell.
+   *
+   * @param in_fd The descriptor to read from
+   * @param out_fd The first descriptor to write to
+   * @param file_fd The second descriptor to write to
+   * @return ssize_t The number of bytes copied or -1 on error
+   */
+  ssize_t sh_tee_fd(int in_fd, int out_fd, int file_fd);
+
+  /**
+   * @brief Free the job table.
+   *
+   * @param sh The shell
+   */
+  void jobs_destroy(struct shell *sh);
+
+  /**
+   * @brief Add a job for a pipeline that was just launched.
+   *
+   * @param jt The job table
+   * @param pgid The job's process group
+   * @param pids The pid of each stage, -1 for stages that did not start
+   * @param n Number of stages
+   * @param text The command text
+   * @return struct job* The new job or NULL on allocation failure
+   */
+  struct job *job_add(struct job_table *jt, pid_t pgid, const pid_t *pids, size_t n,
+                      const char *text);
+
+  /**
+   * @brief Remove a job from the table and free it.
+   *
+   * @param jt The job table
+   * @param j The job
+   */
+  void job_remove(struct job_table *jt, struct job *j);
+
+  /**
+   * @brief Find a job by spec: %n or n for job n, %%, %+ or NULL for the
+   * current job.
+   *
+   * @param jt The job table
+   * @param spec The job spec
+   * @return struct job* The job or NULL if there is no such job
+   */
+  struct job *job_find(struct job_table *jt, const char *spec);
+
+  /**
+   * @brief Find the job member with the given pid.
+   *
+   * @param jt The job table
+   * @param pid The process id
+   * @return struct job_proc* The member or NULL
+   */
+  struct job_proc *job_find_proc(struct job_table *jt, pid_t pid);
+
+  /**
+   * @brief Record a wait status for pid in the job that owns it.
+   *
+   * @param sh The shell
+   * @param pid The child that changed state
+   * @param status Its wait status
+   */
+  void job_record(struct shell *sh, pid_t pid, int status);
+
+  /**
+   * @brief Collect every child that changed state without blocking and
+   * record the result in the job table.
+   *
+   * @param sh The shell
+   */
+  void jobs_reap(struct shell *sh);
+
+  /**
+   * @brief Block until a job finishes or stops. A foreground job gives the
+   * terminal back to the shell afterwards.
+   *
+   * @param sh The shell
+   * @param j The job
+   * @param foreground True if the job owns the terminal
+   * @return int The wait status of the job's last stage
+   */
+  int job_wait(struct shell *sh, struct job *j, bool foreground);
+
+  /**
+   * @brief Continue a job (sending SIGCONT if it is stopped) in the
+   * foreground, waiting for it, or in the background.
+   *
+   * @param sh The shell
+   * @param j The job
+   * @param foreground True for fg, false for bg
+   * @return int The wait status in the foreground, 0 in the background
+   */
+  int job_continue(struct shell *sh, struct job *j, bool foreground);
+
+  /**
+   * @brief Print a job the way the jobs builtin does.
+   *
+   * @param sh The shell
+   * @param j The job
+   * @param with_pids Include the process group id
+   */
+  void job_print(struct shell *sh, const struct job *j, bool with_pids);
+
+  /**
+   * @brief Report finished jobs (in an interactive shell) and drop them
+   * from the table. Called before each prompt.
+   *
+   * @param sh The shell
+   */
+  void jobs_notify(struct shell *sh);
+
+  /**
+   * @brief Create the event loop: an epoll instance, a signalfd that takes
+   * over SIGCHLD and SIGWINCH (both are blocked from now on, children get
+   * an empty mask) and support for per child pidfds if the kernel has them.
+   *
+   * @param sh The shell
+   * @return int 0 on success, -1 if the loop could not be created
+   */
+  int sh_loop_init(struct shell *sh);
+
+  /**
+   * @brief Tear down the event loop and unblock its signals.
+   *
+   * @param sh The shell
+   */
+  void sh_loop_destroy(struct shell *sh);
+
+  /**
+   * @brief Forget the loop in a forked child without touching the epoll
+   * instance it still shares with the parent.
+   *
+   * @param sh The child's copy of the shell
+   */
+  void sh_loop_detach(struct shell *sh);
+
+  /**
+   * @brief Wait for events and dispatch them: input goes to on_input,
+   * SIGCHLD collects stops and continues, SIGWINCH resizes readline and a
+   * readable pidfd reaps that child.
+   *
+   * @param sh The shell
+   * @param read_input True to also wait for input
+   * @param timeout_ms Milliseconds to wait, -1 forever, 0 to poll
+   * @return int Number of events handled, -1 if the loop is not running
+   */
+  int sh_loop_once(struct shell *sh, bool read_input, int timeout_ms);
+
+  /**
+   * @brief Convert the result of waitid into a waitpid style status.
+   *
+   * @param si What waitid filled in
+   * @return int The equivalent wait status
+   */
+  int sh_wait_status(const siginfo_t *si);
+
+  /**
+   * @brief Watch the exit of every member of a job through a pidfd.
+   *
+   * @param sh The shell
+   * @param j The job
+   */
+  void sh_loop_watch_job(struct shell *sh, struct job *j);
+
+  /**
+   * @brief Stop watching a descriptor and close it. Does nothing for -1.
+   *
+   * @param fd The descriptor
+   */
+  void sh_loop_unwatch_fd(int fd);
+
+  /**
+   * @brief Watch the command index's inotify descriptor, so changes to
+   * the PATH directories mark it stale as they happen.
+   *
+   * @param sh The shell
+   */
+  void sh_loop_watch_commands(struct shell *sh);
+
+  /**
+   * @brief Watch the eventfd the prompt's helper thread signals.
+   *
+   * @param sh The shell
+   */
+  void sh_loop_watch_prompt(struct shell *sh);
 
   /**
    * @brief Initialize the shell for use. Allocate all data structures
@@ -113,7 +2009,11 @@ extern "C"
   void sh_destroy(struct shell *sh);
 
   /**
-   * @brief Parse command line args from the user when the shell was launched
+   * @brief Parse command line args from the user when the shell was launched.
+   * Supported options are -v to print the version, -l spawn|fork to pick
+   * the launch backend used by the next call to sh_init and -c string to
+   * run a string instead of reading commands. The first argument that is
+   * not an option names a script to run.
    *
    * @param argc Number of args
    * @param argv The arg array
@@ -0,0 +1,301 @@
+/**
+ * launch.c
+ * Process creation for external commands. The default backend uses
+ * posix_spawn so the shell's address space is never duplicated; the fork
+ * backend is kept as a fallback and for benchmarking.
+ *
+ * @author Vladyslav (Vlad) Maliutin
+ */
+
+#define _GNU_SOURCE
+#include "lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+/* Signals the shell ignores that every child must get back */
+static const int job_signals[] = { SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU };
+
+/**
+ * @brief Starts a child with posix_spawn.
+ *
+ * @param sh Shell instance.
+ * @param exe Resolved executable path.
+ * @param argv Command arguments.
+ * @param io Descriptors to install as stdin/stdout, may be NULL.
+ * @param pgid Process group to join, 0 for a new group.
+ * @param foreground Whether the child gets the terminal.
+ * @param env Environment of the child.
+ * @param pid Receives the child pid.
+ * @return 0 on success or an errno value.
+ */
+static int launch_spawn(struct shell *sh, const char *exe, char **argv,
+                        const struct launch_io *io, pid_t pgid, bool foreground,
+                        char **env, pid_t *pid) {
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    sigset_t defaults, mask;
+
+    sigemptyset(&defaults);
+    for (size_t i = 0; i < sizeof(job_signals) / sizeof(job_signals[0]); i++)
+        sigaddset(&defaults, job_signals[i]);
+    sigemptyset(&mask);
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF |
+                                        POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, &mask);
+
+    posix_spawn_file_actions_init(&actions);
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+    if (foreground && sh->shell_is_interactive)
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, sh->shell_terminal);
+#endif
+    /* Pipe ends are close-on-exec so only the dups survive into the child */
+    if (io && io->in_fd >= 0 && io->in_fd != STDIN_FILENO)
+        posix_spawn_file_actions_adddup2(&actions, io->in_fd, STDIN_FILENO);
+    if (io && io->out_fd >= 0 && io->out_fd != STDOUT_FILENO)
+        posix_spawn_file_actions_adddup2(&actions, io->out_fd, STDOUT_FILENO);
+    for (size_t i = 0; io && i < io->nredirs; i++) {
+        const struct redirect *r = &io->redirs[i];
+        if (r->kind == REDIR_OPEN)
+            posix_spawn_file_actions_addopen(&actions, r->fd, r->path, r->flags, 0666);
+        else if (r->kind == REDIR_DUP)
+            posix_spawn_file_actions_adddup2(&actions, r->src_fd, r->fd);
+        else
+            posix_spawn_file_actions_addclose(&actions, r->fd);
+    }
+
+    int rc = posix_spawn(pid, exe, &actions, &attr, argv, env);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    return rc;
+}
+
+/**
+ * @brief Applies redirections in order to the current process.
+ *
+ * @param redirs Redirections to apply.
+ * @param n Number of redirections.
+ * @param will_exec True if the caller is about to exec.
+ * @return 0 on success, -1 on failure.
+ */
+int sh_apply_redirects(const struct redirect *redirs, size_t n, bool will_exec) {
+    for (size_t i = 0; i < n; i++) {
+        const struct redirect *r = &redirs[i];
+        if (r->kind == REDIR_CLOSE) {
+            close(r->fd);
+            continue;
+        }
+
+        int fd = r->src_fd;
+        if (r->kind == REDIR_OPEN) {
+            fd = open(r->path, r->flags | O_CLOEXEC, 0666);
+            if (fd < 0) {
+                fprintf(stderr, "%s: %s\n", r->path, strerror(errno));
+                return -1;
+            }
+        }
+        if (fd == r->fd) {
+            /* Landed on the target already, it must survive exec */
+            if (r->kind == REDIR_OPEN) fcntl(fd, F_SETFD, 0);
+            continue;
+        }
+        if (dup3(fd, r->fd, 0) < 0) {
+            fprintf(stderr, "%d: %s\n", r->src_fd, strerror(errno));
+            if (r->kind == REDIR_OPEN) close(fd);
+            return -1;
+        }
+        /* With an exec coming, close-on-exec disposes of the temporary */
+        if (r->kind == REDIR_OPEN && !will_exec) close(fd);
+    }
+    return 0;
+}
+
+/**
+ * @brief Puts a freshly forked child into its process group, gives it the
+ * terminal if requested, restores default signal handling and installs the
+ * requested descriptors.
+ *
+ * @param sh Shell instance.
+ * @param io Descriptors to install as stdin/stdout, may be NULL.
+ * @param pgid Process group to join, 0 for a new group.
+ * @param foreground Whether the child gets the terminal.
+ * @return 0 on success, -1 if a redirection failed.
+ */
+int sh_child_setup(struct shell *sh, const struct launch_io *io, pid_t pgid,
+                   bool foreground) {
+    setpgid(0, pgid);
+    if (foreground && sh->shell_is_interactive)
+        tcsetpgrp(sh->shell_terminal, getpgrp());
+    for (size_t i = 0; i < sizeof(job_signals) / sizeof(job_signals[0]); i++)
+        signal(job_signals[i], SIG_DFL);
+    /* The shell blocks the signals its event loop reads from a signalfd */
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    if (io && io->in_fd >= 0 && io->in_fd != STDIN_FILENO)
+        dup2(io->in_fd, STDIN_FILENO);
+    if (io && io->out_fd >= 0 && io->out_fd != STDOUT_FILENO)
+        dup2(io->out_fd, STDOUT_FILENO);
+    return io ? sh_apply_redirects(io->redirs, io->nredirs, true) : 0;
+}
+
+/**
+ * @brief Starts a child with fork and execve. Like posix_spawn, a failed
+ * execve is reported back through a close-on-exec pipe, so it is returned
+ * here and not only seen as the child's exit status.
+ *
+ * @param sh Shell instance.
+ * @param exe Resolved executable path.
+ * @param argv Command arguments.
+ * @param io Descriptors to install as stdin/stdout, may be NULL.
+ * @param pgid Process group to join, 0 for a new group.
+ * @param foreground Whether the child gets the terminal.
+ * @param env Environment of the child.
+ * @param pid Receives the child pid.
+ * @return 0 on success or an errno value.
+ */
+static int launch_fork(struct shell *sh, const char *exe, char **argv,
+                       const struct launch_io *io, pid_t pgid, bool foreground,
+                       char **env, pid_t *pid) {
+    int report[2];
+    if (pipe2(report, O_CLOEXEC) != 0) return errno;
+    pid_t child = fork();
+    if (child < 0) {
+        int err = errno;
+        close(report[0]);
+        close(report[1]);
+        return err;
+    }
+    if (child == 0) {
+        /*This is the child process*/
+        close(report[0]);
+        if (sh_child_setup(sh, io, pgid, foreground) != 0)
+            _exit(1);
+        execve(exe, argv, env);
+        int err = errno;
+        /* A redirection may have put something else on the pipe's number */
+        bool reachable = true;
+        for (size_t i = 0; io && i < io->nredirs; i++)
+            if (io->redirs[i].fd == report[1]) reachable = false;
+        if (!reachable || write(report[1], &err, sizeof(err)) != sizeof(err))
+            perror(argv[0]);
+        _exit(127);
+    }
+    close(report[1]);
+    int err = 0;
+    ssize_t got;
+    while ((got = read(report[0], &err, sizeof(err))) < 0 && errno == EINTR)
+        ;
+    close(report[0]);
+    if (got == sizeof(err)) {
+        while (waitpid(child, NULL, 0) < 0 && errno == EINTR)
+            ;
+        return err;
+    }
+    *pid = child;
+    return 0;
+}
+
+/**
+ * @brief Starts a child with the configured backend, falling back to fork
+ * where posix_spawn cannot do the job.
+ *
+ * @param sh Shell instance.
+ * @param exe Resolved executable path.
+ * @param argv Command arguments.
+ * @param io Descriptors to install as stdin/stdout, may be NULL.
+ * @param pgid Process group to join, 0 for a new group.
+ * @param foreground Whether the child gets the terminal.
+ * @param env Environment of the child.
+ * @param pid Receives the child pid.
+ * @return 0 on success or an errno value.
+ */
+static int launch_child(struct shell *sh, const char *exe, char **argv,
+                        const struct launch_io *io, pid_t pgid, bool foreground,
+                        char **env, pid_t *pid) {
+    if (sh->launch != LAUNCH_SPAWN)
+        return launch_fork(sh, exe, argv, io, pgid, foreground, env, pid);
+    int rc = launch_spawn(sh, exe, argv, io, pgid, foreground, env, pid);
+    if (rc != 0 && io && io->nredirs) {
+        /*
+        posix_spawn cannot say whether the program or a redirection
+        failed; the fork path reports the exact cause from the child
+        */
+        rc = launch_fork(sh, exe, argv, io, pgid, foreground, env, pid);
+    } else if (rc != 0 && rc != ENOENT && rc != EACCES && rc != ENOEXEC) {
+        /* spawn itself is unusable here, fall back to fork */
+        rc = launch_fork(sh, exe, argv, io, pgid, foreground, env, pid);
+    }
+    return rc;
+}
+
+/**
+ * @brief Launches an external command with the configured backend.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @param io Descriptors to install as stdin/stdout, may be NULL.
+ * @param pgid Process group to join, 0 for a new group.
+ * @param foreground Whether the child gets the terminal.
+ * @return Child pid or -1 on failure.
+ */
+pid_t sh_launch(struct shell *sh, char **argv, const struct launch_io *io,
+                pid_t pgid, bool foreground) {
+    if (!argv || !argv[0]) return -1;
+
+    const char *exe = path_cache_lookup(&sh->paths, argv[0]);
+    if (!exe) {
+        fprintf(stderr, "%s: command not found\n", argv[0]);
+        return -1;
+    }
+
+    /*
+    environ is the variable table's own array, kept current as exported
+    variables change; only assignments in front of the command need a copy
+    */
+    char **env = environ;
+    if (io && io->nassigns) {
+        env = vars_env_with(&sh->vars, io->assigns, io->nassigns);
+        if (!env) {
+            perror(argv[0]);
+            return -1;
+        }
+    }
+
+    pid_t pid = -1;
+    int rc = launch_child(sh, exe, argv, io, pgid, foreground, env, &pid);
+    if (rc == ENOENT && exe != argv[0]) {
+        /* The cached location went stale, search PATH again for this one */
+        path_cache_forget(&sh->paths, argv[0]);
+        exe = path_cache_lookup(&sh->paths, argv[0]);
+        rc = exe ? launch_child(sh, exe, argv, io, pgid, foreground, env, &pid) : ENOENT;
+    }
+    if (env != environ) free(env);
+
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(rc));
+        return -1;
+    }
+
+    /*
+    Repeat the child's setup from the parent so it does not matter which
+    of the two runs first
+    */
+    setpgid(pid, pgid ? pgid : pid);
+    if (foreground && sh->shell_is_interactive)
+        tcsetpgrp(sh->shell_terminal, pgid ? pgid : pid);
+    return pid;
+}
@@ -0,0 +1,363 @@
+/**
+ * lex.c
+ * Single pass tokenizer shared by cmd_parse and pipeline_parse. Quotes and
+ * escapes are resolved while scanning and word text is written straight
+ * into the caller's buffer, so no byte of the line is looked at twice.
+ * The line is a (pointer, length) view, so it can be a slice of a mapped
+ * script that is not NUL terminated. Parameter references, command and
+ * arithmetic substitutions and tilde prefixes are copied as written behind
+ * an EXP_* mark and expanded only when the command runs.
+ *
+ * @author Vladyslav (Vlad) Maliutin
+ */
+
+#include "lab.h"
+#include <string.h>
+#include <ctype.h>
+
+/* Quoting state while scanning a word */
+enum lex_state
+{
+    ST_PLAIN,
+    ST_SINGLE,
+    ST_DOUBLE
+};
+
+/* Characters that interrupt a run of ordinary word characters */
+#define WORD_STOP " \t\n'\"\\"
+/* $ and the bytes that would be mistaken for expansion marks */
+#define MARK_STOP "$\001\002\003"
+#define OP_STOP WORD_STOP "|&;<>" MARK_STOP
+
+/* The stop characters of each quoting state, prepared for the scanner */
+static struct scan_set word_stop, op_stop, single_stop, double_stop;
+static bool stops_ready;
+
+/**
+ * @brief Starts lexing a line.
+ *
+ * @param lx Lexer to set up.
+ * @param line Line to split.
+ * @param len Length of the line.
+ * @param buf Output buffer of at least len + 1 bytes.
+ * @param words_only True to split on blanks alone.
+ */
+void lexer_init(struct lexer *lx, const char *line, size_t len, char *buf, bool words_only) {
+    if (!stops_ready) {
+        sh_scan_set_init(&word_stop, WORD_STOP);
+        sh_scan_set_init(&op_stop, OP_STOP);
+        sh_scan_set_init(&single_stop, "'\001\002\003");
+        sh_scan_set_init(&double_stop, "\"\\" MARK_STOP);
+        stops_ready = true;
+    }
+    lx->pos = line;
+    lx->end = line + len;
+    lx->out = buf;
+    lx->words_only = words_only;
+}
+
+/**
+ * @brief Character at p, or NUL past the end of the line.
+ *
+ * @param lx Lexer.
+ * @param p Position in the line.
+ * @return The character.
+ */
+static inline char at(const struct lexer *lx, const char *p) {
+    return p < lx->end ? *p : '\0';
+}
+
+/**
+ * @brief Finds the character that closes a $( or ${, stepping over quotes,
+ * escapes and nested references on the way.
+ *
+ * @param p First character inside the opening bracket.
+ * @param end End of the line.
+ * @param close ')' or '}'.
+ * @return Position of the closing character, NULL if there is none.
+ */
+static const char *match_close(const char *p, const char *end, char close) {
+    size_t depth = 0;
+    for (; p < end && *p; p++) {
+        char c = *p;
+        if (c == close && depth == 0) return p;
+        if (c == '\\') {
+            if (p + 1 < end) p++;
+        } else if (c == '\'') {
+            p = memchr(p + 1, '\'', end - (p + 1));
+            if (!p) return NULL;
+        } else if (c == '"') {
+            for (p++; p < end && *p && *p != '"'; p++) {
+                size_t ref = *p == '$' ? lex_reference_len(p, end) : 0;
+                if (ref == SIZE_MAX) return NULL;
+                if (ref) p += ref - 1;
+                else if (*p == '\\' && p + 1 < end) p++;
+            }
+            if (p == end || !*p) return NULL;
+        } else if (c == '$') {
+            size_t ref = lex_reference_len(p, end);
+            if (ref == SIZE_MAX) return NULL;
+            if (ref) p += ref - 1;
+        } else if (close == ')' && c == '(') {
+            depth++;
+        } else if (close == ')' && c == ')') {
+            depth--;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Length of the reference at p, see lab.h.
+ *
+ * @param p Position of the $.
+ * @param end End of the line.
+ * @return Length including the $, 0 for none, SIZE_MAX if unterminated.
+ */
+size_t lex_reference_len(const char *p, const char *end) {
+    char c = p + 1 < end ? p[1] : '\0';
+    if (c == '?') return 2;
+    if (c == '(' || c == '{') {
+        const char *close = match_close(p + 2, end, c == '(' ? ')' : '}');
+        return close ? (size_t)(close - p + 1) : SIZE_MAX;
+    }
+    if (!isalpha((unsigned char)c) && c != '_') return 0;
+    const char *q = p + 2;
+    while (q < end && (isalnum((unsigned char)*q) || *q == '_')) q++;
+    return q - p;
+}
+
+/**
+ * @brief Length of a tilde prefix: a ~ and the login name after it, which
+ * must run to a / or the end of the word.
+ *
+ * @param lx Lexer.
+ * @param p Position of the ~.
+ * @return Length including the ~, 0 if p does not start a tilde prefix.
+ */
+static size_t tilde_len(const struct lexer *lx, const char *p) {
+    if (at(lx, p) != '~') return 0;
+    const char *q = p + 1;
+    while (q < lx->end && (isalnum((unsigned char)*q) || (*q && strchr("._-", *q)))) q++;
+    char next = at(lx, q);
+    if (next != '\0' && next != '/' && !strchr(" \t\n|&;<>", next)) return 0;
+    return q - p;
+}
+
+/**
+ * @brief Writes a character taken literally, escaping it if it could be
+ * mistaken for an expansion mark.
+ *
+ * @param lx Lexer.
+ * @param o Output position.
+ * @param c Character.
+ * @param expand Set if an escape was needed.
+ * @return The new output position.
+ */
+static inline char *put_literal(const struct lexer *lx, char *o, char c, bool *expand) {
+    if (!lx->words_only && (c == EXP_PLAIN || c == EXP_QUOTED || c == EXP_LITERAL)) {
+        *o++ = EXP_LITERAL;
+        *expand = true;
+    }
+    *o++ = c;
+    return o;
+}
+
+/**
+ * @brief Finishes an operator token.
+ *
+ * @param lx Lexer.
+ * @param t Token being built.
+ * @param kind Token kind.
+ * @param len Length of the operator in the line.
+ * @return The token kind.
+ */
+static enum lex_kind op(struct lexer *lx, struct lex_token *t, enum lex_kind kind, size_t len) {
+    t->kind = kind;
+    t->srclen = lx->pos + len - t->start;
+    lx->pos += len;
+    return kind;
+}
+
+/**
+ * @brief Reads a redirection operator at lx->pos. t->fd is already set if
+ * the operator had an fd number in front of it.
+ *
+ * @param lx Lexer.
+ * @param t Token being built.
+ * @return LEX_REDIR.
+ */
+static enum lex_kind redir(struct lexer *lx, struct lex_token *t) {
+    const char *p = lx->pos;
+    char next = at(lx, p + 1);
+    if (p[0] == '<') {
+        if (t->fd < 0) t->fd = STDIN_FILENO;
+        if (next == '&') { t->op = OP_DUP_IN; return op(lx, t, LEX_REDIR, 2); }
+        if (next == '>') { t->op = OP_INOUT; return op(lx, t, LEX_REDIR, 2); }
+        t->op = OP_IN;
+        return op(lx, t, LEX_REDIR, 1);
+    }
+    if (t->fd < 0) t->fd = STDOUT_FILENO;
+    if (next == '>') { t->op = OP_APPEND; return op(lx, t, LEX_REDIR, 2); }
+    if (next == '&') { t->op = OP_DUP_OUT; return op(lx, t, LEX_REDIR, 2); }
+    t->op = OP_OUT;
+    return op(lx, t, LEX_REDIR, next == '|' ? 2 : 1);
+}
+
+/**
+ * @brief Reads the next token, see lab.h.
+ *
+ * @param lx Lexer.
+ * @param t Receives the token.
+ * @return Kind of the token.
+ */
+enum lex_kind lexer_next(struct lexer *lx, struct lex_token *t) {
+    const char *p = lx->pos;
+    const char *end = lx->end;
+    for (;;) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n')) p++;
+        /* A # where a token would start comments out the rest of the line */
+        if (p == end || *p != '#' || lx->words_only) break;
+        const char *nl = memchr(p, '\n', end - p);
+        p = nl ? nl : end;
+    }
+    lx->pos = p;
+    t->start = p;
+    t->srclen = 0;
+    t->word = NULL;
+    t->len = 0;
+    t->fd = -1;
+    t->expand = false;
+
+    if (p == end || *p == '\0') {
+        t->kind = LEX_END;
+        return LEX_END;
+    }
+    if (!lx->words_only) {
+        switch (*p) {
+        case '|':
+            return at(lx, p + 1) == '|' ? op(lx, t, LEX_OR_IF, 2) : op(lx, t, LEX_PIPE, 1);
+        case ';':
+            return op(lx, t, LEX_SEMI, 1);
+        case '&':
+            if (at(lx, p + 1) == '&') return op(lx, t, LEX_AND_IF, 2);
+            if (at(lx, p + 1) != '>') return op(lx, t, LEX_AMP, 1);
+            t->op = at(lx, p + 2) == '>' ? OP_BOTH_APPEND : OP_BOTH;
+            t->fd = STDOUT_FILENO;
+            return op(lx, t, LEX_REDIR, t->op == OP_BOTH_APPEND ? 3 : 2);
+        case '<':
+        case '>':
+            return redir(lx, t);
+        }
+        /* Unquoted digits directly followed by < or > name the fd */
+        const char *q = p;
+        int fd = 0;
+        while (q < end && *q >= '0' && *q <= '9' && fd < 100000) fd = fd * 10 + (*q++ - '0');
+        if (q > p && (at(lx, q) == '<' || at(lx, q) == '>')) {
+            t->fd = fd;
+            lx->pos = q;
+            return redir(lx, t);
+        }
+    }
+
+    /*
+    Runs of ordinary characters are found with the vectorized scanner and
+    copied in one go; the state machine only looks at the character that stopped a run
+    */
+    char *o = lx->out;
+    enum lex_state state = ST_PLAIN;
+    bool expand = false, quoted = false;
+    if (!lx->words_only) {
+        /* A ~ starting the word, or the value of an assignment, is a tilde prefix */
+        const char *q = p;
+        if (isalpha((unsigned char)*q) || *q == '_') {
+            while (q < end && (isalnum((unsigned char)*q) || *q == '_')) q++;
+            q = at(lx, q) == '=' ? q + 1 : p;
+        }
+        size_t tilde = tilde_len(lx, q);
+        if (tilde) {
+            memcpy(o, p, q - p);
+            o += q - p;
+            *o++ = EXP_PLAIN;
+            memcpy(o, q, tilde);
+            o += tilde;
+            p = q + tilde;
+            expand = true;
+        }
+    }
+    for (;;) {
+        size_t n;
+        if (state == ST_PLAIN) n = sh_strncspn(p, end - p, lx->words_only ? &word_stop : &op_stop);
+        else if (state == ST_SINGLE) n = sh_strncspn(p, end - p, &single_stop);
+        else n = sh_strncspn(p, end - p, &double_stop);
+        memcpy(o, p, n);
+        o += n;
+        p += n;
+
+        char c = at(lx, p);
+        if (c == '\0') {
+            if (state == ST_PLAIN) break;
+            sh_parse_error("unexpected EOF while looking for matching `%c'",
+                           state == ST_SINGLE ? '\'' : '"');
+            t->kind = LEX_ERROR;
+            t->srclen = p - t->start;
+            lx->pos = p;
+            return LEX_ERROR;
+        }
+        if (c == '$' || c == EXP_PLAIN || c == EXP_QUOTED || c == EXP_LITERAL) {
+            /* Expansions are left marked for when the command runs */
+            size_t ref = c == '$' && !lx->words_only ? lex_reference_len(p, end) : 0;
+            if (ref == SIZE_MAX) {
+                sh_parse_error("unexpected EOF while looking for matching `%c'",
+                               p[1] == '(' ? ')' : '}');
+                t->kind = LEX_ERROR;
+                t->srclen = end - t->start;
+                lx->pos = end;
+                return LEX_ERROR;
+            }
+            if (ref) {
+                *o++ = state == ST_DOUBLE ? EXP_QUOTED : EXP_PLAIN;
+                memcpy(o, p, ref);
+                o += ref;
+                p += ref;
+                expand = true;
+                continue;
+            }
+            o = put_literal(lx, o, c, &expand);
+        } else if (state == ST_SINGLE) {
+            state = ST_PLAIN;
+        } else if (state == ST_DOUBLE) {
+            if (c == '"') {
+                state = ST_PLAIN;
+            } else if (at(lx, p + 1) && strchr("$`\"\\\n", p[1])) {
+                if (*++p != '\n') *o++ = *p;
+            } else {
+                *o++ = c;
+            }
+        } else if (c == '\'') {
+            state = ST_SINGLE;
+            quoted = true;
+        } else if (c == '"') {
+            state = ST_DOUBLE;
+            quoted = true;
+        } else if (c == '\\') {
+            if (!at(lx, p + 1)) *o++ = c;
+            else if (*++p != '\n') o = put_literal(lx, o, *p, &expand);
+        } else {
+            break; /* a blank or an operator ends the word */
+        }
+        p++;
+    }
+    /* Keeps "" or "$EMPTY" an argument after expansion */
+    if (expand && quoted) *o++ = EXP_QUOTED;
+    *o = '\0';
+
+    t->kind = LEX_WORD;
+    t->expand = expand;
+    t->word = lx->out;
+    t->len = o - lx->out;
+    t->srclen = p - t->start;
+    lx->out = o + 1;
+    lx->pos = p;
+    return LEX_WORD;
+}
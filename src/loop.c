@@ -0,0 +1,340 @@
+/**
+ * loop.c
+ * The shell's event loop. Terminal input, SIGCHLD/SIGWINCH (through a
+ * signalfd), child exits (through one pidfd per child), changes to the PATH
+ * directories (through inotify) and news from the prompt's helper thread
+ * (through an eventfd) are all watched by a single epoll instance and
+ * dispatched from sh_loop_once.
+ *
+ * @author Vladyslav (Vlad) Maliutin
+ */
+
+#define _GNU_SOURCE
+#include "lab.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/pidfd.h>
+#include <sys/wait.h>
+#include <readline/readline.h>
+
+/* What an epoll event refers to, packed into the event's 64 bit data */
+#define SRC_INPUT 1ULL
+#define SRC_SIGNAL 2ULL
+#define SRC_PIDFD 3ULL
+#define SRC_COMMANDS 4ULL
+#define SRC_PROMPT 5ULL
+#define SRC(kind, value) ((kind) << 32 | (uint32_t)(value))
+#define SRC_KIND(data) ((data) >> 32)
+#define SRC_VALUE(data) ((pid_t)(uint32_t)(data))
+
+#define LOOP_MAX_EVENTS 16
+
+/* epoll instance of the running loop, so job teardown can unregister pidfds */
+static int active_epfd = -1;
+
+/**
+ * @brief Converts what waitid reports into a waitpid style status.
+ *
+ * @param si Result of waitid.
+ * @return Equivalent wait status.
+ */
+int sh_wait_status(const siginfo_t *si) {
+    switch (si->si_code) {
+    case CLD_EXITED:
+        return W_EXITCODE(si->si_status, 0);
+    case CLD_KILLED:
+        return si->si_status;
+    case CLD_DUMPED:
+        return si->si_status | WCOREFLAG;
+    case CLD_STOPPED:
+    case CLD_TRAPPED:
+        return W_STOPCODE(si->si_status);
+    default:
+        return 0xffff; /* continued */
+    }
+}
+
+/**
+ * @brief Collects job control state changes after SIGCHLD. When pidfds
+ * are available exits are left to them, so a child some other part of the
+ * shell is waiting on by pid can never be stolen here.
+ *
+ * @param sh Shell instance.
+ */
+static void reap_changes(struct shell *sh) {
+    int flags = WSTOPPED | WCONTINUED | WNOHANG;
+    if (!sh->loop.pidfds) flags |= WEXITED;
+    for (;;) {
+        siginfo_t si;
+        si.si_pid = 0;
+        if (waitid(P_ALL, 0, &si, flags) != 0 || si.si_pid == 0) break;
+        job_record(sh, si.si_pid, sh_wait_status(&si));
+    }
+    if (!sh->loop.pidfds) return;
+
+    /* Members whose pidfd could not be opened are checked one by one */
+    for (size_t i = 0; i < sh->jobs.count; i++) {
+        struct job *j = sh->jobs.jobs[i];
+        for (size_t k = 0; k < j->nprocs; k++) {
+            struct job_proc *p = &j->procs[k];
+            int status;
+            if (p->pid > 0 && !p->done && p->pidfd < 0 &&
+                waitpid(p->pid, &status, WNOHANG) == p->pid)
+                job_record(sh, p->pid, status);
+        }
+    }
+}
+
+/**
+ * @brief Arms or disarms input events without touching the other sources.
+ * Disarming removes the descriptor outright, since a hung up input would
+ * otherwise keep reporting EPOLLHUP while a foreground job runs.
+ *
+ * @param loop Loop instance.
+ * @param armed True to be woken up by input.
+ */
+static void set_input(struct event_loop *loop, bool armed) {
+    if (!loop->input_pollable || loop->input_armed == armed) return;
+    struct epoll_event ev = { .events = EPOLLIN,
+                              .data.u64 = SRC(SRC_INPUT, loop->input_fd) };
+    epoll_ctl(loop->epfd, armed ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, loop->input_fd, &ev);
+    loop->input_armed = armed;
+}
+
+/**
+ * @brief Sets up epoll, blocks SIGCHLD and SIGWINCH in favour of a
+ * signalfd and checks whether the input descriptor can be polled.
+ *
+ * @param sh Shell instance.
+ * @return 0 on success, -1 if the loop could not be created.
+ */
+int sh_loop_init(struct shell *sh) {
+    struct event_loop *loop = &sh->loop;
+    memset(loop, 0, sizeof(*loop));
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGWINCH);
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    sigprocmask(SIG_BLOCK, &set, NULL);
+    loop->sigfd = signalfd(-1, &set, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (loop->sigfd < 0) {
+        perror("signalfd");
+        sigprocmask(SIG_UNBLOCK, &set, NULL);
+        close(loop->epfd);
+        return -1;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = SRC(SRC_SIGNAL, 0) };
+    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->sigfd, &ev);
+
+    /* epoll refuses regular files; such input is always ready anyway */
+    loop->input_fd = sh->shell_terminal;
+    ev.data.u64 = SRC(SRC_INPUT, loop->input_fd);
+    loop->input_pollable = epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->input_fd, &ev) == 0;
+    if (loop->input_pollable) epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->input_fd, NULL);
+
+    int probe = pidfd_open(getpid(), 0);
+    loop->pidfds = probe >= 0;
+    if (probe >= 0) close(probe);
+
+    /* readline must not expect to see SIGWINCH itself */
+    rl_catch_sigwinch = 0;
+    loop->active = true;
+    active_epfd = loop->epfd;
+    return 0;
+}
+
+/**
+ * @brief Closes the loop and unblocks the signals it consumed.
+ *
+ * @param sh Shell instance.
+ */
+void sh_loop_destroy(struct shell *sh) {
+    struct event_loop *loop = &sh->loop;
+    if (!loop->active) return;
+    close(loop->sigfd);
+    close(loop->epfd);
+    if (active_epfd == loop->epfd) active_epfd = -1;
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGWINCH);
+    sigprocmask(SIG_UNBLOCK, &set, NULL);
+    loop->active = false;
+}
+
+/**
+ * @brief Drops a forked child's copy of the loop. The epoll instance is
+ * shared with the parent, so the child must never modify it; it only
+ * closes its descriptors.
+ *
+ * @param sh Shell instance (the child's copy).
+ */
+void sh_loop_detach(struct shell *sh) {
+    struct event_loop *loop = &sh->loop;
+    if (!loop->active) return;
+    active_epfd = -1;
+    close(loop->sigfd);
+    close(loop->epfd);
+    loop->active = false;
+}
+
+/**
+ * @brief Opens a pidfd for every live member of a job and watches it.
+ * Without pidfd support the members are reaped through SIGCHLD instead.
+ *
+ * @param sh Shell instance.
+ * @param j Job to watch.
+ */
+void sh_loop_watch_job(struct shell *sh, struct job *j) {
+    if (!sh->loop.active || !sh->loop.pidfds) return;
+    for (size_t i = 0; i < j->nprocs; i++) {
+        struct job_proc *p = &j->procs[i];
+        if (p->pid <= 0 || p->done || p->pidfd >= 0) continue;
+        p->pidfd = pidfd_open(p->pid, 0);
+        if (p->pidfd < 0) continue;
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = SRC(SRC_PIDFD, p->pid) };
+        epoll_ctl(sh->loop.epfd, EPOLL_CTL_ADD, p->pidfd, &ev);
+    }
+}
+
+/**
+ * @brief Stops watching a pidfd and closes it. The explicit delete matters
+ * because a forked builtin may still hold a copy of the descriptor.
+ *
+ * @param fd Descriptor to forget.
+ */
+void sh_loop_unwatch_fd(int fd) {
+    if (fd < 0) return;
+    if (active_epfd >= 0) epoll_ctl(active_epfd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+}
+
+/**
+ * @brief Watches the command index's inotify descriptor. The index swaps
+ * descriptors when it is rebuilt and closes the old one through
+ * sh_loop_unwatch_fd.
+ *
+ * @param sh Shell instance.
+ */
+void sh_loop_watch_commands(struct shell *sh) {
+    if (!sh->loop.active || !sh->commands.watching) return;
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = SRC(SRC_COMMANDS, 0) };
+    epoll_ctl(sh->loop.epfd, EPOLL_CTL_ADD, sh->commands.inotify_fd, &ev);
+}
+
+/**
+ * @brief Watches the eventfd the prompt's helper thread writes to.
+ *
+ * @param sh Shell instance.
+ */
+void sh_loop_watch_prompt(struct shell *sh) {
+    if (!sh->loop.active || sh->prompt_info.eventfd < 0) return;
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = SRC(SRC_PROMPT, 0) };
+    epoll_ctl(sh->loop.epfd, EPOLL_CTL_ADD, sh->prompt_info.eventfd, &ev);
+}
+
+/**
+ * @brief Reaps the child behind a readable pidfd.
+ *
+ * @param sh Shell instance.
+ * @param pid Child that exited.
+ */
+static void on_pidfd(struct shell *sh, pid_t pid) {
+    struct job_proc *p = job_find_proc(&sh->jobs, pid);
+    if (!p || p->pidfd < 0) return;
+
+    siginfo_t si;
+    si.si_pid = 0;
+    int fd = p->pidfd;
+    if (waitid(P_PIDFD, fd, &si, WEXITED | WNOHANG) == 0 && si.si_pid != 0) {
+        p->pidfd = -1;
+        sh_loop_unwatch_fd(fd);
+        job_record(sh, pid, sh_wait_status(&si));
+    } else if (errno == ECHILD) {
+        /* Somebody else reaped it, stop listening */
+        p->pidfd = -1;
+        sh_loop_unwatch_fd(fd);
+    }
+}
+
+/**
+ * @brief Drains the signalfd and reacts to what arrived.
+ *
+ * @param sh Shell instance.
+ * @param read_input Whether readline currently owns the terminal.
+ */
+static void on_signal(struct shell *sh, bool read_input) {
+    struct signalfd_siginfo info[8];
+    bool child = false, winch = false;
+    ssize_t n;
+    while ((n = read(sh->loop.sigfd, info, sizeof(info))) > 0) {
+        for (size_t i = 0; i < (size_t)n / sizeof(info[0]); i++) {
+            if (info[i].ssi_signo == SIGCHLD) child = true;
+            if (info[i].ssi_signo == SIGWINCH) winch = true;
+        }
+    }
+    if (child) reap_changes(sh);
+    if (winch && read_input) rl_resize_terminal();
+}
+
+/**
+ * @brief Waits for the next batch of events and dispatches them.
+ *
+ * @param sh Shell instance.
+ * @param read_input True to also wake up for (and deliver) terminal input.
+ * @param timeout_ms How long to wait, -1 for no limit, 0 to only poll.
+ * @return Number of events handled, -1 if the loop is not running.
+ */
+int sh_loop_once(struct shell *sh, bool read_input, int timeout_ms) {
+    struct event_loop *loop = &sh->loop;
+    if (!loop->active) return -1;
+
+    read_input = read_input && loop->on_input;
+    int handled = 0;
+    if (read_input && !loop->input_pollable) {
+        loop->on_input();
+        handled++;
+        timeout_ms = 0;
+    }
+    set_input(loop, read_input);
+
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    int n = epoll_wait(loop->epfd, events, LOOP_MAX_EVENTS, timeout_ms);
+    if (n < 0) return errno == EINTR ? handled : -1;
+
+    for (int i = 0; i < n; i++) {
+        uint64_t data = events[i].data.u64;
+        switch (SRC_KIND(data)) {
+        case SRC_INPUT:
+            if (read_input) loop->on_input();
+            break;
+        case SRC_SIGNAL:
+            on_signal(sh, read_input);
+            break;
+        case SRC_PIDFD:
+            on_pidfd(sh, SRC_VALUE(data));
+            break;
+        case SRC_COMMANDS:
+            cmd_index_drain(&sh->commands);
+            break;
+        case SRC_PROMPT:
+            prompt_update(sh, read_input);
+            break;
+        }
+    }
+    return handled + n;
+}
@@ -0,0 +1,398 @@
+/**
+ * parallel.c
+ * The parallel builtin: fans one command out over a list of arguments,
+ * keeping a bounded number of children in flight and collecting their
+ * exits from a pidfd completion queue.
+ *
+ * @author Vladyslav (Vlad) Maliutin
+ */
+
+#define _GNU_SOURCE
+#include "lab.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/pidfd.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+
+/* Completion queue tag of the shell's signalfd, every other tag is a task index */
+#define PAR_SIGNAL UINT64_MAX
+#define PAR_MAX_EVENTS 16
+/* How often children without a pidfd are polled, in milliseconds */
+#define PAR_POLL_MS 10
+/* Finished jobs whose output -k may hold back while an earlier one runs */
+#define PAR_MAX_HELD 64
+
+struct par_task
+{
+    const char *arg;
+    pid_t pid;
+    int pidfd;
+    int out_fd;
+    int status;
+    bool started;
+    bool done;
+};
+
+struct par_run
+{
+    struct shell *sh;
+    char **cmd;
+    size_t ncmd;
+    bool has_slot;
+    struct par_task *tasks;
+    size_t ntasks;
+    /* Finished tasks in completion order, not yet written out */
+    size_t *ready;
+    size_t nready;
+    size_t next;
+    size_t flushed;
+    size_t running;
+    size_t buffered;
+    bool ordered;
+    bool foreground;
+    bool interrupted;
+    bool polling;
+    bool sigchld;
+    pid_t pgid;
+    int null_fd;
+    int qfd;
+};
+
+/**
+ * @brief Writes a finished task's buffered output to stdout.
+ *
+ * @param run Current run.
+ * @param t Task to flush.
+ */
+static void write_out(struct par_run *run, struct par_task *t) {
+    if (t->out_fd < 0) return;
+    fflush(stdout);
+    if (lseek(t->out_fd, 0, SEEK_SET) == 0) sh_copy_fd(t->out_fd, STDOUT_FILENO);
+    close(t->out_fd);
+    t->out_fd = -1;
+    run->buffered--;
+}
+
+/**
+ * @brief Marks a task finished and queues it for writing out.
+ *
+ * @param run Current run.
+ * @param t Task that finished.
+ * @param status Its wait status.
+ */
+static void finish(struct par_run *run, struct par_task *t, int status) {
+    t->status = status;
+    t->done = true;
+    run->ready[run->nready++] = t - run->tasks;
+}
+
+/**
+ * @brief Writes out every task that is due: the ones finished since the
+ * last call, or with -k only the finished run at the head of the argument
+ * list.
+ *
+ * @param run Current run.
+ */
+static void flush_ready(struct par_run *run) {
+    if (!run->ordered) {
+        for (size_t i = 0; i < run->nready; i++)
+            write_out(run, &run->tasks[run->ready[i]]);
+        run->nready = 0;
+        return;
+    }
+    while (run->flushed < run->next && run->tasks[run->flushed].done)
+        write_out(run, &run->tasks[run->flushed++]);
+}
+
+/**
+ * @brief Replaces every {} in a word with the task's argument.
+ *
+ * @param word Command word containing at least one {}.
+ * @param arg Argument to substitute.
+ * @return Newly allocated word or NULL on allocation failure.
+ */
+static char *substitute(const char *word, const char *arg) {
+    size_t slots = 0;
+    for (const char *p = word; (p = strstr(p, "{}")); p += 2) slots++;
+    size_t alen = strlen(arg);
+    char *out = malloc(strlen(word) + slots * alen + 1);
+    if (!out) return NULL;
+
+    char *dst = out;
+    for (const char *p; (p = strstr(word, "{}")); word = p + 2) {
+        dst = mempcpy(dst, word, p - word);
+        dst = mempcpy(dst, arg, alen);
+    }
+    strcpy(dst, word);
+    return out;
+}
+
+/**
+ * @brief Starts one task with its stdout going to a private memfd. When no
+ * memfd can be had while other buffers are still open, the task is left
+ * for later, since those buffers are released as their jobs are flushed.
+ *
+ * @param run Current run.
+ * @param idx Index of the task.
+ * @return False if the task was not started and should be tried again.
+ */
+static bool start_task(struct par_run *run, size_t idx) {
+    struct par_task *t = &run->tasks[idx];
+    /* Output written straight to stdout would break the ordering */
+    t->out_fd = memfd_create("parallel", MFD_CLOEXEC);
+    if (t->out_fd < 0 && (errno == EMFILE || errno == ENFILE) && run->buffered)
+        return false;
+    t->started = true;
+    if (t->out_fd < 0) {
+        perror("parallel");
+        finish(run, t, W_EXITCODE(127, 0));
+        return true;
+    }
+    run->buffered++;
+
+    char **argv = malloc((run->ncmd + 2) * sizeof(*argv));
+    if (!argv) {
+        finish(run, t, W_EXITCODE(127, 0));
+        return true;
+    }
+    bool ok = true;
+    for (size_t i = 0; i < run->ncmd; i++) {
+        if (strstr(run->cmd[i], "{}")) {
+            argv[i] = substitute(run->cmd[i], t->arg);
+            ok = ok && argv[i];
+        } else {
+            argv[i] = run->cmd[i];
+        }
+    }
+    argv[run->ncmd] = run->has_slot ? NULL : (char *)t->arg;
+    argv[run->ncmd + 1] = NULL;
+
+    struct launch_io io = { .in_fd = run->null_fd, .out_fd = t->out_fd };
+
+    fflush(stdout);
+    pid_t pid = -1;
+    if (!ok)
+        perror("parallel");
+    else if (is_builtin(argv[0]))
+        pid = sh_fork_builtin(run->sh, argv, &io, run->pgid, run->foreground, NULL, 0);
+    else
+        pid = sh_launch(run->sh, argv, &io, run->pgid, run->foreground);
+    for (size_t i = 0; i < run->ncmd; i++)
+        if (argv[i] != run->cmd[i]) free(argv[i]);
+    free(argv);
+
+    if (pid < 0) {
+        finish(run, t, W_EXITCODE(127, 0));
+        return true;
+    }
+    t->pid = pid;
+    if (run->pgid == 0) run->pgid = pid;
+    run->running++;
+
+    t->pidfd = pidfd_open(pid, 0);
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = idx };
+    if (t->pidfd < 0 || epoll_ctl(run->qfd, EPOLL_CTL_ADD, t->pidfd, &ev) != 0)
+        run->polling = true;
+    return true;
+}
+
+/**
+ * @brief Collects a task if it has exited. The group leader is only looked
+ * at, not reaped, so its process group stays valid for later tasks.
+ *
+ * @param run Current run.
+ * @param t Task to check.
+ */
+static void collect(struct par_run *run, struct par_task *t) {
+    siginfo_t si;
+    si.si_pid = 0;
+    int flags = WEXITED | WNOHANG;
+    if (t->pid == run->pgid) flags |= WNOWAIT;
+    int rc = t->pidfd >= 0 ? waitid(P_PIDFD, t->pidfd, &si, flags)
+                           : waitid(P_PID, t->pid, &si, flags);
+    if (rc != 0 && errno != ECHILD) return;
+    if (rc == 0 && si.si_pid == 0) return;
+
+    finish(run, t, rc == 0 ? sh_wait_status(&si) : W_EXITCODE(127, 0));
+    run->running--;
+    if (t->pidfd >= 0) {
+        epoll_ctl(run->qfd, EPOLL_CTL_DEL, t->pidfd, NULL);
+        close(t->pidfd);
+        t->pidfd = -1;
+    }
+    /* ^C reaches every job; like a shell loop, stop starting new ones */
+    if (WIFSIGNALED(t->status) && WTERMSIG(t->status) == SIGINT)
+        run->interrupted = true;
+}
+
+/**
+ * @brief Handles SIGCHLD while jobs run. Stopped jobs are continued right
+ * away since the builtin cannot be suspended as a whole.
+ *
+ * @param run Current run.
+ */
+static void on_signal(struct par_run *run) {
+    struct signalfd_siginfo info[8];
+    while (read(run->sh->loop.sigfd, info, sizeof(info)) > 0)
+        run->sigchld = true;
+
+    bool stopped = false;
+    for (;;) {
+        siginfo_t si;
+        si.si_pid = 0;
+        if (waitid(P_PGID, run->pgid, &si, WSTOPPED | WNOHANG) != 0 || si.si_pid == 0) break;
+        stopped = true;
+    }
+    if (stopped) kill(-run->pgid, SIGCONT);
+}
+
+/**
+ * @brief Prints the exit status of a task for the summary.
+ *
+ * @param t Task to describe.
+ */
+static void print_task(const struct par_task *t) {
+    if (!t->started)
+        fprintf(stderr, "not run    %s\n", t->arg);
+    else if (WIFSIGNALED(t->status))
+        fprintf(stderr, "signal %-3d %s\n", WTERMSIG(t->status), t->arg);
+    else
+        fprintf(stderr, "exit %-5d %s\n", WEXITSTATUS(t->status), t->arg);
+}
+
+/**
+ * @brief Builtin parallel, see lab.h.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @return True if every job exited with 0.
+ */
+bool sh_parallel(struct shell *sh, char **argv) {
+    struct par_run run = { .sh = sh, .null_fd = -1, .qfd = -1 };
+    long max = sh->limits.ncpu > 0 ? sh->limits.ncpu : 1;
+    bool summary = false;
+
+    int i = 1;
+    for (; argv[i] && argv[i][0] == '-' && strcmp(argv[i], ":::") != 0; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(argv[i], "-k") == 0) {
+            run.ordered = true;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            summary = true;
+        } else if (strncmp(argv[i], "-j", 2) == 0) {
+            const char *n = argv[i][2] ? argv[i] + 2 : argv[++i];
+            char *end;
+            max = n ? strtol(n, &end, 10) : 0;
+            if (!n || *end || max <= 0) {
+                fprintf(stderr, "parallel: %s: invalid job count\n", n ? n : "");
+                return false;
+            }
+        } else {
+            fprintf(stderr, "parallel: %s: invalid option\n", argv[i]);
+            return false;
+        }
+    }
+
+    run.cmd = &argv[i];
+    while (argv[i] && strcmp(argv[i], ":::") != 0) {
+        if (strstr(argv[i], "{}")) run.has_slot = true;
+        i++;
+    }
+    run.ncmd = &argv[i] - run.cmd;
+    if (!argv[i] || run.ncmd == 0) {
+        fprintf(stderr, "parallel: usage: parallel [-j N] [-k] [-s] command ... ::: arg ...\n");
+        return false;
+    }
+    i++;
+
+    run.ntasks = 0;
+    while (argv[i + run.ntasks]) run.ntasks++;
+    if (run.ntasks == 0) return true;
+
+    run.tasks = calloc(run.ntasks, sizeof(*run.tasks));
+    run.ready = malloc(run.ntasks * sizeof(*run.ready));
+    run.qfd = epoll_create1(EPOLL_CLOEXEC);
+    if (!run.tasks || !run.ready || run.qfd < 0) {
+        perror("parallel");
+        free(run.tasks);
+        free(run.ready);
+        if (run.qfd >= 0) close(run.qfd);
+        return false;
+    }
+    for (size_t k = 0; k < run.ntasks; k++) {
+        run.tasks[k].arg = argv[i + k];
+        run.tasks[k].pidfd = -1;
+        run.tasks[k].out_fd = -1;
+    }
+
+    /* The jobs run in their own process group, which gets the terminal */
+    run.foreground = !sh->subshell;
+    run.null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (sh->loop.active) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = PAR_SIGNAL };
+        epoll_ctl(run.qfd, EPOLL_CTL_ADD, sh->loop.sigfd, &ev);
+    }
+
+    while (run.running || (!run.interrupted && run.next < run.ntasks)) {
+        while (!run.interrupted && run.next < run.ntasks && run.running < (size_t)max &&
+               (!run.ordered || run.next - run.flushed - run.running < PAR_MAX_HELD)) {
+            if (!start_task(&run, run.next)) break;
+            run.next++;
+        }
+        flush_ready(&run);
+        if (!run.running) continue;
+
+        struct epoll_event events[PAR_MAX_EVENTS];
+        int n = epoll_wait(run.qfd, events, PAR_MAX_EVENTS, run.polling ? PAR_POLL_MS : -1);
+        for (int e = 0; e < n; e++) {
+            if (events[e].data.u64 == PAR_SIGNAL)
+                on_signal(&run);
+            else
+                collect(&run, &run.tasks[events[e].data.u64]);
+        }
+        if (run.polling) {
+            for (size_t k = 0; k < run.next; k++) {
+                struct par_task *t = &run.tasks[k];
+                if (t->pid > 0 && !t->done && t->pidfd < 0) collect(&run, t);
+            }
+        }
+    }
+    flush_ready(&run);
+
+    if (run.pgid) {
+        int status;
+        while (waitpid(run.pgid, &status, 0) == -1 && errno == EINTR)
+            ;
+    }
+    if (run.foreground && sh->shell_is_interactive) {
+        tcsetpgrp(sh->shell_terminal, sh->shell_pgid);
+        tcsetattr(sh->shell_terminal, TCSADRAIN, &sh->shell_tmodes);
+        if (run.interrupted) fputc('\n', stderr);
+    }
+    /* Hand any SIGCHLD we consumed back to the main loop */
+    if (run.sigchld) kill(getpid(), SIGCHLD);
+    if (run.null_fd >= 0) close(run.null_fd);
+    close(run.qfd);
+
+    size_t failed = 0;
+    for (size_t k = 0; k < run.ntasks; k++) {
+        struct par_task *t = &run.tasks[k];
+        write_out(&run, t);
+        if (!t->started || t->status != 0) failed++;
+        if (summary) print_task(t);
+    }
+    if (failed) fprintf(stderr, "parallel: %zu of %zu jobs failed\n", failed, run.ntasks);
+    free(run.tasks);
+    free(run.ready);
+    return failed == 0;
+}
@@ -0,0 +1,455 @@
+/**
+ * parse.c
+ * Turns a command line into a pipeline: stages separated by '|', each with
+ * its argument vector and the redirections that apply to it.
+ *
+ * @author Vladyslav (Vlad) Maliutin
+ */
+
+#include "lab.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+
+/* Tokens kept on the stack before the token list moves to the heap */
+#define PARSE_INLINE_TOKENS 32
+
+/**
+ * @brief Prints a syntax error for the token that was not expected.
+ *
+ * @param t Offending token.
+ */
+static void syntax_error(const struct lex_token *t) {
+    if (t->kind == LEX_END)
+        sh_parse_error("syntax error near unexpected token `newline'");
+    else
+        sh_parse_error("syntax error near unexpected token `%.*s'",
+                        (int)(t->srclen ? t->srclen : 1), t->start);
+}
+
+/**
+ * @brief Number of redirect actions an operator expands to.
+ *
+ * @param op Operator.
+ * @return 2 for &> and &>>, 1 otherwise.
+ */
+static size_t redir_actions(enum redir_op op) {
+    return op == OP_BOTH || op == OP_BOTH_APPEND ? 2 : 1;
+}
+
+/**
+ * @brief Fills in the redirect action(s) for an operator and its word.
+ *
+ * @param r Where to store the action(s).
+ * @param t Operator token.
+ * @param word Target word, already NUL terminated.
+ * @return Number of actions written or 0 if the word is not valid here.
+ */
+static size_t make_redirect(struct redirect *r, const struct lex_token *t, char *word) {
+    r->fd = t->fd;
+    r->path = word;
+    switch (t->op) {
+    case OP_IN:
+        r->kind = REDIR_OPEN;
+        r->flags = O_RDONLY;
+        return 1;
+    case OP_INOUT:
+        r->kind = REDIR_OPEN;
+        r->flags = O_RDWR | O_CREAT;
+        return 1;
+    case OP_OUT:
+        r->kind = REDIR_OPEN;
+        r->flags = O_WRONLY | O_CREAT | O_TRUNC;
+        return 1;
+    case OP_APPEND:
+        r->kind = REDIR_OPEN;
+        r->flags = O_WRONLY | O_CREAT | O_APPEND;
+        return 1;
+    case OP_DUP_IN:
+    case OP_DUP_OUT:
+        if (strcmp(word, "-") == 0) {
+            r->kind = REDIR_CLOSE;
+            return 1;
+        }
+        for (const char *c = word; *c; c++) {
+            if (!isdigit((unsigned char)*c)) {
+                sh_parse_error("%s: ambiguous redirect", word);
+                return 0;
+            }
+        }
+        r->kind = REDIR_DUP;
+        r->src_fd = atoi(word);
+        return 1;
+    case OP_BOTH:
+    case OP_BOTH_APPEND:
+        r->kind = REDIR_OPEN;
+        r->flags = O_WRONLY | O_CREAT | (t->op == OP_BOTH ? O_TRUNC : O_APPEND);
+        r[1].fd = STDERR_FILENO;
+        r[1].kind = REDIR_DUP;
+        r[1].src_fd = STDOUT_FILENO;
+        return 2;
+    }
+    return 0;
+}
+
+/**
+ * @brief Whether a word is an assignment: a variable name, written
+ * without quotes or escapes, then '='.
+ *
+ * @param t Word token.
+ * @return True for NAME=value.
+ */
+static bool is_assignment(const struct lex_token *t) {
+    size_t len = var_name_len(t->word);
+    return len && t->word[len] == '=' && memcmp(t->start, t->word, len + 1) == 0;
+}
+
+/**
+ * @brief Makes room for one more token, moving the list to the heap once
+ * the inline array is full.
+ *
+ * @param toks Current token list.
+ * @param inline_toks The caller's inline array.
+ * @param cap Capacity, updated on growth.
+ * @return The (possibly moved) list or NULL if out of memory.
+ */
+static struct lex_token *grow_tokens(struct lex_token *toks, struct lex_token *inline_toks,
+                                     size_t *cap) {
+    size_t n = *cap * 2;
+    struct lex_token *grown;
+    if (toks == inline_toks) {
+        grown = malloc(n * sizeof(*grown));
+        if (grown) memcpy(grown, toks, *cap * sizeof(*grown));
+    } else {
+        grown = realloc(toks, n * sizeof(*grown));
+    }
+    if (!grown) return NULL;
+    *cap = n;
+    return grown;
+}
+
+/* Where the parser is in the grammar while walking the tokens */
+enum parse_pos
+{
+    AT_ITEM,     /* start of the line or after ';' / '&' */
+    AT_PIPELINE, /* after '&&' / '||' */
+    AT_COMMAND,  /* after '|' */
+    IN_COMMAND   /* inside a simple command */
+};
+
+/* Number of each kind of node a line parses into */
+struct parse_counts
+{
+    size_t items;
+    size_t pipelines;
+    size_t commands;
+    size_t words;
+    size_t redirs;
+};
+
+/**
+ * @brief Copies the source text between two tokens into dst.
+ *
+ * @param dst Where to put the text, advanced past its NUL.
+ * @param first First token of the span.
+ * @param last Last token of the span.
+ * @return The copied text.
+ */
+static char *copy_span(char **dst, const struct lex_token *first, const struct lex_token *last) {
+    size_t n = last->start + last->srclen - first->start;
+    char *text = memcpy(*dst, first->start, n);
+    text[n] = '\0';
+    *dst += n + 1;
+    return text;
+}
+
+/**
+ * @brief Lexes a whole line into a token list, checking the grammar and
+ * counting the nodes on the way.
+ *
+ * @param lx Lexer writing words into the arena.
+ * @param toks In: the inline token array, out: the token list.
+ * @param ntoks Receives the number of tokens.
+ * @param inline_toks The caller's inline array.
+ * @param c Receives the node counts.
+ * @param lists False to reject ';', '&&', '||' and anything after '&'.
+ * @return True if the line is well formed.
+ */
+static bool collect_tokens(struct lexer *lx, struct lex_token **toks, size_t *ntoks,
+                           struct lex_token *inline_toks, struct parse_counts *c, bool lists) {
+    size_t n = 0, cap = PARSE_INLINE_TOKENS;
+    enum parse_pos pos = AT_ITEM;
+    for (;;) {
+        /* Room for an operator and its target word */
+        if (n + 2 > cap) {
+            struct lex_token *grown = grow_tokens(*toks, inline_toks, &cap);
+            if (!grown) return false;
+            *toks = grown;
+        }
+        struct lex_token *t = &(*toks)[n];
+        enum lex_kind kind = lexer_next(lx, t);
+        if (kind == LEX_ERROR) return false;
+        if (kind == LEX_END) {
+            if (pos == AT_PIPELINE || pos == AT_COMMAND) {
+                syntax_error(t);
+                return false;
+            }
+            *ntoks = n;
+            return true;
+        }
+
+        if (kind == LEX_WORD || kind == LEX_REDIR) {
+            if (pos == AT_ITEM) c->items++;
+            if (pos <= AT_PIPELINE) c->pipelines++;
+            if (pos <= AT_COMMAND) c->commands++;
+            pos = IN_COMMAND;
+            n++;
+            if (kind == LEX_WORD) {
+                c->words++;
+                continue;
+            }
+            struct lex_token *word = &(*toks)[n++];
+            if (lexer_next(lx, word) != LEX_WORD) {
+                if (word->kind != LEX_ERROR) syntax_error(word);
+                return false;
+            }
+            c->redirs += redir_actions(t->op);
+            continue;
+        }
+
+        bool list_op = kind == LEX_AND_IF || kind == LEX_OR_IF || kind == LEX_SEMI;
+        if (pos != IN_COMMAND || (list_op && !lists)) {
+            syntax_error(t);
+            return false;
+        }
+        n++;
+        if (kind == LEX_PIPE) {
+            pos = AT_COMMAND;
+        } else if (kind == LEX_AND_IF || kind == LEX_OR_IF) {
+            pos = AT_PIPELINE;
+        } else {
+            pos = AT_ITEM;
+        }
+
+        /* Without lists '&' may only end the line */
+        if (kind == LEX_AMP && !lists) {
+            struct lex_token end;
+            if (lexer_next(lx, &end) == LEX_END) {
+                *ntoks = n;
+                return true;
+            }
+            if (end.kind != LEX_ERROR) syntax_error(&end);
+            return false;
+        }
+    }
+}
+
+/**
+ * @brief Parses a line into a command list; see list_parse.
+ * The line is lexed once: word text goes straight into the arena and the
+ * tokens are kept so that every node of the tree can then be carved out of
+ * a single further allocation.
+ *
+ * @param line Input command string.
+ * @param len Length of the line.
+ * @param lists False to accept a single pipeline only.
+ * @return Parsed list or NULL on error.
+ */
+static struct cmd_list *parse(const char *line, size_t len, bool lists) {
+    struct arena a = { 0 };
+    char *words = arena_alloc(&a, 2 * len + 1);
+    if (!words) return NULL;
+
+    struct lex_token inline_toks[PARSE_INLINE_TOKENS];
+    struct lex_token *toks = inline_toks;
+    size_t ntoks = 0;
+    struct parse_counts c = { 0 };
+    struct lexer lx;
+    lexer_init(&lx, line, len, words, false);
+    bool ok = collect_tokens(&lx, &toks, &ntoks, inline_toks, &c, lists);
+
+    /* Pipeline and list texts are disjoint spans of the line */
+    size_t nops = c.pipelines - c.items;
+    size_t size = sizeof(struct cmd_list) + c.items * sizeof(struct and_or) +
+                  c.pipelines * sizeof(struct pipeline) + c.commands * sizeof(struct command) +
+                  c.redirs * sizeof(struct redirect) + (c.words + c.commands) * sizeof(char *) +
+                  nops * sizeof(enum andor_op) + 2 * len + c.pipelines + c.items;
+    char *block = ok ? arena_alloc(&a, size) : NULL;
+    if (!block) {
+        if (toks != inline_toks) free(toks);
+        arena_free(&a);
+        return NULL;
+    }
+
+    struct cmd_list *list = (struct cmd_list *)block;
+    struct and_or *items = (struct and_or *)(list + 1);
+    struct pipeline *pipelines = (struct pipeline *)(items + c.items);
+    struct command *commands = (struct command *)(pipelines + c.pipelines);
+    struct redirect *redirs = (struct redirect *)(commands + c.commands);
+    char **argv = (char **)(redirs + c.redirs);
+    enum andor_op *ops = (enum andor_op *)(argv + c.words + c.commands);
+    char *text = (char *)(ops + nops);
+    list->items = items;
+
+    struct and_or *item = NULL;
+    struct pipeline *pl = NULL;
+    struct command *cmd = NULL;
+    const struct lex_token *item_first = NULL, *pl_first = NULL, *last = NULL;
+    enum parse_pos pos = AT_ITEM;
+    for (size_t i = 0; i <= ntoks; i++) {
+        struct lex_token *t = i < ntoks ? &toks[i] : NULL;
+        if (t && (t->kind == LEX_WORD || t->kind == LEX_REDIR)) {
+            if (pos == AT_ITEM) {
+                item = item ? item + 1 : items;
+                list->nitems++;
+                item->pipelines = pl ? pl + 1 : pipelines;
+                item->ops = ops;
+                item_first = t;
+            }
+            if (pos <= AT_PIPELINE) {
+                pl = pl ? pl + 1 : pipelines;
+                item->npipelines++;
+                pl->cmds = cmd ? cmd + 1 : commands;
+                pl_first = t;
+            }
+            if (pos <= AT_COMMAND) {
+                cmd = cmd ? cmd + 1 : commands;
+                pl->ncmds++;
+                cmd->assigns = cmd->argv = argv;
+                cmd->redirs = redirs;
+            }
+            pos = IN_COMMAND;
+            if (t->kind == LEX_WORD) {
+                /* Assignments in front of the command name stay apart */
+                bool assign = cmd->argv == argv && is_assignment(t);
+                *argv++ = t->word;
+                if (assign) {
+                    cmd->nassigns++;
+                    cmd->argv = argv;
+                }
+                cmd->expand |= t->expand;
+                last = t;
+                continue;
+            }
+            cmd->expand |= toks[i + 1].expand;
+            size_t n = make_redirect(redirs, t, toks[++i].word);
+            if (n == 0) {
+                if (toks != inline_toks) free(toks);
+                arena_free(&a);
+                return NULL;
+            }
+            redirs += n;
+            cmd->nredirs += n;
+            last = &toks[i];
+            continue;
+        }
+
+        /* An operator or the end of the line closes the open nodes */
+        if (pos == IN_COMMAND) *argv++ = NULL;
+        if (t && t->kind == LEX_PIPE) {
+            pos = AT_COMMAND;
+            continue;
+        }
+        if (pos == IN_COMMAND) pl->text = copy_span(&text, pl_first, last);
+        if (t && (t->kind == LEX_AND_IF || t->kind == LEX_OR_IF)) {
+            *ops++ = t->kind == LEX_AND_IF ? ANDOR_AND : ANDOR_OR;
+            pos = AT_PIPELINE;
+            continue;
+        }
+        if (pos == IN_COMMAND) {
+            item->text = copy_span(&text, item_first, last);
+            item->background = t && t->kind == LEX_AMP;
+            if (item->background && item->npipelines == 1) pl->background = true;
+        }
+        pos = AT_ITEM;
+    }
+    if (toks != inline_toks) free(toks);
+
+    list->arena = a;
+    list->refs = 1;
+    return list;
+}
+
+/**
+ * @brief Parses a whole line into a command list.
+ *
+ * @param line Input command string.
+ * @return Parsed list (must be freed using list_free) or NULL.
+ */
+struct cmd_list *list_parse(const char *line) {
+    return parse(line, strlen(line), true);
+}
+
+/**
+ * @brief Parses a line that is not NUL terminated into a command list.
+ *
+ * @param line Start of the line.
+ * @param len Length of the line.
+ * @return Parsed list (must be freed using list_free) or NULL.
+ */
+struct cmd_list *list_parse_n(const char *line, size_t len) {
+    return parse(line, len, true);
+}
+
+/**
+ * @brief Drops a reference to a command list, freeing it and everything
+ * it references with the last one.
+ *
+ * @param list List to release.
+ */
+void list_free(struct cmd_list *list) {
+    if (!list || --list->refs > 0) return;
+    struct arena a = list->arena;
+    arena_free(&a);
+}
+
+/**
+ * @brief Takes another reference to a command list.
+ *
+ * @param list List to share.
+ * @return The list.
+ */
+struct cmd_list *list_ref(struct cmd_list *list) {
+    list->refs++;
+    return list;
+}
+
+/**
+ * @brief Splits a line into pipeline stages, arguments and redirections,
+ * and notes a trailing '&'.
+ *
+ * @param line Input command string.
+ * @return Parsed pipeline (must be freed using pipeline_free) or NULL.
+ */
+struct pipeline *pipeline_parse(const char *line) {
+    struct cmd_list *list = parse(line, strlen(line), false);
+    if (!list) return NULL;
+
+    /* The pipeline takes over the arena, which also holds the list */
+    struct arena a = list->arena;
+    struct pipeline *pl;
+    if (list->nitems) {
+        pl = list->items[0].pipelines;
+    } else {
+        pl = arena_alloc(&a, sizeof(*pl) + 1);
+        if (!pl) {
+            arena_free(&a);
+            return NULL;
+        }
+        pl->text = (char *)(pl + 1);
+    }
+    pl->arena = a;
+    return pl;
+}
+
+/**
+ * @brief Frees a pipeline and everything it references.
+ *
+ * @param pl Pipeline to free.
+ */
+void pipeline_free(struct pipeline *pl) {
+    if (!pl) return;
+    struct arena a = pl->arena;
+    arena_free(&a);
+}
@@ -0,0 +1,157 @@
+/**
+ * parse_cache.c
+ * Cache of parsed command lines. Loops, scripts and history recall run the
+ * same literal lines over and over; a hit hands out the command list that
+ * was built the first time instead of lexing and allocating again.
+ *
+ * @author Vladyslav (Vlad) Maliutin
+ */
+
+#include "lab.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief FNV-1a hash of a line.
+ *
+ * @param s Line to hash.
+ * @param len Length of the line.
+ * @return Hash value.
+ */
+static uint64_t hash_line(const char *s, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/**
+ * @brief Initializes an empty cache.
+ *
+ * @param pc Cache instance.
+ * @param max Most lines to remember, 0 to disable the cache.
+ */
+void parse_cache_init(struct parse_cache *pc, size_t max) {
+    memset(pc, 0, sizeof(*pc));
+    pc->max = max;
+}
+
+/**
+ * @brief Unlinks an entry from the recency list.
+ *
+ * @param pc Cache instance.
+ * @param e Entry to unlink.
+ */
+static void lru_unlink(struct parse_cache *pc, struct parse_entry *e) {
+    if (e->newer) e->newer->older = e->older;
+    else pc->newest = e->older;
+    if (e->older) e->older->newer = e->newer;
+    else pc->oldest = e->newer;
+    e->newer = e->older = NULL;
+}
+
+/**
+ * @brief Makes an entry the most recently used one.
+ *
+ * @param pc Cache instance.
+ * @param e Entry, not currently linked.
+ */
+static void lru_push(struct parse_cache *pc, struct parse_entry *e) {
+    e->older = pc->newest;
+    if (pc->newest) pc->newest->newer = e;
+    pc->newest = e;
+    if (!pc->oldest) pc->oldest = e;
+}
+
+/**
+ * @brief Removes an entry and drops the cache's reference to its list.
+ *
+ * @param pc Cache instance.
+ * @param e Entry to remove.
+ */
+static void evict(struct parse_cache *pc, struct parse_entry *e) {
+    struct parse_entry **link = &pc->buckets[e->hash & (pc->nbuckets - 1)];
+    while (*link != e) link = &(*link)->chain;
+    *link = e->chain;
+    lru_unlink(pc, e);
+    list_free(e->list);
+    free(e);
+    pc->count--;
+}
+
+/**
+ * @brief Removes every entry; lists still referenced elsewhere stay valid.
+ *
+ * @param pc Cache instance.
+ */
+void parse_cache_clear(struct parse_cache *pc) {
+    while (pc->oldest) evict(pc, pc->oldest);
+}
+
+/**
+ * @brief Frees every entry and the table.
+ *
+ * @param pc Cache instance.
+ */
+void parse_cache_destroy(struct parse_cache *pc) {
+    parse_cache_clear(pc);
+    free(pc->buckets);
+    parse_cache_init(pc, pc->max);
+}
+
+/**
+ * @brief Returns the command list for a line, parsing it only on a miss.
+ *
+ * @param pc Cache instance.
+ * @param line Trimmed line, not necessarily NUL terminated.
+ * @param len Length of the line.
+ * @return A reference to the list (release it with list_free) or NULL on a
+ * syntax error.
+ */
+struct cmd_list *parse_cache_get(struct parse_cache *pc, const char *line, size_t len) {
+    if (pc->max == 0) return list_parse_n(line, len);
+
+    unsigned long long hash = hash_line(line, len);
+    if (pc->buckets) {
+        for (struct parse_entry *e = pc->buckets[hash & (pc->nbuckets - 1)]; e; e = e->chain) {
+            if (e->hash == hash && e->len == len && memcmp(e->line, line, len) == 0) {
+                pc->hits++;
+                lru_unlink(pc, e);
+                lru_push(pc, e);
+                return list_ref(e->list);
+            }
+        }
+    }
+
+    /* Lines with syntax errors are not remembered, so the error repeats */
+    pc->misses++;
+    struct cmd_list *list = list_parse_n(line, len);
+    if (!list) return NULL;
+
+    if (!pc->buckets) {
+        /* A load factor of at most one half keeps the chains short */
+        size_t n = 1;
+        while (n < pc->max * 2) n <<= 1;
+        pc->buckets = calloc(n, sizeof(*pc->buckets));
+        if (!pc->buckets) return list;
+        pc->nbuckets = n;
+    }
+    struct parse_entry *e = malloc(sizeof(*e) + len);
+    if (!e) return list;
+    if (pc->count == pc->max) evict(pc, pc->oldest);
+
+    e->hash = hash;
+    e->len = len;
+    memcpy(e->line, line, len);
+    e->list = list_ref(list);
+    e->newer = e->older = NULL;
+    struct parse_entry **bucket = &pc->buckets[hash & (pc->nbuckets - 1)];
+    e->chain = *bucket;
+    *bucket = e;
+    lru_push(pc, e);
+    pc->count++;
+    return list;
+}
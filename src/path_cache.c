@@ -0,0 +1,226 @@
+/**
+ * path_cache.c
+ * Command location cache. Remembers where each command was found in PATH so
+ * that launching it again is a single execve instead of a PATH walk.
+ *
+ * @author Vladyslav (Vlad) Maliutin
+ */
+
+#include "lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define PATH_CACHE_INITIAL 64
+
+/**
+ * @brief FNV-1a hash of a command name.
+ *
+ * @param s Name to hash.
+ * @return Hash value.
+ */
+static size_t hash_name(const char *s) {
+    size_t h = 14695981039346656037ULL;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/**
+ * @brief Finds the slot for name, either the one holding it or the empty
+ * slot where it would be inserted.
+ *
+ * @param pc Cache instance.
+ * @param name Command name.
+ * @return Pointer to the slot.
+ */
+static struct path_entry *find_slot(struct path_cache *pc, const char *name) {
+    size_t mask = pc->capacity - 1;
+    size_t i = hash_name(name) & mask;
+    while (pc->slots[i].name && strcmp(pc->slots[i].name, name) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &pc->slots[i];
+}
+
+/**
+ * @brief Doubles the table and reinserts every entry.
+ *
+ * @param pc Cache instance.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+static int grow(struct path_cache *pc) {
+    struct path_entry *old = pc->slots;
+    size_t old_cap = pc->capacity;
+    size_t cap = old_cap ? old_cap * 2 : PATH_CACHE_INITIAL;
+
+    struct path_entry *slots = calloc(cap, sizeof(*slots));
+    if (!slots) return -1;
+    pc->slots = slots;
+    pc->capacity = cap;
+
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].name) *find_slot(pc, old[i].name) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/**
+ * @brief Searches every PATH directory for an executable regular file.
+ *
+ * @param path Value of PATH.
+ * @param name Command name.
+ * @return Newly allocated full path or NULL if not found.
+ */
+static char *search_path(const char *path, const char *name) {
+    size_t name_len = strlen(name);
+    char *buf = malloc(sh_limits()->path_max + 1);
+    if (!buf) return NULL;
+
+    const char *dir = path;
+    for (;;) {
+        const char *end = strchr(dir, ':');
+        size_t dir_len = end ? (size_t)(end - dir) : strlen(dir);
+        /* An empty PATH element means the current directory */
+        if (dir_len == 0) {
+            dir = ".";
+            dir_len = 1;
+        }
+        if (dir_len + name_len + 2 <= (size_t)sh_limits()->path_max) {
+            memcpy(buf, dir, dir_len);
+            buf[dir_len] = '/';
+            memcpy(buf + dir_len + 1, name, name_len + 1);
+
+            struct stat st;
+            if (stat(buf, &st) == 0 && S_ISREG(st.st_mode) && access(buf, X_OK) == 0) {
+                char *found = strdup(buf);
+                free(buf);
+                return found;
+            }
+        }
+        if (!end) break;
+        dir = end + 1;
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * @brief Initializes an empty cache.
+ *
+ * @param pc Cache instance.
+ */
+void path_cache_init(struct path_cache *pc) {
+    pc->slots = NULL;
+    pc->capacity = 0;
+    pc->count = 0;
+    pc->path_env = NULL;
+}
+
+/**
+ * @brief Removes every entry but keeps the table allocated.
+ *
+ * @param pc Cache instance.
+ */
+void path_cache_clear(struct path_cache *pc) {
+    for (size_t i = 0; i < pc->capacity; i++) {
+        free(pc->slots[i].name);
+        free(pc->slots[i].path);
+        pc->slots[i].name = NULL;
+        pc->slots[i].path = NULL;
+        pc->slots[i].hits = 0;
+    }
+    pc->count = 0;
+}
+
+/**
+ * @brief Removes the entry for one name, if there is one. Entries further
+ * along its probe run are moved back so that lookups still reach them.
+ *
+ * @param pc Cache instance.
+ * @param name Command name.
+ */
+void path_cache_forget(struct path_cache *pc, const char *name) {
+    if (!pc->capacity || !name) return;
+    struct path_entry *e = find_slot(pc, name);
+    if (!e->name) return;
+    free(e->name);
+    free(e->path);
+
+    size_t mask = pc->capacity - 1, hole = e - pc->slots;
+    for (size_t j = (hole + 1) & mask; pc->slots[j].name; j = (j + 1) & mask) {
+        /* An entry may fill the hole if the hole lies on its way from home */
+        size_t home = hash_name(pc->slots[j].name) & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            pc->slots[hole] = pc->slots[j];
+            hole = j;
+        }
+    }
+    pc->slots[hole].name = NULL;
+    pc->slots[hole].path = NULL;
+    pc->slots[hole].hits = 0;
+    pc->count--;
+}
+
+/**
+ * @brief Frees every entry and the table.
+ *
+ * @param pc Cache instance.
+ */
+void path_cache_destroy(struct path_cache *pc) {
+    path_cache_clear(pc);
+    free(pc->slots);
+    free(pc->path_env);
+    path_cache_init(pc);
+}
+
+/**
+ * @brief Resolves a command name to an executable path, caching the result.
+ *
+ * @param pc Cache instance.
+ * @param name Command name.
+ * @return Path owned by the cache, name itself if it contains a slash, or NULL.
+ */
+const char *path_cache_lookup(struct path_cache *pc, const char *name) {
+    if (!name || !*name) return NULL;
+    if (strchr(name, '/')) return name;
+
+    const char *path = getenv("PATH");
+    if (!path) path = "/usr/bin:/bin";
+
+    /* Entries are only valid for the PATH they were resolved against */
+    if (!pc->path_env || strcmp(pc->path_env, path) != 0) {
+        path_cache_clear(pc);
+        free(pc->path_env);
+        pc->path_env = strdup(path);
+    }
+
+    if (pc->capacity) {
+        struct path_entry *e = find_slot(pc, name);
+        if (e->name) {
+            e->hits++;
+            return e->path;
+        }
+    }
+
+    char *found = search_path(path, name);
+    if (!found) return NULL;
+
+    char *key = strdup(name);
+    if (!key || ((pc->count + 1) * 2 > pc->capacity && grow(pc) != 0)) {
+        free(key);
+        free(found);
+        return NULL;
+    }
+    struct path_entry *e = find_slot(pc, name);
+    e->name = key;
+    e->path = found;
+    e->hits = 1;
+    pc->count++;
+    return e->path;
+}
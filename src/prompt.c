@@ -0,0 +1,514 @@
+/**
+ * prompt.c
+ * Prompt escapes. Cheap segments are expanded each time the prompt is
+ * shown; the version control segment, which has to walk up the directory
+ * tree and may hit a slow filesystem, is looked up by a helper thread and
+ * remembered per directory. The prompt shows the remembered value at once
+ * and is redrawn if the helper finds something different.
+ *
+ * @author Vladyslav (Vlad) Maliutin
+ */
+
+#define _GNU_SOURCE
+#include "lab.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <readline/readline.h>
+
+/* Longest HEAD file worth reading, a ref name or a commit id */
+#define HEAD_MAX 256
+
+/* Looked up once, neither changes while the shell runs */
+static char user_name[256];
+static char host_name[256];
+
+/**
+ * Growing output buffer of prompt_expand.
+ */
+struct prompt_buf {
+    char *s;
+    size_t len;
+    size_t cap;
+};
+
+/**
+ * @brief Appends n bytes to the buffer.
+ *
+ * @param b Buffer.
+ * @param s Bytes to append.
+ * @param n Number of bytes.
+ */
+static void put(struct prompt_buf *b, const char *s, size_t n) {
+    if (!b->s) return;
+    if (b->len + n + 1 > b->cap) {
+        size_t cap = (b->len + n + 1) * 2;
+        char *grown = realloc(b->s, cap);
+        if (!grown) {
+            free(b->s);
+            b->s = NULL;
+            return;
+        }
+        b->s = grown;
+        b->cap = cap;
+    }
+    memcpy(b->s + b->len, s, n);
+    b->len += n;
+    b->s[b->len] = '\0';
+}
+
+/**
+ * @brief Appends a string to the buffer.
+ *
+ * @param b Buffer.
+ * @param s String to append.
+ */
+static void puts_buf(struct prompt_buf *b, const char *s) {
+    put(b, s, strlen(s));
+}
+
+/**
+ * @brief Reads a small file into buf.
+ *
+ * @param path File to read.
+ * @param buf Receives the contents, NUL terminated and without trailing
+ * whitespace.
+ * @param size Size of buf.
+ * @return True on success.
+ */
+static bool read_small(const char *path, char *buf, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0) return false;
+    while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == ' ' || buf[n - 1] == '\r')) n--;
+    buf[n] = '\0';
+    return true;
+}
+
+/**
+ * @brief Names what HEAD points at in a git directory: the branch, or the
+ * first seven digits of a detached commit.
+ *
+ * @param gitdir Path of the git directory.
+ * @return Newly allocated segment, NULL if HEAD could not be read.
+ */
+static char *head_of(const char *gitdir) {
+    size_t n = strlen(gitdir);
+    char *path = malloc(n + sizeof("/HEAD"));
+    if (!path) return NULL;
+    memcpy(path, gitdir, n);
+    memcpy(path + n, "/HEAD", sizeof("/HEAD"));
+    char head[HEAD_MAX];
+    bool ok = read_small(path, head, sizeof(head));
+    free(path);
+    if (!ok) return NULL;
+
+    if (strncmp(head, "ref: ", 5) == 0) {
+        const char *ref = head + 5;
+        if (strncmp(ref, "refs/heads/", 11) == 0) ref += 11;
+        return strdup(ref);
+    }
+    head[7] = '\0';
+    return strdup(head);
+}
+
+/**
+ * @brief Finds the repository holding dir and names its HEAD. A .git file
+ * (worktrees, submodules) points at the real git directory.
+ *
+ * @param dir Absolute directory.
+ * @return Newly allocated segment, empty outside a repository.
+ */
+static char *vcs_lookup(const char *dir) {
+    size_t len = strlen(dir);
+    size_t cap = len + HEAD_MAX + sizeof("/.git");
+    char *path = malloc(cap);
+    char *found = NULL;
+    if (!path) return strdup("");
+    memcpy(path, dir, len);
+
+    for (;;) {
+        memcpy(path + len, "/.git", sizeof("/.git"));
+        struct stat st;
+        if (stat(path, &st) == 0) {
+            char link[HEAD_MAX];
+            if (S_ISDIR(st.st_mode)) {
+                found = head_of(path);
+            } else if (read_small(path, link, sizeof(link)) && strncmp(link, "gitdir: ", 8) == 0) {
+                /* A relative gitdir is relative to the directory of the file */
+                if (link[8] == '/') {
+                    found = head_of(link + 8);
+                } else {
+                    path[len] = '/';
+                    memcpy(path + len + 1, link + 8, strlen(link + 8) + 1);
+                    found = head_of(path);
+                }
+            }
+            break;
+        }
+        if (len == 0) break;
+        while (len > 0 && path[len - 1] != '/') len--;
+        if (len > 0) len--;
+    }
+    free(path);
+    return found ? found : strdup("");
+}
+
+/**
+ * @brief Remembers the segment found for dir, taking ownership of both.
+ * The oldest entry makes room when the cache is full. Called with the lock
+ * held.
+ *
+ * @param ps Prompt state.
+ * @param dir Directory.
+ * @param segment What was found there.
+ * @return True if this differs from what was remembered before.
+ */
+static bool vcs_store(struct prompt_state *ps, char *dir, char *segment) {
+    struct vcs_entry *slot = NULL;
+    for (size_t i = 0; i < PROMPT_VCS_CACHE; i++) {
+        struct vcs_entry *e = &ps->cache[i];
+        if (e->dir && strcmp(e->dir, dir) == 0) {
+            slot = e;
+            break;
+        }
+        if (!slot || !e->dir || (slot->dir && e->used < slot->used)) slot = e;
+    }
+    const char *before = slot->dir && strcmp(slot->dir, dir) == 0 ? slot->segment : NULL;
+    bool changed = strcmp(before ? before : "", segment ? segment : "") != 0;
+    free(slot->dir);
+    free(slot->segment);
+    slot->dir = dir;
+    slot->segment = segment;
+    slot->used = ++ps->tick;
+    return changed;
+}
+
+/**
+ * @brief Body of the helper thread: looks up each directory it is handed
+ * and signals the event loop when the answer changed.
+ *
+ * @param arg Prompt state.
+ * @return NULL.
+ */
+static void *vcs_worker(void *arg) {
+    struct prompt_state *ps = arg;
+    pthread_mutex_lock(&ps->lock);
+    for (;;) {
+        while (!ps->pending && !ps->quit) pthread_cond_wait(&ps->wake, &ps->lock);
+        if (ps->quit) break;
+        char *dir = ps->pending;
+        ps->pending = NULL;
+        pthread_mutex_unlock(&ps->lock);
+
+        char *segment = vcs_lookup(dir);
+        pthread_mutex_lock(&ps->lock);
+        if (vcs_store(ps, dir, segment)) {
+            uint64_t one = 1;
+            if (write(ps->eventfd, &one, sizeof(one)) < 0) {
+                /* The counter is already nonzero, the loop will wake up */
+            }
+        }
+    }
+    pthread_mutex_unlock(&ps->lock);
+    return NULL;
+}
+
+/**
+ * @brief Starts the helper thread with every signal blocked, so signals
+ * keep going to the main thread's signalfd.
+ *
+ * @param sh Shell instance.
+ * @return True if the thread is running.
+ */
+static bool start_worker(struct shell *sh) {
+    struct prompt_state *ps = &sh->prompt_info;
+    if (ps->running) return true;
+    ps->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ps->eventfd < 0) return false;
+
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int rc = pthread_create(&ps->thread, NULL, vcs_worker, ps);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        close(ps->eventfd);
+        ps->eventfd = -1;
+        return false;
+    }
+    ps->running = true;
+    sh_loop_watch_prompt(sh);
+    return true;
+}
+
+/**
+ * @brief Initializes the prompt state.
+ *
+ * @param sh Shell instance.
+ */
+void prompt_init(struct shell *sh) {
+    struct prompt_state *ps = &sh->prompt_info;
+    memset(ps, 0, sizeof(*ps));
+    ps->eventfd = -1;
+    pthread_mutex_init(&ps->lock, NULL);
+    pthread_cond_init(&ps->wake, NULL);
+}
+
+/**
+ * @brief Stops the helper thread and frees everything.
+ *
+ * @param sh Shell instance.
+ */
+void prompt_destroy(struct shell *sh) {
+    struct prompt_state *ps = &sh->prompt_info;
+    if (ps->running) {
+        pthread_mutex_lock(&ps->lock);
+        ps->quit = true;
+        pthread_cond_signal(&ps->wake);
+        pthread_mutex_unlock(&ps->lock);
+        pthread_join(ps->thread, NULL);
+        sh_loop_unwatch_fd(ps->eventfd);
+    }
+    free(ps->pending);
+    for (size_t i = 0; i < PROMPT_VCS_CACHE; i++) {
+        free(ps->cache[i].dir);
+        free(ps->cache[i].segment);
+    }
+    free(ps->shown);
+    pthread_mutex_destroy(&ps->lock);
+    pthread_cond_destroy(&ps->wake);
+    memset(ps, 0, sizeof(*ps));
+    ps->eventfd = -1;
+}
+
+/**
+ * @brief Appends the remembered segment for dir, and unless only
+ * redrawing, asks the helper thread to look at dir again.
+ *
+ * @param sh Shell instance.
+ * @param b Buffer.
+ * @param dir Working directory.
+ * @param revalidate True to queue a fresh lookup.
+ */
+static void put_vcs(struct shell *sh, struct prompt_buf *b, const char *dir, bool revalidate) {
+    struct prompt_state *ps = &sh->prompt_info;
+    if (!dir || (revalidate && !start_worker(sh)) || !ps->running) return;
+    pthread_mutex_lock(&ps->lock);
+    for (size_t i = 0; i < PROMPT_VCS_CACHE; i++) {
+        struct vcs_entry *e = &ps->cache[i];
+        if (e->dir && strcmp(e->dir, dir) == 0) {
+            puts_buf(b, e->segment ? e->segment : "");
+            e->used = ++ps->tick;
+            break;
+        }
+    }
+    if (revalidate) {
+        char *copy = strdup(dir);
+        if (copy) {
+            free(ps->pending);
+            ps->pending = copy;
+            pthread_cond_signal(&ps->wake);
+        }
+    }
+    pthread_mutex_unlock(&ps->lock);
+}
+
+/**
+ * @brief Appends the working directory with the home directory shown as ~.
+ *
+ * @param b Buffer.
+ * @param cwd Working directory.
+ * @param base True for the last component only.
+ */
+static void put_cwd(struct prompt_buf *b, const char *cwd, bool base) {
+    if (!cwd) return;
+    const char *home = sh_home_dir();
+    size_t n = home ? strlen(home) : 0;
+    if (n > 1 && strncmp(cwd, home, n) == 0 && (cwd[n] == '/' || cwd[n] == '\0')) {
+        if (base && cwd[n] == '/') {
+            puts_buf(b, strrchr(cwd, '/') + 1);
+        } else {
+            puts_buf(b, "~");
+            if (!base) puts_buf(b, cwd + n);
+        }
+        return;
+    }
+    const char *slash = strrchr(cwd, '/');
+    puts_buf(b, base && slash && slash[1] ? slash + 1 : cwd);
+}
+
+/**
+ * @brief Appends how long the last command took: milliseconds under a
+ * second, tenths of seconds under a minute, then minutes and seconds.
+ *
+ * @param b Buffer.
+ * @param ms Duration.
+ */
+static void put_duration(struct prompt_buf *b, long ms) {
+    char num[48];
+    if (ms < 1000) snprintf(num, sizeof(num), "%ldms", ms);
+    else if (ms < 60000) snprintf(num, sizeof(num), "%ld.%lds", ms / 1000, ms % 1000 / 100);
+    else snprintf(num, sizeof(num), "%ldm%02lds", ms / 60000, ms % 60000 / 1000);
+    puts_buf(b, num);
+}
+
+/**
+ * @brief Expands a template, see lab.h.
+ *
+ * @param sh Shell instance.
+ * @param fmt Template.
+ * @param revalidate False when redrawing for the helper thread's news.
+ * @return Newly allocated prompt, NULL if memory ran out.
+ */
+static char *expand(struct shell *sh, const char *fmt, bool revalidate) {
+    struct prompt_buf b = { malloc(64), 0, 64 };
+    if (!b.s) return NULL;
+    b.s[0] = '\0';
+    char *cwd = NULL;
+    bool have_cwd = false;
+    char num[32];
+
+    for (const char *p = fmt; *p && b.s; p++) {
+        if (*p == '$' && p[1] == '?') {
+            snprintf(num, sizeof(num), "%d", sh->last_status);
+            puts_buf(&b, num);
+            p++;
+            continue;
+        }
+        if (*p != '\\' || !p[1]) {
+            put(&b, p, 1);
+            continue;
+        }
+        char c = *++p;
+        if (!have_cwd && (c == 'w' || c == 'W' || c == 'g')) {
+            cwd = getcwd(NULL, 0);
+            have_cwd = true;
+        }
+        switch (c) {
+        case 'u':
+            if (!user_name[0]) {
+                struct passwd *pw = getpwuid(geteuid());
+                const char *name = pw ? pw->pw_name : getenv("USER");
+                snprintf(user_name, sizeof(user_name), "%s", name ? name : "?");
+            }
+            puts_buf(&b, user_name);
+            break;
+        case 'h':
+        case 'H':
+            if (!host_name[0] && gethostname(host_name, sizeof(host_name) - 1) != 0)
+                strcpy(host_name, "?");
+            put(&b, host_name, c == 'h' ? strcspn(host_name, ".") : strlen(host_name));
+            break;
+        case 'w':
+        case 'W':
+            put_cwd(&b, cwd, c == 'W');
+            break;
+        case 'j': {
+            size_t live = 0;
+            for (size_t i = 0; i < sh->jobs.count; i++)
+                if (sh->jobs.jobs[i]->state != JOB_DONE) live++;
+            snprintf(num, sizeof(num), "%zu", live);
+            puts_buf(&b, num);
+            break;
+        }
+        case 'D':
+            put_duration(&b, sh->prompt_info.duration_ms);
+            break;
+        case '$':
+            puts_buf(&b, geteuid() == 0 ? "#" : "$");
+            break;
+        case 'g':
+            put_vcs(sh, &b, cwd, revalidate);
+            break;
+        case 'n':
+            puts_buf(&b, "\n");
+            break;
+        case 'e':
+            puts_buf(&b, "\033");
+            break;
+        case '[':
+            puts_buf(&b, "\001");
+            break;
+        case ']':
+            puts_buf(&b, "\002");
+            break;
+        case '\\':
+            puts_buf(&b, "\\");
+            break;
+        default:
+            put(&b, p - 1, 2);
+            break;
+        }
+    }
+    free(cwd);
+    return b.s;
+}
+
+/**
+ * @brief Expands a template, see lab.h.
+ *
+ * @param sh Shell instance.
+ * @param fmt Template.
+ * @return Newly allocated prompt, NULL if memory ran out.
+ */
+char *prompt_expand(struct shell *sh, const char *fmt) {
+    return expand(sh, fmt, true);
+}
+
+/**
+ * @brief Template of the prompt: MY_PROMPT as it is now, so changing it
+ * takes effect at the next prompt, or the default.
+ *
+ * @param sh Shell instance.
+ * @return The template.
+ */
+static const char *prompt_template(struct shell *sh) {
+    const char *fmt = getenv("MY_PROMPT");
+    return fmt ? fmt : sh->prompt;
+}
+
+/**
+ * @brief Renders the prompt to show now.
+ *
+ * @param sh Shell instance.
+ * @return The prompt, owned by the shell.
+ */
+const char *prompt_render(struct shell *sh) {
+    char *p = prompt_expand(sh, prompt_template(sh));
+    if (p) {
+        free(sh->prompt_info.shown);
+        sh->prompt_info.shown = p;
+    }
+    return sh->prompt_info.shown ? sh->prompt_info.shown : sh->prompt;
+}
+
+/**
+ * @brief Redraws the prompt after the helper thread found something new.
+ *
+ * @param sh Shell instance.
+ * @param showing True if readline is waiting for input.
+ */
+void prompt_update(struct shell *sh, bool showing) {
+    struct prompt_state *ps = &sh->prompt_info;
+    uint64_t count;
+    while (read(ps->eventfd, &count, sizeof(count)) > 0) continue;
+    /* Otherwise the next prompt picks the news up from the cache */
+    if (!showing) return;
+    char *p = expand(sh, prompt_template(sh), false);
+    if (!p || (ps->shown && strcmp(p, ps->shown) == 0)) {
+        free(p);
+        return;
+    }
+    free(ps->shown);
+    ps->shown = p;
+    rl_set_prompt(ps->shown);
+    rl_forced_update_display();
+    fflush(rl_outstream ? rl_outstream : stdout);
+}
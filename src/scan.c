@@ -0,0 +1,349 @@
+/**
+ * scan.c
+ * Vectorized byte class scanning for the lexer and trim_white. Each step
+ * classifies 16 (SSE2) or 32 (AVX2) bytes against a prepared character
+ * set; the implementation is picked at runtime from what the CPU supports,
+ * with a portable scalar version as the fallback.
+ *
+ * Forward scans use aligned loads only and stop at a NUL or after a given
+ * length, so a load never touches a page the input does not reach into.
+ * That also makes them safe on views into a mapped file.
+ *
+ * @author Vladyslav (Vlad) Maliutin
+ */
+
+#include "lab.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+The aligned loads may read past the terminating NUL (never past its page),
+which AddressSanitizer would report when the shell is built with make debug
+*/
+#define SCAN_NO_ASAN __attribute__((no_sanitize_address))
+
+/* Signatures shared by every implementation */
+typedef size_t (*scan_fn)(const char *s, size_t len, const struct scan_set *set, bool in_set);
+typedef size_t (*rscan_fn)(const char *s, size_t len, const struct scan_set *set);
+
+/**
+ * @brief Prepares a character set for the scanners. Besides a plain lookup
+ * table it builds the two 16 entry nibble tables used by the AVX2 code: a
+ * byte is in the set when lo[byte & 15] & hi[byte >> 4] is not zero. That
+ * is exact as long as the characters have at most 8 distinct high nibbles.
+ *
+ * @param set Set to fill in.
+ * @param chars Characters of the set, at most SCAN_MAX_SET.
+ */
+void sh_scan_set_init(struct scan_set *set, const char *chars) {
+    memset(set, 0, sizeof(*set));
+    unsigned char bit_of[16] = { 0 };
+    unsigned bits = 0;
+    for (const unsigned char *c = (const unsigned char *)chars; *c; c++) {
+        set->table[*c] = true;
+        if (set->n < SCAN_MAX_SET) set->chars[set->n] = *c;
+        set->n++;
+
+        unsigned hi = *c >> 4;
+        if (!bit_of[hi] && bits < 8) bit_of[hi] = 1u << bits++;
+        set->hi[hi] = bit_of[hi];
+        set->lo[*c & 15] |= bit_of[hi];
+    }
+    /* Too many distinct high nibbles leave some characters without a bit */
+    set->nibble = true;
+    for (const unsigned char *c = (const unsigned char *)chars; *c; c++)
+        if (!bit_of[*c >> 4]) set->nibble = false;
+}
+
+/**
+ * @brief Scalar scan: length of the prefix of s[0..len) whose bytes are
+ * not (in_set true) or are (in_set false) in set. NUL always ends the scan.
+ *
+ * @param s String.
+ * @param len Most bytes to look at, SIZE_MAX for the whole string.
+ * @param set Prepared set.
+ * @param in_set True to stop at the first byte in set, false at the first not in it.
+ * @return Length of the prefix.
+ */
+static size_t scan_scalar(const char *s, size_t len, const struct scan_set *set, bool in_set) {
+    const unsigned char *p = (const unsigned char *)s;
+    const unsigned char *end = len < SIZE_MAX ? p + len : NULL;
+    while (p != end && *p && set->table[*p] != in_set) p++;
+    return (const char *)p - s;
+}
+
+/**
+ * @brief Scalar reverse scan: number of trailing bytes of s[0..len) in set.
+ *
+ * @param s String.
+ * @param len Length of s.
+ * @param set Prepared set.
+ * @return Number of trailing bytes in set.
+ */
+static size_t rscan_scalar(const char *s, size_t len, const struct scan_set *set) {
+    size_t end = len;
+    while (end > 0 && set->table[(unsigned char)s[end - 1]]) end--;
+    return len - end;
+}
+
+#ifdef SCAN_X86
+/* SSE2 has no byte shuffle, so membership is one compare per set character */
+struct sse2_set
+{
+    __m128i c[SCAN_MAX_SET];
+    size_t n;
+};
+
+/**
+ * @brief Broadcasts every character of a set to its own register.
+ *
+ * @param v Receives the broadcasts.
+ * @param set Prepared set.
+ */
+static inline void sse2_set_load(struct sse2_set *v, const struct scan_set *set) {
+    v->n = set->n;
+    for (size_t i = 0; i < set->n; i++) v->c[i] = _mm_set1_epi8((char)set->chars[i]);
+}
+
+/**
+ * @brief Marks the bytes of b that are in the set.
+ *
+ * @param b 16 bytes of input.
+ * @param v Broadcast set.
+ * @return Bit i set if byte i is in the set.
+ */
+static inline unsigned sse2_match(__m128i b, const struct sse2_set *v) {
+    __m128i m = _mm_setzero_si128();
+    for (size_t i = 0; i < v->n; i++) m = _mm_or_si128(m, _mm_cmpeq_epi8(b, v->c[i]));
+    return (unsigned)_mm_movemask_epi8(m);
+}
+
+/**
+ * @brief Bytes of b where a forward scan stops: NUL, and set members
+ * (in_set) or non-members (!in_set).
+ */
+static inline unsigned sse2_stops(__m128i b, const struct sse2_set *v, bool in_set) {
+    unsigned in = sse2_match(b, v);
+    if (!in_set) return ~in & 0xffffu;
+    return in | (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(b, _mm_setzero_si128()));
+}
+
+/**
+ * @brief SSE2 version of scan_scalar.
+ */
+SCAN_NO_ASAN static size_t
+scan_sse2(const char *s, size_t len, const struct scan_set *set, bool in_set) {
+    struct sse2_set v;
+    sse2_set_load(&v, set);
+
+    /* Start at the aligned block holding s and ignore the bytes before it */
+    const char *p = (const char *)((uintptr_t)s & ~(uintptr_t)15);
+    unsigned skip = s - p;
+    unsigned mask = sse2_stops(_mm_load_si128((const __m128i *)p), &v, in_set) >> skip << skip;
+    size_t seen = 16 - skip;
+    while (!mask) {
+        /* The next block is only loaded if it holds a byte of the input */
+        if (seen >= len) return len;
+        p += 16;
+        seen += 16;
+        mask = sse2_stops(_mm_load_si128((const __m128i *)p), &v, in_set);
+    }
+    size_t n = p + __builtin_ctz(mask) - s;
+    return n < len ? n : len;
+}
+
+/**
+ * @brief SSE2 version of rscan_scalar. It stays inside [s, s + len), so
+ * unaligned loads are safe.
+ */
+static size_t rscan_sse2(const char *s, size_t len, const struct scan_set *set) {
+    struct sse2_set v;
+    sse2_set_load(&v, set);
+
+    size_t end = len;
+    while (end >= 16) {
+        unsigned keep = ~sse2_match(_mm_loadu_si128((const __m128i *)(s + end - 16)), &v) & 0xffffu;
+        if (keep) return len - (end - 16 + 32 - __builtin_clz(keep));
+        end -= 16;
+    }
+    return len - end + rscan_scalar(s, end, set);
+}
+
+/**
+ * @brief Marks the bytes of b that are in the set with two nibble lookups.
+ *
+ * @param b 32 bytes of input.
+ * @param lo Low nibble table, repeated in both lanes.
+ * @param hi High nibble table, repeated in both lanes.
+ * @return Bit i set if byte i is in the set.
+ */
+__attribute__((target("avx2"))) static inline uint32_t
+avx2_match(__m256i b, __m256i lo, __m256i hi) {
+    __m256i nib = _mm256_set1_epi8(0x0f);
+    __m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(b, nib));
+    __m256i h = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(b, 4), nib));
+    __m256i none = _mm256_cmpeq_epi8(_mm256_and_si256(l, h), _mm256_setzero_si256());
+    return ~(uint32_t)_mm256_movemask_epi8(none);
+}
+
+/**
+ * @brief AVX2 counterpart of sse2_stops for 32 bytes.
+ */
+__attribute__((target("avx2"))) static inline uint32_t
+avx2_stops(__m256i b, __m256i lo, __m256i hi, bool in_set) {
+    uint32_t in = avx2_match(b, lo, hi);
+    if (!in_set) return ~in;
+    return in | (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, _mm256_setzero_si256()));
+}
+
+/**
+ * @brief AVX2 version of scan_scalar.
+ */
+SCAN_NO_ASAN __attribute__((target("avx2"))) static size_t
+scan_avx2(const char *s, size_t len, const struct scan_set *set, bool in_set) {
+    if (!set->nibble) return scan_sse2(s, len, set, in_set);
+    __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->lo));
+    __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->hi));
+
+    const char *p = (const char *)((uintptr_t)s & ~(uintptr_t)31);
+    unsigned skip = s - p;
+    uint32_t mask = avx2_stops(_mm256_load_si256((const __m256i *)p), lo, hi, in_set) >> skip << skip;
+    size_t seen = 32 - skip;
+    while (!mask) {
+        if (seen >= len) return len;
+        p += 32;
+        seen += 32;
+        mask = avx2_stops(_mm256_load_si256((const __m256i *)p), lo, hi, in_set);
+    }
+    size_t n = p + __builtin_ctz(mask) - s;
+    return n < len ? n : len;
+}
+
+/**
+ * @brief AVX2 version of rscan_scalar.
+ */
+__attribute__((target("avx2"))) static size_t
+rscan_avx2(const char *s, size_t len, const struct scan_set *set) {
+    if (!set->nibble) return rscan_sse2(s, len, set);
+    __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->lo));
+    __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->hi));
+
+    size_t end = len;
+    while (end >= 32) {
+        uint32_t keep = ~avx2_match(_mm256_loadu_si256((const __m256i *)(s + end - 32)), lo, hi);
+        if (keep) return len - (end - 32 + 32 - __builtin_clz(keep));
+        end -= 32;
+    }
+    return len - end + rscan_sse2(s, end, set);
+}
+#endif
+
+/* Implementation in use, picked on first use */
+static scan_fn scan_impl;
+static rscan_fn rscan_impl;
+
+/**
+ * @brief Selects an implementation, see lab.h.
+ *
+ * @param backend Implementation to use.
+ * @return False if the CPU cannot run it.
+ */
+bool sh_scan_use(enum scan_backend backend) {
+    switch (backend) {
+    case SCAN_SCALAR:
+        scan_impl = scan_scalar;
+        rscan_impl = rscan_scalar;
+        return true;
+#ifdef SCAN_X86
+    case SCAN_SSE2:
+        scan_impl = scan_sse2;
+        rscan_impl = rscan_sse2;
+        return true;
+    case SCAN_AVX2:
+        if (!__builtin_cpu_supports("avx2")) return false;
+        scan_impl = scan_avx2;
+        rscan_impl = rscan_avx2;
+        return true;
+#endif
+    case SCAN_AUTO:
+        return sh_scan_use(SCAN_AVX2) || sh_scan_use(SCAN_SSE2) || sh_scan_use(SCAN_SCALAR);
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Runs the selected forward scan. Sets too large for the vector
+ * code are scanned with the lookup table.
+ */
+static size_t scan(const char *s, size_t len, const struct scan_set *set, bool in_set) {
+    if (!scan_impl) sh_scan_use(SCAN_AUTO);
+    if (len == 0) return 0;
+    if (set->n == 0 || set->n > SCAN_MAX_SET) return scan_scalar(s, len, set, in_set);
+    return scan_impl(s, len, set, in_set);
+}
+
+/**
+ * @brief Length of the prefix of s without any byte from the set.
+ *
+ * @param s NUL terminated string.
+ * @param set Characters to stop at.
+ * @return Same as strcspn with the set's characters.
+ */
+size_t sh_strcspn(const char *s, const struct scan_set *set) {
+    return scan(s, SIZE_MAX, set, true);
+}
+
+/**
+ * @brief Length of the prefix of s made only of bytes from the set.
+ *
+ * @param s NUL terminated string.
+ * @param set Characters to skip.
+ * @return Same as strspn with the set's characters.
+ */
+size_t sh_strspn(const char *s, const struct scan_set *set) {
+    return scan(s, SIZE_MAX, set, false);
+}
+
+/**
+ * @brief sh_strcspn limited to the first len bytes of s.
+ *
+ * @param s String, need not be NUL terminated.
+ * @param len Length of s.
+ * @param set Characters to stop at.
+ * @return Length of the prefix, at most len.
+ */
+size_t sh_strncspn(const char *s, size_t len, const struct scan_set *set) {
+    return scan(s, len, set, true);
+}
+
+/**
+ * @brief sh_strspn limited to the first len bytes of s.
+ *
+ * @param s String, need not be NUL terminated.
+ * @param len Length of s.
+ * @param set Characters to skip.
+ * @return Length of the prefix, at most len.
+ */
+size_t sh_strnspn(const char *s, size_t len, const struct scan_set *set) {
+    return scan(s, len, set, false);
+}
+
+/**
+ * @brief Number of trailing bytes of s[0..len) that are in the set.
+ *
+ * @param s String, need not be NUL terminated.
+ * @param len Length of s.
+ * @param set Characters to skip.
+ * @return Number of trailing bytes in the set.
+ */
+size_t sh_strrspn(const char *s, size_t len, const struct scan_set *set) {
+    if (!rscan_impl) sh_scan_use(SCAN_AUTO);
+    if (set->n == 0 || set->n > SCAN_MAX_SET) return rscan_scalar(s, len, set);
+    return rscan_impl(s, len, set);
+}
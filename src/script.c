@@ -0,0 +1,305 @@
+/**
+ * script.c
+ * Non-interactive input: script files, -c strings and piped stdin. Script
+ * files are mapped and parsed in place; other input is read in large
+ * blocks and split into lines in a buffer. Neither readline nor the
+ * history is involved.
+ *
+ * @author Vladyslav (Vlad) Maliutin
+ */
+
+#include "lab.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define READER_BLOCK 65536
+
+/* Script being run, so parse errors can say where they happened */
+static struct line_reader *where;
+static const char *where_name;
+
+/**
+ * @brief Starts reading lines from a descriptor.
+ *
+ * @param r Reader to set up.
+ * @param fd Descriptor to read, owned by the caller.
+ * @param shared True if commands run from the input inherit fd as well.
+ */
+void reader_init_fd(struct line_reader *r, int fd, bool shared) {
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->shared = shared;
+    r->synced = -1;
+}
+
+/**
+ * @brief Starts reading lines from a string, which is copied.
+ *
+ * @param r Reader to set up.
+ * @param s Text to split into lines.
+ */
+void reader_init_string(struct line_reader *r, const char *s) {
+    reader_init_fd(r, -1, false);
+    r->end = strlen(s);
+    r->cap = r->end + 1;
+    r->buf = malloc(r->cap);
+    if (!r->buf) {
+        r->end = 0;
+    } else {
+        memcpy(r->buf, s, r->end);
+    }
+    r->eof = true;
+}
+
+/**
+ * @brief Starts reading lines from a mapping of a regular file.
+ *
+ * @param r Reader to set up.
+ * @param fd Open file; it may be closed once this returns.
+ * @return False if fd is not a regular file or could not be mapped, in
+ * which case the reader is untouched.
+ */
+bool reader_init_map(struct line_reader *r, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) return false;
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return false;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    reader_init_fd(r, -1, false);
+    r->map = map;
+    r->end = st.st_size;
+    r->eof = true;
+    return true;
+}
+
+/**
+ * @brief Frees the reader's buffer or mapping. A descriptor is left open.
+ *
+ * @param r Reader.
+ */
+void reader_destroy(struct line_reader *r) {
+    if (r->map) munmap((void *)r->map, r->end);
+    free(r->buf);
+    free(r->lines);
+    r->map = NULL;
+    r->buf = NULL;
+    r->lines = NULL;
+    r->start = r->end = r->cap = 0;
+}
+
+/**
+ * @brief Undoes reader_sync once the command is done. If nothing moved the
+ * offset the buffered input is still good and the offset skips past it
+ * again, otherwise a command read some of it and the buffer is dropped.
+ *
+ * @param r Reader.
+ */
+static void reader_resume(struct line_reader *r) {
+    if (r->synced < 0) return;
+    if (lseek(r->fd, 0, SEEK_CUR) == r->synced) {
+        lseek(r->fd, (off_t)(r->end - r->start), SEEK_CUR);
+    } else {
+        r->start = r->end = r->checked = 0;
+        r->eof = false;
+    }
+    r->synced = -1;
+}
+
+/**
+ * @brief Hands the unread part of a shared, seekable input back to the
+ * descriptor before a command runs, so a command reading stdin starts
+ * right after the current line just as if the shell read unbuffered.
+ * Pipes cannot be rewound; whatever is buffered is the shell's.
+ *
+ * @param r Reader.
+ */
+void reader_sync(struct line_reader *r) {
+    if (!r->shared || r->synced >= 0) return;
+    off_t pos = lseek(r->fd, -(off_t)(r->end - r->start), SEEK_CUR);
+    if (pos < 0) {
+        r->shared = false; /* not seekable, stop trying */
+        return;
+    }
+    r->synced = pos;
+}
+
+/**
+ * @brief Reads the next line, see lab.h.
+ *
+ * @param r Reader.
+ * @param len Receives the length of the line.
+ * @return The line without its newline, NULL at the end of the input.
+ */
+const char *reader_next_line(struct line_reader *r, size_t *len) {
+    if (r->map) {
+        /* The line is a view into the mapping; nothing is copied */
+        if (r->start >= r->end) return NULL;
+        const char *line = r->map + r->start;
+        const char *nl = memchr(line, '\n', r->end - r->start);
+        *len = nl ? (size_t)(nl - line) : r->end - r->start;
+        r->line_off = r->start;
+        r->start += *len + (nl != NULL);
+        return line;
+    }
+
+    reader_resume(r);
+    for (;;) {
+        /* Bytes before checked are known not to hold a newline */
+        char *from = r->buf + r->start + r->checked;
+        char *nl = r->buf ? memchr(from, '\n', r->end - r->start - r->checked) : NULL;
+        if (nl || (r->eof && r->start < r->end)) {
+            char *line = r->buf + r->start;
+            char *stop = nl ? nl : r->buf + r->end;
+            *stop = '\0';
+            *len = stop - line;
+            r->start = nl ? (size_t)(nl + 1 - r->buf) : r->end;
+            r->checked = 0;
+            r->lineno++;
+            return line;
+        }
+        if (r->eof) return NULL;
+
+        r->checked = r->end - r->start;
+        if (r->start > 0) {
+            memmove(r->buf, r->buf + r->start, r->end - r->start);
+            r->end -= r->start;
+            r->start = 0;
+        }
+        /* One byte is always kept free for the terminator of a last line */
+        if (r->cap - r->end < READER_BLOCK / 2) {
+            size_t cap = r->cap ? r->cap * 2 : READER_BLOCK;
+            char *buf = realloc(r->buf, cap);
+            if (!buf) {
+                perror("realloc");
+                r->eof = true;
+                continue;
+            }
+            r->buf = buf;
+            r->cap = cap;
+        }
+        ssize_t n = read(r->fd, r->buf + r->end, r->cap - r->end - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) perror("read");
+        if (n <= 0) r->eof = true;
+        else r->end += n;
+    }
+}
+
+/**
+ * @brief Line number of the line last returned. A mapped script is only
+ * indexed when this is called, and only as far as that line, so a script
+ * that never fails is never scanned for line breaks twice.
+ *
+ * @param r Reader.
+ * @return The line number, counting from 1.
+ */
+unsigned long reader_line(struct line_reader *r) {
+    if (!r->map) return r->lineno;
+
+    /* r->lines holds the start of every line after the first */
+    while (r->indexed < r->line_off) {
+        const char *nl = memchr(r->map + r->indexed, '\n', r->line_off - r->indexed);
+        if (!nl) {
+            r->indexed = r->line_off;
+            break;
+        }
+        if (r->nlines == r->lines_cap) {
+            size_t cap = r->lines_cap ? r->lines_cap * 2 : 1024;
+            size_t *lines = realloc(r->lines, cap * sizeof(*lines));
+            if (!lines) return 0;
+            r->lines = lines;
+            r->lines_cap = cap;
+        }
+        r->indexed = nl + 1 - r->map;
+        r->lines[r->nlines++] = r->indexed;
+    }
+
+    /* Lines starting at or before the offset, plus the first line */
+    size_t lo = 0, hi = r->nlines;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (r->lines[mid] <= r->line_off) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo + 1;
+}
+
+/**
+ * @brief Prints a parse error, prefixed with the script and line when a
+ * script is running.
+ *
+ * @param fmt printf style format of the message, without a newline.
+ */
+void sh_parse_error(const char *fmt, ...) {
+    if (where && where_name) fprintf(stderr, "%s: line %lu: ", where_name, reader_line(where));
+    else if (where) fprintf(stderr, "line %lu: ", reader_line(where));
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+/**
+ * @brief Runs every line of the input, see lab.h.
+ *
+ * @param sh Shell instance.
+ * @param r Open reader.
+ * @param name Name used in error messages, NULL for none.
+ * @return The shell's exit status.
+ */
+int sh_run_script(struct shell *sh, struct line_reader *r, const char *name) {
+    where = r;
+    where_name = name;
+    const char *line;
+    size_t len;
+    while ((line = reader_next_line(r, &len))) {
+        line = trim_white_n(line, &len);
+        if (len == 0) continue;
+        reader_sync(r);
+        /* Like other shells, give up on a script with a syntax error */
+        if (!sh_run_line(sh, line, len)) break;
+        jobs_notify(sh);
+    }
+    where = NULL;
+    where_name = NULL;
+    return sh->last_status;
+}
+
+/**
+ * @brief Runs the shell without a terminal, see lab.h.
+ *
+ * @param sh Shell instance.
+ * @return The shell's exit status.
+ */
+int sh_run_batch(struct shell *sh) {
+    struct line_reader r;
+    if (sh->command_string) {
+        reader_init_string(&r, sh->command_string);
+    } else if (sh->script_path) {
+        int fd = open(sh->script_path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "%s: %s\n", sh->script_path, strerror(errno));
+            return 127;
+        }
+        /* A fifo or a file that cannot be mapped is read like stdin */
+        if (reader_init_map(&r, fd)) {
+            close(fd);
+        } else {
+            reader_init_fd(&r, fd, false);
+        }
+    } else {
+        reader_init_fd(&r, STDIN_FILENO, true);
+    }
+    int status = sh_run_script(sh, &r, sh->script_path);
+    if (r.fd >= 0 && r.fd != STDIN_FILENO) close(r.fd);
+    reader_destroy(&r);
+    return status;
+}
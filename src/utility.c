@@ -0,0 +1,588 @@
+/**
+ * utility.c
+ * Builtin versions of the small utilities scripts run most: echo, printf,
+ * test and [, true, false and pwd. Run inside the shell they cost a
+ * function call instead of a fork and an exec.
+ *
+ * @author Vladyslav (Vlad) Maliutin
+ */
+
+#define _GNU_SOURCE
+#include "lab.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+/* Longest conversion specification printf builds, e.g. "%-+#0123.456lld" */
+#define SPEC_MAX 64
+
+/**
+ * @brief Writes the character a backslash escape stands for.
+ *
+ * @param p Text right after the backslash.
+ * @param echo_style True for echo -e and %b, where octal escapes start
+ * with \0 and \c ends all output; false for a printf format, where octal
+ * escapes are \nnn.
+ * @param stop Set when \c was seen.
+ * @return Number of characters consumed after the backslash.
+ */
+static size_t put_escape(const char *p, bool echo_style, bool *stop) {
+    static const char from[] = "abefnrtv\\\"'";
+    static const char to[] = "\a\b\033\f\n\r\t\v\\\"'";
+    const char *hit = *p ? strchr(from, *p) : NULL;
+    if (hit) {
+        putchar(to[hit - from]);
+        return 1;
+    }
+    if (*p == 'c' && echo_style) {
+        *stop = true;
+        return 1;
+    }
+    size_t used = 0;
+    int value = 0;
+    if (*p == 'x' && isxdigit((unsigned char)p[1])) {
+        for (used = 1; used < 3 && isxdigit((unsigned char)p[used]); used++)
+            value = value * 16 + (isdigit((unsigned char)p[used]) ? p[used] - '0'
+                                                                  : tolower((unsigned char)p[used]) - 'a' + 10);
+        putchar(value);
+        return used;
+    }
+    /* \0nnn for echo, \nnn for printf */
+    size_t first = echo_style ? (*p == '0' ? 1 : 0) : 0;
+    if ((echo_style && *p == '0') || (!echo_style && *p >= '0' && *p <= '7')) {
+        for (used = first; used < first + 3 && p[used] >= '0' && p[used] <= '7'; used++)
+            value = value * 8 + (p[used] - '0');
+        putchar(value);
+        return used;
+    }
+    putchar('\\');
+    return 0;
+}
+
+/**
+ * @brief Writes text, expanding backslash escapes echo style.
+ *
+ * @param s Text.
+ * @return False if \c ended the output.
+ */
+static bool put_escaped(const char *s) {
+    bool stop = false;
+    for (; *s && !stop; s++) {
+        if (*s == '\\' && s[1]) s += put_escape(s + 1, true, &stop);
+        else putchar(*s);
+    }
+    return !stop;
+}
+
+/**
+ * @brief Builtin echo: prints its arguments separated by spaces. -n drops
+ * the newline, -e expands backslash escapes and -E (the default) does not.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @return True.
+ */
+bool builtin_echo(struct shell *sh, char **argv) {
+    UNUSED(sh);
+    bool newline = true, escapes = false;
+    int i = 1;
+    /* Only words made entirely of known option letters are options */
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (argv[i][strspn(argv[i] + 1, "neE") + 1] != '\0') break;
+        for (const char *o = argv[i] + 1; *o; o++) {
+            if (*o == 'n') newline = false;
+            else escapes = *o == 'e';
+        }
+    }
+    for (int first = i; argv[i]; i++) {
+        if (i > first) putchar(' ');
+        if (!escapes) fputs(argv[i], stdout);
+        else if (!put_escaped(argv[i])) return true;
+    }
+    if (newline) putchar('\n');
+    return true;
+}
+
+/**
+ * @brief Converts a printf argument to an integer. A leading quote gives
+ * the code of the character after it.
+ *
+ * @param arg Argument, NULL when they ran out.
+ * @param ok Cleared (after a message) if arg is not a number.
+ * @return The value.
+ */
+static long long int_arg(const char *arg, bool *ok) {
+    if (!arg || !*arg) return 0;
+    if (*arg == '\'' || *arg == '"') return (unsigned char)arg[1];
+    char *end;
+    errno = 0;
+    long long v = strtoll(arg, &end, 0);
+    if (*end || errno) {
+        /* Values past LLONG_MAX are still fine for the unsigned conversions */
+        unsigned long long u = errno == ERANGE && *arg != '-' ? strtoull(arg, &end, 0) : 0;
+        if (*end || (errno && u == 0)) {
+            fprintf(stderr, "printf: %s: invalid number\n", arg);
+            *ok = false;
+        }
+        return u ? (long long)u : v;
+    }
+    return v;
+}
+
+/**
+ * @brief Converts a printf argument to a floating point number.
+ *
+ * @param arg Argument, NULL when they ran out.
+ * @param ok Cleared (after a message) if arg is not a number.
+ * @return The value.
+ */
+static double float_arg(const char *arg, bool *ok) {
+    if (!arg || !*arg) return 0;
+    if (*arg == '\'' || *arg == '"') return (unsigned char)arg[1];
+    char *end;
+    double v = strtod(arg, &end);
+    if (*end) {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        *ok = false;
+    }
+    return v;
+}
+
+/**
+ * @brief Appends to a conversion specification being rebuilt, keeping room
+ * for the length modifier, the conversion and the NUL.
+ *
+ * @param spec Specification of SPEC_MAX bytes.
+ * @param n Its length, advanced.
+ * @param s Bytes to append.
+ * @param len Their count.
+ * @return False if they do not fit.
+ */
+static bool spec_put(char *spec, size_t *n, const char *s, size_t len) {
+    if (len > SPEC_MAX - 4 - *n) return false;
+    memcpy(spec + *n, s, len);
+    *n += len;
+    return true;
+}
+
+/**
+ * @brief Prints the format once, taking conversions' values from args.
+ *
+ * @param fmt Format.
+ * @param args Remaining arguments, advanced past the ones used.
+ * @param ok Cleared on an invalid number or directive.
+ * @return False if output has to stop (\c in %b, or a bad directive).
+ */
+static bool format_once(const char *fmt, char ***args, bool *ok) {
+    for (const char *p = fmt; *p; p++) {
+        if (*p == '\\' && p[1]) {
+            bool stop = false;
+            p += put_escape(p + 1, false, &stop);
+            continue;
+        }
+        if (*p != '%') {
+            putchar(*p);
+            continue;
+        }
+        if (p[1] == '%') {
+            putchar('%');
+            p++;
+            continue;
+        }
+
+        /* Rebuild the specification with * replaced and a length added */
+        char spec[SPEC_MAX];
+        size_t n = 0;
+        bool fits = true;
+        const char *start = p++;
+        spec[n++] = '%';
+        while (*p && strchr("-+ #0", *p)) fits &= spec_put(spec, &n, p++, 1);
+        for (int part = 0; part < 2; part++) {
+            if (part == 1) {
+                if (*p != '.') break;
+                fits &= spec_put(spec, &n, p++, 1);
+            }
+            if (*p == '*') {
+                long long v = int_arg(**args, ok);
+                if (**args) (*args)++;
+                char num[16];
+                fits &= spec_put(spec, &n, num, snprintf(num, sizeof(num), "%d", (int)v));
+                p++;
+            } else {
+                while (isdigit((unsigned char)*p)) fits &= spec_put(spec, &n, p++, 1);
+            }
+        }
+
+        const char *arg = **args;
+        char conv = *p;
+        if (conv && strchr("diouxXcsbfFeEgGaA", conv) && arg) (*args)++;
+        if (!fits) {
+            fprintf(stderr, "printf: %.*s: invalid directive\n", (int)(p - start + (conv != 0)), start);
+            *ok = false;
+            return false;
+        } else if (conv == 'd' || conv == 'i') {
+            memcpy(spec + n, "lld", 4);
+            printf(spec, int_arg(arg, ok));
+        } else if (conv && strchr("ouxX", conv)) {
+            spec[n++] = 'l';
+            spec[n++] = 'l';
+            spec[n++] = conv;
+            spec[n] = '\0';
+            printf(spec, (unsigned long long)int_arg(arg, ok));
+        } else if (conv && strchr("fFeEgGaA", conv)) {
+            spec[n++] = conv;
+            spec[n] = '\0';
+            printf(spec, float_arg(arg, ok));
+        } else if (conv == 's' || conv == 'c') {
+            memcpy(spec + n, "s", 2);
+            char c[2] = { arg ? arg[0] : '\0', '\0' };
+            printf(spec, conv == 'c' ? c : arg ? arg : "");
+        } else if (conv == 'b') {
+            if (arg && !put_escaped(arg)) return false;
+        } else {
+            fprintf(stderr, "printf: %.*s: invalid directive\n", (int)(p - start + (conv != 0)), start);
+            *ok = false;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Builtin printf: formats its arguments like printf(1). The format
+ * is reused until every argument has been consumed.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @return False on a usage error, an invalid number or directive.
+ */
+bool builtin_printf(struct shell *sh, char **argv) {
+    UNUSED(sh);
+    if (!argv[1]) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return false;
+    }
+    bool ok = true;
+    char **args = argv + 2;
+    for (;;) {
+        char **before = args;
+        if (!format_once(argv[1], &args, &ok)) break;
+        /* Stop once the arguments are used up, or if the format takes none */
+        if (!*args || args == before) break;
+    }
+    return ok;
+}
+
+/**
+ * State of one test expression: the words and the position reached.
+ */
+struct test_expr {
+    char **w;
+    int n;
+    int i;
+    bool error;
+};
+
+/**
+ * @brief Reads an integer operand of test.
+ *
+ * @param t Expression.
+ * @param s Operand.
+ * @return The value; t->error is set if s is not an integer.
+ */
+static long long test_int(struct test_expr *t, const char *s) {
+    char *end;
+    errno = 0;
+    while (isspace((unsigned char)*s)) s++;
+    long long v = strtoll(s, &end, 10);
+    while (isspace((unsigned char)*end)) end++;
+    if (!*s || *end || errno) {
+        fprintf(stderr, "test: %s: integer expression expected\n", s);
+        t->error = true;
+    }
+    return v;
+}
+
+/**
+ * @brief Whether a word is a binary operator of test.
+ *
+ * @param s Word.
+ * @return True for = == != < > -eq -ne -lt -le -gt -ge -nt -ot -ef.
+ */
+static bool is_binary_op(const char *s) {
+    static const char *const ops[] = { "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le",
+                                       "-gt", "-ge", "-nt", "-ot", "-ef", NULL };
+    for (int i = 0; ops[i]; i++)
+        if (strcmp(s, ops[i]) == 0) return true;
+    return false;
+}
+
+/**
+ * @brief Evaluates a binary test.
+ *
+ * @param t Expression.
+ * @param a Left operand.
+ * @param op Operator.
+ * @param b Right operand.
+ * @return The result.
+ */
+static bool test_binary(struct test_expr *t, const char *a, const char *op, const char *b) {
+    if (op[0] != '-') {
+        int c = strcmp(a, b);
+        if (op[0] == '!') return c != 0;
+        if (op[0] == '<') return c < 0;
+        if (op[0] == '>') return c > 0;
+        return c == 0;
+    }
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        struct stat sa, sb;
+        bool ha = stat(a, &sa) == 0, hb = stat(b, &sb) == 0;
+        if (op[1] == 'e') return ha && hb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+        /* A file that exists is newer than one that does not */
+        if (!ha || !hb) return op[1] == 'n' ? ha && !hb : hb && !ha;
+        struct timespec ma = sa.st_mtim, mb = sb.st_mtim;
+        bool newer = ma.tv_sec > mb.tv_sec || (ma.tv_sec == mb.tv_sec && ma.tv_nsec > mb.tv_nsec);
+        bool older = ma.tv_sec < mb.tv_sec || (ma.tv_sec == mb.tv_sec && ma.tv_nsec < mb.tv_nsec);
+        return op[1] == 'n' ? newer : older;
+    }
+    long long x = test_int(t, a), y = test_int(t, b);
+    if (strcmp(op, "-eq") == 0) return x == y;
+    if (strcmp(op, "-ne") == 0) return x != y;
+    if (strcmp(op, "-lt") == 0) return x < y;
+    if (strcmp(op, "-le") == 0) return x <= y;
+    if (strcmp(op, "-gt") == 0) return x > y;
+    return x >= y;
+}
+
+/**
+ * @brief Evaluates a unary test such as -f file.
+ *
+ * @param t Expression.
+ * @param op Operator.
+ * @param arg Operand.
+ * @param known Cleared if op is not a unary operator.
+ * @return The result.
+ */
+static bool test_unary(struct test_expr *t, const char *op, const char *arg, bool *known) {
+    *known = true;
+    switch (op[1]) {
+    case 'n':
+        return *arg != '\0';
+    case 'z':
+        return *arg == '\0';
+    case 't':
+        return isatty((int)test_int(t, arg));
+    case 'r':
+        return access(arg, R_OK) == 0;
+    case 'w':
+        return access(arg, W_OK) == 0;
+    case 'x':
+        return access(arg, X_OK) == 0;
+    }
+    struct stat st;
+    if (op[1] == 'L' || op[1] == 'h') return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    if (!strchr("efdsbcpSgukO", op[1])) {
+        *known = false;
+        return false;
+    }
+    if (stat(arg, &st) != 0) return false;
+    switch (op[1]) {
+    case 'f':
+        return S_ISREG(st.st_mode);
+    case 'd':
+        return S_ISDIR(st.st_mode);
+    case 's':
+        return st.st_size > 0;
+    case 'b':
+        return S_ISBLK(st.st_mode);
+    case 'c':
+        return S_ISCHR(st.st_mode);
+    case 'p':
+        return S_ISFIFO(st.st_mode);
+    case 'S':
+        return S_ISSOCK(st.st_mode);
+    case 'g':
+        return st.st_mode & S_ISGID;
+    case 'u':
+        return st.st_mode & S_ISUID;
+    case 'k':
+        return st.st_mode & S_ISVTX;
+    case 'O':
+        return st.st_uid == geteuid();
+    default:
+        return true; /* -e */
+    }
+}
+
+static bool test_or(struct test_expr *t);
+
+/**
+ * @brief primary: ( expr ), a binary test, a unary test or a string. A
+ * binary operator in second place wins, so [ "$x" = -f ] compares.
+ *
+ * @param t Expression.
+ * @return The result.
+ */
+static bool test_primary(struct test_expr *t) {
+    if (t->i >= t->n) {
+        t->error = true;
+        return false;
+    }
+    char **w = t->w + t->i;
+    int left = t->n - t->i;
+    if (left >= 3 && is_binary_op(w[1])) {
+        t->i += 3;
+        return test_binary(t, w[0], w[1], w[2]);
+    }
+    if (left >= 2 && strcmp(w[0], "(") == 0) {
+        t->i++;
+        bool r = test_or(t);
+        if (t->i < t->n && strcmp(t->w[t->i], ")") == 0) t->i++;
+        else t->error = true;
+        return r;
+    }
+    if (left >= 2 && w[0][0] == '-' && w[0][1] && !w[0][2]) {
+        bool known;
+        bool r = test_unary(t, w[0], w[1], &known);
+        if (known) {
+            t->i += 2;
+            return r;
+        }
+    }
+    t->i++;
+    return w[0][0] != '\0';
+}
+
+/**
+ * @brief not: ! not | primary.
+ *
+ * @param t Expression.
+ * @return The result.
+ */
+static bool test_not(struct test_expr *t) {
+    if (t->i + 1 < t->n && strcmp(t->w[t->i], "!") == 0) {
+        t->i++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+/**
+ * @brief and: not (-a not)*.
+ *
+ * @param t Expression.
+ * @return The result.
+ */
+static bool test_and(struct test_expr *t) {
+    bool r = test_not(t);
+    while (t->i + 1 < t->n && strcmp(t->w[t->i], "-a") == 0) {
+        t->i++;
+        /* Both sides are always parsed so errors on the right are found */
+        bool rhs = test_not(t);
+        r = r && rhs;
+    }
+    return r;
+}
+
+/**
+ * @brief or: and (-o and)*.
+ *
+ * @param t Expression.
+ * @return The result.
+ */
+static bool test_or(struct test_expr *t) {
+    bool r = test_and(t);
+    while (t->i + 1 < t->n && strcmp(t->w[t->i], "-o") == 0) {
+        t->i++;
+        bool rhs = test_and(t);
+        r = r || rhs;
+    }
+    return r;
+}
+
+/**
+ * @brief Builtin test and [: evaluates a conditional expression. [ needs
+ * a closing ] as its last argument.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @return The value of the expression; false on a syntax error too.
+ */
+bool builtin_test(struct shell *sh, char **argv) {
+    int n = 1;
+    while (argv[n]) n++;
+    if (strcmp(argv[0], "[") == 0) {
+        if (n < 2 || strcmp(argv[n - 1], "]") != 0) {
+            fprintf(stderr, "[: missing `]'\n");
+            sh->builtin_status = 2;
+            return false;
+        }
+        n--;
+    }
+    struct test_expr t = { argv + 1, n - 1, 0, false };
+    if (t.n == 0) return false;
+    bool r = test_or(&t);
+    if (!t.error && t.i < t.n) {
+        fprintf(stderr, "%s: %s: unexpected argument\n", argv[0], t.w[t.i]);
+        t.error = true;
+    }
+    /* An error must not look like a false expression */
+    if (t.error) sh->builtin_status = 2;
+    return r && !t.error;
+}
+
+/**
+ * @brief Builtin true.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @return True.
+ */
+bool builtin_true(struct shell *sh, char **argv) {
+    UNUSED(sh);
+    UNUSED(argv);
+    return true;
+}
+
+/**
+ * @brief Builtin false.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @return False.
+ */
+bool builtin_false(struct shell *sh, char **argv) {
+    UNUSED(sh);
+    UNUSED(argv);
+    return false;
+}
+
+/**
+ * @brief Builtin pwd: prints the working directory. -L and -P are
+ * accepted; the shell does not track a logical directory, so both print
+ * the physical one.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @return True on success.
+ */
+bool builtin_pwd(struct shell *sh, char **argv) {
+    UNUSED(sh);
+    for (int i = 1; argv[i]; i++) {
+        if (strcmp(argv[i], "-L") != 0 && strcmp(argv[i], "-P") != 0) {
+            fprintf(stderr, "pwd: %s: invalid option\n", argv[i]);
+            return false;
+        }
+    }
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd) {
+        perror("pwd");
+        return false;
+    }
+    puts(cwd);
+    free(cwd);
+    return true;
+}
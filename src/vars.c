@@ -0,0 +1,496 @@
+/**
+ * vars.c
+ * Shell variables. They live in an open addressing hash table, each as a
+ * single "NAME=value" string, so the exported ones can be handed to
+ * commands as they are: the environment array just points at them and is
+ * patched in place when one changes instead of being rebuilt for every
+ * command started.
+ *
+ * @author Vladyslav (Vlad) Maliutin
+ */
+
+#define _GNU_SOURCE
+#include "lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define VARS_INITIAL 64
+
+extern char **environ;
+
+/**
+ * @brief FNV-1a hash of a variable name.
+ *
+ * @param name Name, need not be NUL terminated.
+ * @param len Length of the name.
+ * @return Hash value.
+ */
+static size_t hash_name(const char *name, size_t len) {
+    size_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/**
+ * @brief Finds the slot for a name, either the one holding it or the empty
+ * slot where it would be inserted.
+ *
+ * @param vt Table.
+ * @param name Name.
+ * @param len Length of the name.
+ * @return Pointer to the slot.
+ */
+static struct shell_var *find_slot(struct var_table *vt, const char *name, size_t len) {
+    size_t mask = vt->capacity - 1;
+    size_t i = hash_name(name, len) & mask;
+    while (vt->slots[i].entry &&
+           (vt->slots[i].name_len != len || memcmp(vt->slots[i].entry, name, len) != 0))
+        i = (i + 1) & mask;
+    return &vt->slots[i];
+}
+
+/**
+ * @brief Doubles the table and reinserts every variable. Environment
+ * positions move with their variables.
+ *
+ * @param vt Table.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+static int grow(struct var_table *vt) {
+    struct shell_var *old = vt->slots;
+    size_t old_cap = vt->capacity;
+    size_t cap = old_cap ? old_cap * 2 : VARS_INITIAL;
+
+    struct shell_var *slots = calloc(cap, sizeof(*slots));
+    if (!slots) return -1;
+    vt->slots = slots;
+    vt->capacity = cap;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].entry) *find_slot(vt, old[i].entry, old[i].name_len) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/**
+ * @brief Whether a variable has an entry in the environment array.
+ *
+ * @param v Variable.
+ * @return True if it is exported and has a value.
+ */
+static inline bool in_env(const struct shell_var *v) {
+    return (v->flags & VAR_EXPORT) && v->entry[v->name_len] == '=';
+}
+
+/**
+ * @brief Appends an entry to the environment array. Like every change to
+ * the array it also points environ back at it, in case something called
+ * setenv and libc moved environ to an array of its own.
+ *
+ * @param vt Table.
+ * @param v Variable to add.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+static int env_add(struct var_table *vt, struct shell_var *v) {
+    if (vt->nenv + 2 > vt->env_cap) {
+        size_t cap = vt->env_cap ? vt->env_cap * 2 : VARS_INITIAL;
+        char **envp = realloc(vt->envp, cap * sizeof(*envp));
+        if (!envp) return -1;
+        vt->envp = envp;
+        vt->env_cap = cap;
+    }
+    v->env_index = vt->nenv;
+    vt->envp[vt->nenv++] = v->entry;
+    vt->envp[vt->nenv] = NULL;
+    environ = vt->envp;
+    return 0;
+}
+
+/**
+ * @brief Takes an entry out of the environment array by moving the last
+ * entry into its place.
+ *
+ * @param vt Table.
+ * @param v Variable to remove.
+ */
+static void env_remove(struct var_table *vt, struct shell_var *v) {
+    char *last = vt->envp[--vt->nenv];
+    vt->envp[vt->nenv] = NULL;
+    environ = vt->envp;
+    if (v->env_index == vt->nenv) return;
+    vt->envp[v->env_index] = last;
+    size_t len = strchr(last, '=') - last;
+    find_slot(vt, last, len)->env_index = v->env_index;
+}
+
+/**
+ * @brief Fills the table from environ the first time it is used.
+ *
+ * @param vt Table.
+ */
+static void import(struct var_table *vt) {
+    if (vt->imported) return;
+    vt->imported = true;
+    vt->saved_environ = environ;
+    for (char **e = environ; e && *e; e++) {
+        const char *eq = strchr(*e, '=');
+        if (eq && eq > *e) var_set(vt, *e, eq - *e, eq + 1, VAR_EXPORT);
+    }
+    /* An empty environment still has to become the table's own */
+    if (!vt->envp && (vt->envp = calloc(VARS_INITIAL, sizeof(*vt->envp))))
+        vt->env_cap = VARS_INITIAL;
+    if (vt->envp) environ = vt->envp;
+}
+
+/**
+ * @brief Initializes an empty table that has not read environ yet.
+ *
+ * @param vt Table.
+ */
+void vars_init(struct var_table *vt) {
+    memset(vt, 0, sizeof(*vt));
+}
+
+/**
+ * @brief Frees every variable and gives environ back its original array.
+ *
+ * @param vt Table.
+ */
+void vars_destroy(struct var_table *vt) {
+    if (vt->imported && environ == vt->envp) environ = vt->saved_environ;
+    for (size_t i = 0; i < vt->capacity; i++) free(vt->slots[i].entry);
+    free(vt->slots);
+    free(vt->envp);
+    vars_init(vt);
+}
+
+/**
+ * @brief Length of the variable name s starts with.
+ *
+ * @param s Text.
+ * @return Length, 0 if s does not start with a name.
+ */
+size_t var_name_len(const char *s) {
+    if (!isalpha((unsigned char)s[0]) && s[0] != '_') return 0;
+    size_t n = 1;
+    while (isalnum((unsigned char)s[n]) || s[n] == '_') n++;
+    return n;
+}
+
+/**
+ * @brief Looks a variable up.
+ *
+ * @param vt Table.
+ * @param name Name.
+ * @param len Length of the name.
+ * @return The value or NULL if not set.
+ */
+const char *var_get(struct var_table *vt, const char *name, size_t len) {
+    import(vt);
+    if (!vt->capacity) return NULL;
+    struct shell_var *v = find_slot(vt, name, len);
+    if (!v->entry || v->entry[len] != '=') return NULL;
+    return v->entry + len + 1;
+}
+
+/**
+ * @brief Sets a variable and adds flags, see lab.h.
+ *
+ * @param vt Table.
+ * @param name Name.
+ * @param len Length of the name.
+ * @param value Value, NULL to keep the current one.
+ * @param flags Flags to add.
+ * @return 0 on success, -1 on failure.
+ */
+int var_set(struct var_table *vt, const char *name, size_t len, const char *value, unsigned flags) {
+    import(vt);
+    if ((vt->count + 1) * 2 > vt->capacity && grow(vt) != 0) return -1;
+    struct shell_var *v = find_slot(vt, name, len);
+    if (v->entry && (v->flags & VAR_READONLY) && value) return -1;
+
+    char *entry = NULL;
+    if (value || !v->entry) {
+        size_t vlen = value ? strlen(value) : 0;
+        entry = malloc(len + vlen + 2);
+        if (!entry) return -1;
+        memcpy(entry, name, len);
+        entry[len] = '\0';
+        if (value) {
+            entry[len] = '=';
+            memcpy(entry + len + 1, value, vlen + 1);
+        }
+    }
+
+    if (!v->entry) {
+        v->name_len = len;
+        v->flags = 0;
+        vt->count++;
+    }
+    bool was_in_env = v->entry && in_env(v);
+    if (entry) {
+        free(v->entry);
+        v->entry = entry;
+    }
+    v->flags |= flags;
+    if (was_in_env) {
+        vt->envp[v->env_index] = v->entry;
+        environ = vt->envp;
+    } else if (in_env(v) && env_add(vt, v) != 0) {
+        v->flags &= ~VAR_EXPORT;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Removes a variable; the entries after it in its probe run are
+ * shifted back so no tombstones are needed.
+ *
+ * @param vt Table.
+ * @param name Name.
+ * @return 0 on success, -1 if it is readonly.
+ */
+int var_unset(struct var_table *vt, const char *name) {
+    import(vt);
+    size_t len = strlen(name);
+    if (!vt->capacity) return 0;
+    struct shell_var *v = find_slot(vt, name, len);
+    if (!v->entry) return 0;
+    if (v->flags & VAR_READONLY) return -1;
+    if (in_env(v)) env_remove(vt, v);
+    free(v->entry);
+    v->entry = NULL;
+    vt->count--;
+
+    size_t mask = vt->capacity - 1;
+    size_t hole = v - vt->slots;
+    for (size_t i = (hole + 1) & mask; vt->slots[i].entry; i = (i + 1) & mask) {
+        size_t home = hash_name(vt->slots[i].entry, vt->slots[i].name_len) & mask;
+        /* Move it unless its home lies cyclically between the hole and i */
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            vt->slots[hole] = vt->slots[i];
+            vt->slots[i].entry = NULL;
+            hole = i;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief The environment for commands.
+ *
+ * @param vt Table.
+ * @return NULL terminated array of the exported entries.
+ */
+char **vars_environ(struct var_table *vt) {
+    import(vt);
+    return vt->envp;
+}
+
+/**
+ * @brief The environment with a command's own assignments applied.
+ *
+ * @param vt Table.
+ * @param assigns NAME=value words.
+ * @param n Number of words.
+ * @return Array to free, NULL if out of memory.
+ */
+char **vars_env_with(struct var_table *vt, char *const *assigns, size_t n) {
+    import(vt);
+    char **env = malloc((vt->nenv + n + 1) * sizeof(*env));
+    if (!env) return NULL;
+    memcpy(env, vt->envp, vt->nenv * sizeof(*env));
+    size_t count = vt->nenv;
+    for (size_t i = 0; i < n; i++) {
+        size_t len = strchr(assigns[i], '=') - assigns[i];
+        struct shell_var *v = vt->capacity ? find_slot(vt, assigns[i], len) : NULL;
+        size_t at = count;
+        if (v && v->entry && in_env(v)) {
+            at = v->env_index;
+        } else {
+            /* A name given twice replaces its own earlier entry */
+            for (size_t k = vt->nenv; k < count; k++)
+                if (strncmp(env[k], assigns[i], len + 1) == 0) at = k;
+        }
+        env[at] = assigns[i];
+        if (at == count) count++;
+    }
+    env[count] = NULL;
+    return env;
+}
+
+/**
+ * @brief Carries out an assignment word in the shell, see lab.h.
+ *
+ * @param sh Shell instance.
+ * @param word NAME=value.
+ * @param flags Flags to add.
+ * @return 0 on success, -1 on failure.
+ */
+int sh_assign(struct shell *sh, const char *word, unsigned flags) {
+    size_t len = var_name_len(word);
+    const char *value = word[len] == '=' ? word + len + 1 : NULL;
+    if (var_set(&sh->vars, word, len, value, flags) != 0) {
+        fprintf(stderr, "%.*s: readonly variable\n", (int)len, word);
+        return -1;
+    }
+    /* Commands are found through PATH; what was found before is no longer valid */
+    if (value && len == 4 && memcmp(word, "PATH", 4) == 0) {
+        path_cache_clear(&sh->paths);
+        sh->commands.stale = true;
+    }
+    return 0;
+}
+
+/**
+ * @brief Removes a variable from the shell, see lab.h.
+ *
+ * @param sh Shell instance.
+ * @param name Name.
+ * @return 0 on success, -1 if it is readonly.
+ */
+int sh_unset(struct shell *sh, const char *name) {
+    if (var_unset(&sh->vars, name) != 0) {
+        fprintf(stderr, "unset: %s: cannot unset: readonly variable\n", name);
+        return -1;
+    }
+    if (strcmp(name, "PATH") == 0) {
+        path_cache_clear(&sh->paths);
+        sh->commands.stale = true;
+    }
+    return 0;
+}
+
+/**
+ * @brief qsort comparison of two variables by name.
+ */
+static int compare_vars(const void *a, const void *b) {
+    const struct shell_var *x = *(const struct shell_var *const *)a;
+    const struct shell_var *y = *(const struct shell_var *const *)b;
+    size_t n = x->name_len < y->name_len ? x->name_len : y->name_len;
+    int c = memcmp(x->entry, y->entry, n);
+    return c ? c : (x->name_len > y->name_len) - (x->name_len < y->name_len);
+}
+
+/**
+ * @brief Prints the variables having all of the given flags, sorted by
+ * name, in a form the shell can read back.
+ *
+ * @param sh Shell instance.
+ * @param flags Flags a variable needs to be listed.
+ * @param prefix Text in front of each line, such as "export ".
+ */
+static void list_vars(struct shell *sh, unsigned flags, const char *prefix) {
+    struct var_table *vt = &sh->vars;
+    import(vt);
+    const struct shell_var **sorted = malloc((vt->count + 1) * sizeof(*sorted));
+    if (!sorted) return;
+    size_t n = 0;
+    for (size_t i = 0; i < vt->capacity; i++) {
+        const struct shell_var *v = &vt->slots[i];
+        if (v->entry && (v->flags & flags) == flags) sorted[n++] = v;
+    }
+    qsort(sorted, n, sizeof(*sorted), compare_vars);
+    for (size_t i = 0; i < n; i++) {
+        const struct shell_var *v = sorted[i];
+        printf("%s%.*s", prefix, (int)v->name_len, v->entry);
+        if (v->entry[v->name_len] == '=') {
+            /* Single quotes keep everything; a quote itself becomes '\'' */
+            fputs("='", stdout);
+            for (const char *c = v->entry + v->name_len + 1; *c; c++) {
+                if (*c == '\'') fputs("'\\''", stdout);
+                else putchar(*c);
+            }
+            putchar('\'');
+        }
+        putchar('\n');
+    }
+    free(sorted);
+}
+
+/**
+ * @brief Shared body of export and readonly.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @param flag Flag the names get.
+ * @return True if every name was set.
+ */
+static bool flag_vars(struct shell *sh, char **argv, unsigned flag) {
+    int i = 1;
+    if (argv[i] && strcmp(argv[i], "-p") == 0) i++;
+    if (!argv[i]) {
+        list_vars(sh, flag, flag == VAR_EXPORT ? "export " : "readonly ");
+        return true;
+    }
+    bool ok = true;
+    for (; argv[i]; i++) {
+        size_t len = var_name_len(argv[i]);
+        if (len == 0 || (argv[i][len] && argv[i][len] != '=')) {
+            fprintf(stderr, "%s: `%s': not a valid identifier\n", argv[0], argv[i]);
+            ok = false;
+        } else if (sh_assign(sh, argv[i], flag) != 0) {
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/**
+ * @brief Builtin export.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @return True on success.
+ */
+bool builtin_export(struct shell *sh, char **argv) {
+    return flag_vars(sh, argv, VAR_EXPORT);
+}
+
+/**
+ * @brief Builtin readonly.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @return True on success.
+ */
+bool builtin_readonly(struct shell *sh, char **argv) {
+    return flag_vars(sh, argv, VAR_READONLY);
+}
+
+/**
+ * @brief Builtin unset.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @return True on success.
+ */
+bool builtin_unset(struct shell *sh, char **argv) {
+    int i = 1;
+    if (argv[i] && strcmp(argv[i], "-v") == 0) i++;
+    bool ok = true;
+    for (; argv[i]; i++) ok &= sh_unset(sh, argv[i]) == 0;
+    return ok;
+}
+
+/**
+ * @brief Builtin set.
+ *
+ * @param sh Shell instance.
+ * @param argv Command arguments.
+ * @return True when listing.
+ */
+bool builtin_set(struct shell *sh, char **argv) {
+    if (argv[1]) {
+        fprintf(stderr, "set: %s: invalid option\n", argv[1]);
+        return false;
+    }
+    list_vars(sh, 0, "");
+    return true;
+}
@@ -1,4 +1,12 @@
 #include <string.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include "harness/unity.h"
 #include "../src/lab.h"
 
@@ -49,6 +57,208 @@ void test_cmd_parse(void)
      cmd_free(rval);
 }
 
+void test_cmd_parse_repeated_spaces(void)
+{
+     char **rval = cmd_parse("  echo   a  b ");
+     TEST_ASSERT_TRUE(rval);
+     TEST_ASSERT_EQUAL_STRING("echo", rval[0]);
+     TEST_ASSERT_EQUAL_STRING("a", rval[1]);
+     TEST_ASSERT_EQUAL_STRING("b", rval[2]);
+     TEST_ASSERT_FALSE(rval[3]);
+     cmd_free(rval);
+}
+
+void test_cmd_parse_empty(void)
+{
+     char **rval = cmd_parse("");
+     TEST_ASSERT_TRUE(rval);
+     TEST_ASSERT_FALSE(rval[0]);
+     cmd_free(rval);
+}
+
+void test_cmd_parse_quotes(void)
+{
+     char **rval = cmd_parse("echo\t'a b'  \"c \\\"d\\\" $x\" e\\ f '' g\\'h");
+     TEST_ASSERT_EQUAL_STRING("echo", rval[0]);
+     TEST_ASSERT_EQUAL_STRING("a b", rval[1]);
+     TEST_ASSERT_EQUAL_STRING("c \"d\" $x", rval[2]);
+     TEST_ASSERT_EQUAL_STRING("e f", rval[3]);
+     TEST_ASSERT_EQUAL_STRING("", rval[4]);
+     TEST_ASSERT_EQUAL_STRING("g'h", rval[5]);
+     TEST_ASSERT_FALSE(rval[6]);
+     cmd_free(rval);
+
+     /* single quotes keep backslashes, double quotes keep unknown escapes */
+     rval = cmd_parse("'a\\b' \"a\\b\" a|b");
+     TEST_ASSERT_EQUAL_STRING("a\\b", rval[0]);
+     TEST_ASSERT_EQUAL_STRING("a\\b", rval[1]);
+     TEST_ASSERT_EQUAL_STRING("a|b", rval[2]);
+     cmd_free(rval);
+
+     TEST_ASSERT_NULL(cmd_parse("echo 'open"));
+     TEST_ASSERT_NULL(cmd_parse("echo \"open"));
+}
+
+void test_lexer_operators(void)
+{
+     const char *line = "a&&b||c;d|e 2>f\">\" &";
+     char buf[64];
+     struct lexer lx;
+     struct lex_token t;
+     enum lex_kind want[] = { LEX_WORD, LEX_AND_IF, LEX_WORD, LEX_OR_IF, LEX_WORD,
+                              LEX_SEMI, LEX_WORD, LEX_PIPE, LEX_WORD, LEX_REDIR,
+                              LEX_WORD, LEX_AMP, LEX_END };
+     lexer_init(&lx, line, strlen(line), buf, false);
+     for (size_t i = 0; i < sizeof(want) / sizeof(want[0]); i++) {
+          TEST_ASSERT_EQUAL_INT(want[i], lexer_next(&lx, &t));
+          if (t.kind == LEX_REDIR) {
+               TEST_ASSERT_EQUAL_INT(2, t.fd);
+               TEST_ASSERT_EQUAL_INT(OP_OUT, t.op);
+          }
+     }
+     TEST_ASSERT_EQUAL_STRING("f>", buf + strlen("a b c d e") + 1);
+
+     struct pipeline *pl = pipeline_parse("echo 'a | b' \"&\"| cat >'x y'");
+     TEST_ASSERT_NOT_NULL(pl);
+     TEST_ASSERT_EQUAL_size_t(2, pl->ncmds);
+     TEST_ASSERT_EQUAL_STRING("a | b", pl->cmds[0].argv[1]);
+     TEST_ASSERT_EQUAL_STRING("&", pl->cmds[0].argv[2]);
+     TEST_ASSERT_EQUAL_STRING("x y", pl->cmds[1].redirs[0].path);
+     pipeline_free(pl);
+     TEST_ASSERT_NULL(pipeline_parse("echo 'a"));
+}
+
+void test_cmd_parse_long_line(void)
+{
+     enum { WORDS = 4000 };
+     char *line = malloc(WORDS * 8 + 1);
+     char *p = line;
+     for (int i = 0; i < WORDS; i++) p += sprintf(p, "arg%04d ", i);
+
+     char **rval = cmd_parse(line);
+     TEST_ASSERT_EQUAL_STRING("arg0000", rval[0]);
+     TEST_ASSERT_EQUAL_STRING("arg3999", rval[WORDS - 1]);
+     TEST_ASSERT_NULL(rval[WORDS]);
+     cmd_free(rval);
+     free(line);
+}
+
+static const enum scan_backend scan_backends[] = { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 };
+
+void test_scan_alignments(void)
+{
+     _Alignas(64) char buf[256];
+     struct scan_set ops, a, ab, space, tab_semi;
+     sh_scan_set_init(&ops, "|&;<>");
+     sh_scan_set_init(&a, "a");
+     sh_scan_set_init(&ab, "ab");
+     sh_scan_set_init(&space, SCAN_SPACE);
+     sh_scan_set_init(&tab_semi, "\t;");
+     for (size_t b = 0; b < sizeof(scan_backends) / sizeof(scan_backends[0]); b++) {
+          if (!sh_scan_use(scan_backends[b])) continue;
+          for (size_t off = 0; off < 64; off++) {
+               for (size_t len = 0; len < 80; len++) {
+                    char *s = buf + off;
+                    memset(buf, ' ', sizeof(buf));
+                    memset(s, 'a', len);
+                    s[len] = '\0';
+                    TEST_ASSERT_EQUAL_size_t(len, sh_strcspn(s, &ops));
+                    TEST_ASSERT_EQUAL_size_t(len, sh_strspn(s, &a));
+                    TEST_ASSERT_EQUAL_size_t(len, sh_strrspn(s, len, &ab));
+                    TEST_ASSERT_EQUAL_size_t(0, sh_strrspn(s, len, &space));
+
+                    /* a stop byte at the end of the run, then garbage */
+                    s[len] = len % 2 ? ';' : '\t';
+                    s[len + 1] = ';';
+                    s[len + 2] = '\0';
+                    TEST_ASSERT_EQUAL_size_t(strcspn(s, "\t;"), sh_strcspn(s, &tab_semi));
+                    TEST_ASSERT_EQUAL_size_t(len, sh_strspn(s, &a));
+                    TEST_ASSERT_EQUAL_size_t(2, sh_strrspn(s, len + 2, &tab_semi));
+                    memset(s, ' ', len);
+                    TEST_ASSERT_EQUAL_size_t(len + (len % 2 ? 0 : 1), sh_strspn(s, &space));
+               }
+          }
+     }
+     sh_scan_use(SCAN_AUTO);
+}
+
+void test_scan_page_boundary(void)
+{
+     /* Strings ending right before an unmapped page must not fault */
+     long page = sysconf(_SC_PAGESIZE);
+     char *map = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+     TEST_ASSERT_TRUE(map != MAP_FAILED);
+     TEST_ASSERT_EQUAL_INT(0, mprotect(map + page, page, PROT_NONE));
+     memset(map, 'x', page);
+     struct scan_set stops, x, wide;
+     sh_scan_set_init(&stops, " '\"\\|&;<>");
+     sh_scan_set_init(&x, "x");
+     /* more than 8 high nibbles, which the AVX2 code hands to SSE2 */
+     sh_scan_set_init(&wide, "\x01\x11!1AQaq\x81\x91");
+     TEST_ASSERT_FALSE(wide.nibble);
+     map[page - 1] = '\0';
+     for (size_t b = 0; b < sizeof(scan_backends) / sizeof(scan_backends[0]); b++) {
+          if (!sh_scan_use(scan_backends[b])) continue;
+          for (size_t len = 0; len < 100; len++) {
+               char *s = map + page - 1 - len;
+               TEST_ASSERT_EQUAL_size_t(len, sh_strcspn(s, &stops));
+               TEST_ASSERT_EQUAL_size_t(len, sh_strspn(s, &x));
+               TEST_ASSERT_EQUAL_size_t(len, sh_strrspn(s, len, &x));
+               TEST_ASSERT_EQUAL_size_t(len, sh_strcspn(s, &wide));
+          }
+          char line[] = "  \t  trim me \n\v ";
+          TEST_ASSERT_EQUAL_STRING("trim me", trim_white(line));
+
+          /* Views ending at the unmapped page, with no NUL after them */
+          memset(map, 'x', page);
+          for (size_t len = 0; len < 100; len++) {
+               char *s = map + page - len;
+               TEST_ASSERT_EQUAL_size_t(len, sh_strncspn(s, len, &stops));
+               TEST_ASSERT_EQUAL_size_t(len, sh_strnspn(s, len, &x));
+               TEST_ASSERT_EQUAL_size_t(len, sh_strncspn(s, len, &wide));
+               /* and views that stop short of the data that follows */
+               TEST_ASSERT_EQUAL_size_t(len, sh_strncspn(s - 50, len, &stops));
+          }
+          map[page - 4] = '\'';
+          struct cmd_list *list = list_parse_n(map + page - 8, 8);
+          TEST_ASSERT_NULL(list);
+          map[page - 4] = ' ';
+          list = list_parse_n(map + page - 8, 8);
+          TEST_ASSERT_EQUAL_STRING("xxx", list->items[0].pipelines[0].cmds[0].argv[1]);
+          list_free(list);
+          memset(map, 'x', page);
+          map[page - 1] = '\0';
+     }
+     sh_scan_use(SCAN_AUTO);
+     munmap(map, 2 * page);
+}
+
+void test_scan_backends_agree(void)
+{
+     /* Long generated argument lists: few separators, long words */
+     enum { WORDS = 1000 };
+     char *line = malloc(WORDS * 64 + 1);
+     char *p = line;
+     for (int i = 0; i < WORDS; i++)
+          p += sprintf(p, "/usr/share/generated/build/output/objects/file-%06d.o ", i);
+
+     sh_scan_use(SCAN_SCALAR);
+     char **expect = cmd_parse(line);
+     for (size_t b = 1; b < sizeof(scan_backends) / sizeof(scan_backends[0]); b++) {
+          if (!sh_scan_use(scan_backends[b])) continue;
+          char **got = cmd_parse(line);
+          for (int i = 0; i <= WORDS; i++) {
+               if (!expect[i]) TEST_ASSERT_NULL(got[i]);
+               else TEST_ASSERT_EQUAL_STRING(expect[i], got[i]);
+          }
+          cmd_free(got);
+     }
+     sh_scan_use(SCAN_AUTO);
+     TEST_ASSERT_EQUAL_STRING("/usr/share/generated/build/output/objects/file-000999.o", expect[WORDS - 1]);
+     cmd_free(expect);
+     free(line);
+}
+
 void test_trim_white_no_whitespace(void)
 {
      char *line = (char*) calloc(10, sizeof(char));
@@ -159,10 +369,1434 @@ void test_ch_dir_root(void)
      cmd_free(cmd);
 }
 
+void test_limits_cached(void)
+{
+     const struct shell_limits *lim = sh_limits();
+     TEST_ASSERT_EQUAL_INT64(sysconf(_SC_ARG_MAX), lim->arg_max);
+     TEST_ASSERT_TRUE(lim->open_max > 0);
+     TEST_ASSERT_TRUE(lim->path_max > 0);
+     TEST_ASSERT_TRUE(lim->ncpu >= 1);
+     TEST_ASSERT_EQUAL_PTR(lim, sh_limits());
+}
+
+void test_path_cache_lookup(void)
+{
+     struct path_cache pc;
+     path_cache_init(&pc);
+     const char *first = path_cache_lookup(&pc, "sh");
+     TEST_ASSERT_NOT_NULL(first);
+     TEST_ASSERT_EQUAL_CHAR('/', first[0]);
+     TEST_ASSERT_EQUAL_PTR(first, path_cache_lookup(&pc, "sh"));
+     TEST_ASSERT_EQUAL_UINT(1, pc.count);
+     TEST_ASSERT_NULL(path_cache_lookup(&pc, "no-such-command-xyz"));
+     TEST_ASSERT_EQUAL_STRING("./a.out", path_cache_lookup(&pc, "./a.out"));
+     path_cache_destroy(&pc);
+}
+
+void test_path_cache_path_change(void)
+{
+     struct path_cache pc;
+     path_cache_init(&pc);
+     char *saved = strdup(getenv("PATH"));
+     TEST_ASSERT_NOT_NULL(path_cache_lookup(&pc, "sh"));
+     setenv("PATH", "/nonexistent", 1);
+     TEST_ASSERT_NULL(path_cache_lookup(&pc, "sh"));
+     TEST_ASSERT_EQUAL_UINT(0, pc.count);
+     setenv("PATH", saved, 1);
+     free(saved);
+     path_cache_destroy(&pc);
+}
+
+void test_path_cache_forget(void)
+{
+     enum { TOOLS = 30 };
+     char dir[] = "/tmp/lab-paths-XXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     char name[64], file[96];
+     for (int i = 0; i < TOOLS; i++) {
+          snprintf(file, sizeof(file), "%s/tool-%d", dir, i);
+          int fd = open(file, O_WRONLY | O_CREAT, 0755);
+          TEST_ASSERT_TRUE(fd >= 0);
+          close(fd);
+     }
+     char *saved = strdup(getenv("PATH"));
+     setenv("PATH", dir, 1);
+
+     struct path_cache pc;
+     path_cache_init(&pc);
+     const char *paths[TOOLS];
+     for (int i = 0; i < TOOLS; i++) {
+          snprintf(name, sizeof(name), "tool-%d", i);
+          paths[i] = path_cache_lookup(&pc, name);
+          TEST_ASSERT_NOT_NULL(paths[i]);
+     }
+     /* the entries not yet removed are still hits after each removal */
+     for (int i = 0; i < TOOLS; i += 2) {
+          snprintf(name, sizeof(name), "tool-%d", i);
+          path_cache_forget(&pc, name);
+          path_cache_forget(&pc, name);
+          TEST_ASSERT_EQUAL_UINT(TOOLS - i / 2 - 1, pc.count);
+          for (int k = i + 1; k < TOOLS; k++) {
+               snprintf(name, sizeof(name), "tool-%d", k);
+               TEST_ASSERT_EQUAL_PTR(paths[k], path_cache_lookup(&pc, name));
+          }
+     }
+     path_cache_forget(&pc, "not-cached");
+     TEST_ASSERT_EQUAL_UINT(TOOLS / 2, pc.count);
+     TEST_ASSERT_NOT_NULL(path_cache_lookup(&pc, "tool-0"));
+     TEST_ASSERT_EQUAL_UINT(TOOLS / 2 + 1, pc.count);
+     path_cache_destroy(&pc);
+
+     setenv("PATH", saved, 1);
+     free(saved);
+     for (int i = 0; i < TOOLS; i++) {
+          snprintf(file, sizeof(file), "%s/tool-%d", dir, i);
+          unlink(file);
+     }
+     rmdir(dir);
+}
+
+/* A shell that never touches the terminal, for driving the executor */
+static void test_shell_init(struct shell *sh, enum launch_backend backend)
+{
+     memset(sh, 0, sizeof(*sh));
+     sh_limits_init(&sh->limits);
+     path_cache_init(&sh->paths);
+     sh->launch = backend;
+}
+
+static void test_shell_destroy(struct shell *sh)
+{
+     path_cache_destroy(&sh->paths);
+     jobs_destroy(sh);
+     sh_capture_close(sh);
+     vars_destroy(&sh->vars);
+}
+
+/* Runs line as a pipeline and returns everything it wrote to stdout */
+static char *capture_pipeline(struct shell *sh, const char *line, int *status)
+{
+     static char out[4096];
+     FILE *tmp = tmpfile();
+     fflush(stdout);
+     int saved = dup(STDOUT_FILENO);
+     dup2(fileno(tmp), STDOUT_FILENO);
+     struct pipeline *pl = pipeline_parse(line);
+     TEST_ASSERT_NOT_NULL(pl);
+     int st = sh_run_pipeline(sh, pl);
+     if (status) *status = st;
+     pipeline_free(pl);
+     fflush(stdout);
+     dup2(saved, STDOUT_FILENO);
+     close(saved);
+     rewind(tmp);
+     size_t n = fread(out, 1, sizeof(out) - 1, tmp);
+     out[n] = '\0';
+     fclose(tmp);
+     return out;
+}
+
+static void run_true_false(enum launch_backend backend)
+{
+     struct shell sh;
+     test_shell_init(&sh, backend);
+     char **cmd = cmd_parse("true");
+     int status = execute_command(&sh, cmd);
+     TEST_ASSERT_TRUE(WIFEXITED(status));
+     TEST_ASSERT_EQUAL_INT(0, WEXITSTATUS(status));
+     cmd_free(cmd);
+     cmd = cmd_parse("false");
+     status = execute_command(&sh, cmd);
+     TEST_ASSERT_TRUE(WIFEXITED(status));
+     TEST_ASSERT_EQUAL_INT(1, WEXITSTATUS(status));
+     cmd_free(cmd);
+     cmd = cmd_parse("no-such-command-xyz");
+     TEST_ASSERT_EQUAL_INT(-1, execute_command(&sh, cmd));
+     cmd_free(cmd);
+
+     /* a program that moved is searched for again, the rest stays cached */
+     char dir[] = "/tmp/lab-stale-XXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     char old_dir[64], new_dir[64], old_tool[96], new_tool[96], path[4096];
+     snprintf(old_dir, sizeof(old_dir), "%s/old", dir);
+     snprintf(new_dir, sizeof(new_dir), "%s/new", dir);
+     snprintf(old_tool, sizeof(old_tool), "%s/stale-tool", old_dir);
+     snprintf(new_tool, sizeof(new_tool), "%s/stale-tool", new_dir);
+     TEST_ASSERT_EQUAL_INT(0, mkdir(old_dir, 0755));
+     TEST_ASSERT_EQUAL_INT(0, mkdir(new_dir, 0755));
+     TEST_ASSERT_EQUAL_INT(0, symlink("/bin/true", old_tool));
+     char *saved = strdup(getenv("PATH"));
+     snprintf(path, sizeof(path), "%s:%s:%s", old_dir, new_dir, saved);
+     setenv("PATH", path, 1);
+     TEST_ASSERT_NOT_NULL(path_cache_lookup(&sh.paths, "sh"));
+     cmd = cmd_parse("stale-tool");
+     TEST_ASSERT_EQUAL_INT(0, execute_command(&sh, cmd));
+     unlink(old_tool);
+     TEST_ASSERT_EQUAL_INT(0, symlink("/bin/true", new_tool));
+     TEST_ASSERT_EQUAL_INT(0, execute_command(&sh, cmd));
+     cmd_free(cmd);
+     TEST_ASSERT_EQUAL_STRING(new_tool, path_cache_lookup(&sh.paths, "stale-tool"));
+     TEST_ASSERT_EQUAL_UINT(2, sh.paths.count);
+     setenv("PATH", saved, 1);
+     free(saved);
+     unlink(new_tool);
+     rmdir(old_dir);
+     rmdir(new_dir);
+     rmdir(dir);
+     test_shell_destroy(&sh);
+}
+
+void test_execute_command_spawn(void)
+{
+     run_true_false(LAUNCH_SPAWN);
+}
+
+void test_execute_command_fork(void)
+{
+     run_true_false(LAUNCH_FORK);
+}
+
+void test_pipeline_parse(void)
+{
+     struct pipeline *pl = pipeline_parse("ls -l|wc  -l | cat");
+     TEST_ASSERT_NOT_NULL(pl);
+     TEST_ASSERT_EQUAL_UINT(3, pl->ncmds);
+     TEST_ASSERT_EQUAL_STRING("ls", pl->cmds[0].argv[0]);
+     TEST_ASSERT_EQUAL_STRING("-l", pl->cmds[0].argv[1]);
+     TEST_ASSERT_NULL(pl->cmds[0].argv[2]);
+     TEST_ASSERT_EQUAL_STRING("wc", pl->cmds[1].argv[0]);
+     TEST_ASSERT_EQUAL_STRING("-l", pl->cmds[1].argv[1]);
+     TEST_ASSERT_NULL(pl->cmds[1].argv[2]);
+     TEST_ASSERT_EQUAL_STRING("cat", pl->cmds[2].argv[0]);
+     TEST_ASSERT_NULL(pl->cmds[2].argv[1]);
+     pipeline_free(pl);
+}
+
+void test_pipeline_parse_errors(void)
+{
+     TEST_ASSERT_NULL(pipeline_parse("| ls"));
+     TEST_ASSERT_NULL(pipeline_parse("ls |"));
+     TEST_ASSERT_NULL(pipeline_parse("ls | | wc"));
+     struct pipeline *pl = pipeline_parse("   ");
+     TEST_ASSERT_NOT_NULL(pl);
+     TEST_ASSERT_EQUAL_UINT(0, pl->ncmds);
+     pipeline_free(pl);
+}
+
+void test_run_pipeline(void)
+{
+     struct shell sh;
+     int status;
+     test_shell_init(&sh, LAUNCH_SPAWN);
+     char *out = capture_pipeline(&sh, "echo hello world | tr a-z A-Z | rev", &status);
+     TEST_ASSERT_EQUAL_STRING("DLROW OLLEH\n", out);
+     TEST_ASSERT_EQUAL_INT(0, WEXITSTATUS(status));
+     out = capture_pipeline(&sh, "echo a | false", &status);
+     TEST_ASSERT_EQUAL_INT(1, WEXITSTATUS(status));
+     sh.launch = LAUNCH_FORK;
+     out = capture_pipeline(&sh, "ulimit -n | cat", &status);
+     TEST_ASSERT_TRUE(sh.limits.open_max > 0);
+     TEST_ASSERT_EQUAL_INT(sh.limits.open_max, atol(out));
+     capture_pipeline(&sh, "ulimit -z", &status);
+     TEST_ASSERT_EQUAL_INT(1, WEXITSTATUS(status));
+     test_shell_destroy(&sh);
+}
+
+void test_list_parse(void)
+{
+     struct cmd_list *list = list_parse("make && ./run || notify me; a | b > out &  c;");
+     TEST_ASSERT_NOT_NULL(list);
+     TEST_ASSERT_EQUAL_size_t(3, list->nitems);
+
+     struct and_or *item = &list->items[0];
+     TEST_ASSERT_EQUAL_size_t(3, item->npipelines);
+     TEST_ASSERT_EQUAL_INT(ANDOR_AND, item->ops[0]);
+     TEST_ASSERT_EQUAL_INT(ANDOR_OR, item->ops[1]);
+     TEST_ASSERT_EQUAL_STRING("notify", item->pipelines[2].cmds[0].argv[0]);
+     TEST_ASSERT_EQUAL_STRING("me", item->pipelines[2].cmds[0].argv[1]);
+     TEST_ASSERT_NULL(item->pipelines[2].cmds[0].argv[2]);
+     TEST_ASSERT_EQUAL_STRING("make && ./run || notify me", item->text);
+     TEST_ASSERT_FALSE(item->background);
+
+     item = &list->items[1];
+     TEST_ASSERT_TRUE(item->background);
+     TEST_ASSERT_TRUE(item->pipelines[0].background);
+     TEST_ASSERT_EQUAL_size_t(2, item->pipelines[0].ncmds);
+     TEST_ASSERT_EQUAL_size_t(1, item->pipelines[0].cmds[1].nredirs);
+     TEST_ASSERT_EQUAL_STRING("a | b > out", item->pipelines[0].text);
+     TEST_ASSERT_EQUAL_STRING("c", list->items[2].pipelines[0].cmds[0].argv[0]);
+     list_free(list);
+
+     list = list_parse("  ");
+     TEST_ASSERT_NOT_NULL(list);
+     TEST_ASSERT_EQUAL_size_t(0, list->nitems);
+     list_free(list);
+
+     TEST_ASSERT_NULL(list_parse("; ls"));
+     TEST_ASSERT_NULL(list_parse("ls &&"));
+     TEST_ASSERT_NULL(list_parse("ls || && wc"));
+     TEST_ASSERT_NULL(list_parse("ls & ; wc"));
+     /* a single pipeline is all pipeline_parse takes */
+     TEST_ASSERT_NULL(pipeline_parse("ls; wc"));
+     TEST_ASSERT_NULL(pipeline_parse("ls && wc"));
+}
+
+void test_parse_cache(void)
+{
+     struct parse_cache pc;
+     parse_cache_init(&pc, 2);
+     struct cmd_list *a = parse_cache_get(&pc, "echo a | wc", 11);
+     /* only the given length is the key */
+     struct cmd_list *again = parse_cache_get(&pc, "echo a | wc -l", 11);
+     TEST_ASSERT_NOT_NULL(a);
+     TEST_ASSERT_TRUE(a == again);
+     TEST_ASSERT_EQUAL_UINT(1, pc.hits);
+     TEST_ASSERT_EQUAL_UINT(1, pc.misses);
+     TEST_ASSERT_EQUAL_UINT(3, a->refs);
+     list_free(again);
+
+     struct cmd_list *b = parse_cache_get(&pc, "echo b", 6);
+     TEST_ASSERT_TRUE(a != b);
+     list_free(parse_cache_get(&pc, "echo a | wc", 11));
+     /* "echo b" is now the least recently used line and makes room */
+     struct cmd_list *c = parse_cache_get(&pc, "echo c", 6);
+     TEST_ASSERT_EQUAL_size_t(2, pc.count);
+     TEST_ASSERT_EQUAL_UINT(1, b->refs);
+     TEST_ASSERT_EQUAL_STRING("b", b->items[0].pipelines[0].cmds[0].argv[1]);
+     struct cmd_list *b2 = parse_cache_get(&pc, "echo b", 6);
+     TEST_ASSERT_TRUE(b2 != b);
+     TEST_ASSERT_EQUAL_UINT(2, pc.hits);
+     TEST_ASSERT_EQUAL_UINT(4, pc.misses);
+     list_free(b);
+     list_free(b2);
+     list_free(c);
+
+     /* syntax errors are reported every time, never cached */
+     TEST_ASSERT_NULL(parse_cache_get(&pc, "ls &&", 5));
+     TEST_ASSERT_NULL(parse_cache_get(&pc, "ls &&", 5));
+     TEST_ASSERT_EQUAL_UINT(6, pc.misses);
+     TEST_ASSERT_EQUAL_size_t(2, pc.count);
+
+     parse_cache_clear(&pc);
+     TEST_ASSERT_EQUAL_size_t(0, pc.count);
+     TEST_ASSERT_EQUAL_UINT(1, a->refs);
+     list_free(a);
+     parse_cache_destroy(&pc);
+}
+
+void test_history_store(void)
+{
+     char dir[] = "/tmp/lab-history-XXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     char path[64], idx[64];
+     snprintf(path, sizeof(path), "%s/log", dir);
+     snprintf(idx, sizeof(idx), "%s/log.idx", dir);
+
+     struct history a, b;
+     TEST_ASSERT_EQUAL_INT(0, hist_open(&a, path));
+     TEST_ASSERT_EQUAL_INT(0, hist_open(&b, path));
+     TEST_ASSERT_EQUAL_size_t(0, hist_count(&a));
+     TEST_ASSERT_EQUAL_INT(0, hist_add(&a, "ls -l"));
+     TEST_ASSERT_EQUAL_INT(0, hist_add(&b, "echo 'from b'"));
+     TEST_ASSERT_EQUAL_INT(0, hist_add(&a, ""));
+     /* both shells see each other's entries, in the order they were added */
+     TEST_ASSERT_EQUAL_size_t(3, hist_count(&a));
+     TEST_ASSERT_EQUAL_size_t(3, hist_count(&b));
+     char *line = hist_get(&a, 2);
+     TEST_ASSERT_EQUAL_STRING("echo 'from b'", line);
+     free(line);
+     line = hist_get(&b, 3);
+     TEST_ASSERT_EQUAL_STRING("", line);
+     free(line);
+     TEST_ASSERT_NULL(hist_get(&a, 0));
+     TEST_ASSERT_NULL(hist_get(&a, 4));
+
+     line = hist_expand(&a, "!1 | wc; echo !! '!!' \\!! !-3 != x!");
+     TEST_ASSERT_EQUAL_STRING("ls -l | wc; echo  '!!' \\!! ls -l != x!", line);
+     free(line);
+     TEST_ASSERT_NULL(hist_expand(&a, "echo !9"));
+     TEST_ASSERT_NULL(hist_expand(&a, "echo !-4"));
+     hist_close(&b);
+
+     /* a lost index is rebuilt from the log */
+     hist_close(&a);
+     TEST_ASSERT_EQUAL_INT(0, unlink(idx));
+     TEST_ASSERT_EQUAL_INT(0, hist_open(&a, path));
+     TEST_ASSERT_EQUAL_size_t(3, hist_count(&a));
+     line = hist_get(&a, 1);
+     TEST_ASSERT_EQUAL_STRING("ls -l", line);
+     free(line);
+
+     /* a record whose shell died before indexing it is picked up on open */
+     hist_close(&a);
+     int fd = open(path, O_WRONLY | O_APPEND);
+     uint32_t len = 4;
+     TEST_ASSERT_EQUAL_INT(4, write(fd, &len, sizeof(len)));
+     TEST_ASSERT_EQUAL_INT(4, write(fd, "lost", 4));
+     /* and a torn one is not */
+     len = 100;
+     TEST_ASSERT_EQUAL_INT(4, write(fd, &len, sizeof(len)));
+     TEST_ASSERT_EQUAL_INT(3, write(fd, "abc", 3));
+     close(fd);
+     TEST_ASSERT_EQUAL_INT(0, hist_open(&a, path));
+     TEST_ASSERT_EQUAL_size_t(4, hist_count(&a));
+     line = hist_get(&a, 4);
+     TEST_ASSERT_EQUAL_STRING("lost", line);
+     free(line);
+
+     /* many entries cross the mapping step of the index */
+     for (int i = 0; i < 140000; i++) hist_add(&a, "x");
+     TEST_ASSERT_EQUAL_INT(0, hist_add(&a, "last"));
+     line = hist_get(&a, 140005);
+     TEST_ASSERT_EQUAL_STRING("last", line);
+     free(line);
+
+     /* a clear replaces the files under a shell that has them mapped */
+     TEST_ASSERT_EQUAL_INT(0, hist_open(&b, path));
+     TEST_ASSERT_EQUAL_size_t(140005, hist_count(&b));
+     hist_clear(&a);
+     TEST_ASSERT_EQUAL_size_t(0, hist_count(&a));
+     TEST_ASSERT_NULL(hist_get(&a, 1));
+     TEST_ASSERT_NULL(hist_get(&b, 1));
+     TEST_ASSERT_EQUAL_size_t(0, hist_count(&b));
+     TEST_ASSERT_EQUAL_INT(0, hist_add(&b, "again"));
+     TEST_ASSERT_EQUAL_size_t(1, hist_count(&a));
+     line = hist_get(&a, 1);
+     TEST_ASSERT_EQUAL_STRING("again", line);
+     free(line);
+     char tmp[80];
+     snprintf(tmp, sizeof(tmp), "%s.new", idx);
+     TEST_ASSERT_EQUAL_INT(-1, access(tmp, F_OK));
+     hist_close(&b);
+     hist_close(&a);
+     unlink(idx);
+     unlink(path);
+     rmdir(dir);
+}
+
+void test_history_search(void)
+{
+     char dir[] = "/tmp/lab-history-XXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     char path[64], idx[64];
+     snprintf(path, sizeof(path), "%s/log", dir);
+     snprintf(idx, sizeof(idx), "%s/log.idx", dir);
+     struct history h;
+     TEST_ASSERT_EQUAL_INT(0, hist_open(&h, path));
+     hist_add(&h, "git commit -m 'fix parser'");
+     hist_add(&h, "make check");
+     hist_add(&h, "commgit it");
+     hist_add(&h, "git commit --amend");
+     hist_add(&h, "ls");
+
+     struct hist_search s = { 0 };
+     hist_search_sync(&s, &h);
+     TEST_ASSERT_EQUAL_size_t(5, s.nentries);
+     size_t ids[8];
+     /* entry 3 has every trigram of "git com" but not the text */
+     TEST_ASSERT_EQUAL_size_t(2, hist_search_find(&s, &h, "git com", SIZE_MAX, ids, 8));
+     TEST_ASSERT_EQUAL_size_t(4, ids[0]);
+     TEST_ASSERT_EQUAL_size_t(1, ids[1]);
+     TEST_ASSERT_EQUAL_size_t(1, hist_search_find(&s, &h, "git com", 4, ids, 8));
+     TEST_ASSERT_EQUAL_size_t(1, ids[0]);
+     TEST_ASSERT_EQUAL_size_t(1, hist_search_find(&s, &h, "git com", SIZE_MAX, ids, 1));
+     TEST_ASSERT_EQUAL_size_t(0, hist_search_find(&s, &h, "rebase", SIZE_MAX, ids, 8));
+     /* short queries work without trigrams */
+     TEST_ASSERT_EQUAL_size_t(1, hist_search_find(&s, &h, "ls", SIZE_MAX, ids, 8));
+     TEST_ASSERT_EQUAL_size_t(5, ids[0]);
+     TEST_ASSERT_EQUAL_size_t(3, hist_search_find(&s, &h, "it", SIZE_MAX, ids, 8));
+     TEST_ASSERT_EQUAL_size_t(4, ids[0]);
+     TEST_ASSERT_EQUAL_size_t(1, ids[2]);
+     TEST_ASSERT_EQUAL_size_t(1, hist_search_find(&s, &h, "k", SIZE_MAX, ids, 8));
+     TEST_ASSERT_EQUAL_size_t(2, ids[0]);
+     TEST_ASSERT_EQUAL_size_t(0, hist_search_find(&s, &h, "q", SIZE_MAX, ids, 8));
+
+     /* entries another shell appends are picked up by the next sync */
+     struct history other;
+     TEST_ASSERT_EQUAL_INT(0, hist_open(&other, path));
+     hist_add(&other, "make install");
+     hist_close(&other);
+     hist_search_sync(&s, &h);
+     TEST_ASSERT_EQUAL_size_t(1, hist_search_find(&s, &h, "make i", SIZE_MAX, ids, 8));
+     TEST_ASSERT_EQUAL_size_t(6, ids[0]);
+
+     /* a larger history: every query still finds exactly its entry */
+     enum { ENTRIES = 20000, QUERIES = 200 };
+     char line[96];
+     for (int i = 0; i < ENTRIES; i++) {
+          snprintf(line, sizeof(line), "cc -O%d -c src/module_%d.c -o build/obj_%d.o", i % 4, i, i * 7);
+          hist_add(&h, line);
+     }
+     hist_add(&h, "needle --in haystack");
+     /* an index built a slice at a time reads what it lacks from the log */
+     TEST_ASSERT_FALSE(hist_search_sync_some(&s, &h, 1000));
+     TEST_ASSERT_EQUAL_size_t(1006, s.nentries);
+     TEST_ASSERT_EQUAL_size_t(1, hist_search_find(&s, &h, "module_500.c", SIZE_MAX, ids, 8));
+     TEST_ASSERT_EQUAL_size_t(507, ids[0]);
+     TEST_ASSERT_EQUAL_size_t(1, hist_search_find(&s, &h, "module_5000.c", SIZE_MAX, ids, 8));
+     TEST_ASSERT_EQUAL_size_t(5007, ids[0]);
+     while (!hist_search_sync_some(&s, &h, 1000))
+          ;
+     TEST_ASSERT_EQUAL_size_t(ENTRIES + 7, s.nentries);
+     for (int q = 0; q < QUERIES; q++) {
+          snprintf(line, sizeof(line), "module_%d.c", q * 97);
+          TEST_ASSERT_EQUAL_size_t(1, hist_search_find(&s, &h, line, SIZE_MAX, ids, 8));
+          TEST_ASSERT_EQUAL_size_t(7 + q * 97, ids[0]);
+     }
+     TEST_ASSERT_EQUAL_size_t(1, hist_search_find(&s, &h, "needle", SIZE_MAX, ids, 8));
+     TEST_ASSERT_EQUAL_size_t(8, hist_search_find(&s, &h, "cc", SIZE_MAX, ids, 8));
+     TEST_ASSERT_EQUAL_size_t(ENTRIES + 6, ids[0]);
+     TEST_ASSERT_EQUAL_size_t(ENTRIES - 1, ids[7]);
+
+     hist_clear(&h);
+     hist_search_sync(&s, &h);
+     TEST_ASSERT_EQUAL_size_t(0, s.nentries);
+     TEST_ASSERT_EQUAL_size_t(0, hist_search_find(&s, &h, "needle", SIZE_MAX, ids, 8));
+     hist_search_destroy(&s);
+     hist_close(&h);
+     unlink(idx);
+     unlink(path);
+     rmdir(dir);
+}
+
+static void make_command(const char *dir, const char *name, mode_t mode)
+{
+     char path[128];
+     snprintf(path, sizeof(path), "%s/%s", dir, name);
+     int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+     TEST_ASSERT_TRUE(fd >= 0);
+     close(fd);
+}
+
+static size_t count_matches(char **matches)
+{
+     size_t n = 0;
+     if (!matches) return 0;
+     /* matches[0] is the common prefix, unless there is a single match */
+     for (n = 0; matches[n]; n++) ;
+     for (size_t i = 0; matches[i]; i++) free(matches[i]);
+     free(matches);
+     return n > 1 ? n - 1 : n;
+}
+
+void test_command_completion(void)
+{
+     char a[] = "/tmp/lab-path-a-XXXXXX", b[] = "/tmp/lab-path-b-XXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(a));
+     TEST_ASSERT_NOT_NULL(mkdtemp(b));
+     enum { COMMANDS = 5000 };
+     char name[64];
+     for (int i = 0; i < COMMANDS; i++) {
+          snprintf(name, sizeof(name), "tool-%04d", i);
+          make_command(a, name, 0755);
+     }
+     make_command(a, "labzap", 0755);
+     make_command(b, "labzap", 0755);
+     make_command(b, "labdata", 0644);
+     snprintf(name, sizeof(name), "%s/labdir", b);
+     TEST_ASSERT_EQUAL_INT(0, mkdir(name, 0755));
+
+     char *saved = getenv("PATH") ? strdup(getenv("PATH")) : NULL;
+     char path[128];
+     snprintf(path, sizeof(path), "%s:%s", a, b);
+     setenv("PATH", path, 1);
+
+     struct command_index ci;
+     cmd_index_init(&ci);
+     TEST_ASSERT_TRUE(cmd_index_refresh(&ci));
+     /* duplicates, plain files and directories are not commands */
+     TEST_ASSERT_EQUAL_size_t(COMMANDS + 1, ci.count);
+     TEST_ASSERT_FALSE(cmd_index_refresh(&ci));
+
+     size_t first;
+     TEST_ASSERT_EQUAL_size_t(1, cmd_index_prefix(&ci, "lab", &first));
+     TEST_ASSERT_EQUAL_STRING("labzap", cmd_index_name(&ci, first));
+     TEST_ASSERT_EQUAL_size_t(10, cmd_index_prefix(&ci, "tool-123", &first));
+     TEST_ASSERT_EQUAL_STRING("tool-1230", cmd_index_name(&ci, first));
+     TEST_ASSERT_EQUAL_size_t(0, cmd_index_prefix(&ci, "zz", &first));
+     TEST_ASSERT_EQUAL_size_t(COMMANDS + 1, cmd_index_prefix(&ci, "", &first));
+
+     for (int i = 0; i < 500; i++) {
+          snprintf(name, sizeof(name), "tool-%03d", i);
+          TEST_ASSERT_EQUAL_size_t(10, cmd_index_prefix(&ci, name, &first));
+     }
+
+     /* installing, removing or chmod +x a command is noticed */
+     make_command(b, "labnew", 0755);
+     TEST_ASSERT_TRUE(cmd_index_drain(&ci));
+     TEST_ASSERT_FALSE(cmd_index_drain(&ci));
+     TEST_ASSERT_TRUE(cmd_index_refresh(&ci));
+     TEST_ASSERT_EQUAL_size_t(2, cmd_index_prefix(&ci, "lab", &first));
+     snprintf(name, sizeof(name), "%s/labdata", b);
+     TEST_ASSERT_EQUAL_INT(0, chmod(name, 0755));
+     snprintf(name, sizeof(name), "%s/labnew", b);
+     TEST_ASSERT_EQUAL_INT(0, unlink(name));
+     TEST_ASSERT_TRUE(cmd_index_refresh(&ci));
+     TEST_ASSERT_EQUAL_size_t(2, cmd_index_prefix(&ci, "lab", &first));
+     TEST_ASSERT_EQUAL_STRING("labdata", cmd_index_name(&ci, first));
+
+     /* an index built for another PATH is rebuilt */
+     setenv("PATH", b, 1);
+     TEST_ASSERT_TRUE(cmd_index_refresh(&ci));
+     TEST_ASSERT_EQUAL_size_t(2, ci.count);
+     setenv("PATH", path, 1);
+
+     /* what gets completed depends on where the word is */
+     struct shell sh;
+     test_shell_init(&sh, LAUNCH_SPAWN);
+     cmd_index_init(&sh.commands);
+     TEST_ASSERT_EQUAL_size_t(2, count_matches(sh_complete(&sh, "lab", 0, 3)));
+     TEST_ASSERT_EQUAL_size_t(2, count_matches(sh_complete(&sh, "ls | lab", 5, 8)));
+     TEST_ASSERT_EQUAL_size_t(2, count_matches(sh_complete(&sh, "true && lab", 8, 11)));
+     TEST_ASSERT_EQUAL_size_t(1, count_matches(sh_complete(&sh, "paral", 0, 5)));
+     TEST_ASSERT_EQUAL_size_t(1, count_matches(sh_complete(&sh, "ulim", 0, 4)));
+     TEST_ASSERT_NULL(sh_complete(&sh, "cat lab", 4, 7));
+     TEST_ASSERT_NULL(sh_complete(&sh, "./lab", 0, 5));
+     pid_t pids[] = { -1 };
+     job_add(&sh.jobs, 0, pids, 1, "one");
+     job_add(&sh.jobs, 0, pids, 1, "two");
+     TEST_ASSERT_EQUAL_size_t(2, count_matches(sh_complete(&sh, "fg %", 3, 4)));
+     TEST_ASSERT_EQUAL_size_t(1, count_matches(sh_complete(&sh, "kill %2", 5, 7)));
+     cmd_index_destroy(&sh.commands);
+     test_shell_destroy(&sh);
+
+     cmd_index_destroy(&ci);
+     if (saved) setenv("PATH", saved, 1);
+     else unsetenv("PATH");
+     free(saved);
+     char cmd[160];
+     snprintf(cmd, sizeof(cmd), "rm -rf %s %s", a, b);
+     TEST_ASSERT_EQUAL_INT(0, system(cmd));
+}
+
+/* Waits for the prompt's helper thread to report, as the event loop would */
+static bool prompt_news(struct shell *sh)
+{
+     struct pollfd pfd = { .fd = sh->prompt_info.eventfd, .events = POLLIN };
+     return poll(&pfd, 1, 5000) == 1;
+}
+
+void test_prompt_expand(void)
+{
+     struct shell sh;
+     test_shell_init(&sh, LAUNCH_SPAWN);
+     prompt_init(&sh);
+     sh.last_status = 3;
+     sh.prompt_info.duration_ms = 1234;
+     char *p = prompt_expand(&sh, "[$?|\\D|\\j|\\q|\\\\] \\$ ");
+     TEST_ASSERT_EQUAL_STRING(geteuid() == 0 ? "[3|1.2s|0|\\q|\\] # " : "[3|1.2s|0|\\q|\\] $ ", p);
+     free(p);
+     sh.prompt_info.duration_ms = 42;
+     p = prompt_expand(&sh, "\\D \\[\\e[1m\\]x");
+     TEST_ASSERT_EQUAL_STRING("42ms \001\033[1m\002x", p);
+     free(p);
+     sh.prompt_info.duration_ms = 125000;
+     p = prompt_expand(&sh, "\\D");
+     TEST_ASSERT_EQUAL_STRING("2m05s", p);
+     free(p);
+     pid_t pids[] = { 100 };
+     job_add(&sh.jobs, 100, pids, 1, "sleep");
+     p = prompt_expand(&sh, "\\j");
+     TEST_ASSERT_EQUAL_STRING("1", p);
+     free(p);
+     job_remove(&sh.jobs, sh.jobs.jobs[0]);
+
+     char host[256] = "";
+     gethostname(host, sizeof(host) - 1);
+     p = prompt_expand(&sh, "\\H");
+     TEST_ASSERT_EQUAL_STRING(host, p);
+     free(p);
+
+     /* the working directory, with ~ for home */
+     char dir[] = "/tmp/lab-prompt-XXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     char *old_cwd = getcwd(NULL, 0);
+     char *old_home = getenv("HOME") ? strdup(getenv("HOME")) : NULL;
+     char path[128];
+     snprintf(path, sizeof(path), "%s/src", dir);
+     TEST_ASSERT_EQUAL_INT(0, mkdir(path, 0755));
+     snprintf(path, sizeof(path), "%s/src/deep", dir);
+     TEST_ASSERT_EQUAL_INT(0, mkdir(path, 0755));
+     setenv("HOME", dir, 1);
+     TEST_ASSERT_EQUAL_INT(0, chdir(path));
+     p = prompt_expand(&sh, "\\w \\W");
+     TEST_ASSERT_EQUAL_STRING("~/src/deep deep", p);
+     free(p);
+
+     /* the branch is looked up in the background and remembered */
+     p = prompt_expand(&sh, "(\\g)");
+     TEST_ASSERT_EQUAL_STRING("()", p);
+     free(p);
+     TEST_ASSERT_TRUE(sh.prompt_info.running);
+     snprintf(path, sizeof(path), "%s/.git", dir);
+     TEST_ASSERT_EQUAL_INT(0, mkdir(path, 0755));
+     snprintf(path, sizeof(path), "%s/.git/HEAD", dir);
+     FILE *f = fopen(path, "w");
+     fputs("ref: refs/heads/feature/x\n", f);
+     fclose(f);
+     p = prompt_expand(&sh, "(\\g)");
+     free(p);
+     TEST_ASSERT_TRUE(prompt_news(&sh));
+     prompt_update(&sh, false);
+     p = prompt_expand(&sh, "(\\g)");
+     TEST_ASSERT_EQUAL_STRING("(feature/x)", p);
+     free(p);
+
+     /* a detached HEAD shows the commit */
+     f = fopen(path, "w");
+     fputs("0123456789abcdef0123456789abcdef01234567\n", f);
+     fclose(f);
+     p = prompt_expand(&sh, "\\g");
+     free(p);
+     TEST_ASSERT_TRUE(prompt_news(&sh));
+     prompt_update(&sh, false);
+     p = prompt_expand(&sh, "\\g");
+     TEST_ASSERT_EQUAL_STRING("0123456", p);
+     free(p);
+     prompt_destroy(&sh);
+     TEST_ASSERT_FALSE(sh.prompt_info.running);
+
+     TEST_ASSERT_EQUAL_INT(0, chdir(old_cwd));
+     free(old_cwd);
+     if (old_home) setenv("HOME", old_home, 1);
+     free(old_home);
+     test_shell_destroy(&sh);
+     char cmd[160];
+     snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+     TEST_ASSERT_EQUAL_INT(0, system(cmd));
+}
+
+void test_builtin_registry(void)
+{
+     /* if this fails after adding a builtin, pick a new BUILTIN_SEED */
+     TEST_ASSERT_EQUAL_size_t(0, builtin_collisions());
+     size_t n = 0;
+     for (const struct builtin *b = builtin_list(); b->name; b++, n++) {
+          TEST_ASSERT_EQUAL_PTR(b, builtin_find(b->name));
+          TEST_ASSERT_NOT_NULL(b->run);
+     }
+     TEST_ASSERT_TRUE(n > 10 && n < BUILTIN_SLOTS / 2);
+     TEST_ASSERT_NULL(builtin_find("ls"));
+     TEST_ASSERT_NULL(builtin_find("cdx"));
+     TEST_ASSERT_NULL(builtin_find(""));
+     TEST_ASSERT_NULL(builtin_find(NULL));
+     TEST_ASSERT_TRUE(builtin_find("cd")->flags & BUILTIN_PARENT);
+     TEST_ASSERT_FALSE(builtin_find("fg")->flags & BUILTIN_FORKABLE);
+
+     const char *names[] = { "grep", "ls", "make", "git", "sed", "awk", "python3", "cc" };
+     for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) TEST_ASSERT_NULL(builtin_find(names[i]));
+
+     /* fg cannot act on the shell's jobs from a forked stage */
+     struct shell sh;
+     test_shell_init(&sh, LAUNCH_SPAWN);
+     int status;
+     capture_pipeline(&sh, "cat /dev/null | fg", &status);
+     TEST_ASSERT_EQUAL_INT(1, WEXITSTATUS(status));
+     test_shell_destroy(&sh);
+}
+
+static char *capture_list(struct shell *sh, const char *line)
+{
+     static char out[4096];
+     FILE *tmp = tmpfile();
+     fflush(stdout);
+     int saved = dup(STDOUT_FILENO);
+     dup2(fileno(tmp), STDOUT_FILENO);
+     struct cmd_list *list = list_parse(line);
+     TEST_ASSERT_NOT_NULL(list);
+     sh_run_list(sh, list);
+     list_free(list);
+     fflush(stdout);
+     dup2(saved, STDOUT_FILENO);
+     close(saved);
+     rewind(tmp);
+     size_t n = fread(out, 1, sizeof(out) - 1, tmp);
+     out[n] = '\0';
+     fclose(tmp);
+     return out;
+}
+
+void test_run_list(void)
+{
+     struct shell sh;
+     test_shell_init(&sh, LAUNCH_SPAWN);
+     char *out = capture_list(&sh, "true && echo a; false && echo b; false || echo c; true || echo d");
+     TEST_ASSERT_EQUAL_STRING("a\nc\n", out);
+     TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+
+     /* a skipped pipeline keeps the status the next operator looks at */
+     out = capture_list(&sh, "false && echo no && echo no || echo yes");
+     TEST_ASSERT_EQUAL_STRING("yes\n", out);
+     capture_list(&sh, "true; sh -c 'exit 7'");
+     TEST_ASSERT_EQUAL_INT(7, sh.last_status);
+     capture_list(&sh, "sh -c 'kill -TERM $$'");
+     TEST_ASSERT_EQUAL_INT(128 + SIGTERM, sh.last_status);
+     capture_list(&sh, "nosuchcommand-xyz");
+     TEST_ASSERT_EQUAL_INT(127, sh.last_status);
+
+     /* several pipelines in the background become one job */
+     capture_list(&sh, "false || exit 6 &");
+     TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+     TEST_ASSERT_EQUAL_size_t(1, sh.jobs.count);
+     struct job *j = sh.jobs.jobs[0];
+     TEST_ASSERT_EQUAL_STRING("false || exit 6", j->text);
+     TEST_ASSERT_EQUAL_INT(6, WEXITSTATUS(job_wait(&sh, j, false)));
+     job_remove(&sh.jobs, j);
+     test_shell_destroy(&sh);
+}
+
+void test_line_reader(void)
+{
+     int fds[2];
+     TEST_ASSERT_EQUAL_INT(0, pipe(fds));
+     /* A line longer than a block makes the buffer grow */
+     size_t big = 200000;
+     char *line = malloc(big + 1);
+     memset(line, 'x', big);
+     line[big] = '\0';
+     pid_t pid = fork();
+     if (pid == 0) {
+          close(fds[0]);
+          FILE *w = fdopen(fds[1], "w");
+          fprintf(w, "first\n\n%s\nlast", line);
+          fclose(w);
+          _exit(0);
+     }
+     close(fds[1]);
+
+     struct line_reader r;
+     size_t len;
+     reader_init_fd(&r, fds[0], false);
+     TEST_ASSERT_EQUAL_STRING("first", reader_next_line(&r, &len));
+     TEST_ASSERT_EQUAL_STRING("", reader_next_line(&r, &len));
+     TEST_ASSERT_EQUAL_STRING(line, reader_next_line(&r, &len));
+     TEST_ASSERT_EQUAL_size_t(big, len);
+     TEST_ASSERT_EQUAL_STRING("last", reader_next_line(&r, &len));
+     TEST_ASSERT_NULL(reader_next_line(&r, &len));
+     TEST_ASSERT_EQUAL_UINT(4, reader_line(&r));
+     reader_destroy(&r);
+     close(fds[0]);
+     waitpid(pid, NULL, 0);
+     free(line);
+
+     reader_init_string(&r, "a\nb\n");
+     TEST_ASSERT_EQUAL_STRING("a", reader_next_line(&r, &len));
+     TEST_ASSERT_EQUAL_STRING("b", reader_next_line(&r, &len));
+     TEST_ASSERT_NULL(reader_next_line(&r, &len));
+     reader_destroy(&r);
+}
+
+void test_script_map(void)
+{
+     /* A script whose last line runs up to the end of its last page */
+     long page = sysconf(_SC_PAGESIZE);
+     FILE *f = tmpfile();
+     size_t written = 0;
+     for (int i = 1; written + 32 < (size_t)page; i++)
+          written += fprintf(f, i % 3 ? "echo line %d\n" : "\n", i);
+     while (written + 1 < (size_t)page) written += fprintf(f, " ");
+     written += fprintf(f, "x");
+     fflush(f);
+     TEST_ASSERT_EQUAL_size_t(page, written);
+
+     struct line_reader r;
+     size_t len;
+     TEST_ASSERT_TRUE(reader_init_map(&r, fileno(f)));
+     fclose(f);
+     const char *line = reader_next_line(&r, &len);
+     TEST_ASSERT_EQUAL_size_t(11, len);
+     TEST_ASSERT_EQUAL_MEMORY("echo line 1", line, 11);
+     TEST_ASSERT_EQUAL_CHAR('\n', line[len]);
+     TEST_ASSERT_EQUAL_UINT(1, reader_line(&r));
+
+     /* Lines are views: parse them in place, no copy of the line needed */
+     unsigned long n = 1;
+     const char *last = line;
+     size_t last_len = len;
+     while ((line = reader_next_line(&r, &len))) {
+          n++;
+          last = line;
+          last_len = len;
+          struct cmd_list *list = list_parse_n(line, len);
+          TEST_ASSERT_NOT_NULL(list);
+          list_free(list);
+          if (n == 5) TEST_ASSERT_EQUAL_UINT(5, reader_line(&r));
+     }
+     TEST_ASSERT_EQUAL_UINT(n, reader_line(&r));
+     /* The last view ends exactly where the mapping does */
+     TEST_ASSERT_EQUAL_CHAR('x', last[last_len - 1]);
+     char **cmd = cmd_parse_n(last, last_len);
+     TEST_ASSERT_EQUAL_STRING("x", cmd[0]);
+     TEST_ASSERT_NULL(cmd[1]);
+     cmd_free(cmd);
+     reader_destroy(&r);
+
+     int fds[2];
+     TEST_ASSERT_EQUAL_INT(0, pipe(fds));
+     TEST_ASSERT_FALSE(reader_init_map(&r, fds[0]));
+     close(fds[0]);
+     close(fds[1]);
+}
+
+/* Runs text as a script read from a seekable stdin and returns its output */
+static char *capture_script(struct shell *sh, const char *text)
+{
+     static char out[4096];
+     FILE *in = tmpfile();
+     fputs(text, in);
+     rewind(in);
+     FILE *tmp = tmpfile();
+     fflush(stdout);
+     int saved_in = dup(STDIN_FILENO);
+     int saved_out = dup(STDOUT_FILENO);
+     dup2(fileno(in), STDIN_FILENO);
+     dup2(fileno(tmp), STDOUT_FILENO);
+
+     struct line_reader r;
+     reader_init_fd(&r, STDIN_FILENO, true);
+     sh_run_script(sh, &r, NULL);
+     reader_destroy(&r);
+
+     fflush(stdout);
+     dup2(saved_out, STDOUT_FILENO);
+     dup2(saved_in, STDIN_FILENO);
+     close(saved_out);
+     close(saved_in);
+     fclose(in);
+     rewind(tmp);
+     size_t n = fread(out, 1, sizeof(out) - 1, tmp);
+     out[n] = '\0';
+     fclose(tmp);
+     return out;
+}
+
+void test_run_script(void)
+{
+     struct shell sh;
+     test_shell_init(&sh, LAUNCH_SPAWN);
+     char *out = capture_script(&sh, "#!/bin/sh\n# comment\necho one # trailing\n\n  false || echo two\n");
+     TEST_ASSERT_EQUAL_STRING("one\ntwo\n", out);
+     TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+
+     /* commands reading stdin get the script text after their own line */
+     out = capture_script(&sh, "head -n 1\nnot a command\necho done\n");
+     TEST_ASSERT_EQUAL_STRING("not a command\ndone\n", out);
+
+     /* a syntax error ends the script */
+     out = capture_script(&sh, "echo a\n;\necho no\n");
+     TEST_ASSERT_EQUAL_STRING("a\n", out);
+     TEST_ASSERT_EQUAL_INT(2, sh.last_status);
+     test_shell_destroy(&sh);
+}
+
+extern char **environ;
+
+void test_shell_variables(void)
+{
+     struct var_table vt;
+     vars_init(&vt);
+     char **outer = environ;
+     TEST_ASSERT_EQUAL_STRING(getenv("PATH"), var_get(&vt, "PATH", 4));
+     TEST_ASSERT_EQUAL_PTR(environ, vars_environ(&vt));
+     TEST_ASSERT_NULL(var_get(&vt, "TEST_LAB_X", 10));
+
+     /* a local variable stays out of the environment until exported */
+     TEST_ASSERT_EQUAL_INT(0, var_set(&vt, "TEST_LAB_X", 10, "1", 0));
+     TEST_ASSERT_EQUAL_STRING("1", var_get(&vt, "TEST_LAB_X", 10));
+     TEST_ASSERT_NULL(getenv("TEST_LAB_X"));
+     TEST_ASSERT_EQUAL_INT(0, var_set(&vt, "TEST_LAB_X", 10, NULL, VAR_EXPORT));
+     TEST_ASSERT_EQUAL_STRING("1", getenv("TEST_LAB_X"));
+
+     /* changing an exported value patches the array instead of rebuilding it */
+     char **envp = vars_environ(&vt);
+     TEST_ASSERT_EQUAL_INT(0, var_set(&vt, "TEST_LAB_X", 10, "2", 0));
+     TEST_ASSERT_EQUAL_PTR(envp, vars_environ(&vt));
+     TEST_ASSERT_EQUAL_STRING("2", getenv("TEST_LAB_X"));
+
+     char *assigns[] = { "TEST_LAB_X=3", "TEST_LAB_Y=4", "TEST_LAB_Y=5" };
+     char **env = vars_env_with(&vt, assigns, 3);
+     size_t n = 0, seen = 0;
+     for (; env[n]; n++) {
+          if (strncmp(env[n], "TEST_LAB_", 9) == 0) {
+               seen++;
+               TEST_ASSERT_TRUE(strcmp(env[n], "TEST_LAB_X=3") == 0 || strcmp(env[n], "TEST_LAB_Y=5") == 0);
+          }
+     }
+     TEST_ASSERT_EQUAL_size_t(2, seen);
+     TEST_ASSERT_EQUAL_size_t(vt.nenv + 1, n);
+     free(env);
+
+     TEST_ASSERT_EQUAL_INT(0, var_set(&vt, "TEST_LAB_R", 10, "r", VAR_READONLY));
+     TEST_ASSERT_EQUAL_INT(-1, var_set(&vt, "TEST_LAB_R", 10, "s", 0));
+     TEST_ASSERT_EQUAL_INT(-1, var_unset(&vt, "TEST_LAB_R"));
+     TEST_ASSERT_EQUAL_INT(0, var_unset(&vt, "TEST_LAB_X"));
+     TEST_ASSERT_NULL(getenv("TEST_LAB_X"));
+
+     /* many variables: growth and removal keep every name reachable */
+     char name[32];
+     for (int i = 0; i < 1000; i++) {
+          snprintf(name, sizeof(name), "V%d", i);
+          TEST_ASSERT_EQUAL_INT(0, var_set(&vt, name, strlen(name), name, i % 2 ? VAR_EXPORT : 0));
+     }
+     for (int i = 0; i < 1000; i += 3) {
+          snprintf(name, sizeof(name), "V%d", i);
+          TEST_ASSERT_EQUAL_INT(0, var_unset(&vt, name));
+     }
+     for (int i = 0; i < 1000; i++) {
+          snprintf(name, sizeof(name), "V%d", i);
+          const char *v = var_get(&vt, name, strlen(name));
+          if (i % 3 == 0) TEST_ASSERT_NULL(v);
+          else TEST_ASSERT_EQUAL_STRING(name, v);
+          if (i % 3 && i % 2) TEST_ASSERT_EQUAL_STRING(name, getenv(name));
+     }
+     vars_destroy(&vt);
+     TEST_ASSERT_EQUAL_PTR(outer, environ);
+     TEST_ASSERT_NULL(getenv("V1"));
+
+     /* the same through the shell */
+     struct shell sh;
+     test_shell_init(&sh, LAUNCH_SPAWN);
+     TEST_ASSERT_EQUAL_STRING("a b $X $X\n", capture_list(&sh, "X=a; Y=b; echo $X \"${Y}\" '$X' \\$X"));
+     TEST_ASSERT_EQUAL_STRING("[] [] end\n", capture_list(&sh, "echo [$UNSET] \"[$UNSET]\" $UNSET end"));
+     TEST_ASSERT_EQUAL_STRING("1\n", capture_list(&sh, "false; echo $?"));
+     TEST_ASSERT_EQUAL_STRING("3\n[]\n", capture_list(&sh, "Z=3 sh -c 'echo $Z'; echo [$Z]"));
+     TEST_ASSERT_EQUAL_STRING("[] [a]\n", capture_list(&sh, "sh -c 'printf \"[$X] \"'; export X; sh -c 'echo [$X]'"));
+     TEST_ASSERT_EQUAL_STRING("[]\n", capture_list(&sh, "unset X; sh -c 'echo [$X]'"));
+     TEST_ASSERT_EQUAL_STRING("=\n", capture_list(&sh, "E=; echo \"$E\"=$E"));
+     capture_list(&sh, "readonly R=1; R=2");
+     TEST_ASSERT_EQUAL_INT(1, sh.last_status);
+     TEST_ASSERT_EQUAL_STRING("readonly R='1'\n", capture_list(&sh, "readonly -p | grep R="));
+
+     /* a new PATH forgets where commands were found */
+     capture_list(&sh, "ls / > /dev/null");
+     TEST_ASSERT_TRUE(sh.paths.count > 0);
+     capture_list(&sh, "OLD=$PATH; PATH=/nonexistent; ls");
+     TEST_ASSERT_EQUAL_INT(127, sh.last_status);
+     TEST_ASSERT_EQUAL_size_t(0, sh.paths.count);
+     capture_list(&sh, "PATH=$OLD; ls / > /dev/null");
+     TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+     test_shell_destroy(&sh);
+     TEST_ASSERT_EQUAL_PTR(outer, environ);
+}
+
+void test_word_expansion(void)
+{
+     struct shell sh;
+     test_shell_init(&sh, LAUNCH_SPAWN);
+     /* tilde prefixes, only at the start of a word or an assigned value */
+     TEST_ASSERT_EQUAL_STRING("/h /h/x ~ a~ /h/\n", capture_list(&sh, "HOME=/h; D=~/x; echo ~ $D \"~\" a~ ~/"));
+     TEST_ASSERT_EQUAL_STRING("~nosuchuser_x\n", capture_list(&sh, "echo ~nosuchuser_x"));
+
+     /* the ${NAME op word} family */
+     TEST_ASSERT_EQUAL_STRING("d d2 [] [x] 3\n", capture_list(&sh, "unset U; V=abc; echo ${U:-d} ${U-d2} [${U:+p}] [${V:+x}] ${#V}"));
+     TEST_ASSERT_EQUAL_STRING("[e] [] [set]\n", capture_list(&sh, "E=; echo [${E:-e}] [${E-u}] [${E+set}]"));
+     TEST_ASSERT_EQUAL_STRING("z z\n", capture_list(&sh, "echo ${W:=z} $W"));
+     capture_list(&sh, "echo ${U:?missing}");
+     TEST_ASSERT_EQUAL_INT(1, sh.last_status);
+
+     /* field splitting on IFS, and none inside quotes */
+     TEST_ASSERT_EQUAL_STRING("<a><b><c>\n", capture_list(&sh, "X=' a  b c '; printf '<%s>' $X; echo"));
+     TEST_ASSERT_EQUAL_STRING("< a  b c >\n", capture_list(&sh, "printf '<%s>' \"$X\"; echo"));
+     TEST_ASSERT_EQUAL_STRING("<a><><b>\n", capture_list(&sh, "IFS=:; Y=a::b:; printf '<%s>' $Y; unset IFS; echo"));
+     TEST_ASSERT_EQUAL_STRING("<q q><r><r>\n", capture_list(&sh, "printf '<%s>' \"${Q:-q q}\" ${Q:-r r}; echo"));
+
+     /* command substitution */
+     TEST_ASSERT_EQUAL_STRING("<one><two><one two>\n", capture_list(&sh, "printf '<%s>' $(echo one  two) \"$(echo one  two)\"; echo"));
+     TEST_ASSERT_EQUAL_STRING("nested deep|\n", capture_list(&sh, "echo \"$(echo nested $(printf 'deep\\n\\n'))|\""));
+     TEST_ASSERT_EQUAL_STRING("3\n", capture_list(&sh, "V=$(exit 3); echo $?"));
+     TEST_ASSERT_EQUAL_STRING(")\n", capture_list(&sh, "echo $(echo ')')"));
+
+     /* arithmetic */
+     TEST_ASSERT_EQUAL_STRING("7 9 3 1 16 0 -3 24\n", capture_list(&sh, "echo $((1+2*3)) $(( (1+2)*3 )) $((7/2)) $((7%3)) $((1<<4)) $((5>3 && 2<1)) $((-3)) $((0x10 + 010))"));
+     TEST_ASSERT_EQUAL_STRING("11 9\n", capture_list(&sh, "N=5; echo $((N*2 + 1)) $(( 0 ? 1/0 : $N + 4 ))"));
+     capture_list(&sh, "echo $((1/0))");
+     TEST_ASSERT_EQUAL_INT(1, sh.last_status);
+
+     /* a substitution that is never closed is a syntax error */
+     TEST_ASSERT_NULL(list_parse("echo $(echo"));
+     TEST_ASSERT_NULL(list_parse("echo ${X"));
+     test_shell_destroy(&sh);
+}
+
+void test_builtin_substitution(void)
+{
+     struct shell sh;
+     test_shell_init(&sh, LAUNCH_SPAWN);
+     /* a lone output-only builtin runs inside the shell, on a reused memory file */
+     TEST_ASSERT_EQUAL_STRING("ab <x-y-> 1\n", capture_list(&sh, "echo $(echo a)$(echo b) \"<$(printf '%s-' x y)>\" $(false) $?"));
+     TEST_ASSERT_EQUAL_INT(getpid(), sh.capture_pid);
+     char *cwd = getcwd(NULL, 0);
+     char expect[4096];
+     snprintf(expect, sizeof(expect), "[%s]\n", cwd);
+     TEST_ASSERT_EQUAL_STRING(expect, capture_list(&sh, "echo \"[$(pwd)]\""));
+     TEST_ASSERT_EQUAL_STRING("1\n", capture_list(&sh, "V=$(test a = b); echo $?"));
+     TEST_ASSERT_EQUAL_STRING("2000\n", capture_list(&sh, "V=$(printf '%2000s' x); echo ${#V}"));
+
+     /* anything that could change the shell still runs in a child */
+     TEST_ASSERT_EQUAL_STRING("[]\n", capture_list(&sh, "V=$(echo ${Q:=7}); echo [$Q]"));
+     TEST_ASSERT_EQUAL_STRING("[]\n", capture_list(&sh, "V=$(echo \"${R:-${Q=8}}\"); echo [$Q]"));
+     TEST_ASSERT_EQUAL_STRING("[a=x=] []\n", capture_list(&sh, "echo [$(echo a=${Q}x=)] [$Q]"));
+     capture_list(&sh, "V=$(cd /)");
+     char *now = getcwd(NULL, 0);
+     TEST_ASSERT_EQUAL_STRING(cwd, now);
+     TEST_ASSERT_EQUAL_STRING("a b\n", capture_list(&sh, "echo $(echo a; echo b)"));
+     free(now);
+     free(cwd);
+     test_shell_destroy(&sh);
+     TEST_ASSERT_EQUAL_INT(0, sh.capture_pid);
+}
+
+void test_utility_builtins(void)
+{
+     struct shell sh;
+     test_shell_init(&sh, LAUNCH_SPAWN);
+     TEST_ASSERT_EQUAL_STRING("a b\n", capture_script(&sh, "echo a b\n"));
+     TEST_ASSERT_EQUAL_STRING("xy\n", capture_script(&sh, "echo -n x\necho y\n"));
+     TEST_ASSERT_EQUAL_STRING("a\tbA", capture_script(&sh, "echo -e 'a\\tb\\x41\\c' never\n"));
+     TEST_ASSERT_EQUAL_STRING("-q a\\n\n", capture_script(&sh, "echo -q 'a\\n'\n"));
+     TEST_ASSERT_EQUAL_STRING("a=1\nb=2\n", capture_script(&sh, "printf '%s=%d\\n' a 1 b 2\n"));
+     TEST_ASSERT_EQUAL_STRING(" 3.14|ab  |ff|10|x|%\n",
+                              capture_script(&sh, "printf '%5.2f|%-4s|%x|%o|%c|%%\\n' 3.14159 ab 255 8 xy\n"));
+     TEST_ASSERT_EQUAL_STRING("    42|\n", capture_script(&sh, "printf '%*d|\\n' 6 42\n"));
+     capture_script(&sh, "printf %d abc\n");
+     TEST_ASSERT_EQUAL_INT(1, sh.last_status);
+     /* a specification too long for the rebuilt copy is rejected, not overrun */
+     char longspec[128];
+     snprintf(longspec, sizeof(longspec), "printf '%%%0*d.*d|' -2147483648 5\n", 55, 1);
+     memset(strchr(longspec, '%') + 1, '1', 55);
+     TEST_ASSERT_EQUAL_STRING("", capture_script(&sh, longspec));
+     TEST_ASSERT_EQUAL_INT(1, sh.last_status);
+
+     /* builtin output keeps its place among external commands' output */
+     TEST_ASSERT_EQUAL_STRING("1\n2\n3\n", capture_script(&sh, "echo 1\n/bin/echo 2\necho 3\n"));
+
+     const char *yes[] = { "test -f /etc/passwd", "[ -d / ]", "[ abc = abc ]", "[ 3 -lt 10 ]",
+                           "test ! -e /nonexistent", "[ -n x -a \\( -z '' -o 1 -eq 2 \\) ]",
+                           "[ x ]", "test = = =", "true", "[ -f /nonexistent -o -d / ]" };
+     const char *no[] = { "test -d /etc/passwd", "[ a != a ]", "[ 10 -le 3 ]", "[ '' ]", "test", "false" };
+     const char *bad[] = { "[ -f /etc/passwd", "test 1 -eq x", "[ 1 -eq 1 extra ]", "[ \\( x ]" };
+     for (size_t i = 0; i < sizeof(yes) / sizeof(yes[0]); i++) {
+          capture_list(&sh, yes[i]);
+          TEST_ASSERT_EQUAL_INT_MESSAGE(0, sh.last_status, yes[i]);
+     }
+     for (size_t i = 0; i < sizeof(no) / sizeof(no[0]); i++) {
+          capture_list(&sh, no[i]);
+          TEST_ASSERT_EQUAL_INT_MESSAGE(1, sh.last_status, no[i]);
+     }
+     /* errors are 2, in a pipeline and in $(...) as well */
+     for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+          capture_list(&sh, bad[i]);
+          TEST_ASSERT_EQUAL_INT_MESSAGE(2, sh.last_status, bad[i]);
+     }
+     capture_list(&sh, "test 1 -eq x | cat");
+     TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+     capture_list(&sh, "cat /dev/null | test 1 -eq x");
+     TEST_ASSERT_EQUAL_INT(2, sh.last_status);
+     TEST_ASSERT_EQUAL_STRING("2\n", capture_list(&sh, "V=$([ x ); echo $?"));
+     capture_list(&sh, "[ x ]");
+     TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+
+     char *cwd = getcwd(NULL, 0);
+     char expect[4096];
+     snprintf(expect, sizeof(expect), "%s\n", cwd);
+     TEST_ASSERT_EQUAL_STRING(expect, capture_list(&sh, "pwd"));
+     free(cwd);
+     test_shell_destroy(&sh);
+}
+
+void test_copy_fd_file_and_pipe(void)
+{
+     char src[] = "/tmp/test-lab-copy-XXXXXX";
+     char dst[] = "/tmp/test-lab-copy-XXXXXX";
+     int in = mkstemp(src);
+     int out = mkstemp(dst);
+     TEST_ASSERT_EQUAL_INT(11, write(in, "hello world", 11));
+     lseek(in, 0, SEEK_SET);
+     TEST_ASSERT_EQUAL_INT(11, sh_copy_fd(in, out));
+
+     int p[2];
+     TEST_ASSERT_EQUAL_INT(0, pipe(p));
+     lseek(out, 0, SEEK_SET);
+     TEST_ASSERT_EQUAL_INT(11, sh_copy_fd(out, p[1]));
+     close(p[1]);
+     char buf[32] = { 0 };
+     TEST_ASSERT_EQUAL_INT(11, read(p[0], buf, sizeof(buf)));
+     TEST_ASSERT_EQUAL_STRING("hello world", buf);
+     close(p[0]);
+     close(in);
+     close(out);
+     unlink(src);
+     unlink(dst);
+}
+
+void test_tee_fd_pipes(void)
+{
+     char dst[] = "/tmp/test-lab-tee-XXXXXX";
+     int file = mkstemp(dst);
+     int in[2], out[2];
+     TEST_ASSERT_EQUAL_INT(0, pipe(in));
+     TEST_ASSERT_EQUAL_INT(0, pipe(out));
+     TEST_ASSERT_EQUAL_INT(5, write(in[1], "abcde", 5));
+     close(in[1]);
+     TEST_ASSERT_EQUAL_INT(5, sh_tee_fd(in[0], out[1], file));
+     close(out[1]);
+     char buf[16] = { 0 };
+     TEST_ASSERT_EQUAL_INT(5, read(out[0], buf, sizeof(buf)));
+     TEST_ASSERT_EQUAL_STRING("abcde", buf);
+     memset(buf, 0, sizeof(buf));
+     TEST_ASSERT_EQUAL_INT(5, pread(file, buf, sizeof(buf), 0));
+     TEST_ASSERT_EQUAL_STRING("abcde", buf);
+     close(in[0]);
+     close(out[0]);
+     close(file);
+     unlink(dst);
+}
+
+void test_tee_fd_append(void)
+{
+     /* tee -a: the file is O_APPEND, which splice cannot write to */
+     char dst[] = "/tmp/test-lab-tee-XXXXXX";
+     int fd = mkstemp(dst);
+     TEST_ASSERT_EQUAL_INT(4, write(fd, "old\n", 4));
+     close(fd);
+     int file = open(dst, O_WRONLY | O_APPEND);
+     int in[2], out[2];
+     TEST_ASSERT_EQUAL_INT(0, pipe(in));
+     TEST_ASSERT_EQUAL_INT(0, pipe(out));
+     TEST_ASSERT_EQUAL_INT(6, write(in[1], "abcde\n", 6));
+     close(in[1]);
+     TEST_ASSERT_EQUAL_INT(6, sh_tee_fd(in[0], out[1], file));
+     close(out[1]);
+     char buf[16] = { 0 };
+     TEST_ASSERT_EQUAL_INT(6, read(out[0], buf, sizeof(buf)));
+     TEST_ASSERT_EQUAL_STRING("abcde\n", buf);
+     close(in[0]);
+     close(out[0]);
+     close(file);
+
+     /* The same through the builtin in a pipeline */
+     struct shell sh;
+     test_shell_init(&sh, LAUNCH_SPAWN);
+     char line[128];
+     snprintf(line, sizeof(line), "echo xyz | tee -a %s | cat", dst);
+     TEST_ASSERT_EQUAL_STRING("xyz\n", capture_list(&sh, line));
+     test_shell_destroy(&sh);
+     fd = open(dst, O_RDONLY);
+     memset(buf, 0, sizeof(buf));
+     TEST_ASSERT_EQUAL_INT(14, read(fd, buf, sizeof(buf)));
+     TEST_ASSERT_EQUAL_STRING("old\nabcde\nxyz\n", buf);
+     close(fd);
+     unlink(dst);
+}
+
+void test_tee_fd_splice_refused(void)
+{
+     /* splice into an eventfd fails after tee already filled stdout */
+     int file = eventfd(0, EFD_CLOEXEC);
+     int in[2], out[2];
+     TEST_ASSERT_EQUAL_INT(0, pipe(in));
+     TEST_ASSERT_EQUAL_INT(0, pipe(out));
+     TEST_ASSERT_EQUAL_INT(8, write(in[1], "abcdefgh", 8));
+     close(in[1]);
+     TEST_ASSERT_EQUAL_INT(8, sh_tee_fd(in[0], out[1], file));
+     close(out[1]);
+     char buf[16] = { 0 };
+     TEST_ASSERT_EQUAL_INT(8, read(out[0], buf, sizeof(buf)));
+     TEST_ASSERT_EQUAL_STRING("abcdefgh", buf);
+     uint64_t value, expect;
+     memcpy(&expect, "abcdefgh", sizeof(expect));
+     TEST_ASSERT_EQUAL_INT(8, read(file, &value, sizeof(value)));
+     TEST_ASSERT_TRUE(value == expect);
+     close(in[0]);
+     close(out[0]);
+     close(file);
+}
+
+void test_pipeline_parse_redirects(void)
+{
+     struct pipeline *pl = pipeline_parse("sort<in 2>&1 >>out | wc -l &>log");
+     TEST_ASSERT_NOT_NULL(pl);
+     TEST_ASSERT_EQUAL_UINT(2, pl->ncmds);
+     struct command *c = &pl->cmds[0];
+     TEST_ASSERT_EQUAL_STRING("sort", c->argv[0]);
+     TEST_ASSERT_NULL(c->argv[1]);
+     TEST_ASSERT_EQUAL_UINT(3, c->nredirs);
+     TEST_ASSERT_EQUAL_INT(REDIR_OPEN, c->redirs[0].kind);
+     TEST_ASSERT_EQUAL_INT(0, c->redirs[0].fd);
+     TEST_ASSERT_EQUAL_STRING("in", c->redirs[0].path);
+     TEST_ASSERT_EQUAL_INT(REDIR_DUP, c->redirs[1].kind);
+     TEST_ASSERT_EQUAL_INT(2, c->redirs[1].fd);
+     TEST_ASSERT_EQUAL_INT(1, c->redirs[1].src_fd);
+     TEST_ASSERT_EQUAL_INT(1, c->redirs[2].fd);
+     TEST_ASSERT_TRUE(c->redirs[2].flags & O_APPEND);
+     c = &pl->cmds[1];
+     TEST_ASSERT_EQUAL_STRING("-l", c->argv[1]);
+     TEST_ASSERT_EQUAL_UINT(2, c->nredirs);
+     TEST_ASSERT_EQUAL_STRING("log", c->redirs[0].path);
+     TEST_ASSERT_EQUAL_INT(2, c->redirs[1].fd);
+     pipeline_free(pl);
+     TEST_ASSERT_NULL(pipeline_parse("echo >"));
+     TEST_ASSERT_NULL(pipeline_parse("echo > | wc"));
+}
+
+void test_run_redirects(void)
+{
+     struct shell sh;
+     test_shell_init(&sh, LAUNCH_SPAWN);
+     char line[128];
+     char path[] = "/tmp/test-lab-redir-XXXXXX";
+     close(mkstemp(path));
+
+     snprintf(line, sizeof(line), "echo one > %s", path);
+     capture_pipeline(&sh, line, NULL);
+     snprintf(line, sizeof(line), "ls /no-such-dir 2>>%s", path);
+     capture_pipeline(&sh, line, NULL);
+     snprintf(line, sizeof(line), "wc -l < %s", path);
+     TEST_ASSERT_EQUAL_STRING("2\n", capture_pipeline(&sh, line, NULL));
+
+     /* builtins in the shell get their descriptors back afterwards */
+     snprintf(line, sizeof(line), "ulimit -n > %s", path);
+     TEST_ASSERT_EQUAL_STRING("", capture_pipeline(&sh, line, NULL));
+     snprintf(line, sizeof(line), "cat < %s", path);
+     TEST_ASSERT_EQUAL_INT(sh.limits.open_max, atol(capture_pipeline(&sh, line, NULL)));
+     unlink(path);
+     test_shell_destroy(&sh);
+}
+
+void test_job_table(void)
+{
+     struct job_table jt;
+     memset(&jt, 0, sizeof(jt));
+     pid_t a[] = { 100, 101 };
+     pid_t b[] = { -1 };
+     struct job *j1 = job_add(&jt, 100, a, 2, "a | b");
+     struct job *j2 = job_add(&jt, 0, b, 1, "missing");
+     TEST_ASSERT_EQUAL_INT(1, j1->id);
+     TEST_ASSERT_EQUAL_INT(2, j2->id);
+     TEST_ASSERT_EQUAL_INT(JOB_RUNNING, j1->state);
+     TEST_ASSERT_EQUAL_INT(JOB_DONE, j2->state);
+     TEST_ASSERT_EQUAL_PTR(j2, job_find(&jt, NULL));
+     TEST_ASSERT_EQUAL_PTR(j1, job_find(&jt, "%1"));
+     TEST_ASSERT_EQUAL_PTR(j2, job_find(&jt, "2"));
+     TEST_ASSERT_NULL(job_find(&jt, "%3"));
+     job_remove(&jt, j2);
+     TEST_ASSERT_EQUAL_PTR(j1, job_find(&jt, "%+"));
+     job_remove(&jt, j1);
+     TEST_ASSERT_EQUAL_UINT(0, jt.count);
+     free(jt.jobs);
+}
+
+void test_background_job(void)
+{
+     struct shell sh;
+     test_shell_init(&sh, LAUNCH_SPAWN);
+     struct pipeline *pl = pipeline_parse("sleep 0.1 | exit 3 &");
+     TEST_ASSERT_NOT_NULL(pl);
+     TEST_ASSERT_TRUE(pl->background);
+     TEST_ASSERT_EQUAL_STRING("sleep 0.1 | exit 3", pl->text);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_pipeline(&sh, pl));
+     pipeline_free(pl);
+     TEST_ASSERT_EQUAL_UINT(1, sh.jobs.count);
+     struct job *j = job_find(&sh.jobs, "%1");
+     TEST_ASSERT_NOT_NULL(j);
+     TEST_ASSERT_EQUAL_INT(3, WEXITSTATUS(job_wait(&sh, j, false)));
+     TEST_ASSERT_EQUAL_INT(JOB_DONE, j->state);
+     jobs_notify(&sh);
+     TEST_ASSERT_EQUAL_UINT(0, sh.jobs.count);
+     TEST_ASSERT_NULL(pipeline_parse("sleep 1 & ls"));
+     test_shell_destroy(&sh);
+}
+
+void test_event_loop_reaps_jobs(void)
+{
+     struct shell sh;
+     test_shell_init(&sh, LAUNCH_SPAWN);
+     TEST_ASSERT_EQUAL_INT(0, sh_loop_init(&sh));
+     TEST_ASSERT_TRUE(sh.loop.active);
+
+     struct pipeline *pl = pipeline_parse("sleep 0.1 | exit 4 &");
+     sh_run_pipeline(&sh, pl);
+     pipeline_free(pl);
+     pl = pipeline_parse("exit 5 &");
+     sh_run_pipeline(&sh, pl);
+     pipeline_free(pl);
+     TEST_ASSERT_EQUAL_UINT(2, sh.jobs.count);
+
+     struct job *j = job_find(&sh.jobs, "%2");
+     TEST_ASSERT_EQUAL_INT(5, WEXITSTATUS(job_wait(&sh, j, false)));
+     j = job_find(&sh.jobs, "%1");
+     TEST_ASSERT_EQUAL_INT(4, WEXITSTATUS(job_wait(&sh, j, false)));
+     for (size_t i = 0; i < j->nprocs; i++)
+          TEST_ASSERT_EQUAL_INT(-1, j->procs[i].pidfd);
+
+     /* foreground pipelines are waited on through the loop as well */
+     int status;
+     char *out = capture_pipeline(&sh, "echo loop | tr a-z A-Z", &status);
+     TEST_ASSERT_EQUAL_STRING("LOOP\n", out);
+     TEST_ASSERT_EQUAL_INT(0, status);
+
+     test_shell_destroy(&sh);
+     sh_loop_destroy(&sh);
+     TEST_ASSERT_FALSE(sh.loop.active);
+}
+
+void test_parallel_builtin(void)
+{
+     struct shell sh;
+     test_shell_init(&sh, LAUNCH_SPAWN);
+     int status;
+     char *out = capture_pipeline(&sh, "parallel -j 3 -k echo ::: a b c d", &status);
+     TEST_ASSERT_EQUAL_STRING("a\nb\nc\nd\n", out);
+     TEST_ASSERT_EQUAL_INT(0, status);
+
+     out = capture_pipeline(&sh, "parallel -k -j2 echo [{}] ::: x y", &status);
+     TEST_ASSERT_EQUAL_STRING("[x]\n[y]\n", out);
+
+     /* unordered output still arrives whole, one job at a time */
+     out = capture_pipeline(&sh, "parallel echo job ::: 1 2 3 4 5", &status);
+     TEST_ASSERT_EQUAL_size_t(30, strlen(out));
+     for (char *p = out; *p; p += 6)
+          TEST_ASSERT_EQUAL_INT(0, strncmp(p, "job ", 4));
+
+     /* builtins run as forked jobs */
+     out = capture_pipeline(&sh, "parallel -k ulimit ::: -n -n", &status);
+     TEST_ASSERT_EQUAL_INT(sh.limits.open_max, atol(out));
+
+     capture_pipeline(&sh, "parallel -j 2 test -d ::: / /nonexistent /", &status);
+     TEST_ASSERT_NOT_EQUAL(0, status);
+     capture_pipeline(&sh, "parallel -j 0 true ::: a", &status);
+     TEST_ASSERT_NOT_EQUAL(0, status);
+     capture_pipeline(&sh, "parallel true", &status);
+     TEST_ASSERT_NOT_EQUAL(0, status);
+
+     /* -k keeps its order when it runs out of descriptors for buffers */
+     char line[512] = "parallel -k -j 4 sh -c 'sleep $0; echo $0' ::: 0.2";
+     for (int k = 0; k < 120; k++) strcat(line, " 0");
+     struct rlimit saved, low;
+     getrlimit(RLIMIT_NOFILE, &saved);
+     low = saved;
+     low.rlim_cur = 40;
+     setrlimit(RLIMIT_NOFILE, &low);
+     out = capture_pipeline(&sh, line, &status);
+     setrlimit(RLIMIT_NOFILE, &saved);
+     TEST_ASSERT_EQUAL_INT(0, status);
+     TEST_ASSERT_EQUAL_INT(0, strncmp(out, "0.2\n", 4));
+     TEST_ASSERT_EQUAL_size_t(4 + 120 * 2, strlen(out));
+     test_shell_destroy(&sh);
+}
+
 int main(void) {
   UNITY_BEGIN();
   RUN_TEST(test_cmd_parse);
   RUN_TEST(test_cmd_parse2);
+  RUN_TEST(test_cmd_parse_repeated_spaces);
+  RUN_TEST(test_cmd_parse_empty);
+  RUN_TEST(test_cmd_parse_quotes);
+  RUN_TEST(test_lexer_operators);
+  RUN_TEST(test_cmd_parse_long_line);
+  RUN_TEST(test_scan_alignments);
+  RUN_TEST(test_scan_page_boundary);
+  RUN_TEST(test_scan_backends_agree);
   RUN_TEST(test_trim_white_no_whitespace);
   RUN_TEST(test_trim_white_start_whitespace);
   RUN_TEST(test_trim_white_end_whitespace);
@@ -173,6 +1807,40 @@ int main(void) {
   RUN_TEST(test_get_prompt_custom);
   RUN_TEST(test_ch_dir_home);
   RUN_TEST(test_ch_dir_root);
+  RUN_TEST(test_limits_cached);
+  RUN_TEST(test_path_cache_lookup);
+  RUN_TEST(test_path_cache_path_change);
+  RUN_TEST(test_path_cache_forget);
+  RUN_TEST(test_execute_command_spawn);
+  RUN_TEST(test_execute_command_fork);
+  RUN_TEST(test_pipeline_parse);
+  RUN_TEST(test_pipeline_parse_errors);
+  RUN_TEST(test_run_pipeline);
+  RUN_TEST(test_list_parse);
+  RUN_TEST(test_run_list);
+  RUN_TEST(test_parse_cache);
+  RUN_TEST(test_history_store);
+  RUN_TEST(test_history_search);
+  RUN_TEST(test_command_completion);
+  RUN_TEST(test_prompt_expand);
+  RUN_TEST(test_builtin_registry);
+  RUN_TEST(test_line_reader);
+  RUN_TEST(test_script_map);
+  RUN_TEST(test_run_script);
+  RUN_TEST(test_utility_builtins);
+  RUN_TEST(test_shell_variables);
+  RUN_TEST(test_word_expansion);
+  RUN_TEST(test_builtin_substitution);
+  RUN_TEST(test_copy_fd_file_and_pipe);
+  RUN_TEST(test_tee_fd_pipes);
+  RUN_TEST(test_tee_fd_append);
+  RUN_TEST(test_tee_fd_splice_refused);
+  RUN_TEST(test_pipeline_parse_redirects);
+  RUN_TEST(test_run_redirects);
+  RUN_TEST(test_job_table);
+  RUN_TEST(test_background_job);
+  RUN_TEST(test_event_loop_reaps_jobs);
+  RUN_TEST(test_parallel_builtin);
 
   return UNITY_END();
 }